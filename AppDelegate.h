@@ -32,6 +32,7 @@
 - (int)fontSizeAdjustment;
 
 - (NSDictionary*)modelMap;
+- (NSArray *)availableModels;
 - (NSString *)apiKey;
 - (NSString *)monospaceFontName;
 - (NSString *)proportionalFontName;
@@ -40,6 +41,7 @@
 - (void)addDefaultModelsToMenu;
 - (void)applicationDidFinishLaunching:(NSNotification *)notification;
 - (void)applicationWillTerminate:(NSNotification *)notification;
+- (void)compareModels:(id)sender;
 - (void)decreaseFontSize:(id)sender;
 - (void)fetchAvailableModels;
 - (void)increaseFontSize:(id)sender;
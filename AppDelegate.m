@@ -5,6 +5,7 @@
 
 #import "AppDelegate.h"
 #import "ChatWindowController.h"
+#import "HTTPSClient.h"
 #import "ThemeColors.h"
 #import "NSObject+Associations.h"
 #import "SAFEArc.h"
@@ -74,6 +75,9 @@
 - (void)applicationWillTerminate:(NSNotification *)notification {
   // Save preferences
   [[NSUserDefaults standardUserDefaults] synchronize];
+
+  // Say goodbye to the API host instead of leaving sockets for the kernel
+  [HTTPSClient closeIdleConnections];
 }
 
 - (NSString *)apiKey {
@@ -550,6 +554,7 @@
 
   // Clear our models map
   models = [[NSMutableDictionary alloc] init];
+  [availableModels removeAllObjects];
   
   // Add current Claude models
   NSArray *defaultModels = [NSArray arrayWithObjects:
@@ -612,6 +617,7 @@
 
 	  // Prime our models map
   	[models setObject:model forKey:[model objectForKey:@"id"]];
+    [availableModels addObject:model];
     
     // Add keyboard shortcut for first 3 models
     if (i < 3) {
@@ -627,9 +633,22 @@
 
   [modelsMenu addItem:[NSMenuItem separatorItem]];
 
+  // Same message to every model above, replies side by side
+  NSMenuItem *compareItem = [modelsMenu addItemWithTitle:@"Compare All Models"
+                                                  action:@selector(compareModels:)
+                                           keyEquivalent:@"\r"];
+  [compareItem setKeyEquivalentModifierMask:NSCommandKeyMask | NSAlternateKeyMask];
+  [compareItem setTarget:self];
+
   SAFE_ARC_AUTORELEASE_POOL_POP();
 }
 
+- (void)compareModels:(id)sender {
+  if (chatWindowController) {
+    [chatWindowController compareModels:sender];
+  }
+}
+
 - (void)selectModel:(id)sender {
   NSMenuItem *item = (NSMenuItem *)sender;
   NSString *modelId = [[item representedObject] objectForKey:@"id"];
@@ -679,6 +698,10 @@
   return isDarkMode;
 }
 
+- (NSArray *)availableModels {
+  return availableModels;
+}
+
 - (int)fontSizeAdjustment {
   return fontSizeAdjustment;
 }
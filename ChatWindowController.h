@@ -8,6 +8,7 @@
 #import "ClaudeAPIManager.h"
 
 @class ClaudeAPIManager;
+@class ModelComparisonWindowController;
 
 @interface ChatWindowController : NSWindowController <ClaudeAPIManagerDelegate> {
     NSTextView *chatTextView;
@@ -26,6 +27,17 @@
     NSMutableAttributedString *chatHistory;
     NSMutableArray *codeBlockButtons;
     NSMutableArray *codeBlockRanges;
+    
+    // Where the reply currently being streamed starts in the chat text
+    BOOL isStreamingResponse;
+    NSUInteger streamingMessageStart;
+    
+    // Whether the message field was empty before the last edit, so the
+    // first keystroke of a new message can pre-warm the API connection
+    BOOL messageFieldWasEmpty;
+    
+    // Side-by-side replies from every model, created on first use
+    ModelComparisonWindowController *comparisonController;
 }
 
 - (id)init;
@@ -50,6 +62,7 @@
 - (void)adjustMessageFieldHeight;
 - (void)appendMessage:(NSString *)message fromUser:(BOOL)isUser;
 - (void)clearConversation;
+- (void)compareModels:(id)sender;
 - (void)createConversationDrawer;
 - (void)createWindow;
 - (void)loadCurrentConversation;
@@ -5,6 +5,7 @@
 
 #import "ChatWindowController.h"
 #import "ClaudeAPIManager.h"
+#import "ModelComparisonWindowController.h"
 #import "AppDelegate.h"
 #import "ThemeColors.h"
 #import "ConversationManager.h"
@@ -23,9 +24,11 @@
     [self createWindow];
     apiManager = [[ClaudeAPIManager alloc] init];
     [apiManager setDelegate:self];
+    [apiManager setStreamsResponses:YES];
     chatHistory = [[NSMutableAttributedString alloc] init];
     codeBlockButtons = [[NSMutableArray alloc] init];
     codeBlockRanges = [[NSMutableArray alloc] init];
+    messageFieldWasEmpty = YES;
     
     // Listen for font preference changes
     [[NSNotificationCenter defaultCenter] addObserver:self
@@ -56,7 +59,10 @@
   [self removeAllCodeBlockButtons];
   [codeBlockButtons release];
   [codeBlockRanges release];
+  [apiManager setDelegate:nil];
+  [apiManager cancelRequest];
   [apiManager release];
+  [comparisonController release];
   [chatHistory release];
   [messageScrollView release];
   [super dealloc];
@@ -366,6 +372,15 @@
 
 - (void)textDidChange:(NSNotification *)notification {
   if ([notification object] == messageField) {
+    BOOL isEmpty = ([[messageField string] length] == 0);
+    
+    // Start connecting while the user types, so Send finds a warm
+    // connection instead of paying for DNS and the TLS handshake
+    if (messageFieldWasEmpty && !isEmpty) {
+      [apiManager prewarmConnection];
+    }
+    messageFieldWasEmpty = isEmpty;
+    
     [self adjustMessageFieldHeight];
   }
 }
@@ -459,6 +474,7 @@
   // Add user message to chat
   [self appendMessage:trimmedMessage fromUser:YES];
   [messageField setString:@""];
+  messageFieldWasEmpty = YES;
   // Force immediate height adjustment after clearing
   [self performSelector:@selector(adjustMessageFieldHeight) withObject:nil afterDelay:0.0];
   
@@ -481,10 +497,42 @@
     return;
   }
   
+  // The model can change between sends from the menu
+  NSString *model = [appDelegate selectedModel];
+  NSDictionary *modelSettings = [[appDelegate modelMap] objectForKey:model];
+  [apiManager setModel:model];
+  [apiManager setMaxTokens:[[modelSettings objectForKey:@"max-tokens"] intValue]];
+  [apiManager setContextWindow:[[modelSettings objectForKey:@"context-window"] intValue]];
+  
   // Send to API using delegate pattern
   [apiManager sendMessage:trimmedMessage withAPIKey:apiKey];
 }
 
+- (void)compareModels:(id)sender {
+  NSString *message = [[messageField textStorage] string];
+  NSString *trimmedMessage = [message stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
+  if ([trimmedMessage length] == 0) {
+    NSBeep();
+    return;
+  }
+  
+  AppDelegate *appDelegate = (AppDelegate *)[[NSApplication sharedApplication] delegate];
+  NSString *apiKey = [appDelegate apiKey];
+  
+  if (!apiKey || [apiKey length] == 0) {
+    [self appendMessage:@"Error: No API key configured. Please set your API key in preferences." fromUser:NO];
+    return;
+  }
+  
+  // One window, reused, so its fan-out's threads are only started once.
+  // The message stays in the field and out of the conversation; send it
+  // normally to continue with whichever model answered best.
+  if (!comparisonController) {
+    comparisonController = [[ModelComparisonWindowController alloc] initWithModels:[appDelegate availableModels]];
+  }
+  [comparisonController compareMessage:trimmedMessage history:[apiManager history] apiKey:apiKey];
+}
+
 - (void)resetControls {
   [messageField setEditable:YES];
   [sendButton setEnabled:YES];
@@ -577,13 +625,20 @@
   // Clear code block buttons
   [self removeAllCodeBlockButtons];
   
-  // Clear the API manager's conversation history
+  // Clear the API manager's conversation history, abandoning any reply
+  // still being generated for the old one
+  [apiManager setDelegate:nil];
+  [apiManager cancelRequest];
   [apiManager release];
   apiManager = [[ClaudeAPIManager alloc] init];
   [apiManager setDelegate:self];
+  [apiManager setStreamsResponses:YES];
+  isStreamingResponse = NO;
+  [self resetControls];
   
   // Reset the message field
   [messageField setString:@""];
+  messageFieldWasEmpty = YES;
   // Force immediate height adjustment after clearing
   [self performSelector:@selector(adjustMessageFieldHeight) withObject:nil afterDelay:0.0];
   [[self window] makeFirstResponder:messageField];
@@ -618,7 +673,60 @@
 
 #pragma mark - ClaudeAPIManagerDelegate
 
+- (void)apiManager:(ClaudeAPIManager *)manager didReceiveDelta:(NSString *)delta {
+  NSTextStorage *storage = [chatTextView textStorage];
+  AppDelegate *appDelegate = (AppDelegate *)[[NSApplication sharedApplication] delegate];
+  BOOL isDark = [appDelegate isDarkMode];
+  
+  [storage beginEditing];
+  
+  // First delta: start the reply with the usual sender label
+  if (!isStreamingResponse) {
+    float labelFontSize = [NSFont systemFontSize] + 1.0 + [appDelegate fontSizeAdjustment];
+    NSDictionary *senderAttrs = [NSDictionary dictionaryWithObjectsAndKeys:
+                    [NSFont boldSystemFontOfSize:labelFontSize], NSFontAttributeName,
+                    [ThemeColors systemPurpleForDarkMode:isDark], NSForegroundColorAttributeName,
+                    nil];
+    isStreamingResponse = YES;
+    streamingMessageStart = [storage length];
+    [storage appendAttributedString:[[[NSAttributedString alloc] initWithString:@"Claude: "
+                                                                      attributes:senderAttrs] autorelease]];
+  }
+  
+  // Plain text while streaming; markdown is rendered once the reply is complete
+  NSFont *propFont = [NSFont fontWithName:[appDelegate proportionalFontName]
+                                     size:[appDelegate proportionalFontSize]];
+  if (!propFont) propFont = [NSFont systemFontOfSize:[appDelegate proportionalFontSize]];
+  NSDictionary *textAttrs = [NSDictionary dictionaryWithObjectsAndKeys:
+                  propFont, NSFontAttributeName,
+                  [ThemeColors labelColorForDarkMode:isDark], NSForegroundColorAttributeName,
+                  nil];
+  [storage appendAttributedString:[[[NSAttributedString alloc] initWithString:delta
+                                                                    attributes:textAttrs] autorelease]];
+  [storage endEditing];
+  
+  [chatTextView scrollRangeToVisible:NSMakeRange([[chatTextView string] length], 0)];
+}
+
+- (void)apiManager:(ClaudeAPIManager *)manager didReceiveUsage:(NSDictionary *)usage {
+  // Shown on the Send button so prompt cache hits can be checked at a glance
+  [sendButton setToolTip:[NSString stringWithFormat:
+                          @"Last reply: %@ input tokens (%@ read from cache, %@ written to cache), %@ output tokens",
+                          [usage objectForKey:@"input_tokens"],
+                          [usage objectForKey:@"cache_read_input_tokens"],
+                          [usage objectForKey:@"cache_creation_input_tokens"],
+                          [usage objectForKey:@"output_tokens"]]];
+}
+
 - (void)apiManager:(ClaudeAPIManager *)manager didReceiveResponse:(NSString *)response {
+  // Replace the plain streamed text with the fully rendered message
+  if (isStreamingResponse) {
+    NSTextStorage *storage = [chatTextView textStorage];
+    [storage deleteCharactersInRange:NSMakeRange(streamingMessageStart,
+                                                 [storage length] - streamingMessageStart)];
+    isStreamingResponse = NO;
+  }
+  
   // Add to current conversation
   Conversation *current = [[ConversationManager sharedManager] currentConversation];
   if (current) {
@@ -639,10 +747,24 @@
 
 - (void)apiManager:(ClaudeAPIManager *)manager didFailWithError:(NSError *)error {
   NSString *errorMessage = error ? [error localizedDescription] : @"Unknown error occurred";
+  
+  // Keep whatever part of the reply made it, on its own line
+  if (isStreamingResponse) {
+    [[chatTextView textStorage] appendAttributedString:[[[NSAttributedString alloc] initWithString:@"\n"] autorelease]];
+    isStreamingResponse = NO;
+  }
   [self appendMessage:[NSString stringWithFormat:@"Error: %@", errorMessage] fromUser:NO];
   [self resetControls];
 }
 
+- (void)apiManagerDidCancelRequest:(ClaudeAPIManager *)manager {
+  if (isStreamingResponse) {
+    [[chatTextView textStorage] appendAttributedString:[[[NSAttributedString alloc] initWithString:@"\n"] autorelease]];
+    isStreamingResponse = NO;
+  }
+  [self resetControls];
+}
+
 - (void)updateTheme {
   AppDelegate *appDelegate = (AppDelegate *)[[NSApplication sharedApplication] delegate];
   BOOL isDark = [appDelegate isDarkMode];
@@ -755,6 +877,7 @@
   
   // Refresh existing text colors
   [self refreshChatColors];
+  [comparisonController updateTheme];
 }
 
 - (void)updateFontSize {
@@ -1207,11 +1330,15 @@
     // Reset API manager with new conversation
     if (apiManager) {
       [apiManager setDelegate:nil];
+      [apiManager cancelRequest];
       [apiManager release];
       apiManager = nil;
     }
+    [self resetControls];
     apiManager = [[ClaudeAPIManager alloc] init];
     [apiManager setDelegate:self];
+    [apiManager setStreamsResponses:YES];
+    isStreamingResponse = NO;
     
     // Reload messages from conversation
     int i;
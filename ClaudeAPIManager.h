@@ -5,16 +5,120 @@
 
 #import <Foundation/Foundation.h>
 
+// Message Batches API limits on a single batch
+#define CLAUDE_BATCH_MAX_REQUESTS 100000
+#define CLAUDE_BATCH_MAX_BYTES (256 * 1024 * 1024)
+
 @class ClaudeAPIManager;
+@class SSEParser;
+@class HTTPSClient;
+@class JSONWriter;
+@class WorkerPool;
 
 @protocol ClaudeAPIManagerDelegate
 - (void)apiManager:(ClaudeAPIManager *)manager didReceiveResponse:(NSString *)response;
 - (void)apiManager:(ClaudeAPIManager *)manager didFailWithError:(NSError *)error;
+// Streaming only: text as it is generated. Deltas that arrive while the main
+// thread is busy are coalesced. didReceiveResponse: still follows with the
+// complete text once the message has finished.
+- (void)apiManager:(ClaudeAPIManager *)manager didReceiveDelta:(NSString *)delta;
+// Sent instead of didReceiveResponse:/didFailWithError: when the request
+// was stopped with -cancelRequest. Deltas already delivered are all there is.
+- (void)apiManagerDidCancelRequest:(ClaudeAPIManager *)manager;
+// Token usage of a completed reply, sent just before didReceiveResponse:.
+// Keys are the API's usage fields (input_tokens, output_tokens,
+// cache_creation_input_tokens, cache_read_input_tokens) with NSNumber values.
+- (void)apiManager:(ClaudeAPIManager *)manager didReceiveUsage:(NSDictionary *)usage;
+// How long a completed reply took, sent after didReceiveUsage: and before
+// didReceiveResponse:. Keys, all NSNumber: time_to_first_token and latency
+// in seconds from the request going out, and tokens_per_second of output
+// while generating. A reply that is not streamed arrives all at once, so
+// its first token comes with its last.
+- (void)apiManager:(ClaudeAPIManager *)manager didReceiveTimings:(NSDictionary *)timings;
+@end
+
+// Message Batches. Unlike the conversation delegate, these are sent on the
+// batch's own background thread, in order: a batch can return tens of
+// thousands of results, and each is handed over and released before the
+// next is read rather than queued up behind the main run loop.
+@protocol ClaudeAPIManagerBatchDelegate
+// The batch was accepted; polling for its results begins.
+- (void)apiManager:(ClaudeAPIManager *)manager didSubmitBatch:(NSString *)batchId requestCount:(unsigned long)count;
+// Progress from each poll: the API's request_counts (processing,
+// succeeded, errored, canceled, expired) with NSNumber values.
+- (void)apiManager:(ClaudeAPIManager *)manager batch:(NSString *)batchId didUpdateCounts:(NSDictionary *)counts;
+// One result, in the order the results file lists them. Keys: custom_id,
+// type (succeeded, errored, canceled or expired), text or error, usage
+// when succeeded, and json with the result line exactly as received.
+- (void)apiManager:(ClaudeAPIManager *)manager batch:(NSString *)batchId didReceiveResult:(NSDictionary *)result;
+// Every result has been delivered.
+- (void)apiManager:(ClaudeAPIManager *)manager didFinishBatch:(NSString *)batchId;
+// The batch could not be submitted (batchId is nil), polled or downloaded.
+// Results delivered before a download failure stand.
+- (void)apiManager:(ClaudeAPIManager *)manager batch:(NSString *)batchId didFailWithError:(NSError *)error;
 @end
 
 @interface ClaudeAPIManager : NSObject {
     NSMutableArray *conversationHistory;
     id delegate;
+
+    // Streaming state (owned by the background request thread)
+    BOOL streamsResponses;
+    SSEParser *sseParser;
+    NSMutableString *streamedText;
+    NSMutableData *streamErrorBody;
+    NSString *streamError;
+    BOOL streamStopped;
+
+    // Deltas waiting for the main thread
+    NSMutableString *pendingDelta;
+    NSLock *pendingDeltaLock;
+
+    // The request in flight, so the main thread can cancel it
+    HTTPSClient *activeClient;
+    BOOL cancelRequested;
+    NSLock *requestLock;
+
+    // A connection warm-up is queued or running
+    BOOL prewarming;
+
+    // Usage reported for the request in flight, and for the last completed one
+    NSMutableDictionary *requestUsage;
+    NSDictionary *lastUsage;
+
+    // Estimated input tokens of the request in flight, for calibration
+    unsigned long requestEstimate;
+
+    // Serialises request bodies, reusing its buffer from one send to the next
+    JSONWriter *requestWriter;
+
+    // The JSON of the first history messages, each followed by a comma, and
+    // where each one ends, so a send only encodes what is new since the last
+    NSMutableData *encodedHistory;
+    NSMutableArray *encodedHistoryEnds;
+
+    // When the request in flight went out and its first text arrived
+    NSTimeInterval requestStarted;
+    NSTimeInterval firstTokenAt;
+
+    // Where requests go; the API unless pointed elsewhere
+    NSString *apiHost;
+    int apiPort;
+
+    // Model settings, captured by each request as it is queued
+    NSString *model;
+    int maxTokens;
+    int contextWindow;
+
+    // Runs sends and warm-ups
+    WorkerPool *workerPool;
+
+    // Batch requests gathered so far, spooled to a temporary file
+    id batchDelegate;
+    int batchSpoolFd;
+    NSString *batchSpoolPath;
+    unsigned long batchCount;
+    unsigned long long batchBytes;
 }
 
 - (id)init;
@@ -22,9 +126,65 @@
 - (NSString *)arrayToJSON:(NSArray *)array;
 - (NSString *)dictionaryToJSON:(NSDictionary *)dict;
 - (NSString *)extractResponseText:(NSString *)jsonResponse;
+// As extractResponseText:, for a body as HTTPSClient returns it: followed by
+// HTTPS_BODY_PADDING zero bytes. It is parsed in place, overwriting it.
+- (NSString *)extractResponseTextFromPaddedData:(NSData *)data;
+// The parser behind both: bytes must be writable and followed by
+// YYJSON_PADDING_SIZE zero bytes.
+- (NSString *)extractResponseTextFromBytes:(char *)bytes length:(size_t)length;
+// The fields of an already parsed response; frees the document.
+- (NSString *)extractResponseTextFromDocument:(struct yyjson_doc *)doc;
 
 - (void)setDelegate:(id)aDelegate;
+- (BOOL)streamsResponses;
+- (void)setStreamsResponses:(BOOL)flag;
 - (void)sendMessage:(NSString *)message withAPIKey:(NSString *)apiKey;
+// Stops the request started by sendMessage:withAPIKey:, closing its
+// connection at once (which also ends generation on the server). The
+// unanswered message is dropped from the history. Safe to call when idle.
+- (void)cancelRequest;
+// Opens a connection to the API host in the background so the next send
+// skips DNS, TCP and TLS setup. Call when a message is likely to follow,
+// e.g. on the first keystroke. Does nothing while a warm-up is already under
+// way; an unused warm connection is closed after the pool's idle lifetime.
+- (void)prewarmConnection;
 - (void)addToHistory:(NSString *)message isUser:(BOOL)isUser;
+// The conversation so far: role/content dictionaries, oldest first.
+- (NSArray *)history;
+// Token usage of the last completed reply, as passed to didReceiveUsage:,
+// or nil before the first one.
+- (NSDictionary *)lastUsage;
+// Sends requests to another host, such as a local test server. The default
+// is the Anthropic API on port 443.
+- (void)setHost:(NSString *)host port:(int)port;
+// Model and limits for the following sends and batch requests. The manager
+// does not look them up itself, so it can run without the application.
+// Defaults: Haiku 3 with 4096 output tokens, and an unknown context window
+// (0), which turns off history trimming.
+- (NSString *)model;
+- (void)setModel:(NSString *)aModel;
+- (int)maxTokens;
+- (void)setMaxTokens:(int)tokens;
+- (int)contextWindow;
+- (void)setContextWindow:(int)tokens;
+// Pool that sends run on; [WorkerPool sharedPool] unless set. A tool that
+// drives many managers at once can give them a pool sized to match.
+- (void)setWorkerPool:(WorkerPool *)pool;
+
+// Message Batches: gather requests with addBatchRequest:customId:, then
+// send them all with submitBatchWithAPIKey:. Requests are written to a
+// temporary file as they are added, so only one is in memory at a time.
+// Gathering is not thread-safe; add and submit from one thread.
+- (void)setBatchDelegate:(id)aDelegate;
+// Adds a single-turn request using the current model settings. customId
+// (1-64 letters, digits, '-' or '_') identifies its result; pass nil for
+// request-N. Returns NO if the ID is invalid or the batch is at the API's
+// limits (CLAUDE_BATCH_MAX_REQUESTS requests or CLAUDE_BATCH_MAX_BYTES).
+- (BOOL)addBatchRequest:(NSString *)prompt customId:(NSString *)customId;
+- (unsigned long)pendingBatchCount;
+// Submits the gathered requests on a new background thread, which polls
+// until the batch ends and then streams its results to the batch delegate.
+// Gathering starts afresh at once. Returns NO if nothing was gathered.
+- (BOOL)submitBatchWithAPIKey:(NSString *)apiKey;
 
 @end
\ No newline at end of file
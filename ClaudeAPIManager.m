@@ -7,9 +7,224 @@
 
 #import "ClaudeAPIManager.h"
 #import "HTTPSClient.h"
-#import "AppDelegate.h"
+#import "SSEParser.h"
+#import "RateLimiter.h"
+#import "WorkerPool.h"
+#import "TokenEstimator.h"
+#import "JSONWriter.h"
+#import "JSONArena.h"
+#import "JSONIncrementalReader.h"
 #include "yyjson.h"
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define CLAUDE_API_HOST @"api.anthropic.com"
+#define CLAUDE_API_PORT 443
+
+#define CLAUDE_DEFAULT_MODEL @"claude-3-haiku-20240307"
+#define CLAUDE_DEFAULT_MAX_TOKENS 4096
+
+// Prompt caching breakpoints placed on the most recent user turns (the API
+// allows four per request). One writes the prefix that ends with the new
+// turn; the one before it reads back what the previous send wrote.
+#define CLAUDE_CACHE_BREAKPOINTS 2
+
+// Once the history outgrows its budget it is cut back to this fraction of
+// it, so the next several turns fit without another cut. Each cut changes
+// the cached prefix; cutting a little every turn would defeat the cache.
+#define CLAUDE_TRIM_TARGET 0.75
+
+// When a message alone leaves less room than max_tokens asks for, the reply
+// is allowed what is left of the context window, but never less than this
+// (or than max_tokens itself, if that is smaller)
+#define CLAUDE_MIN_REPLY_TOKENS 1024
+
+// Batch status polling: the first poll waits this long, each later one
+// waits CLAUDE_BATCH_POLL_GROWTH times longer, up to CLAUDE_BATCH_MAX_POLL.
+// Batches take minutes to hours, so there is nothing to gain polling faster.
+#define CLAUDE_BATCH_FIRST_POLL 5.0
+#define CLAUDE_BATCH_POLL_GROWTH 1.5
+#define CLAUDE_BATCH_MAX_POLL 60.0
+
+// Polls in a row that may fail on the network or with 429/5xx before the
+// batch is given up on. The batch itself carries on server-side regardless.
+#define CLAUDE_BATCH_MAX_POLL_FAILURES 5
+
+// The integer fields of a JSON object (usage, request_counts) as NSNumbers.
+static NSDictionary *ClaudeIntegerFields(yyjson_val *object) {
+  NSMutableDictionary *fields = [NSMutableDictionary dictionary];
+  yyjson_obj_iter iter;
+  yyjson_val *key;
+  
+  if (!yyjson_is_obj(object)) {
+    return fields;
+  }
+  iter = yyjson_obj_iter_with(object);
+  while ((key = yyjson_obj_iter_next(&iter))) {
+    yyjson_val *value = yyjson_obj_iter_get_val(key);
+    if (yyjson_is_uint(value)) {
+      [fields setObject:[NSNumber numberWithUnsignedLongLong:yyjson_get_uint(value)]
+                 forKey:[NSString stringWithUTF8String:yyjson_get_str(key)]];
+    }
+  }
+  return fields;
+}
+
+// Reads a batch results file (one JSON object per line) as it downloads and
+// hands each result to the batch delegate. Only the line being assembled is
+// held; each result's objects are released before the next line is read.
+@interface ClaudeBatchResultReader : NSObject {
+  ClaudeAPIManager *manager;
+  NSString *batchId;
+  id delegate;
+  NSMutableData *partialLine;
+  NSMutableData *errorBody;
+  unsigned long resultCount;
+}
+
+- (id)initWithManager:(ClaudeAPIManager *)aManager batchId:(NSString *)aBatchId delegate:(id)aDelegate;
+- (void)finish;
+- (unsigned long)resultCount;
+- (NSData *)errorBody;
+
+@end
+
+@implementation ClaudeBatchResultReader
+
+- (id)initWithManager:(ClaudeAPIManager *)aManager batchId:(NSString *)aBatchId delegate:(id)aDelegate {
+  self = [super init];
+  if (self) {
+    manager = aManager;
+    batchId = [aBatchId copy];
+    delegate = aDelegate;
+    partialLine = [[NSMutableData alloc] init];
+    errorBody = [[NSMutableData alloc] init];
+  }
+  return self;
+}
+
+- (void)dealloc {
+  [batchId release];
+  [partialLine release];
+  [errorBody release];
+  [super dealloc];
+}
+
+- (unsigned long)resultCount {
+  return resultCount;
+}
+
+- (NSData *)errorBody {
+  return errorBody;
+}
+
+- (void)handleLine:(const char *)line length:(unsigned long)length {
+  NSAutoreleasePool *pool;
+  NSMutableDictionary *entry;
+  NSMutableString *text;
+  yyjson_doc *doc;
+  yyjson_val *root;
+  yyjson_val *result;
+  yyjson_val *error;
+  const char *type;
+  const char *customId;
+  const char *message;
+  
+  while (length > 0 && (line[length - 1] == '\r' || line[length - 1] == ' ')) {
+    length--;
+  }
+  if (length == 0) {
+    return;
+  }
+  
+  pool = [[NSAutoreleasePool alloc] init];
+  doc = yyjson_read_opts((char *)line, length, 0, [JSONArena currentAllocator], NULL);
+  if (!doc) {
+    NSLog(@"Could not parse batch result line %lu", resultCount + 1);
+    [pool release];
+    return;
+  }
+  root = yyjson_doc_get_root(doc);
+  result = yyjson_obj_get(root, "result");
+  type = yyjson_get_str(yyjson_obj_get(result, "type"));
+  customId = yyjson_get_str(yyjson_obj_get(root, "custom_id"));
+  
+  entry = [NSMutableDictionary dictionary];
+  [entry setObject:[NSString stringWithUTF8String:customId ? customId : ""] forKey:@"custom_id"];
+  [entry setObject:[NSString stringWithUTF8String:type ? type : "unknown"] forKey:@"type"];
+  [entry setObject:[[[NSString alloc] initWithBytes:line length:length encoding:NSUTF8StringEncoding] autorelease]
+            forKey:@"json"];
+  
+  if (type && strcmp(type, "succeeded") == 0) {
+    yyjson_val *msg = yyjson_obj_get(result, "message");
+    yyjson_val *block;
+    yyjson_arr_iter iter = yyjson_arr_iter_with(yyjson_obj_get(msg, "content"));
+    
+    text = [NSMutableString string];
+    while ((block = yyjson_arr_iter_next(&iter))) {
+      const char *piece = yyjson_get_str(yyjson_obj_get(block, "text"));
+      if (piece && yyjson_equals_str(yyjson_obj_get(block, "type"), "text")) {
+        [text appendString:[NSString stringWithUTF8String:piece]];
+      }
+    }
+    [entry setObject:text forKey:@"text"];
+    [entry setObject:ClaudeIntegerFields(yyjson_obj_get(msg, "usage")) forKey:@"usage"];
+  } else if (type && strcmp(type, "errored") == 0) {
+    // An error response wrapped in the result: {type, error: {type, message}}
+    error = yyjson_obj_get(result, "error");
+    message = yyjson_get_str(yyjson_obj_get(error, "message"));
+    if (!message) {
+      message = yyjson_get_str(yyjson_obj_get(yyjson_obj_get(error, "error"), "message"));
+    }
+    [entry setObject:[NSString stringWithUTF8String:message ? message : "Unknown error"] forKey:@"error"];
+  } else if (type) {
+    [entry setObject:[NSString stringWithFormat:@"Request %s", type] forKey:@"error"];
+  }
+  yyjson_doc_free(doc);
+  
+  resultCount++;
+  if (delegate && [delegate respondsToSelector:@selector(apiManager:batch:didReceiveResult:)]) {
+    [delegate apiManager:manager batch:batchId didReceiveResult:entry];
+  }
+  [pool release];
+}
+
+// Complete lines are parsed straight out of the received buffer; only a
+// line split across reads is copied.
+- (void)httpsClient:(HTTPSClient *)client didReceiveBytes:(const char *)bytes length:(unsigned long)length {
+  const char *end = bytes + length;
+  const char *newline;
+  
+  if ([client lastStatusCode] >= 300) {
+    [errorBody appendBytes:bytes length:length];
+    return;
+  }
+  while (bytes < end && (newline = memchr(bytes, '\n', end - bytes))) {
+    if ([partialLine length] > 0) {
+      [partialLine appendBytes:bytes length:newline - bytes];
+      [self handleLine:[partialLine bytes] length:[partialLine length]];
+      [partialLine setLength:0];
+    } else {
+      [self handleLine:bytes length:newline - bytes];
+    }
+    bytes = newline + 1;
+  }
+  if (bytes < end) {
+    [partialLine appendBytes:bytes length:end - bytes];
+  }
+}
+
+// The last line need not end with a newline.
+- (void)finish {
+  if ([partialLine length] > 0) {
+    [self handleLine:[partialLine bytes] length:[partialLine length]];
+    [partialLine setLength:0];
+  }
+}
+
+@end
 
 @implementation ClaudeAPIManager
 
@@ -18,13 +233,50 @@
   if (self) {
     conversationHistory = [[NSMutableArray alloc] init];
     delegate = nil;
+    streamsResponses = NO;
+    streamedText = [[NSMutableString alloc] init];
+    streamErrorBody = [[NSMutableData alloc] init];
+    pendingDelta = [[NSMutableString alloc] init];
+    pendingDeltaLock = [[NSLock alloc] init];
+    requestLock = [[NSLock alloc] init];
+    requestUsage = [[NSMutableDictionary alloc] init];
+    requestWriter = [[JSONWriter alloc] init];
+    encodedHistory = [[NSMutableData alloc] init];
+    encodedHistoryEnds = [[NSMutableArray alloc] init];
+    apiHost = [CLAUDE_API_HOST copy];
+    apiPort = CLAUDE_API_PORT;
+    model = [CLAUDE_DEFAULT_MODEL copy];
+    maxTokens = CLAUDE_DEFAULT_MAX_TOKENS;
+    workerPool = [[WorkerPool sharedPool] retain];
+    batchSpoolFd = -1;
   }
   return self;
 }
 
 - (void)dealloc {
   [conversationHistory release];
+  [streamedText release];
+  [streamErrorBody release];
+  [streamError release];
+  [pendingDelta release];
+  [pendingDeltaLock release];
+  [activeClient release];
+  [requestLock release];
+  [requestUsage release];
+  [lastUsage release];
+  [requestWriter release];
+  [encodedHistory release];
+  [encodedHistoryEnds release];
+  [apiHost release];
+  [model release];
+  [workerPool release];
+  if (batchSpoolFd >= 0) {
+    close(batchSpoolFd);
+    unlink([batchSpoolPath fileSystemRepresentation]);
+  }
+  [batchSpoolPath release];
   delegate = nil;
+  batchDelegate = nil;
   [super dealloc];
 }
 
@@ -32,23 +284,156 @@
   delegate = aDelegate;
 }
 
+- (BOOL)streamsResponses {
+  return streamsResponses;
+}
+
+- (void)setStreamsResponses:(BOOL)flag {
+  streamsResponses = flag;
+}
+
+- (void)setHost:(NSString *)host port:(int)port {
+  [apiHost autorelease];
+  apiHost = [host copy];
+  apiPort = port;
+}
+
+- (NSString *)model {
+  return model;
+}
+
+- (void)setModel:(NSString *)aModel {
+  if ([aModel length] == 0) {
+    aModel = CLAUDE_DEFAULT_MODEL;
+  }
+  [model autorelease];
+  model = [aModel copy];
+}
+
+- (int)maxTokens {
+  return maxTokens;
+}
+
+- (void)setMaxTokens:(int)tokens {
+  maxTokens = tokens > 0 ? tokens : CLAUDE_DEFAULT_MAX_TOKENS;
+}
+
+- (int)contextWindow {
+  return contextWindow;
+}
+
+- (void)setContextWindow:(int)tokens {
+  contextWindow = tokens > 0 ? tokens : 0;
+}
+
+- (void)setWorkerPool:(WorkerPool *)pool {
+  [workerPool autorelease];
+  workerPool = [(pool ? pool : [WorkerPool sharedPool]) retain];
+}
+
 - (void)sendMessage:(NSString *)message withAPIKey:(NSString *)apiKey {
-  // Retain for background thread
-  [message retain];
-  [apiKey retain];
+  [requestLock lock];
+  cancelRequested = NO;
+  [requestLock unlock];
   
-  // Create info dictionary
+  // Create info dictionary; the pool keeps it until the send has run.
+  // It carries the model settings too, so changing them mid-send is safe.
   NSDictionary *info = [[NSDictionary alloc] initWithObjectsAndKeys:
               message, @"message",
               apiKey, @"apiKey",
+              model, @"model",
+              [NSNumber numberWithInt:maxTokens], @"maxTokens",
+              [NSNumber numberWithInt:contextWindow], @"contextWindow",
               nil];
   
-  [self performSelectorInBackground:@selector(sendMessageInBackground:) 
-              withObject:info];
+  if (![workerPool performSelector:@selector(sendMessageInBackground:)
+                                       onTarget:self
+                                     withObject:info
+                                       priority:WorkerPoolPriorityInteractive]) {
+    // Too many sends already waiting; refuse this one rather than pile up
+    NSError *busyError = [NSError errorWithDomain:@"ClaudeAPI"
+                         code:503
+                       userInfo:[NSDictionary dictionaryWithObject:@"Too many requests are already waiting to be sent"
+                                        forKey:NSLocalizedDescriptionKey]];
+    [self performSelectorOnMainThread:@selector(notifyDelegateWithError:)
+                 withObject:busyError
+              waitUntilDone:NO];
+  }
   
   [info release];
 }
 
+- (void)cancelRequest {
+  [requestLock lock];
+  cancelRequested = YES;
+  [activeClient cancel];
+  [requestLock unlock];
+}
+
+- (void)prewarmConnection {
+  [requestLock lock];
+  if (prewarming) {
+    [requestLock unlock];
+    return;
+  }
+  prewarming = YES;
+  [requestLock unlock];
+  
+  // Behind sends, ahead of saves; if the pool is that busy, skip it
+  if (![workerPool performSelector:@selector(prewarmInBackground:)
+                                       onTarget:self
+                                     withObject:nil
+                                       priority:WorkerPoolPriorityDefault]) {
+    [requestLock lock];
+    prewarming = NO;
+    [requestLock unlock];
+  }
+}
+
+// Runs on a pool thread: connects and parks the connection in the pool.
+- (void)prewarmInBackground:(id)unused {
+  HTTPSClient *client = [[HTTPSClient alloc] initWithHost:apiHost port:apiPort];
+  
+  if ([client prewarmConnection]) {
+    [self performSelectorOnMainThread:@selector(scheduleIdleConnectionSweep)
+                 withObject:nil
+              waitUntilDone:NO];
+  }
+  [client release];
+  
+  [requestLock lock];
+  prewarming = NO;
+  [requestLock unlock];
+}
+
+// Closes the warm connection once it has outlived the pool's idle lifetime
+// without a send to use it. A later warm-up pushes the sweep back.
+- (void)scheduleIdleConnectionSweep {
+  NSTimeInterval lifetime = [HTTPSClient idleConnectionLifetime];
+  
+  if (lifetime <= 0) {
+    return;
+  }
+  [NSObject cancelPreviousPerformRequestsWithTarget:[HTTPSClient class]
+                       selector:@selector(closeExpiredConnections)
+                         object:nil];
+  [[HTTPSClient class] performSelector:@selector(closeExpiredConnections)
+                withObject:nil
+                afterDelay:lifetime + 1.0];
+}
+
+// Makes the client reachable from -cancelRequest for the duration of one
+// attempt. A cancel that came in before the client existed is applied now.
+- (void)setActiveClient:(HTTPSClient *)client {
+  [requestLock lock];
+  [activeClient release];
+  activeClient = [client retain];
+  if (cancelRequested) {
+    [client cancel];
+  }
+  [requestLock unlock];
+}
+
 - (void)addToHistory:(NSString *)message isUser:(BOOL)isUser {
   NSDictionary *historyMessage = [NSDictionary dictionaryWithObjectsAndKeys:
                   isUser ? @"user" : @"assistant", @"role",
@@ -57,21 +442,283 @@
   [conversationHistory addObject:historyMessage];
 }
 
+- (NSArray *)history {
+  return [[conversationHistory copy] autorelease];
+}
+
+- (NSDictionary *)lastUsage {
+  NSDictionary *usage;
+  
+  [requestLock lock];
+  usage = [[lastUsage retain] autorelease];
+  [requestLock unlock];
+  return usage;
+}
+
+// Where the cache breakpoints start: the last CLAUDE_CACHE_BREAKPOINTS user
+// turns become text content blocks marked cache_control ephemeral, so the
+// breakpoints move forward as the conversation grows. Everything before the
+// returned index is sent exactly as stored.
+- (unsigned int)cacheBreakpointStart {
+  unsigned int start = [conversationHistory count];
+  int remaining = CLAUDE_CACHE_BREAKPOINTS;
+  int i;
+  
+  for (i = [conversationHistory count] - 1; i >= 0 && remaining > 0; i--) {
+    NSDictionary *turn = [conversationHistory objectAtIndex:i];
+    
+    if ([[turn objectForKey:@"role"] isEqualToString:@"user"] &&
+        [[turn objectForKey:@"content"] isKindOfClass:[NSString class]]) {
+      start = i;
+      remaining--;
+    }
+  }
+  return start;
+}
+
+// The history from start on, as sent: user turns with plain string content
+// are rewritten as marked text blocks. The stored history keeps plain
+// strings; only the request copy is rewritten.
+- (NSArray *)messagesWithCacheBreakpointsFromIndex:(unsigned int)start {
+  NSMutableArray *messages = [NSMutableArray arrayWithCapacity:[conversationHistory count] - start];
+  NSDictionary *ephemeral = [NSDictionary dictionaryWithObject:@"ephemeral" forKey:@"type"];
+  unsigned int i;
+  
+  for (i = start; i < [conversationHistory count]; i++) {
+    NSDictionary *turn = [conversationHistory objectAtIndex:i];
+    id content = [turn objectForKey:@"content"];
+    NSDictionary *block;
+    
+    if (![[turn objectForKey:@"role"] isEqualToString:@"user"] || ![content isKindOfClass:[NSString class]]) {
+      [messages addObject:turn];
+      continue;
+    }
+    block = [NSDictionary dictionaryWithObjectsAndKeys:
+             @"text", @"type",
+             content, @"text",
+             ephemeral, @"cache_control",
+             nil];
+    [messages addObject:[NSDictionary dictionaryWithObjectsAndKeys:
+                         @"user", @"role",
+                         [NSArray arrayWithObject:block], @"content",
+                         nil]];
+  }
+  
+  return messages;
+}
+
+// Forgets the encoded JSON of history messages from index on, after they
+// were removed or changed. Earlier messages stay encoded.
+- (void)discardEncodedHistoryFromIndex:(unsigned int)index {
+  unsigned int count = [encodedHistoryEnds count];
+  
+  if (index >= count) {
+    return;
+  }
+  [encodedHistory setLength:(index == 0) ? 0 : [[encodedHistoryEnds objectAtIndex:index - 1] unsignedLongValue]];
+  [encodedHistoryEnds removeObjectsInRange:NSMakeRange(index, count - index)];
+}
+
+// Removes one message from the history, and its JSON if it was encoded.
+- (void)removeHistoryMessage:(NSDictionary *)historyMessage {
+  unsigned int index = [conversationHistory indexOfObjectIdenticalTo:historyMessage];
+  
+  if (index != NSNotFound) {
+    [self discardEncodedHistoryFromIndex:index];
+    [conversationHistory removeObjectAtIndex:index];
+  }
+}
+
+// The request body as pieces for HTTPSClient's bodyParts: the parameters,
+// the encoded history before the cache breakpoints, the breakpoint turns
+// and the closing brace. Only messages added since the last send are
+// encoded, so the cost per turn follows the new message rather than the
+// conversation. The pieces point into buffers the manager reuses and are
+// only valid until the next send. Returns nil if encoding failed.
+- (NSArray *)requestBodyPartsWithParameters:(NSDictionary *)parameters {
+  unsigned int start = [self cacheBreakpointStart];
+  unsigned int i;
+  NSMutableData *head;
+  NSData *prefix;
+  NSData *tail;
+  unsigned long prefixLength;
+  
+  // Encode messages that became part of the unchanging prefix
+  for (i = [encodedHistoryEnds count]; i < start; i++) {
+    if (![requestWriter writeObject:[conversationHistory objectAtIndex:i]]) {
+      return nil;
+    }
+    [encodedHistory appendBytes:[requestWriter bytes] length:[requestWriter length]];
+    [encodedHistory appendBytes:"," length:1];
+    [encodedHistoryEnds addObject:[NSNumber numberWithUnsignedLong:[encodedHistory length]]];
+  }
+  
+  // {"model":...} becomes {"model":...,"messages":[
+  head = [[[JSONWriter dataWithJSONObject:parameters] mutableCopy] autorelease];
+  if ([head length] < 2) {
+    return nil;
+  }
+  [head setLength:[head length] - 1];
+  [head appendBytes:",\"messages\":[" length:strlen(",\"messages\":[")];
+  
+  // [turn,...] loses its opening bracket and keeps the closing one
+  if (![requestWriter writeObject:[self messagesWithCacheBreakpointsFromIndex:start]]) {
+    return nil;
+  }
+  tail = [NSData dataWithBytesNoCopy:(char *)[requestWriter bytes] + 1
+                              length:[requestWriter length] - 1
+                        freeWhenDone:NO];
+  
+  prefixLength = (start == 0) ? 0 : [[encodedHistoryEnds objectAtIndex:start - 1] unsignedLongValue];
+  if (start == [conversationHistory count] && prefixLength > 0) {
+    // Nothing follows the prefix, so its last comma must go
+    prefixLength--;
+  }
+  prefix = [NSData dataWithBytesNoCopy:[encodedHistory mutableBytes] length:prefixLength freeWhenDone:NO];
+  
+  return [NSArray arrayWithObjects:head, prefix, tail, [NSData dataWithBytes:"}" length:1], nil];
+}
+
+// Drops the oldest exchanges after the first one until the history's
+// estimated size fits the budget, keeping the opening turn (which usually
+// sets up the task) and the most recent turns. Returns the estimate for
+// what is left. A budget of 0 means the model's limits are unknown.
+- (unsigned long)trimHistoryToFitTokens:(unsigned long)budget {
+  TokenEstimator *estimator = [TokenEstimator sharedEstimator];
+  unsigned long estimate = [estimator estimatedTokensForMessages:conversationHistory];
+  unsigned long target = (unsigned long)(budget * CLAUDE_TRIM_TARGET);
+  unsigned long removed = 0;
+  
+  if (budget == 0 || estimate <= budget) {
+    return estimate;
+  }
+  
+  // Whole exchanges from just after the first, so roles keep alternating
+  [self discardEncodedHistoryFromIndex:2];
+  while (estimate > target && [conversationHistory count] > 3) {
+    do {
+      NSArray *turn = [NSArray arrayWithObject:[conversationHistory objectAtIndex:2]];
+      unsigned long size = [estimator estimatedTokensForMessages:turn];
+      estimate = (size < estimate) ? estimate - size : 0;
+      [conversationHistory removeObjectAtIndex:2];
+      removed++;
+    } while ([conversationHistory count] > 3 &&
+             ![[[conversationHistory objectAtIndex:2] objectForKey:@"role"] isEqualToString:@"user"]);
+  }
+  
+  // Only the first exchange and the new turn are left; give up the first
+  if (estimate > budget && [conversationHistory count] == 3) {
+    [self discardEncodedHistoryFromIndex:0];
+    [conversationHistory removeObjectsInRange:NSMakeRange(0, 2)];
+    removed += 2;
+    estimate = [estimator estimatedTokensForMessages:conversationHistory];
+  }
+  
+  NSLog(@"Trimmed %lu earlier messages to fit the context window (about %lu of %lu tokens)",
+        removed, estimate, budget);
+  return estimate;
+}
+
+// Merges the integer fields of a usage object into requestUsage. Streams
+// report input and cache counts in message_start and output counts in
+// message_delta, so later fields simply overwrite earlier ones.
+- (void)recordUsage:(yyjson_val *)usage {
+  yyjson_obj_iter iter;
+  yyjson_val *key;
+  
+  if (!yyjson_is_obj(usage)) {
+    return;
+  }
+  iter = yyjson_obj_iter_with(usage);
+  while ((key = yyjson_obj_iter_next(&iter))) {
+    yyjson_val *value = yyjson_obj_iter_get_val(key);
+    if (yyjson_is_uint(value)) {
+      [requestUsage setObject:[NSNumber numberWithUnsignedLongLong:yyjson_get_uint(value)]
+                       forKey:[NSString stringWithUTF8String:yyjson_get_str(key)]];
+    }
+  }
+}
+
+// Publishes the finished request's usage; call before the response goes out.
+- (void)publishUsage {
+  NSDictionary *usage;
+  
+  NSArray *fields = [NSArray arrayWithObjects:@"input_tokens", @"output_tokens",
+                     @"cache_creation_input_tokens", @"cache_read_input_tokens", nil];
+  NSEnumerator *fieldEnum;
+  NSString *field;
+  
+  if ([requestUsage count] == 0) {
+    return;
+  }
+  
+  // Cached and uncached input together is what the estimate predicted
+  [[TokenEstimator sharedEstimator]
+    recordActualTokens:[[requestUsage objectForKey:@"input_tokens"] unsignedLongValue] +
+                       [[requestUsage objectForKey:@"cache_creation_input_tokens"] unsignedLongValue] +
+                       [[requestUsage objectForKey:@"cache_read_input_tokens"] unsignedLongValue]
+    forEstimatedTokens:requestEstimate];
+  
+  // Models without prompt caching leave the cache fields out
+  fieldEnum = [fields objectEnumerator];
+  while ((field = [fieldEnum nextObject])) {
+    if (![requestUsage objectForKey:field]) {
+      [requestUsage setObject:[NSNumber numberWithInt:0] forKey:field];
+    }
+  }
+  usage = [[requestUsage copy] autorelease];
+  [requestLock lock];
+  [lastUsage release];
+  lastUsage = [usage retain];
+  [requestLock unlock];
+  
+  NSLog(@"Usage: input=%@ output=%@ cache_write=%@ cache_read=%@",
+        [usage objectForKey:@"input_tokens"], [usage objectForKey:@"output_tokens"],
+        [usage objectForKey:@"cache_creation_input_tokens"], [usage objectForKey:@"cache_read_input_tokens"]);
+  [self performSelectorOnMainThread:@selector(notifyDelegateWithUsage:)
+               withObject:usage
+            waitUntilDone:NO];
+}
+
+// Publishes how long the finished request took; call before the response
+// goes out. Output tokens per second are counted from the first token, so
+// they measure generation rather than the wait for it.
+- (void)publishTimings {
+  NSTimeInterval finished = [NSDate timeIntervalSinceReferenceDate];
+  NSTimeInterval firstToken = (firstTokenAt > 0) ? firstTokenAt : finished;
+  unsigned long outputTokens = [[requestUsage objectForKey:@"output_tokens"] unsignedLongValue];
+  double tokensPerSecond;
+  NSDictionary *timings;
+  
+  if (finished - firstToken > 0) {
+    tokensPerSecond = outputTokens / (finished - firstToken);
+  } else {
+    tokensPerSecond = (finished > requestStarted) ? outputTokens / (finished - requestStarted) : 0;
+  }
+  timings = [NSDictionary dictionaryWithObjectsAndKeys:
+             [NSNumber numberWithDouble:firstToken - requestStarted], @"time_to_first_token",
+             [NSNumber numberWithDouble:finished - requestStarted], @"latency",
+             [NSNumber numberWithDouble:tokensPerSecond], @"tokens_per_second",
+             nil];
+  
+  NSLog(@"Timings: first token %.3f s, total %.3f s, %.1f tokens/s",
+        firstToken - requestStarted, finished - requestStarted, tokensPerSecond);
+  [self performSelectorOnMainThread:@selector(notifyDelegateWithTimings:)
+               withObject:timings
+            waitUntilDone:NO];
+}
+
 - (void)sendMessageInBackground:(NSDictionary *)info {
   NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
   
   NSString *message = [[info objectForKey:@"message"] retain];
   NSString *apiKey = [[[info objectForKey:@"apiKey"] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]] retain];
   
-  // Get selected model from AppDelegate
-  AppDelegate *appDelegate = (AppDelegate *)[[NSApplication sharedApplication] delegate];
-  NSString *model = [appDelegate selectedModel];
-  int maxTokens = [[[[appDelegate modelMap] objectForKey:model] objectForKey:@"max-tokens"] intValue];
-  if (!model || [model length] == 0) {
-    model = @"claude-3-haiku-20240307";  // Default to Haiku 3
-  }
+  NSString *requestModel = [info objectForKey:@"model"];
+  int requestMaxTokens = [[info objectForKey:@"maxTokens"] intValue];
+  int requestContextWindow = [[info objectForKey:@"contextWindow"] intValue];
 
-  NSLog(@"Using model %@", model);
+  NSLog(@"Using model %@", requestModel);
   
   // Add message to history
   NSDictionary *userMessage = [NSDictionary dictionaryWithObjectsAndKeys:
@@ -80,18 +727,72 @@
                   nil];
   [conversationHistory addObject:userMessage];
   
+  // Leave room for the reply within the context window, and refuse locally
+  // what the API would only refuse after the whole upload: the input plus
+  // max_tokens has to fit the window
+  unsigned long inputBudget = (requestContextWindow > requestMaxTokens ? requestContextWindow - requestMaxTokens : 0);
+  int replyFloor = (requestMaxTokens < CLAUDE_MIN_REPLY_TOKENS ? requestMaxTokens : CLAUDE_MIN_REPLY_TOKENS);
+  requestEstimate = [self trimHistoryToFitTokens:inputBudget];
+  if (requestContextWindow > 0 && requestEstimate > inputBudget &&
+      requestEstimate + replyFloor <= (unsigned long)requestContextWindow) {
+    // Trimming could not get under the budget, so the newest message is
+    // most of it; shorten the reply instead of refusing
+    requestMaxTokens = (int)(requestContextWindow - requestEstimate);
+    NSLog(@"Input of about %lu tokens leaves room for a %d-token reply", requestEstimate, requestMaxTokens);
+  } else if (requestContextWindow > 0 && requestEstimate > inputBudget) {
+    NSString *tooLong = [NSString stringWithFormat:
+                         @"This message is too long for the model (about %lu tokens; the limit is %lu, "
+                         @"leaving %d tokens of the %d-token context window for the reply)",
+                         requestEstimate,
+                         (unsigned long)(requestContextWindow > replyFloor ? requestContextWindow - replyFloor : 0),
+                         replyFloor, requestContextWindow];
+    [self removeHistoryMessage:userMessage];
+    [self performSelectorOnMainThread:@selector(notifyDelegateWithError:)
+                 withObject:[NSError errorWithDomain:@"ClaudeAPI"
+                                                code:413
+                                            userInfo:[NSDictionary dictionaryWithObject:tooLong
+                                                                                 forKey:NSLocalizedDescriptionKey]]
+              waitUntilDone:NO];
+    [message release];
+    [apiKey release];
+    [pool release];
+    return;
+  }
+  
   // Prepare request body
-  NSDictionary *requestBody = [NSDictionary dictionaryWithObjectsAndKeys:
-                  model, @"model",
-                  conversationHistory, @"messages",
-                  [NSNumber numberWithInt:maxTokens], @"max_tokens",
+  NSMutableDictionary *requestParameters = [NSMutableDictionary dictionaryWithObjectsAndKeys:
+                  requestModel, @"model",
+                  [NSNumber numberWithInt:requestMaxTokens], @"max_tokens",
                   nil];
+  if (streamsResponses) {
+    [requestParameters setObject:[NSNumber numberWithBool:YES] forKey:@"stream"];
+  }
                   
-  NSLog(@"Reqest body set to model %@, with max-tokens of %lu", model, maxTokens);
+  NSLog(@"Reqest body set to model %@, with max-tokens of %lu", requestModel, requestMaxTokens);
   
-  // For Tiger, we need to manually create JSON
-  NSString *jsonString = [self dictionaryToJSON:requestBody];
-  NSData *bodyData = [jsonString dataUsingEncoding:NSUTF8StringEncoding];
+  // Built from the history encoded by earlier sends plus what is new; the
+  // pieces stay valid until this request ends, as one runs at a time
+  NSArray *bodyParts = [self requestBodyPartsWithParameters:requestParameters];
+  if (!bodyParts) {
+    [self discardEncodedHistoryFromIndex:0];
+    [self removeHistoryMessage:userMessage];
+    [self performSelectorOnMainThread:@selector(notifyDelegateWithError:)
+                 withObject:[NSError errorWithDomain:@"ClaudeAPI"
+                                                code:-1
+                                            userInfo:[NSDictionary dictionaryWithObject:@"Could not encode the request"
+                                                                                 forKey:NSLocalizedDescriptionKey]]
+              waitUntilDone:NO];
+    [message release];
+    [apiKey release];
+    [pool release];
+    return;
+  }
+  NSEnumerator *partEnum = [bodyParts objectEnumerator];
+  NSData *part;
+  unsigned long bodyLength = 0;
+  while ((part = [partEnum nextObject])) {
+    bodyLength += [part length];
+  }
   
   // Use HTTPSClient for the request
   NSDictionary *headers = [NSDictionary dictionaryWithObjectsAndKeys:
@@ -102,42 +803,92 @@
   
   NSLog(@"Sending request to Claude API");
   NSLog(@"Request headers: %@", headers);
-  NSLog(@"Request body: %@", jsonString);
-  
-  // Create HTTPS client
-  HTTPSClient *client = [[[HTTPSClient alloc] initWithHost:@"api.anthropic.com" port:443] autorelease];
+  NSLog(@"Request body: %lu bytes, %lu of them encoded for earlier requests",
+        bodyLength, (unsigned long)[[bodyParts objectAtIndex:1] length]);
   
-  // Send request
-  NSData *data = [client sendPOSTRequest:@"/v1/messages"
-                   headers:headers
-                    body:bodyData];
+  // Pace sends to the account's rate limits, and retry replies that say
+  // the limit (429) or the service (529) is saturated
+  RateLimiter *limiter = [RateLimiter sharedLimiter];
+  unsigned long inputTokens = requestEstimate;
+  HTTPSClient *client = nil;
+  NSData *data = nil;
+  JSONIncrementalReader *responseReader = nil;
+  BOOL cancelled = NO;
+  unsigned int attempt;
   
-  if (data) {
-    NSLog(@"Received data of length: %lu", (unsigned long)[data length]);
+  for (attempt = 0; ; attempt++) {
+    BOOL mayRetry = (attempt < RATE_LIMITER_MAX_RETRIES);
+    BOOL retry;
+    NSTimeInterval delay;
     
-    NSString *jsonResponse = [[[NSString alloc] initWithData:data 
-                             encoding:NSUTF8StringEncoding] autorelease];
+    [requestUsage removeAllObjects];
+    // A cancel while held back, or while backing off before a retry, ends
+    // the wait; -setActiveClient: only covers the attempt itself
+    if (![limiter waitForKey:apiKey inputTokens:inputTokens cancelFlag:&cancelRequested]) {
+      cancelled = YES;
+      break;
+    }
+    requestStarted = [NSDate timeIntervalSinceReferenceDate];
+    firstTokenAt = 0;
+    client = [[[HTTPSClient alloc] initWithHost:apiHost port:apiPort] autorelease];
+    [self setActiveClient:client];
     
-    if (!jsonResponse) {
-      NSLog(@"Failed to convert data to string");
-      NSError *parseError = [NSError errorWithDomain:@"ClaudeAPI"
-                             code:500
-                           userInfo:[NSDictionary dictionaryWithObject:@"Failed to decode response as UTF-8"
-                                            forKey:NSLocalizedDescriptionKey]];
-      [self performSelectorOnMainThread:@selector(notifyDelegateWithError:)
-                   withObject:parseError
-                waitUntilDone:NO];
-      [message release];
-      [apiKey release];
-      [pool release];
-      return;
+    if (streamsResponses) {
+      // A streamed reply starts as soon as the request is accepted, so there
+      // is no reason to wait as long for its first byte
+      [client setFirstByteTimeout:HTTPS_DEFAULT_IDLE_TIMEOUT];
+      retry = [self streamRequestWithClient:client headers:headers bodyParts:bodyParts mayRetry:mayRetry];
+    } else {
+      // A long reply is parsed as it arrives, so it is ready with the last byte
+      if (!responseReader) {
+        responseReader = [[[JSONIncrementalReader alloc] init] autorelease];
+      }
+      [client setBodyDelegate:responseReader];
+      data = [client sendPOSTRequest:@"/v1/messages"
+                       headers:headers
+                   bodyParts:bodyParts];
+      retry = mayRetry && [RateLimiter isRetryableStatus:[client lastStatusCode]];
     }
     
-    NSLog(@"JSON Response length: %lu", (unsigned long)[jsonResponse length]);
+    [self setActiveClient:nil];
+    [limiter updateKey:apiKey withResponseHeaders:[client lastResponseHeaders]];
+    cancelled = [client isCancelled];
+    if (!retry || cancelled) {
+      break;
+    }
+    delay = [limiter backOffKey:apiKey attempt:attempt responseHeaders:[client lastResponseHeaders]];
+    NSLog(@"HTTP %d from API, retrying in %.1f seconds", [client lastStatusCode], delay);
+  }
+  
+  if (cancelled) {
+    // The next request must not carry a question that was never answered
+    [self removeHistoryMessage:userMessage];
+    [self performSelectorOnMainThread:@selector(notifyDelegateOfCancel)
+                 withObject:nil
+              waitUntilDone:NO];
+  }
+  
+  if (streamsResponses || cancelled) {
+    [message release];
+    [apiKey release];
+    [pool release];
+    return;
+  }
+  
+  if (data) {
+    NSLog(@"Received data of length: %lu", (unsigned long)[data length]);
     
-    // Check if response is empty or just whitespace
-    NSString *trimmedResponse = [jsonResponse stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
-    if ([trimmedResponse length] == 0) {
+    // Check if response is empty or just whitespace, without decoding it;
+    // yyjson checks the UTF-8 as it parses
+    const char *responseBytes = (const char *)[data bytes];
+    unsigned long responseLength = [data length];
+    unsigned long offset = 0;
+    while (offset < responseLength &&
+           (responseBytes[offset] == ' ' || responseBytes[offset] == '\t' ||
+            responseBytes[offset] == '\r' || responseBytes[offset] == '\n')) {
+      offset++;
+    }
+    if (offset == responseLength) {
       NSLog(@"Response is empty or contains only whitespace");
       NSError *emptyError = [NSError errorWithDomain:@"ClaudeAPI"
                              code:500
@@ -152,7 +903,21 @@
       return;
     }
     
-    NSString *responseText = [self extractResponseText:jsonResponse];
+    // Parsed in place in the receive buffer, which HTTPSClient pads for it,
+    // unless it was parsed already on the way in
+    NSString *responseText;
+    yyjson_read_err readError;
+    yyjson_doc *responseDoc = [responseReader takeDocumentForData:data error:&readError];
+    if (responseDoc) {
+      NSLog(@"API Response: %lu bytes, parsed as it arrived", (unsigned long)[data length]);
+      responseText = [self extractResponseTextFromDocument:responseDoc];
+    } else if (readError.code != YYJSON_READ_SUCCESS) {
+      NSLog(@"Failed to parse JSON with yyjson - Error code: %u, message: %s, position: %lu",
+          readError.code, readError.msg, (unsigned long)readError.pos);
+      responseText = nil;
+    } else {
+      responseText = [self extractResponseTextFromPaddedData:data];
+    }
     
     if (responseText) {
       // Add assistant response to history
@@ -163,6 +928,8 @@
       [conversationHistory addObject:assistantMessage];
       
       // Notify delegate on main thread
+      [self publishUsage];
+      [self publishTimings];
       [self performSelectorOnMainThread:@selector(notifyDelegateWithResponse:)
                    withObject:responseText
                 waitUntilDone:NO];
@@ -176,10 +943,14 @@
                 waitUntilDone:NO];
     }
   } else {
-    NSError *networkError = [NSError errorWithDomain:@"ClaudeAPI"
+    // Prefer the transport's own error, which says which phase failed
+    NSError *networkError = [client lastError];
+    if (!networkError) {
+      networkError = [NSError errorWithDomain:@"ClaudeAPI"
                            code:500
                          userInfo:[NSDictionary dictionaryWithObject:@"Failed to connect to API"
                                             forKey:NSLocalizedDescriptionKey]];
+    }
     [self performSelectorOnMainThread:@selector(notifyDelegateWithError:)
                  withObject:networkError
               waitUntilDone:NO];
@@ -190,163 +961,633 @@
   [pool release];
 }
 
+// Sends the request with stream: true and feeds the event stream through
+// the SSE parser as it arrives. Runs on the background request thread.
+// Returns YES, without telling the delegate anything, when mayRetry is set
+// and the reply was a 429 or 529 that the caller should send again.
+- (BOOL)streamRequestWithClient:(HTTPSClient *)client
+                        headers:(NSDictionary *)headers
+                      bodyParts:(NSArray *)bodyParts
+                       mayRetry:(BOOL)mayRetry {
+  BOOL completed;
+  NSString *failure = nil;
+  
+  [streamedText setString:@""];
+  [streamErrorBody setLength:0];
+  [streamError release];
+  streamError = nil;
+  streamStopped = NO;
+  sseParser = [[SSEParser alloc] initWithDelegate:self];
+  
+  completed = [client sendStreamingRequest:@"POST"
+                                      path:@"/v1/messages"
+                                   headers:headers
+                                 bodyParts:bodyParts
+                                  delegate:self];
+  
+  [sseParser finish];
+  [sseParser release];
+  sseParser = nil;
+  
+  // The caller reports a cancel; anything else here is just its fallout
+  if ([client isCancelled]) {
+    return NO;
+  }
+  
+  // Error replies carry no events, so nothing has reached the delegate yet
+  if (mayRetry && [RateLimiter isRetryableStatus:[client lastStatusCode]]) {
+    return YES;
+  }
+  
+  if (!completed && !streamStopped && [client lastError]) {
+    // Timeouts and connection failures, even partway through the stream
+    [self performSelectorOnMainThread:@selector(notifyDelegateWithError:)
+                 withObject:[client lastError]
+              waitUntilDone:NO];
+    return NO;
+  } else if ([streamErrorBody length] > 0) {
+    // Non-2xx replies are a plain JSON error object, not an event stream.
+    // The added length is zeroed, which is the padding in-place parsing needs.
+    unsigned long errorLength = [streamErrorBody length];
+    [streamErrorBody increaseLengthBy:YYJSON_PADDING_SIZE];
+    failure = [self extractResponseTextFromBytes:[streamErrorBody mutableBytes] length:errorLength];
+    if (!failure) {
+      failure = [NSString stringWithFormat:@"HTTP error %d", [client lastStatusCode]];
+    }
+  } else if (streamError) {
+    failure = [NSString stringWithFormat:@"API Error: %@", streamError];
+  } else if (!streamStopped) {
+    failure = completed ? @"Response ended before the message was complete"
+                        : @"Failed to connect to API";
+  }
+  
+  if (failure) {
+    NSError *streamFailure = [NSError errorWithDomain:@"ClaudeAPI"
+                                                 code:500
+                                             userInfo:[NSDictionary dictionaryWithObject:failure
+                                                                                  forKey:NSLocalizedDescriptionKey]];
+    [self performSelectorOnMainThread:@selector(notifyDelegateWithError:)
+                 withObject:streamFailure
+              waitUntilDone:NO];
+    return NO;
+  }
+  
+  NSString *responseText = [[streamedText copy] autorelease];
+  NSDictionary *assistantMessage = [NSDictionary dictionaryWithObjectsAndKeys:
+                     @"assistant", @"role",
+                     responseText, @"content",
+                     nil];
+  [conversationHistory addObject:assistantMessage];
+  
+  // Queued behind any pending deltas, so the delegate sees them first
+  [self publishUsage];
+  [self publishTimings];
+  [self performSelectorOnMainThread:@selector(notifyDelegateWithResponse:)
+               withObject:responseText
+            waitUntilDone:NO];
+  return NO;
+}
+
+- (void)httpsClient:(HTTPSClient *)client didReceiveBytes:(const char *)bytes length:(unsigned long)length {
+  if ([client lastStatusCode] >= 300) {
+    [streamErrorBody appendBytes:bytes length:length];
+  } else {
+    [sseParser appendBytes:bytes length:length];
+  }
+}
+
+- (void)parser:(SSEParser *)parser didReceiveEvent:(NSString *)event data:(NSData *)data {
+  yyjson_doc *doc;
+  yyjson_val *root;
+  yyjson_val *delta;
+  const char *text;
+  
+  if ([event isEqualToString:@"ping"]) {
+    return;
+  }
+  if ([event isEqualToString:@"message_stop"]) {
+    streamStopped = YES;
+    return;
+  }
+  
+  doc = yyjson_read_opts((char *)[data bytes], [data length], 0, [JSONArena currentAllocator], NULL);
+  if (!doc) {
+    NSLog(@"Could not parse %@ event", event);
+    return;
+  }
+  root = yyjson_doc_get_root(doc);
+  
+  if ([event isEqualToString:@"message_start"]) {
+    [self recordUsage:yyjson_obj_get(yyjson_obj_get(root, "message"), "usage")];
+  } else if ([event isEqualToString:@"content_block_delta"]) {
+    delta = yyjson_obj_get(root, "delta");
+    if (yyjson_equals_str(yyjson_obj_get(delta, "type"), "text_delta")) {
+      text = yyjson_get_str(yyjson_obj_get(delta, "text"));
+      if (text) {
+        NSString *piece = [NSString stringWithUTF8String:text];
+        if (firstTokenAt == 0) {
+          firstTokenAt = [NSDate timeIntervalSinceReferenceDate];
+        }
+        [streamedText appendString:piece];
+        [self queueDelta:piece];
+      }
+    }
+  } else if ([event isEqualToString:@"message_delta"]) {
+    text = yyjson_get_str(yyjson_obj_get(yyjson_obj_get(root, "delta"), "stop_reason"));
+    if (text) {
+      NSLog(@"Stream stop reason: %s", text);
+    }
+    [self recordUsage:yyjson_obj_get(root, "usage")];
+  } else if ([event isEqualToString:@"error"]) {
+    text = yyjson_get_str(yyjson_obj_get(yyjson_obj_get(root, "error"), "message"));
+    [streamError release];
+    streamError = [[NSString alloc] initWithUTF8String:text ? text : "Unknown stream error"];
+  }
+  
+  yyjson_doc_free(doc);
+}
+
+// Only one main-thread hop is in flight at a time; later deltas ride along
+// with it instead of queueing one perform per token.
+- (void)queueDelta:(NSString *)piece {
+  BOOL schedule;
+  
+  [pendingDeltaLock lock];
+  schedule = ([pendingDelta length] == 0);
+  [pendingDelta appendString:piece];
+  [pendingDeltaLock unlock];
+  
+  if (schedule) {
+    [self performSelectorOnMainThread:@selector(notifyDelegateWithPendingDelta)
+                 withObject:nil
+              waitUntilDone:NO];
+  }
+}
+
+- (void)notifyDelegateWithPendingDelta {
+  NSString *delta;
+  
+  [pendingDeltaLock lock];
+  delta = [[pendingDelta copy] autorelease];
+  [pendingDelta setString:@""];
+  [pendingDeltaLock unlock];
+  
+  if ([delta length] > 0 && delegate && [delegate respondsToSelector:@selector(apiManager:didReceiveDelta:)]) {
+    [delegate apiManager:self didReceiveDelta:delta];
+  }
+}
+
 - (void)notifyDelegateWithResponse:(NSString *)response {
   if (delegate && [delegate respondsToSelector:@selector(apiManager:didReceiveResponse:)]) {
     [delegate apiManager:self didReceiveResponse:response];
   }
 }
 
+- (void)notifyDelegateWithUsage:(NSDictionary *)usage {
+  if (delegate && [delegate respondsToSelector:@selector(apiManager:didReceiveUsage:)]) {
+    [delegate apiManager:self didReceiveUsage:usage];
+  }
+}
+
+- (void)notifyDelegateWithTimings:(NSDictionary *)timings {
+  if (delegate && [delegate respondsToSelector:@selector(apiManager:didReceiveTimings:)]) {
+    [delegate apiManager:self didReceiveTimings:timings];
+  }
+}
+
+- (void)notifyDelegateOfCancel {
+  if (delegate && [delegate respondsToSelector:@selector(apiManagerDidCancelRequest:)]) {
+    [delegate apiManagerDidCancelRequest:self];
+  }
+}
+
 - (void)notifyDelegateWithError:(NSError *)error {
   if (delegate && [delegate respondsToSelector:@selector(apiManager:didFailWithError:)]) {
     [delegate apiManager:self didFailWithError:error];
   }
 }
 
-// Simple JSON serialization for Tiger
-- (NSString *)dictionaryToJSON:(NSDictionary *)dict {
-  NSMutableString *json = [NSMutableString stringWithString:@"{"];
-  NSArray *keys = [dict allKeys];
-  int i;
-  for (i = 0; i < [keys count]; i++) {
-    NSString *key = [keys objectAtIndex:i];
-    id value = [dict objectForKey:key];
-    
-    if (i > 0) [json appendString:@","];
-    [json appendFormat:@"\"%@\":", key];
-    
-    if ([value isKindOfClass:[NSString class]]) {
-      NSString *escaped = [(NSString *)value stringByReplacingOccurrencesOfString:@"\"" 
-                                        withString:@"\\\""];
-      escaped = [escaped stringByReplacingOccurrencesOfString:@"\n" withString:@"\\n"];
-      escaped = [escaped stringByReplacingOccurrencesOfString:@"\r" withString:@"\\r"];
-      escaped = [escaped stringByReplacingOccurrencesOfString:@"\t" withString:@"\\t"];
-      [json appendFormat:@"\"%@\"", escaped];
-    } else if ([value isKindOfClass:[NSNumber class]]) {
-      [json appendFormat:@"%@", value];
-    } else if ([value isKindOfClass:[NSArray class]]) {
-      [json appendString:[self arrayToJSON:value]];
-    } else if ([value isKindOfClass:[NSDictionary class]]) {
-      [json appendString:[self dictionaryToJSON:value]];
+- (void)setBatchDelegate:(id)aDelegate {
+  batchDelegate = aDelegate;
+}
+
+- (unsigned long)pendingBatchCount {
+  return batchCount;
+}
+
+// Writes all of a buffer to the spool, riding out short writes.
+- (BOOL)writeToBatchSpool:(const char *)bytes length:(unsigned long)length {
+  while (length > 0) {
+    ssize_t written = write(batchSpoolFd, bytes, length);
+    if (written < 0 && errno == EINTR) {
+      continue;
     }
+    if (written <= 0) {
+      NSLog(@"Could not write batch spool %@: %s", batchSpoolPath, strerror(errno));
+      return NO;
+    }
+    bytes += written;
+    length -= written;
   }
-  [json appendString:@"}"];
-  return json;
+  return YES;
 }
 
-- (NSString *)arrayToJSON:(NSArray *)array {
-  NSMutableString *json = [NSMutableString stringWithString:@"["];
-  int i;
-  for (i = 0; i < [array count]; i++) {
-    id value = [array objectAtIndex:i];
-    
-    if (i > 0) [json appendString:@","];
+- (BOOL)addBatchRequest:(NSString *)prompt customId:(NSString *)customId {
+  NSCharacterSet *idChars = [NSCharacterSet characterSetWithCharactersInString:
+                             @"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"];
+  NSDictionary *entry;
+  NSData *entryData;
+  unsigned long long size;
+  
+  if (!prompt) {
+    return NO;
+  }
+  if (!customId) {
+    customId = [NSString stringWithFormat:@"request-%lu", batchCount + 1];
+  }
+  if ([customId length] == 0 || [customId length] > 64 ||
+      [[customId stringByTrimmingCharactersInSet:idChars] length] > 0) {
+    NSLog(@"Invalid batch custom_id: %@", customId);
+    return NO;
+  }
+  if (batchCount >= CLAUDE_BATCH_MAX_REQUESTS) {
+    return NO;
+  }
+  
+  entry = [NSDictionary dictionaryWithObjectsAndKeys:
+           customId, @"custom_id",
+           [NSDictionary dictionaryWithObjectsAndKeys:
+            model, @"model",
+            [NSNumber numberWithInt:maxTokens], @"max_tokens",
+            [NSArray arrayWithObject:[NSDictionary dictionaryWithObjectsAndKeys:
+                                      @"user", @"role",
+                                      prompt, @"content",
+                                      nil]], @"messages",
+            nil], @"params",
+           nil];
+  entryData = [JSONWriter dataWithJSONObject:entry];
+  
+  // The request wrapper and a separating comma count towards the limit too
+  size = batchBytes + [entryData length] + 1;
+  if (size + strlen("{\"requests\":[]}") > CLAUDE_BATCH_MAX_BYTES) {
+    return NO;
+  }
+  
+  if (batchSpoolFd < 0) {
+    char spoolTemplate[1024];
+    NSString *pattern = [NSTemporaryDirectory() stringByAppendingPathComponent:@"ClaudeChat-batch.XXXXXX"];
     
-    if ([value isKindOfClass:[NSString class]]) {
-      NSString *escaped = [(NSString *)value stringByReplacingOccurrencesOfString:@"\"" 
-                                        withString:@"\\\""];
-      escaped = [escaped stringByReplacingOccurrencesOfString:@"\n" withString:@"\\n"];
-      escaped = [escaped stringByReplacingOccurrencesOfString:@"\r" withString:@"\\r"];
-      escaped = [escaped stringByReplacingOccurrencesOfString:@"\t" withString:@"\\t"];
-      [json appendFormat:@"\"%@\"", escaped];
-    } else if ([value isKindOfClass:[NSNumber class]]) {
-      [json appendFormat:@"%@", value];
-    } else if ([value isKindOfClass:[NSDictionary class]]) {
-      [json appendString:[self dictionaryToJSON:value]];
+    if (![pattern getFileSystemRepresentation:spoolTemplate maxLength:sizeof(spoolTemplate)] ||
+        (batchSpoolFd = mkstemp(spoolTemplate)) < 0) {
+      NSLog(@"Could not create batch spool file: %s", strerror(errno));
+      return NO;
     }
+    batchSpoolPath = [[[NSFileManager defaultManager] stringWithFileSystemRepresentation:spoolTemplate
+                                                                                 length:strlen(spoolTemplate)] retain];
   }
-  [json appendString:@"]"];
-  return json;
+  
+  if ((batchCount > 0 && ![self writeToBatchSpool:"," length:1]) ||
+      ![self writeToBatchSpool:[entryData bytes] length:[entryData length]]) {
+    return NO;
+  }
+  batchCount++;
+  batchBytes = size;
+  return YES;
 }
 
-
-// JSON response parser using yyjson
-- (NSString *)extractResponseText:(NSString *)jsonResponse {
-  // Log for debugging (truncate if too long)
-  if ([jsonResponse length] > 1000) {
-    NSLog(@"API Response (first 500 chars): %@", [jsonResponse substringToIndex:500]);
-    NSLog(@"API Response (last 500 chars): %@", [jsonResponse substringFromIndex:[jsonResponse length] - 500]);
-  } else {
-    NSLog(@"API Response: %@", jsonResponse);
+- (BOOL)submitBatchWithAPIKey:(NSString *)apiKey {
+  NSDictionary *job;
+  
+  if (batchCount == 0 || batchSpoolFd < 0) {
+    return NO;
   }
+  close(batchSpoolFd);
+  batchSpoolFd = -1;
   
-  // Convert NSString to C string for yyjson
-  const char *json_str = [jsonResponse UTF8String];
-  size_t json_len = strlen(json_str);
+  job = [NSDictionary dictionaryWithObjectsAndKeys:
+         batchSpoolPath, @"spoolPath",
+         [apiKey stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]], @"apiKey",
+         [NSNumber numberWithUnsignedLong:batchCount], @"count",
+         nil];
+  [batchSpoolPath release];
+  batchSpoolPath = nil;
+  batchCount = 0;
+  batchBytes = 0;
   
-  NSLog(@"Attempting to parse JSON of length: %zu", json_len);
-  NSLog(@"First 200 chars of JSON: %.200s", json_str);
+  // Polling can go on for hours; give it its own thread rather than tie up
+  // one of the pool's
+  [NSThread detachNewThreadSelector:@selector(runBatch:) toTarget:self withObject:job];
+  return YES;
+}
+
+- (void)notifyBatchDelegateOfError:(NSError *)error batch:(NSString *)batchId {
+  NSLog(@"Batch %@ failed: %@", batchId, [error localizedDescription]);
+  if (batchDelegate && [batchDelegate respondsToSelector:@selector(apiManager:batch:didFailWithError:)]) {
+    [batchDelegate apiManager:self batch:batchId didFailWithError:error];
+  }
+}
+
+// An error for a failed batch call: the transport's own error if there was
+// no reply, otherwise the API's error message or the bare status.
+- (NSError *)batchErrorWithClient:(HTTPSClient *)client body:(NSData *)body {
+  NSString *message = nil;
   
-  // Parse JSON with yyjson
-  yyjson_read_err err;
-  memset(&err, 0, sizeof(err));
-  yyjson_doc *doc = yyjson_read_opts((char *)json_str, json_len, 0, NULL, &err);
-  if (!doc) {
-    NSLog(@"Failed to parse JSON with yyjson - Error code: %u, message: %s, position: %zu", 
-        err.code, err.msg, err.pos);
-    NSLog(@"Error occurred near: %.50s", json_str + (err.pos > 50 ? err.pos - 50 : 0));
+  if ([client lastStatusCode] == 0 && [client lastError]) {
+    return [client lastError];
+  }
+  if ([body length] > 0) {
+    // Error bodies are small, and some come from the results reader rather
+    // than HTTPSClient, so parse a padded copy
+    NSMutableData *buffer = [NSMutableData dataWithLength:[body length] + YYJSON_PADDING_SIZE];
+    memcpy([buffer mutableBytes], [body bytes], [body length]);
+    message = [self extractResponseTextFromBytes:[buffer mutableBytes] length:[body length]];
+  }
+  if (!message) {
+    message = [NSString stringWithFormat:@"HTTP error %d", [client lastStatusCode]];
+  }
+  return [NSError errorWithDomain:@"ClaudeAPI"
+                             code:([client lastStatusCode] ? [client lastStatusCode] : 500)
+                         userInfo:[NSDictionary dictionaryWithObject:message forKey:NSLocalizedDescriptionKey]];
+}
+
+// Uploads the spooled requests. The spool is mapped rather than read and
+// sent as the middle of three body parts, so even a full 256 MB batch is
+// never copied into memory. Returns the new batch's ID, or nil.
+- (NSString *)createBatchFromSpool:(NSString *)spoolPath headers:(NSDictionary *)headers apiKey:(NSString *)apiKey {
+  RateLimiter *limiter = [RateLimiter sharedLimiter];
+  NSData *spool = [NSData dataWithContentsOfMappedFile:spoolPath];
+  NSArray *bodyParts;
+  HTTPSClient *client = nil;
+  NSData *data = nil;
+  NSString *batchId = nil;
+  yyjson_doc *doc;
+  const char *idString;
+  unsigned int attempt;
+  
+  if (!spool) {
+    [self notifyBatchDelegateOfError:[NSError errorWithDomain:@"ClaudeAPI"
+                                                         code:500
+                                                     userInfo:[NSDictionary dictionaryWithObject:@"Could not read the batch spool file"
+                                                                                          forKey:NSLocalizedDescriptionKey]]
+                               batch:nil];
     return nil;
   }
+  bodyParts = [NSArray arrayWithObjects:
+               [@"{\"requests\":[" dataUsingEncoding:NSUTF8StringEncoding],
+               spool,
+               [@"]}" dataUsingEncoding:NSUTF8StringEncoding],
+               nil];
+  
+  for (attempt = 0; ; attempt++) {
+    NSTimeInterval delay;
+    
+    // Batches have their own limits and do not count against the token budget
+    [limiter waitForKey:apiKey inputTokens:0];
+    client = [[[HTTPSClient alloc] initWithHost:apiHost port:apiPort] autorelease];
+    data = [client sendPOSTRequest:@"/v1/messages/batches" headers:headers bodyParts:bodyParts];
+    [limiter updateKey:apiKey withResponseHeaders:[client lastResponseHeaders]];
+    if (attempt >= RATE_LIMITER_MAX_RETRIES || ![RateLimiter isRetryableStatus:[client lastStatusCode]]) {
+      break;
+    }
+    delay = [limiter backOffKey:apiKey attempt:attempt responseHeaders:[client lastResponseHeaders]];
+    NSLog(@"HTTP %d creating batch, retrying in %.1f seconds", [client lastStatusCode], delay);
+  }
   
-  // Get root object
-  yyjson_val *root = yyjson_doc_get_root(doc);
-  if (!root) {
+  if (data && [client lastStatusCode] == 200) {
+    doc = yyjson_read_opts((char *)[data bytes], [data length], 0, [JSONArena currentAllocator], NULL);
+    idString = yyjson_get_str(yyjson_obj_get(yyjson_doc_get_root(doc), "id"));
+    if (idString) {
+      batchId = [NSString stringWithUTF8String:idString];
+    }
     yyjson_doc_free(doc);
-    NSLog(@"No root object in JSON");
-    return nil;
   }
+  if (!batchId) {
+    [self notifyBatchDelegateOfError:[self batchErrorWithClient:client body:data] batch:nil];
+  }
+  return batchId;
+}
+
+// Polls the batch with a growing interval until it has ended, reporting
+// its counts each time. Returns the results URL, or nil if polling failed.
+- (NSString *)pollBatch:(NSString *)batchId headers:(NSDictionary *)headers apiKey:(NSString *)apiKey {
+  RateLimiter *limiter = [RateLimiter sharedLimiter];
+  NSString *path = [@"/v1/messages/batches/" stringByAppendingString:batchId];
+  NSTimeInterval delay = CLAUDE_BATCH_FIRST_POLL;
+  unsigned int failures = 0;
+  NSString *resultsURL = nil;
+  NSError *failure = nil;
   
-  // Check for error response
-  yyjson_val *error_obj = yyjson_obj_get(root, "error");
-  if (error_obj) {
-    yyjson_val *error_msg = yyjson_obj_get(error_obj, "message");
-    if (error_msg && yyjson_is_str(error_msg)) {
-      const char *error_str = yyjson_get_str(error_msg);
-      NSLog(@"API Error: %s", error_str);
-      NSString *errorString = [NSString stringWithFormat:@"API Error: %s", error_str];
+  while (!resultsURL && !failure) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    HTTPSClient *client;
+    NSData *data;
+    int status;
+    
+    [NSThread sleepUntilDate:[NSDate dateWithTimeIntervalSinceNow:delay]];
+    delay *= CLAUDE_BATCH_POLL_GROWTH;
+    if (delay > CLAUDE_BATCH_MAX_POLL) {
+      delay = CLAUDE_BATCH_MAX_POLL;
+    }
+    
+    [limiter waitForKey:apiKey inputTokens:0];
+    client = [[[HTTPSClient alloc] initWithHost:apiHost port:apiPort] autorelease];
+    data = [client sendGETRequest:path headers:headers];
+    [limiter updateKey:apiKey withResponseHeaders:[client lastResponseHeaders]];
+    status = [client lastStatusCode];
+    
+    if (!data || status >= 500 || [RateLimiter isRetryableStatus:status]) {
+      // The next poll is a retry in itself; only a run of failures counts
+      if (++failures > CLAUDE_BATCH_MAX_POLL_FAILURES) {
+        failure = [[self batchErrorWithClient:client body:data] retain];
+      } else {
+        NSLog(@"Polling batch %@ failed (HTTP %d), trying again in %.0f seconds", batchId, status, delay);
+      }
+    } else if (status != 200) {
+      failure = [[self batchErrorWithClient:client body:data] retain];
+    } else {
+      yyjson_doc *doc = yyjson_read_opts((char *)[data bytes], [data length], 0,
+                                         [JSONArena currentAllocator], NULL);
+      yyjson_val *root = yyjson_doc_get_root(doc);
+      const char *url = yyjson_get_str(yyjson_obj_get(root, "results_url"));
+      
+      failures = 0;
+      if (batchDelegate && [batchDelegate respondsToSelector:@selector(apiManager:batch:didUpdateCounts:)]) {
+        [batchDelegate apiManager:self batch:batchId
+                  didUpdateCounts:ClaudeIntegerFields(yyjson_obj_get(root, "request_counts"))];
+      }
+      if (yyjson_equals_str(yyjson_obj_get(root, "processing_status"), "ended") && url) {
+        resultsURL = [[NSString alloc] initWithUTF8String:url];
+      }
       yyjson_doc_free(doc);
-      return errorString;  // Return error message to display to user
     }
+    [pool release];
+  }
+  
+  if (failure) {
+    [self notifyBatchDelegateOfError:[failure autorelease] batch:batchId];
   }
+  return [resultsURL autorelease];
+}
+
+// Streams the results file to the batch delegate as it downloads. The
+// file is fetched from the configured host, which for the API is also the
+// host results_url names.
+- (void)downloadBatchResults:(NSString *)resultsURL batch:(NSString *)batchId headers:(NSDictionary *)headers apiKey:(NSString *)apiKey {
+  NSString *path = [[NSURL URLWithString:resultsURL] path];
+  ClaudeBatchResultReader *reader;
+  HTTPSClient *client;
+  BOOL completed;
   
-  // Get content array
-  yyjson_val *content = yyjson_obj_get(root, "content");
-  if (!content) {
-    NSLog(@"No 'content' field found in response root");
-    // Log all keys in the root object for debugging
-    yyjson_obj_iter iter = yyjson_obj_iter_with(root);
-    yyjson_val *key;
-    while ((key = yyjson_obj_iter_next(&iter))) {
-      const char *key_str = yyjson_get_str(key);
-      NSLog(@"Root object has key: %s", key_str);
+  if ([path length] == 0) {
+    path = [NSString stringWithFormat:@"/v1/messages/batches/%@/results", batchId];
+  }
+  reader = [[[ClaudeBatchResultReader alloc] initWithManager:self batchId:batchId delegate:batchDelegate] autorelease];
+  
+  [[RateLimiter sharedLimiter] waitForKey:apiKey inputTokens:0];
+  client = [[[HTTPSClient alloc] initWithHost:apiHost port:apiPort] autorelease];
+  completed = [client sendStreamingRequest:@"GET"
+                                      path:path
+                                   headers:headers
+                                      body:nil
+                                  delegate:reader];
+  [reader finish];
+  [[RateLimiter sharedLimiter] updateKey:apiKey withResponseHeaders:[client lastResponseHeaders]];
+  
+  if (!completed || [client lastStatusCode] != 200) {
+    [self notifyBatchDelegateOfError:[self batchErrorWithClient:client body:[reader errorBody]] batch:batchId];
+    return;
+  }
+  
+  NSLog(@"Batch %@ finished with %lu results", batchId, [reader resultCount]);
+  if (batchDelegate && [batchDelegate respondsToSelector:@selector(apiManager:didFinishBatch:)]) {
+    [batchDelegate apiManager:self didFinishBatch:batchId];
+  }
+}
+
+// Body of the thread started by -submitBatchWithAPIKey:. Creates the batch,
+// waits for it to end and delivers its results.
+- (void)runBatch:(NSDictionary *)job {
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  NSString *spoolPath = [job objectForKey:@"spoolPath"];
+  NSString *apiKey = [job objectForKey:@"apiKey"];
+  unsigned long count = [[job objectForKey:@"count"] unsignedLongValue];
+  NSDictionary *headers = [NSDictionary dictionaryWithObjectsAndKeys:
+                           apiKey, @"x-api-key",
+                           @"2023-06-01", @"anthropic-version",
+                           @"application/json", @"content-type",
+                           nil];
+  NSString *batchId;
+  NSString *resultsURL = nil;
+  
+  NSLog(@"Submitting batch of %lu requests", count);
+  batchId = [self createBatchFromSpool:spoolPath headers:headers apiKey:apiKey];
+  unlink([spoolPath fileSystemRepresentation]);
+  
+  if (batchId) {
+    NSLog(@"Created batch %@", batchId);
+    if (batchDelegate && [batchDelegate respondsToSelector:@selector(apiManager:didSubmitBatch:requestCount:)]) {
+      [batchDelegate apiManager:self didSubmitBatch:batchId requestCount:count];
     }
-    yyjson_doc_free(doc);
+    resultsURL = [self pollBatch:batchId headers:headers apiKey:apiKey];
+  }
+  if (resultsURL) {
+    [self downloadBatchResults:resultsURL batch:batchId headers:headers apiKey:apiKey];
+  }
+  
+  [pool release];
+}
+
+// JSON serialization, kept for callers that want a string
+- (NSString *)dictionaryToJSON:(NSDictionary *)dict {
+  return [JSONWriter stringWithJSONObject:dict];
+}
+
+- (NSString *)arrayToJSON:(NSArray *)array {
+  return [JSONWriter stringWithJSONObject:array];
+}
+
+
+// JSON response parser using yyjson. The text is copied into a padded
+// buffer and parsed in place; bodies straight from HTTPSClient can skip the
+// copy with extractResponseTextFromPaddedData:.
+- (NSString *)extractResponseText:(NSString *)jsonResponse {
+  const char *utf8 = [jsonResponse UTF8String];
+  size_t length;
+  NSMutableData *buffer;
+  
+  if (!utf8) {
     return nil;
   }
-  if (!yyjson_is_arr(content)) {
-    NSLog(@"'content' field is not an array");
-    yyjson_doc_free(doc);
+  length = strlen(utf8);
+  buffer = [NSMutableData dataWithLength:length + YYJSON_PADDING_SIZE];
+  memcpy([buffer mutableBytes], utf8, length);
+  return [self extractResponseTextFromBytes:[buffer mutableBytes] length:length];
+}
+
+// A body returned by HTTPSClient, which follows it with HTTPS_BODY_PADDING
+// zero bytes. It is parsed where it lies and is overwritten in the process.
+- (NSString *)extractResponseTextFromPaddedData:(NSData *)data {
+  return [self extractResponseTextFromBytes:(char *)[data bytes] length:[data length]];
+}
+
+// Parses a Messages API response in place (YYJSON_READ_INSITU): yyjson
+// unescapes strings into the buffer itself rather than a copy of it, so the
+// buffer must be writable and followed by YYJSON_PADDING_SIZE zero bytes.
+- (NSString *)extractResponseTextFromBytes:(char *)bytes length:(size_t)length {
+  yyjson_read_err err;
+  yyjson_doc *doc;
+  
+  NSLog(@"API Response: %lu bytes", (unsigned long)length);
+  
+  memset(&err, 0, sizeof(err));
+  doc = yyjson_read_opts(bytes, length, YYJSON_READ_INSITU, [JSONArena currentAllocator], &err);
+  if (!doc) {
+    NSLog(@"Failed to parse JSON with yyjson - Error code: %u, message: %s, position: %lu", 
+        err.code, err.msg, (unsigned long)err.pos);
     return nil;
   }
+  return [self extractResponseTextFromDocument:doc];
+}
+
+// Only the fields used are turned into objects: the error message, the
+// usage counts and the first content block's text. Frees the document.
+- (NSString *)extractResponseTextFromDocument:(yyjson_doc *)doc {
+  yyjson_val *root;
+  yyjson_val *errorMessage;
+  yyjson_val *content;
+  yyjson_val *text;
+  NSString *result;
   
-  // Get first content item
-  yyjson_val *first_content = yyjson_arr_get(content, 0);
-  if (!first_content) {
-    NSLog(@"Content array is empty");
+  // Check for error response
+  root = yyjson_doc_get_root(doc);
+  errorMessage = yyjson_obj_get(yyjson_obj_get(root, "error"), "message");
+  if (yyjson_is_str(errorMessage)) {
+    result = [[[NSString alloc] initWithBytes:yyjson_get_str(errorMessage)
+                                       length:yyjson_get_len(errorMessage)
+                                     encoding:NSUTF8StringEncoding] autorelease];
+    NSLog(@"API Error: %@", result);
     yyjson_doc_free(doc);
-    return nil;
+    return [NSString stringWithFormat:@"API Error: %@", result];  // Return error message to display to user
   }
   
-  // Get text field from content item
-  yyjson_val *text_val = yyjson_obj_get(first_content, "text");
-  if (!text_val || !yyjson_is_str(text_val)) {
-    NSLog(@"No text field in content item");
+  [self recordUsage:yyjson_obj_get(root, "usage")];
+  
+  // The text of the first content block
+  content = yyjson_obj_get(root, "content");
+  if (!yyjson_is_arr(content)) {
+    NSLog(@"No 'content' array found in response root");
     yyjson_doc_free(doc);
     return nil;
   }
-  
-  // Get the text string
-  const char *text_str = yyjson_get_str(text_val);
-  NSString *result = [NSString stringWithUTF8String:text_str];
+  text = yyjson_obj_get(yyjson_arr_get_first(content), "text");
+  if (!yyjson_is_str(text)) {
+    NSLog(@"No text field in first content item");
+    yyjson_doc_free(doc);
+    return nil;
+  }
+  result = [[[NSString alloc] initWithBytes:yyjson_get_str(text)
+                                     length:yyjson_get_len(text)
+                                   encoding:NSUTF8StringEncoding] autorelease];
   
   // Clean up
   yyjson_doc_free(doc);
@@ -204,7 +204,9 @@ NEHProperty(NSAttributedString*, displayContent, setDisplayContent);
  * Saves the current conversation to disk on a background thread.
  *
  * This is the preferred method for saving during normal operation to
- * avoid blocking the main thread.
+ * avoid blocking the main thread. Saves run at background priority on
+ * the shared WorkerPool; if its save queue is full, the conversation is
+ * saved on the calling thread instead.
  */
 - (void)saveCurrentConversationInBackground;
 
@@ -10,6 +10,7 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #import "ConversationManager.h"
+#import "WorkerPool.h"
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -379,9 +380,15 @@ static ConversationManager *sharedInstance = nil;
   // Retain conversation for background operation
   conv = [currentConversation retain];
 
-  // Perform save on background thread
-  [self performSelectorInBackground:@selector(saveConversationToFile:)
-                         withObject:conv];
+  // Perform save on a pool thread; if the save queue is full, the caller
+  // pays for the save itself rather than letting the backlog grow
+  if (![[WorkerPool sharedPool] performSelector:@selector(saveConversationToFile:)
+                                       onTarget:self
+                                     withObject:conv
+                                       priority:WorkerPoolPriorityBackground])
+  {
+    [self saveConversationToFile:conv];
+  }
 }
 
 
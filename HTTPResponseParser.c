@@ -0,0 +1,615 @@
+////////////////////////////////////////////////////////////////////////////////
+// HTTPResponseParser.c
+// ClaudeChat
+//
+// Byte-at-a-time state machine for HTTP/1.1 responses. Only the status and
+// header lines are buffered (they have to be whole before they can be
+// interpreted); body bytes are reported as runs pointing into the caller's
+// buffer, with chunk-size lines and trailers consumed along the way.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#include "HTTPResponseParser.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+
+// MARK: - States
+
+enum
+{
+  HTTPParserStatusLine = 0,
+  HTTPParserHeaderLine,
+  HTTPParserBodyIdentity,
+  HTTPParserBodyUntilClose,
+  HTTPParserChunkSize,
+  HTTPParserChunkExtension,
+  HTTPParserChunkData,
+  HTTPParserChunkDataEnd,
+  HTTPParserChunkTrailer,
+  HTTPParserDone,
+  HTTPParserError
+};
+
+
+// MARK: - Helpers
+
+/**
+ * Appends one byte to the pending line, dropping CRs (a line ends at LF, and
+ * bare LF endings are tolerated).
+ */
+static int HTTPParserAppendLineByte(HTTPResponseParser *parser, char c)
+{
+  if (c == '\r')
+  {
+    return 1;
+  }
+
+  if (parser->lineLength >= HTTP_PARSER_MAX_LINE)
+  {
+    return 0;
+  }
+
+  parser->line[parser->lineLength++] = c;
+  return 1;
+}
+
+
+/**
+ * Case-insensitive comparison of a length-delimited token with a C string.
+ */
+static int HTTPParserTokenEquals(const char *token, size_t length, const char *literal)
+{
+  return strlen(literal) == length && strncasecmp(token, literal, length) == 0;
+}
+
+
+/**
+ * Reports whether a comma-separated header value contains the given token,
+ * as in "Transfer-Encoding: gzip, chunked" or "Connection: keep-alive, close".
+ */
+static int HTTPParserListContains(const char *value, size_t length, const char *literal)
+{
+  size_t start = 0;
+  size_t end;
+
+  while (start < length)
+  {
+    while (start < length && (value[start] == ' ' || value[start] == '\t' || value[start] == ','))
+    {
+      start++;
+    }
+
+    end = start;
+    while (end < length && value[end] != ',')
+    {
+      end++;
+    }
+
+    {
+      size_t tokenEnd = end;
+      while (tokenEnd > start && (value[tokenEnd - 1] == ' ' || value[tokenEnd - 1] == '\t'))
+      {
+        tokenEnd--;
+      }
+
+      if (tokenEnd > start && HTTPParserTokenEquals(value + start, tokenEnd - start, literal))
+      {
+        return 1;
+      }
+    }
+
+    start = end;
+  }
+
+  return 0;
+}
+
+
+/**
+ * Parses "HTTP/1.x NNN reason".
+ */
+static int HTTPParserParseStatusLine(HTTPResponseParser *parser)
+{
+  const char *line = parser->line;
+  size_t length = parser->lineLength;
+
+  if (length < 12 || strncmp(line, "HTTP/1.", 7) != 0)
+  {
+    return 0;
+  }
+
+  if (line[7] < '0' || line[7] > '9' || line[8] != ' ')
+  {
+    return 0;
+  }
+
+  if (line[9] < '1' || line[9] > '5' ||
+      line[10] < '0' || line[10] > '9' ||
+      line[11] < '0' || line[11] > '9')
+  {
+    return 0;
+  }
+
+  if (length > 12 && line[12] != ' ')
+  {
+    return 0;
+  }
+
+  parser->httpMinorVersion = line[7] - '0';
+  parser->statusCode = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+
+  // HTTP/1.1 defaults to persistent connections, 1.0 does not
+  parser->keepAlive = parser->httpMinorVersion >= 1;
+  parser->chunked = 0;
+  parser->contentLength = -1;
+
+  return 1;
+}
+
+
+/**
+ * Splits a header line into name and value, notes the framing headers, and
+ * hands the field to the caller.
+ */
+static int HTTPParserParseHeaderLine(HTTPResponseParser *parser,
+                                     const HTTPResponseParserCallbacks *callbacks,
+                                     void *context)
+{
+  const char *line = parser->line;
+  size_t length = parser->lineLength;
+  size_t colon = 0;
+  size_t nameLength;
+  size_t valueStart;
+  size_t valueEnd;
+
+  while (colon < length && line[colon] != ':')
+  {
+    colon++;
+  }
+
+  if (colon == 0 || colon == length)
+  {
+    return 0;
+  }
+
+  nameLength = colon;
+  while (nameLength > 0 && (line[nameLength - 1] == ' ' || line[nameLength - 1] == '\t'))
+  {
+    nameLength--;
+  }
+
+  valueStart = colon + 1;
+  while (valueStart < length && (line[valueStart] == ' ' || line[valueStart] == '\t'))
+  {
+    valueStart++;
+  }
+
+  valueEnd = length;
+  while (valueEnd > valueStart && (line[valueEnd - 1] == ' ' || line[valueEnd - 1] == '\t'))
+  {
+    valueEnd--;
+  }
+
+  if (HTTPParserTokenEquals(line, nameLength, "Content-Length"))
+  {
+    long long value = 0;
+    size_t i;
+
+    if (valueEnd == valueStart)
+    {
+      return 0;
+    }
+
+    for (i = valueStart; i < valueEnd; i++)
+    {
+      if (line[i] < '0' || line[i] > '9' || value > (0x7fffffffffffffffLL - 9) / 10)
+      {
+        return 0;
+      }
+      value = value * 10 + (line[i] - '0');
+    }
+
+    // Conflicting lengths are a framing error (RFC 7230 3.3.2)
+    if (parser->contentLength >= 0 && parser->contentLength != value)
+    {
+      return 0;
+    }
+    parser->contentLength = value;
+  }
+  else if (HTTPParserTokenEquals(line, nameLength, "Transfer-Encoding"))
+  {
+    if (HTTPParserListContains(line + valueStart, valueEnd - valueStart, "chunked"))
+    {
+      parser->chunked = 1;
+    }
+  }
+  else if (HTTPParserTokenEquals(line, nameLength, "Connection"))
+  {
+    if (HTTPParserListContains(line + valueStart, valueEnd - valueStart, "close"))
+    {
+      parser->keepAlive = 0;
+    }
+    else if (HTTPParserListContains(line + valueStart, valueEnd - valueStart, "keep-alive"))
+    {
+      parser->keepAlive = 1;
+    }
+  }
+
+  if (callbacks && callbacks->onHeader)
+  {
+    if (callbacks->onHeader(context, line, nameLength, line + valueStart, valueEnd - valueStart) != 0)
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+/**
+ * Picks the body framing once the blank line ending the headers arrives.
+ */
+static int HTTPParserHeadersEnded(HTTPResponseParser *parser,
+                                  const HTTPResponseParserCallbacks *callbacks,
+                                  void *context)
+{
+  int status = parser->statusCode;
+
+  // Interim 1xx responses carry no body; the real response follows
+  if (status >= 100 && status < 200 && status != 101)
+  {
+    parser->state = HTTPParserStatusLine;
+    return 1;
+  }
+
+  if (callbacks && callbacks->onHeadersComplete)
+  {
+    if (callbacks->onHeadersComplete(context, status) != 0)
+    {
+      return 0;
+    }
+  }
+
+  if (parser->headRequest || status == 204 || status == 304)
+  {
+    parser->state = HTTPParserDone;
+  }
+  else if (parser->chunked)
+  {
+    // Transfer-Encoding overrides Content-Length when both are present
+    parser->contentLength = -1;
+    parser->chunkSizeDigits = 0;
+    parser->bodyRemaining = 0;
+    parser->state = HTTPParserChunkSize;
+  }
+  else if (parser->contentLength >= 0)
+  {
+    parser->bodyRemaining = (unsigned long long)parser->contentLength;
+    parser->state = parser->bodyRemaining > 0 ? HTTPParserBodyIdentity : HTTPParserDone;
+  }
+  else
+  {
+    // No framing: the body runs until the server closes the connection
+    parser->keepAlive = 0;
+    parser->state = HTTPParserBodyUntilClose;
+  }
+
+  return 1;
+}
+
+
+/**
+ * Reports a run of body bytes to the caller.
+ */
+static int HTTPParserEmitBody(HTTPResponseParser *parser,
+                              const HTTPResponseParserCallbacks *callbacks,
+                              void *context,
+                              const char *bytes,
+                              size_t length)
+{
+  parser->bodyReceived += length;
+
+  if (length > 0 && callbacks && callbacks->onBody)
+  {
+    return callbacks->onBody(context, bytes, length) == 0;
+  }
+
+  return 1;
+}
+
+
+// MARK: - Public Interface
+
+void HTTPResponseParserInit(HTTPResponseParser *parser, int headRequest)
+{
+  memset(parser, 0, offsetof(HTTPResponseParser, line));
+  parser->state = HTTPParserStatusLine;
+  parser->headRequest = headRequest;
+  parser->contentLength = -1;
+}
+
+
+long HTTPResponseParserExecute(HTTPResponseParser *parser,
+                               const HTTPResponseParserCallbacks *callbacks,
+                               void *context,
+                               const char *bytes,
+                               size_t length)
+{
+  size_t i = 0;
+
+  while (i < length)
+  {
+    char c = bytes[i];
+
+    switch (parser->state)
+    {
+      case HTTPParserStatusLine:
+      case HTTPParserHeaderLine:
+      case HTTPParserChunkTrailer:
+      {
+        if (c != '\n')
+        {
+          if (!HTTPParserAppendLineByte(parser, c))
+          {
+            goto fail;
+          }
+          i++;
+          break;
+        }
+        i++;
+
+        if (parser->state == HTTPParserStatusLine)
+        {
+          // Tolerate stray blank lines before the status line
+          if (parser->lineLength == 0)
+          {
+            break;
+          }
+          if (!HTTPParserParseStatusLine(parser))
+          {
+            goto fail;
+          }
+          parser->state = HTTPParserHeaderLine;
+        }
+        else if (parser->state == HTTPParserHeaderLine)
+        {
+          if (parser->lineLength == 0)
+          {
+            if (!HTTPParserHeadersEnded(parser, callbacks, context))
+            {
+              goto fail;
+            }
+          }
+          else if (!HTTPParserParseHeaderLine(parser, callbacks, context))
+          {
+            goto fail;
+          }
+        }
+        else if (parser->lineLength == 0)
+        {
+          // Blank line ends the (ignored) trailer section
+          parser->state = HTTPParserDone;
+        }
+
+        parser->lineLength = 0;
+        break;
+      }
+
+      case HTTPParserBodyIdentity:
+      {
+        size_t run = length - i;
+
+        if ((unsigned long long)run > parser->bodyRemaining)
+        {
+          run = (size_t)parser->bodyRemaining;
+        }
+
+        if (!HTTPParserEmitBody(parser, callbacks, context, bytes + i, run))
+        {
+          goto fail;
+        }
+
+        i += run;
+        parser->bodyRemaining -= run;
+        if (parser->bodyRemaining == 0)
+        {
+          parser->state = HTTPParserDone;
+        }
+        break;
+      }
+
+      case HTTPParserBodyUntilClose:
+      {
+        if (!HTTPParserEmitBody(parser, callbacks, context, bytes + i, length - i))
+        {
+          goto fail;
+        }
+        i = length;
+        break;
+      }
+
+      case HTTPParserChunkSize:
+      {
+        int digit;
+
+        if (c >= '0' && c <= '9')
+        {
+          digit = c - '0';
+        }
+        else if (c >= 'a' && c <= 'f')
+        {
+          digit = c - 'a' + 10;
+        }
+        else if (c >= 'A' && c <= 'F')
+        {
+          digit = c - 'A' + 10;
+        }
+        else if (c == ';' || c == ' ' || c == '\t' || c == '\r')
+        {
+          if (parser->chunkSizeDigits == 0)
+          {
+            goto fail;
+          }
+          parser->state = HTTPParserChunkExtension;
+          i++;
+          break;
+        }
+        else if (c == '\n')
+        {
+          if (parser->chunkSizeDigits == 0)
+          {
+            goto fail;
+          }
+          parser->state = parser->bodyRemaining > 0 ? HTTPParserChunkData : HTTPParserChunkTrailer;
+          parser->lineLength = 0;
+          i++;
+          break;
+        }
+        else
+        {
+          goto fail;
+        }
+
+        if (parser->bodyRemaining > (~0ULL >> 4))
+        {
+          goto fail;
+        }
+        parser->bodyRemaining = (parser->bodyRemaining << 4) | (unsigned long long)digit;
+        parser->chunkSizeDigits++;
+        i++;
+        break;
+      }
+
+      case HTTPParserChunkExtension:
+      {
+        // Extensions are skipped up to the end of the size line
+        if (c == '\n')
+        {
+          parser->state = parser->bodyRemaining > 0 ? HTTPParserChunkData : HTTPParserChunkTrailer;
+          parser->lineLength = 0;
+        }
+        i++;
+        break;
+      }
+
+      case HTTPParserChunkData:
+      {
+        size_t run = length - i;
+
+        if ((unsigned long long)run > parser->bodyRemaining)
+        {
+          run = (size_t)parser->bodyRemaining;
+        }
+
+        if (!HTTPParserEmitBody(parser, callbacks, context, bytes + i, run))
+        {
+          goto fail;
+        }
+
+        i += run;
+        parser->bodyRemaining -= run;
+        if (parser->bodyRemaining == 0)
+        {
+          parser->state = HTTPParserChunkDataEnd;
+        }
+        break;
+      }
+
+      case HTTPParserChunkDataEnd:
+      {
+        // CRLF after the chunk payload
+        if (c == '\n')
+        {
+          parser->state = HTTPParserChunkSize;
+          parser->chunkSizeDigits = 0;
+          parser->bodyRemaining = 0;
+        }
+        else if (c != '\r')
+        {
+          goto fail;
+        }
+        i++;
+        break;
+      }
+
+      case HTTPParserDone:
+        return (long)i;
+
+      default:
+        goto fail;
+    }
+  }
+
+  return (long)i;
+
+fail:
+  parser->state = HTTPParserError;
+  return -1;
+}
+
+
+int HTTPResponseParserFinish(HTTPResponseParser *parser)
+{
+  if (parser->state == HTTPParserBodyUntilClose)
+  {
+    parser->state = HTTPParserDone;
+  }
+
+  return parser->state == HTTPParserDone;
+}
+
+
+int HTTPResponseParserIsComplete(const HTTPResponseParser *parser)
+{
+  return parser->state == HTTPParserDone;
+}
+
+
+int HTTPResponseParserHeadersComplete(const HTTPResponseParser *parser)
+{
+  return parser->state != HTTPParserStatusLine &&
+         parser->state != HTTPParserHeaderLine &&
+         parser->state != HTTPParserError;
+}
+
+
+int HTTPResponseParserShouldKeepAlive(const HTTPResponseParser *parser)
+{
+  return parser->keepAlive && parser->state == HTTPParserDone;
+}
+
+
+long long HTTPResponseParserContentLength(const HTTPResponseParser *parser)
+{
+  return parser->contentLength;
+}
+
+
+unsigned long long HTTPResponseParserBodyRemaining(const HTTPResponseParser *parser)
+{
+  return parser->state == HTTPParserBodyIdentity ? parser->bodyRemaining : 0;
+}
+
+
+int HTTPResponseParserSkipBody(HTTPResponseParser *parser, size_t length)
+{
+  if (parser->state != HTTPParserBodyIdentity || (unsigned long long)length > parser->bodyRemaining)
+  {
+    return 0;
+  }
+
+  parser->bodyReceived += length;
+  parser->bodyRemaining -= length;
+  if (parser->bodyRemaining == 0)
+  {
+    parser->state = HTTPParserDone;
+  }
+
+  return 1;
+}
@@ -0,0 +1,156 @@
+////////////////////////////////////////////////////////////////////////////////
+// HTTPResponseParser.h
+// ClaudeChat
+//
+// Incremental HTTP/1.1 response parser. Bytes are fed as they come off the
+// socket; the status line and headers are reported once each is complete,
+// and body bytes are reported with Content-Length or chunked framing already
+// removed. Body callbacks point straight into the caller's buffer, so the
+// parser itself never copies payload bytes.
+//
+// Plain C so the transport can use it without any Foundation objects on the
+// per-byte path.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef HTTP_RESPONSE_PARSER_H
+#define HTTP_RESPONSE_PARSER_H
+
+#include <stddef.h>
+
+
+/**
+ * Longest status or header line the parser will accept. Longer lines are
+ * treated as a protocol error rather than buffered without bound.
+ */
+#define HTTP_PARSER_MAX_LINE 8192
+
+
+/**
+ * Callbacks invoked while parsing. Any of them may be NULL. A callback that
+ * returns non-zero stops parsing; HTTPResponseParserExecute() then returns -1
+ * and the parser is left in the error state.
+ */
+typedef struct
+{
+  /** One header field, with surrounding whitespace trimmed from the value. */
+  int (*onHeader)(void *context, const char *name, size_t nameLength,
+                  const char *value, size_t valueLength);
+
+  /** The header block has ended. Not called for 1xx interim responses. */
+  int (*onHeadersComplete)(void *context, int statusCode);
+
+  /** A run of decoded body bytes. */
+  int (*onBody)(void *context, const char *bytes, size_t length);
+} HTTPResponseParserCallbacks;
+
+
+/**
+ * Parser state. Treat as opaque; it is a plain struct so it can live on the
+ * stack or inside another object without a separate allocation.
+ */
+typedef struct
+{
+  int state;
+  int statusCode;
+  int httpMinorVersion;
+  int keepAlive;
+  int chunked;
+  int headRequest;
+  long long contentLength;
+  unsigned long long bodyRemaining;
+  unsigned long long bodyReceived;
+  int chunkSizeDigits;
+  size_t lineLength;
+  char line[HTTP_PARSER_MAX_LINE];
+} HTTPResponseParser;
+
+
+/**
+ * Prepares a parser for one response.
+ *
+ * @param parser The parser to initialize
+ * @param headRequest Non-zero if the request was HEAD (no body follows)
+ */
+void HTTPResponseParserInit(HTTPResponseParser *parser, int headRequest);
+
+
+/**
+ * Parses the next piece of the response.
+ *
+ * Parsing stops at the end of the response; any bytes after it are left
+ * unconsumed.
+ *
+ * @param parser The parser
+ * @param callbacks Callbacks to invoke, or NULL
+ * @param context Passed through to every callback
+ * @param bytes Response bytes
+ * @param length Number of bytes
+ * @return Number of bytes consumed, or -1 on a protocol error or abort
+ */
+long HTTPResponseParserExecute(HTTPResponseParser *parser,
+                               const HTTPResponseParserCallbacks *callbacks,
+                               void *context,
+                               const char *bytes,
+                               size_t length);
+
+
+/**
+ * Tells the parser the connection has closed. A body delimited by the end
+ * of the connection is complete at this point.
+ *
+ * @return Non-zero if a complete response had been received
+ */
+int HTTPResponseParserFinish(HTTPResponseParser *parser);
+
+
+/**
+ * @return Non-zero once the full response, including any chunked trailer,
+ *         has been parsed
+ */
+int HTTPResponseParserIsComplete(const HTTPResponseParser *parser);
+
+
+/**
+ * @return Non-zero if the headers have been parsed
+ */
+int HTTPResponseParserHeadersComplete(const HTTPResponseParser *parser);
+
+
+/**
+ * @return Non-zero if the connection may carry another request once this
+ *         response is complete
+ */
+int HTTPResponseParserShouldKeepAlive(const HTTPResponseParser *parser);
+
+
+/**
+ * @return The Content-Length of the response, or -1 if it did not send one
+ *         (chunked or connection-delimited bodies)
+ */
+long long HTTPResponseParserContentLength(const HTTPResponseParser *parser);
+
+
+/**
+ * @return Body bytes still to come in a Content-Length body, or 0 when the
+ *         body is chunked, runs to the end of the connection, or is done
+ */
+unsigned long long HTTPResponseParserBodyRemaining(const HTTPResponseParser *parser);
+
+
+/**
+ * Accounts for Content-Length body bytes the caller read into its own
+ * buffer instead of passing them through HTTPResponseParserExecute(). This
+ * lets a known-size body be read straight into its final home. No callbacks
+ * are made for these bytes.
+ *
+ * @param parser The parser
+ * @param length Number of body bytes read
+ * @return Non-zero on success, 0 if the parser was not expecting that many
+ *         Content-Length body bytes
+ */
+int HTTPResponseParserSkipBody(HTTPResponseParser *parser, size_t length);
+
+#endif /* HTTP_RESPONSE_PARSER_H */
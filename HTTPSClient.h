@@ -10,23 +10,211 @@
 
 #import <Foundation/Foundation.h>
 
+@class HTTPSClient;
+
+// Errors reported through -lastError
+extern NSString * const HTTPSClientErrorDomain;
+
+enum {
+    HTTPSClientErrorResolveFailed = 1,
+    HTTPSClientErrorConnectFailed,
+    HTTPSClientErrorConnectTimeout,
+    HTTPSClientErrorHandshakeFailed,
+    HTTPSClientErrorHandshakeTimeout,
+    HTTPSClientErrorSendFailed,
+    HTTPSClientErrorFirstByteTimeout,
+    HTTPSClientErrorIdleTimeout,
+    HTTPSClientErrorConnectionClosed,
+    HTTPSClientErrorMalformedResponse,
+    HTTPSClientErrorCancelled
+};
+
+// Default deadlines in seconds. The first-byte deadline has to cover a whole
+// non-streamed reply being generated, so it is much longer than the others.
+#define HTTPS_DEFAULT_CONNECT_TIMEOUT       10.0
+#define HTTPS_DEFAULT_HANDSHAKE_TIMEOUT     15.0
+#define HTTPS_DEFAULT_FIRST_BYTE_TIMEOUT    600.0
+#define HTTPS_DEFAULT_IDLE_TIMEOUT          60.0
+
+// Zero bytes that follow a returned response body in memory, past its
+// length. A parser that reads ahead, such as yyjson parsing in place
+// (YYJSON_READ_INSITU, which needs YYJSON_PADDING_SIZE), can then work on
+// the body's bytes directly instead of a padded copy. Not less than 4.
+#define HTTPS_BODY_PADDING                  8
+
+// Where the time went in one request. Durations are in seconds, from a
+// monotonic clock. The connection phases are zero when a pooled connection
+// was reused (and dns is near zero when the address was cached).
+typedef struct {
+    double dnsTime;             // name resolution
+    double connectTime;         // TCP connect, including address racing
+    double handshakeTime;       // TLS handshake
+    double firstByteTime;       // request fully sent to first response byte
+    double transferTime;        // first response byte to end of response
+    double totalTime;           // whole call, including any stale-connection retry
+    unsigned long long bytesSent;       // request header and body
+    unsigned long long bytesReceived;   // response as read, headers included
+    BOOL reusedConnection;
+    BOOL resumedSession;
+} HTTPSRequestMetrics;
+
+// Receives response body bytes as they arrive from a streaming request.
+// Transfer framing (chunked encoding) has already been removed. The bytes
+// are only valid for the duration of the call.
+@protocol HTTPSClientStreamDelegate
+- (void)httpsClient:(HTTPSClient *)client didReceiveBytes:(const char *)bytes length:(unsigned long)length;
+@end
+
+// Watches a collected (non-streamed) response body fill up, so a caller can
+// start on it before the last byte arrives. Only used when the body's size
+// is known from Content-Length and it is not compressed. The buffer then
+// has room for the whole body and does not move: it becomes the returned
+// NSData, followed by HTTPS_BODY_PADDING bytes, and the delegate may write
+// to it (parse in place) as it goes. The first length bytes are filled by
+// the time the last call comes. A client may call neither method, in which
+// case the body is only there once the request returns.
+@protocol HTTPSClientBodyDelegate
+- (void)httpsClient:(HTTPSClient *)client willReceiveBody:(char *)buffer length:(unsigned long)length;
+- (void)httpsClient:(HTTPSClient *)client didReceiveBodyLength:(unsigned long)length;
+@end
+
 @interface HTTPSClient : NSObject {
     NSString *hostname;
     int port;
+    int statusCode;
+    NSMutableDictionary *responseHeaders;
+    NSError *lastError;
+    unsigned long long bodyWireLength;
+    unsigned long long bodyDecodedLength;
+    NSTimeInterval connectTimeout;
+    NSTimeInterval handshakeTimeout;
+    NSTimeInterval firstByteTimeout;
+    NSTimeInterval idleTimeout;
+    id streamReceiver;
+    id bodyReceiver;
+    BOOL streamFinished;
+    BOOL streamFailed;
+    NSLock *cancelLock;
+    volatile BOOL cancelled;
+    int activeSocket;
+    HTTPSRequestMetrics metrics;
+    NSTimeInterval requestStarted;
 }
 
+// Close every idle keep-alive connection held in the shared pool.
+// Connections are otherwise reused across clients for the same host:port
+// and expire on their own after a short idle period.
++ (void)closeIdleConnections;
+
+// Close pooled connections that have sat idle past the pool's lifetime.
+// Expired connections are otherwise only noticed the next time a request
+// goes to their host, and keep their socket open until then.
++ (void)closeExpiredConnections;
+
+// How long an idle pooled connection is kept, in seconds, or 0 if the
+// connection cache belongs to the system rather than this class.
++ (NSTimeInterval)idleConnectionLifetime;
+
+// Number of TLS handshakes performed in full vs. resumed from a cached
+// session since launch. Useful for checking the session cache hit rate.
++ (unsigned long)fullHandshakeCount;
++ (unsigned long)resumedHandshakeCount;
+
+// Adds the PEM certificates in a file to the trusted roots and turns peer
+// verification on. For test servers with self-signed certificates; only
+// the OpenSSL client supports it (the other returns NO).
++ (BOOL)trustCertificatesInFile:(NSString *)path;
+
+// Turns the per-request handshake and metrics log lines on or off (on by
+// default). Benchmarks switch them off to keep logging out of the timings.
++ (void)setLogsRequests:(BOOL)flag;
+
 // Initialize with hostname and port
 - (id)initWithHost:(NSString *)host port:(int)portNum;
 
-// Send HTTPS POST request
+// Deadlines for each phase of a request. Connect covers the TCP handshake,
+// handshake the TLS negotiation, first byte the wait between sending the
+// request and the first byte of the response, and idle the longest gap
+// allowed between reads (or writes) after that. Each one that expires fails
+// the request with its own HTTPSClientErrorDomain code.
+- (void)setConnectTimeout:(NSTimeInterval)seconds;
+- (void)setHandshakeTimeout:(NSTimeInterval)seconds;
+- (void)setFirstByteTimeout:(NSTimeInterval)seconds;
+- (void)setIdleTimeout:(NSTimeInterval)seconds;
+
+// Delegate (not retained) told about each collected response body as it
+// arrives; see HTTPSClientBodyDelegate. Only the OpenSSL client calls it.
+- (void)setBodyDelegate:(id)delegate;
+
+// Resolve the host, connect and complete the TLS handshake now, leaving the
+// connection idle in the shared pool for the next request to pick up. Does
+// nothing if a live pooled connection is already waiting. Blocks until the
+// connection is ready; call it off the main thread. Returns NO on failure.
+- (BOOL)prewarmConnection;
+
+// Abandon the request in flight, from any thread. Its socket is shut down
+// at once, so the blocked send returns promptly with nil/NO and a lastError
+// of HTTPSClientErrorCancelled, and the connection is never pooled. A
+// cancelled client stays cancelled: later requests fail the same way.
+- (void)cancel;
+- (BOOL)isCancelled;
+
+// Send HTTPS POST request. Like every method here that returns a body, the
+// data is followed by HTTPS_BODY_PADDING zero bytes, and belongs to the
+// caller alone: it may parse it in place, overwriting it.
 - (NSData *)sendPOSTRequest:(NSString *)path
                     headers:(NSDictionary *)headers
                        body:(NSData *)bodyData;
 
+// Send HTTPS POST request with a body supplied in pieces (NSData objects).
+// The pieces are sent in order without being joined into one buffer first,
+// so a caller can keep, say, an unchanged prefix around between requests.
+- (NSData *)sendPOSTRequest:(NSString *)path
+                    headers:(NSDictionary *)headers
+                  bodyParts:(NSArray *)bodyParts;
+
 // Send HTTPS GET request
 - (NSData *)sendGETRequest:(NSString *)path
                    headers:(NSDictionary *)headers;
 
+// Send a request and hand the body to the delegate piece by piece as it
+// arrives instead of collecting it. Blocks until the response has ended.
+// Returns NO if the connection failed or closed before the body was complete.
+- (BOOL)sendStreamingRequest:(NSString *)method
+                        path:(NSString *)path
+                     headers:(NSDictionary *)headers
+                        body:(NSData *)bodyData
+                    delegate:(id)delegate;
+
+// Streaming request with a body supplied in pieces, as above
+- (BOOL)sendStreamingRequest:(NSString *)method
+                        path:(NSString *)path
+                     headers:(NSDictionary *)headers
+                   bodyParts:(NSArray *)bodyParts
+                    delegate:(id)delegate;
+
+// HTTP status code of the most recent response, or 0 if none was received
+- (int)lastStatusCode;
+
+// Header fields of the most recent response, keyed by lowercase field name.
+// Repeated fields are joined with ", ". Filled in as soon as the header block
+// arrives, so a stream delegate can consult it from its first callback.
+- (NSDictionary *)lastResponseHeaders;
+
+// Why the most recent request failed, or nil if it succeeded
+- (NSError *)lastError;
+
+// Size of the most recent response body as it crossed the wire (after
+// chunked framing is removed, before gzip/deflate decoding) and once
+// decoded. The two differ only for compressed responses.
+- (unsigned long long)lastBodyWireLength;
+- (unsigned long long)lastBodyDecodedLength;
+
+// Phase timings and byte counts of the most recent request, successful or
+// not. Each request also logs them on one line and adds them to the
+// per-host histograms kept by NetworkMetrics.
+- (HTTPSRequestMetrics)lastMetrics;
+
 @end
 
 #endif
\ No newline at end of file
@@ -6,23 +6,215 @@
 //
 
 #import "HTTPSClient.h"
+#import "NetworkMetrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+NSString * const HTTPSClientErrorDomain = @"HTTPSClientErrorDomain";
+
+// Whether each request's metrics line is logged
+static BOOL logsRequests = YES;
+
+// The loading system's body followed by HTTPS_BODY_PADDING zero bytes, as
+// the header promises. Costs a copy the OpenSSL client does not make.
+static NSData *HTTPSPaddedBody(NSData *body) {
+    unsigned long length = [body length];
+    char *bytes;
+
+    if (!body) {
+        return nil;
+    }
+    bytes = malloc(length + HTTPS_BODY_PADDING);
+    if (!bytes) {
+        return nil;
+    }
+    memcpy(bytes, [body bytes], length);
+    memset(bytes + length, 0, HTTPS_BODY_PADDING);
+    return [NSData dataWithBytesNoCopy:bytes length:length freeWhenDone:YES];
+}
 
 @implementation HTTPSClient
 
++ (void)closeIdleConnections {
+    // NSURLConnection manages its own connection cache
+}
+
++ (void)closeExpiredConnections {
+    // The system expires its cached connections itself
+}
+
++ (NSTimeInterval)idleConnectionLifetime {
+    return 0;
+}
+
++ (unsigned long)fullHandshakeCount {
+    // Handshakes happen inside the URL loading system and are not visible here
+    return 0;
+}
+
++ (unsigned long)resumedHandshakeCount {
+    return 0;
+}
+
++ (BOOL)trustCertificatesInFile:(NSString *)path {
+    // Trust is evaluated by the system here, against the keychain
+    return NO;
+}
+
++ (void)setLogsRequests:(BOOL)flag {
+    logsRequests = flag;
+}
+
 - (id)initWithHost:(NSString *)host port:(int)portNum {
     self = [super init];
     if (self) {
         hostname = [host retain];
         port = portNum;
+        responseHeaders = [[NSMutableDictionary alloc] init];
+        connectTimeout = HTTPS_DEFAULT_CONNECT_TIMEOUT;
+        handshakeTimeout = HTTPS_DEFAULT_HANDSHAKE_TIMEOUT;
+        firstByteTimeout = HTTPS_DEFAULT_FIRST_BYTE_TIMEOUT;
+        idleTimeout = HTTPS_DEFAULT_IDLE_TIMEOUT;
+        cancelLock = [[NSLock alloc] init];
+        activeSocket = -1;
     }
     return self;
 }
 
 - (void)dealloc {
     [hostname release];
+    [responseHeaders release];
+    [lastError release];
+    [cancelLock release];
     [super dealloc];
 }
 
+// The URL loading system only has a single inactivity timeout, so connect
+// and handshake are bounded by it too
+- (void)setConnectTimeout:(NSTimeInterval)seconds {
+    connectTimeout = seconds;
+}
+
+- (void)setHandshakeTimeout:(NSTimeInterval)seconds {
+    handshakeTimeout = seconds;
+}
+
+- (void)setFirstByteTimeout:(NSTimeInterval)seconds {
+    firstByteTimeout = seconds;
+}
+
+- (void)setIdleTimeout:(NSTimeInterval)seconds {
+    idleTimeout = seconds;
+}
+
+// NSURLConnection gathers the body out of sight, so the delegate is kept
+// for the interface's sake but never called
+- (void)setBodyDelegate:(id)delegate {
+    bodyReceiver = delegate;
+}
+
+- (NSError *)lastError {
+    return lastError;
+}
+
+// NSURLConnection may only be cancelled from the thread running it, so this
+// just raises the flag; the streaming run loop below notices it within a
+// fraction of a second. A synchronous request cannot be interrupted and is
+// discarded when it returns.
+- (void)cancel {
+    [cancelLock lock];
+    cancelled = YES;
+    [cancelLock unlock];
+}
+
+- (BOOL)isCancelled {
+    return cancelled;
+}
+
+- (void)rememberCancellation {
+    [lastError release];
+    lastError = [[NSError alloc] initWithDomain:HTTPSClientErrorDomain
+                                           code:HTTPSClientErrorCancelled
+                                       userInfo:[NSDictionary dictionaryWithObject:@"Request was cancelled"
+                                                                            forKey:NSLocalizedDescriptionKey]];
+}
+
+// The URL loading system negotiates and removes compression on its own and
+// never shows us the encoded bytes, so both sizes are the decoded size
+- (unsigned long long)lastBodyWireLength {
+    return bodyWireLength;
+}
+
+- (unsigned long long)lastBodyDecodedLength {
+    return bodyDecodedLength;
+}
+
+// Connection setup happens out of sight here, so only the first byte,
+// transfer and total times are known, and the byte counts are body sizes
+- (HTTPSRequestMetrics)lastMetrics {
+    return metrics;
+}
+
+- (void)beginMetricsWithBody:(NSData *)bodyData {
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.bytesSent = [bodyData length];
+    requestStarted = [NSDate timeIntervalSinceReferenceDate];
+}
+
+- (void)finishMetrics {
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+
+    metrics.totalTime = now - requestStarted;
+    if (metrics.firstByteTime > 0) {
+        metrics.transferTime = metrics.totalTime - metrics.firstByteTime;
+    }
+    metrics.bytesReceived = bodyDecodedLength;
+    if (logsRequests) {
+        NSLog(@"%@", [NetworkMetrics logLineForMetrics:metrics host:hostname status:statusCode]);
+    }
+    [[NetworkMetrics sharedMetrics] recordMetrics:metrics forHost:hostname];
+}
+
+// Keeps the error for -lastError, translating URL loading timeouts into the
+// matching HTTPSClientErrorDomain code
+- (void)rememberError:(NSError *)error receivedResponse:(BOOL)receivedResponse {
+    [lastError release];
+    lastError = nil;
+    if (!error) {
+        return;
+    }
+
+    if ([[error domain] isEqualToString:NSURLErrorDomain] && [error code] == NSURLErrorTimedOut) {
+        lastError = [[NSError alloc] initWithDomain:HTTPSClientErrorDomain
+                                               code:receivedResponse ? HTTPSClientErrorIdleTimeout
+                                                                     : HTTPSClientErrorFirstByteTimeout
+                                           userInfo:[error userInfo]];
+    } else {
+        lastError = [error retain];
+    }
+}
+
+// Records the status and header map of a response, with lowercase field
+// names to match the OpenSSL client
+- (void)rememberResponse:(NSURLResponse *)response {
+    NSDictionary *fields;
+    NSEnumerator *keyEnum;
+    NSString *key;
+
+    [responseHeaders removeAllObjects];
+    if (![response isKindOfClass:[NSHTTPURLResponse class]]) {
+        return;
+    }
+
+    statusCode = [(NSHTTPURLResponse *)response statusCode];
+    fields = [(NSHTTPURLResponse *)response allHeaderFields];
+    keyEnum = [fields keyEnumerator];
+    while ((key = [keyEnum nextObject])) {
+        [responseHeaders setObject:[fields objectForKey:key] forKey:[key lowercaseString]];
+    }
+}
+
 - (NSData *)sendPOSTRequest:(NSString *)path
                     headers:(NSDictionary *)headers
                        body:(NSData *)bodyData {
@@ -34,6 +226,7 @@
     // Create request
     NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:url];
     [request setHTTPMethod:@"POST"];
+    [request setTimeoutInterval:firstByteTimeout];
     [request setHTTPBody:bodyData];
     
     // Add headers
@@ -47,10 +240,20 @@
     // Send synchronous request
     NSError *error = nil;
     NSURLResponse *response = nil;
+    [self beginMetricsWithBody:[request HTTPBody]];
     NSData *responseData = [NSURLConnection sendSynchronousRequest:request
                                                   returningResponse:&response
                                                               error:&error];
     
+    [self rememberError:error receivedResponse:(response != nil)];
+    bodyDecodedLength = [responseData length];
+    bodyWireLength = bodyDecodedLength;
+    statusCode = [response isKindOfClass:[NSHTTPURLResponse class]] ? [(NSHTTPURLResponse *)response statusCode] : 0;
+    [self finishMetrics];
+    if (cancelled) {
+        [self rememberCancellation];
+        return nil;
+    }
     if (error) {
         NSLog(@"HTTPSClient error: %@", [error localizedDescription]);
         NSLog(@"Error domain: %@, code: %ld", [error domain], (long)[error code]);
@@ -59,6 +262,7 @@
     
     if (response) {
         NSHTTPURLResponse *httpResponse = (NSHTTPURLResponse *)response;
+        [self rememberResponse:response];
         NSLog(@"HTTP Status Code: %ld", (long)[httpResponse statusCode]);
         NSLog(@"Response headers: %@", [httpResponse allHeaderFields]);
     }
@@ -76,7 +280,48 @@
         NSLog(@"No response data received");
     }
     
-    return responseData;
+    return HTTPSPaddedBody(responseData);
+}
+
+// NSURLRequest takes the body as a single NSData, so the pieces are joined
+// here; only the OpenSSL client can send them without the copy
+static NSData *HTTPSJoinBodyParts(NSArray *bodyParts) {
+    NSMutableData *body;
+    NSEnumerator *partEnum;
+    NSData *part;
+
+    if ([bodyParts count] <= 1) {
+        return [bodyParts lastObject];
+    }
+
+    body = [NSMutableData data];
+    partEnum = [bodyParts objectEnumerator];
+    while ((part = [partEnum nextObject])) {
+        [body appendData:part];
+    }
+    return body;
+}
+
+- (NSData *)sendPOSTRequest:(NSString *)path
+                    headers:(NSDictionary *)headers
+                  bodyParts:(NSArray *)bodyParts {
+    return [self sendPOSTRequest:path headers:headers body:HTTPSJoinBodyParts(bodyParts)];
+}
+
+- (BOOL)prewarmConnection {
+    NSString *urlString = [NSString stringWithFormat:@"https://%@:%d/", hostname, port];
+    NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:[NSURL URLWithString:urlString]];
+    NSURLResponse *response = nil;
+    NSError *error = nil;
+
+    // There is no way to open a connection without using it, so send a
+    // bodyless HEAD; the loading system keeps the connection alive for the
+    // request that follows
+    [request setHTTPMethod:@"HEAD"];
+    [request setTimeoutInterval:connectTimeout + handshakeTimeout];
+    [NSURLConnection sendSynchronousRequest:request returningResponse:&response error:&error];
+
+    return (response != nil);
 }
 
 - (NSData *)sendGETRequest:(NSString *)path
@@ -89,6 +334,7 @@
     // Create request
     NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:url];
     [request setHTTPMethod:@"GET"];
+    [request setTimeoutInterval:firstByteTimeout];
     
     // Add headers
     NSEnumerator *keyEnum = [headers keyEnumerator];
@@ -101,16 +347,131 @@
     // Send synchronous request
     NSError *error = nil;
     NSURLResponse *response = nil;
+    [self beginMetricsWithBody:[request HTTPBody]];
     NSData *responseData = [NSURLConnection sendSynchronousRequest:request
                                                   returningResponse:&response
                                                               error:&error];
     
+    [self rememberError:error receivedResponse:(response != nil)];
+    bodyDecodedLength = [responseData length];
+    bodyWireLength = bodyDecodedLength;
+    statusCode = [response isKindOfClass:[NSHTTPURLResponse class]] ? [(NSHTTPURLResponse *)response statusCode] : 0;
+    [self finishMetrics];
+    if (cancelled) {
+        [self rememberCancellation];
+        return nil;
+    }
     if (error) {
         NSLog(@"HTTPSClient error: %@", [error localizedDescription]);
         return nil;
     }
     
-    return responseData;
+    [self rememberResponse:response];
+    
+    return HTTPSPaddedBody(responseData);
+}
+
+- (BOOL)sendStreamingRequest:(NSString *)method
+                        path:(NSString *)path
+                     headers:(NSDictionary *)headers
+                        body:(NSData *)bodyData
+                    delegate:(id)delegate {
+    
+    // Build URL
+    NSString *urlString = [NSString stringWithFormat:@"https://%@:%d%@", hostname, port, path];
+    NSURL *url = [NSURL URLWithString:urlString];
+    
+    // Create request
+    NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:url];
+    [request setHTTPMethod:method];
+    [request setTimeoutInterval:firstByteTimeout];
+    if (bodyData) {
+        [request setHTTPBody:bodyData];
+    }
+    
+    // Add headers
+    NSEnumerator *keyEnum = [headers keyEnumerator];
+    NSString *key;
+    while ((key = [keyEnum nextObject])) {
+        NSString *value = [headers objectForKey:key];
+        [request setValue:value forHTTPHeaderField:key];
+    }
+    
+    // Run the connection asynchronously on this (background) thread's run
+    // loop so data callbacks arrive as the server sends them
+    statusCode = 0;
+    [responseHeaders removeAllObjects];
+    [self rememberError:nil receivedResponse:NO];
+    bodyWireLength = 0;
+    bodyDecodedLength = 0;
+    streamReceiver = delegate;
+    streamFinished = NO;
+    streamFailed = NO;
+    [self beginMetricsWithBody:bodyData];
+    
+    NSURLConnection *connection = [[NSURLConnection alloc] initWithRequest:request delegate:self];
+    while (!streamFinished) {
+        if (cancelled) {
+            [connection cancel];
+            [self rememberCancellation];
+            streamFailed = YES;
+            break;
+        }
+        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode
+                                 beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.25]];
+    }
+    [connection release];
+    streamReceiver = nil;
+    [self finishMetrics];
+    
+    return !streamFailed;
+}
+
+- (BOOL)sendStreamingRequest:(NSString *)method
+                        path:(NSString *)path
+                     headers:(NSDictionary *)headers
+                   bodyParts:(NSArray *)bodyParts
+                    delegate:(id)delegate {
+    return [self sendStreamingRequest:method
+                                 path:path
+                              headers:headers
+                                 body:HTTPSJoinBodyParts(bodyParts)
+                             delegate:delegate];
+}
+
+- (int)lastStatusCode {
+    return statusCode;
+}
+
+- (NSDictionary *)lastResponseHeaders {
+    return responseHeaders;
+}
+
+#pragma mark - NSURLConnection delegate (streaming)
+
+- (void)connection:(NSURLConnection *)connection didReceiveResponse:(NSURLResponse *)response {
+    metrics.firstByteTime = [NSDate timeIntervalSinceReferenceDate] - requestStarted;
+    [self rememberResponse:response];
+}
+
+- (void)connection:(NSURLConnection *)connection didReceiveData:(NSData *)data {
+    bodyDecodedLength += [data length];
+    bodyWireLength = bodyDecodedLength;
+    if (cancelled) {
+        return;
+    }
+    [streamReceiver httpsClient:self didReceiveBytes:[data bytes] length:[data length]];
+}
+
+- (void)connectionDidFinishLoading:(NSURLConnection *)connection {
+    streamFinished = YES;
+}
+
+- (void)connection:(NSURLConnection *)connection didFailWithError:(NSError *)error {
+    NSLog(@"HTTPSClient streaming error: %@", [error localizedDescription]);
+    [self rememberError:error receivedResponse:(statusCode != 0)];
+    streamFailed = YES;
+    streamFinished = YES;
 }
 
 @end
\ No newline at end of file
@@ -6,6 +6,9 @@
 //
 
 #import "HTTPSClient.h"
+#import "HostResolver.h"
+#import "NetworkMetrics.h"
+#include "HTTPResponseParser.h"
 
 // Check if we have OpenSSL available
 // Just include OpenSSL directly - the Makefile handles the include paths
@@ -16,39 +19,290 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <signal.h>
+#include <zlib.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
 
-@implementation HTTPSClient
+NSString * const HTTPSClientErrorDomain = @"HTTPSClientErrorDomain";
 
-- (id)initWithHost:(NSString *)host port:(int)portNum {
+// Pool tuning. The API edge keeps idle connections open for a while, but we
+// expire ours well before that so a reused socket is almost never half-closed.
+#define HTTPS_POOL_IDLE_TIMEOUT       30.0
+#define HTTPS_POOL_MAX_PER_HOST       4
+
+// Connection racing (Happy Eyeballs, RFC 8305): start the next address if
+// the previous attempt has not connected within this delay, keeping at most
+// this many attempts in flight
+#define HTTPS_CONNECT_ATTEMPT_DELAY   0.25
+#define HTTPS_CONNECT_MAX_IN_FLIGHT   4
+
+// Largest TLS plaintext record. Request writes are cut to fill whole records,
+// and the response read size grows up to it.
+#define HTTPS_TLS_RECORD_SIZE         16384
+#define HTTPS_INITIAL_READ_SIZE       4096
+
+// Trust Content-Length for pre-sizing the body only up to this much; past
+// it the buffer grows as data actually arrives
+#define HTTPS_BODY_PRESIZE_LIMIT      (64UL * 1024 * 1024)
+
+// How long a pre-warmed TLS 1.3 connection waits for the server's session
+// tickets, which follow the handshake, before it is parked
+#define HTTPS_PREWARM_TICKET_WAIT     0.5
+
+// CA bundles tried in order when building the shared context. MacPorts and
+// Homebrew ship their own; the system locations cover Leopard and later.
+static const char *HTTPSTrustStorePaths[] = {
+    "/opt/local/etc/openssl/cert.pem",
+    "/opt/local/share/curl/curl-ca-bundle.crt",
+    "/usr/local/etc/openssl/cert.pem",
+    "/usr/local/etc/openssl@1.1/cert.pem",
+    "/opt/homebrew/etc/openssl@3/cert.pem",
+    "/etc/ssl/cert.pem",
+    "/etc/ssl/certs/ca-certificates.crt",
+    NULL
+};
+
+// A single TLS connection that can outlive the request that opened it
+@interface HTTPSConnection : NSObject {
+    SSL *ssl;
+    int sockfd;
+    char *sessionHost;
+    NSTimeInterval lastUsed;
+}
+
+- (id)initWithSSL:(SSL *)aSSL socket:(int)fd sessionHost:(char *)host;
+- (SSL *)ssl;
+- (int)socket;
+- (NSTimeInterval)lastUsed;
+- (void)touch;
+- (BOOL)isReusable;
+- (BOOL)readPendingRecords;
+- (BOOL)readSessionTicketsWaiting:(NSTimeInterval)seconds;
+- (void)close;
+
+@end
+
+@implementation HTTPSConnection
+
+- (id)initWithSSL:(SSL *)aSSL socket:(int)fd sessionHost:(char *)host {
     self = [super init];
     if (self) {
-        hostname = [host retain];
-        port = portNum;
-        
-        // Initialize OpenSSL (not needed for OpenSSL 1.1.0+)
-        #if OPENSSL_VERSION_NUMBER < 0x10100000L
-        SSL_load_error_strings();
-        SSL_library_init();
-        OpenSSL_add_all_algorithms();
-        #endif
+        ssl = aSSL;
+        sockfd = fd;
+        sessionHost = host;
+        lastUsed = [NSDate timeIntervalSinceReferenceDate];
     }
     return self;
 }
 
 - (void)dealloc {
-    [hostname release];
+    [self close];
     [super dealloc];
 }
 
-- (NSData *)sendRequestData:(NSData *)requestData {
-    SSL_CTX *ctx = NULL;
-    SSL *ssl = NULL;
-    int sockfd = -1;
-    NSMutableData *responseData = nil;
-    
+- (SSL *)ssl {
+    return ssl;
+}
+
+- (int)socket {
+    return sockfd;
+}
+
+- (NSTimeInterval)lastUsed {
+    return lastUsed;
+}
+
+- (void)touch {
+    lastUsed = [NSDate timeIntervalSinceReferenceDate];
+}
+
+// An idle keep-alive socket should have nothing to read but TLS records
+// the server sends on its own, such as TLS 1.3 session tickets. If the peer
+// has closed it (EOF), reset it, or sent anything else (usually a
+// close_notify alert), it is not safe to reuse.
+- (BOOL)isReusable {
+    struct pollfd pfd;
+
+    if (!ssl || sockfd < 0) {
+        return NO;
+    }
+    if ([NSDate timeIntervalSinceReferenceDate] - lastUsed > HTTPS_POOL_IDLE_TIMEOUT) {
+        return NO;
+    }
+
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) == 0) {
+        return YES;
+    }
+    if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        return NO;
+    }
+    return [self readPendingRecords];
+}
+
+// Lets OpenSSL process whatever records are waiting, without blocking (the
+// socket is non-blocking). Session tickets are consumed, and reach the
+// session cache through the new-session callback. Returns YES if that
+// leaves the connection idle, NO on EOF, an alert or application data
+// nobody asked for.
+- (BOOL)readPendingRecords {
+    char probe;
+    int result;
+
+    ERR_clear_error();
+    result = SSL_peek(ssl, &probe, 1);
+    if (result > 0) {
+        return NO;
+    }
+    switch (SSL_get_error(ssl, result)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            return YES;
+        default:
+            ERR_clear_error();
+            return NO;
+    }
+}
+
+// A TLS 1.3 server sends its session tickets after the handshake. A request
+// reads them with its response, but a connection opened ahead of time has
+// to, or they sit unread and no session is cached from it. Waits up to the
+// given time for them, then reads them.
+- (BOOL)readSessionTicketsWaiting:(NSTimeInterval)seconds {
+#ifdef TLS1_3_VERSION
+    struct pollfd pfd;
+
+    if (SSL_version(ssl) != TLS1_3_VERSION) {
+        return YES;
+    }
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, (int)(seconds * 1000)) <= 0) {
+        return YES;
+    }
+    return [self readPendingRecords];
+#else
+    return YES;
+#endif
+}
+
+- (void)close {
+    if (ssl) {
+        SSL_free(ssl);
+        ssl = NULL;
+    }
+    if (sockfd >= 0) {
+        close(sockfd);
+        sockfd = -1;
+    }
+    if (sessionHost) {
+        free(sessionHost);
+        sessionHost = NULL;
+    }
+}
+
+@end
+
+// Process-wide pool of idle connections, keyed by "host:port"
+static NSMutableDictionary *connectionPool = nil;
+static NSLock *connectionPoolLock = nil;
+
+// One client context for the whole process. Building it (and especially
+// parsing a CA bundle) is the most expensive thing we did per request.
+static SSL_CTX *sharedContext = NULL;
+static BOOL sharedContextVerifiesPeer = NO;
+
+// Last session ticket/ID per host, so reconnects can resume instead of doing
+// a full handshake. Values are NSValue-wrapped SSL_SESSION pointers that we
+// hold one reference to. The lock also guards the handshake counters.
+static NSMutableDictionary *sessionCache = nil;
+static NSLock *sessionCacheLock = nil;
+static unsigned long fullHandshakeCount = 0;
+static unsigned long resumedHandshakeCount = 0;
+
+// Whether each request's handshake and metrics lines are logged
+static BOOL logsRequests = YES;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+// OpenSSL before 1.1.0 is only thread-safe when the application supplies
+// locking callbacks, which a shared SSL_CTX now requires.
+static pthread_mutex_t *opensslLocks = NULL;
+
+static void HTTPSLockingCallback(int mode, int n, const char *file, int line) {
+    if (mode & CRYPTO_LOCK) {
+        pthread_mutex_lock(&opensslLocks[n]);
+    } else {
+        pthread_mutex_unlock(&opensslLocks[n]);
+    }
+}
+
+static unsigned long HTTPSThreadIdCallback(void) {
+    return (unsigned long)pthread_self();
+}
+#endif
+
+// Called by OpenSSL whenever the server hands us a resumable session. For
+// TLS 1.3 this happens after the handshake, when the NewSessionTicket
+// message is read. Returning 1 keeps the reference OpenSSL gave us.
+static int HTTPSNewSessionCallback(SSL *ssl, SSL_SESSION *session) {
+    const char *host = (const char *)SSL_get_app_data(ssl);
+    NSAutoreleasePool *pool;
+    NSString *key;
+    NSValue *previous;
+
+    if (!host) {
+        return 0;
+    }
+
+    pool = [[NSAutoreleasePool alloc] init];
+    key = [NSString stringWithUTF8String:host];
+
+    [sessionCacheLock lock];
+    previous = [sessionCache objectForKey:key];
+    if (previous) {
+        SSL_SESSION_free((SSL_SESSION *)[previous pointerValue]);
+    }
+    [sessionCache setObject:[NSValue valueWithPointer:session] forKey:key];
+    [sessionCacheLock unlock];
+
+    [pool release];
+    return 1;
+}
+
+static void HTTPSForgetSession(NSString *host) {
+    NSValue *cached;
+
+    [sessionCacheLock lock];
+    cached = [sessionCache objectForKey:host];
+    if (cached) {
+        SSL_SESSION_free((SSL_SESSION *)[cached pointerValue]);
+        [sessionCache removeObjectForKey:host];
+    }
+    [sessionCacheLock unlock];
+}
+
+static SSL_CTX *HTTPSCreateSharedContext(void) {
+    SSL_CTX *ctx;
+    const char **path;
+
     // Create SSL context (use TLS_client_method if available, fall back to SSLv23)
     #if OPENSSL_VERSION_NUMBER >= 0x10100000L
         const SSL_METHOD *method = TLS_client_method();
@@ -58,290 +312,1409 @@
     ctx = SSL_CTX_new(method);
     if (!ctx) {
         NSLog(@"Failed to create SSL context");
-        return nil;
+        return NULL;
     }
-    
+
     // Set options for compatibility
     SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
-    
-    // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        NSLog(@"Failed to create socket");
-        SSL_CTX_free(ctx);
-        return nil;
+
+    // Load the trust store exactly once. Without a bundle we keep the old
+    // unverified behaviour rather than refusing to talk to the API at all.
+    for (path = HTTPSTrustStorePaths; *path; path++) {
+        if (access(*path, R_OK) == 0 && SSL_CTX_load_verify_locations(ctx, *path, NULL) == 1) {
+            NSLog(@"Loaded TLS trust store from %s", *path);
+            sharedContextVerifiesPeer = YES;
+            break;
+        }
     }
-    
-    // Resolve hostname
-    struct hostent *host_entry = gethostbyname([hostname UTF8String]);
-    if (!host_entry) {
-        NSLog(@"Failed to resolve hostname: %@", hostname);
-        close(sockfd);
-        SSL_CTX_free(ctx);
-        return nil;
+    if (!sharedContextVerifiesPeer) {
+        SSL_CTX_set_default_verify_paths(ctx);
+        NSLog(@"No CA bundle found; server certificates will not be verified");
     }
-    
-    // Setup server address
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    memcpy(&server_addr.sin_addr.s_addr, host_entry->h_addr_list[0], host_entry->h_length);
-    
-    // Connect to server
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        NSLog(@"Failed to connect to server");
-        close(sockfd);
-        SSL_CTX_free(ctx);
-        return nil;
+    SSL_CTX_set_verify(ctx, sharedContextVerifiesPeer ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, NULL);
+
+    // Client-side session caching. We keep sessions ourselves (per host)
+    // instead of in OpenSSL's internal store, which is keyed for servers.
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, HTTPSNewSessionCallback);
+
+    return ctx;
+}
+
+// Writing to a socket the peer has closed raises SIGPIPE, which kills the
+// process unless it is handled. Apple systems turn that off per socket
+// (SO_NOSIGPIPE, set in HTTPSConnectRace). Elsewhere, such as Linux, the
+// signal is blocked on the calling thread for as long as a request may touch
+// the socket, and one raised in that time is discarded before it is
+// unblocked, so the write fails with EPIPE and the request's own error
+// handling (the stale-connection retry, cancellation) takes over.
+typedef struct {
+    sigset_t previousMask;
+    BOOL alreadyPending;
+} HTTPSSigpipeGuard;
+
+static void HTTPSBlockSigpipe(HTTPSSigpipeGuard *guard) {
+#ifndef SO_NOSIGPIPE
+    sigset_t pipeSet;
+    sigset_t pending;
+
+    sigemptyset(&pipeSet);
+    sigaddset(&pipeSet, SIGPIPE);
+    sigemptyset(&pending);
+    sigpending(&pending);
+    // A SIGPIPE that was pending before is not ours to discard
+    guard->alreadyPending = (sigismember(&pending, SIGPIPE) == 1);
+    pthread_sigmask(SIG_BLOCK, &pipeSet, &guard->previousMask);
+#endif
+}
+
+static void HTTPSRestoreSigpipe(HTTPSSigpipeGuard *guard) {
+#ifndef SO_NOSIGPIPE
+    sigset_t pipeSet;
+    struct timespec noWait = { 0, 0 };
+
+    sigemptyset(&pipeSet);
+    sigaddset(&pipeSet, SIGPIPE);
+    if (!guard->alreadyPending) {
+        while (sigtimedwait(&pipeSet, NULL, &noWait) == SIGPIPE) {
+        }
     }
-    
-    // Create SSL connection
-    ssl = SSL_new(ctx);
-    SSL_set_fd(ssl, sockfd);
-    
-    // Set SNI hostname (only if available)
-    #ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
-    SSL_ctrl(ssl, SSL_CTRL_SET_TLSEXT_HOSTNAME, TLSEXT_NAMETYPE_host_name, (char *)[hostname UTF8String]);
-    #endif
-    
-    // Perform SSL handshake
-    if (SSL_connect(ssl) <= 0) {
-        NSLog(@"SSL handshake failed");
-        ERR_print_errors_fp(stderr);
-        SSL_free(ssl);
-        close(sockfd);
-        SSL_CTX_free(ctx);
-        return nil;
+    pthread_sigmask(SIG_SETMASK, &guard->previousMask, NULL);
+#endif
+}
+
+// Seconds on a clock that never jumps, for measuring deadlines
+static double HTTPSMonotonicNow(void) {
+#ifdef __APPLE__
+    static double secondsPerTick = 0;
+    if (secondsPerTick == 0) {
+        mach_timebase_info_data_t timebase;
+        mach_timebase_info(&timebase);
+        secondsPerTick = (double)timebase.numer / (double)timebase.denom / 1e9;
     }
-    
-    // Send request data
-    const char *requestBytes = [requestData bytes];
-    int totalSent = 0;
-    int requestLen = [requestData length];
-    
-    while (totalSent < requestLen) {
-        int sent = SSL_write(ssl, requestBytes + totalSent, requestLen - totalSent);
-        if (sent <= 0) {
-            NSLog(@"Failed to send request");
-            SSL_free(ssl);
-            close(sockfd);
-            SSL_CTX_free(ctx);
-            return nil;
+    return (double)mach_absolute_time() * secondsPerTick;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#endif
+}
+
+// Waits until the socket is ready for the given poll events or the deadline
+// passes. Returns 1 when ready, 0 on timeout and -1 on error. Error and
+// hang-up conditions count as ready; the next read or write reports them.
+static int HTTPSWaitForSocket(int fd, short events, double deadline) {
+    struct pollfd pfd;
+    double remaining;
+    int result;
+
+    for (;;) {
+        remaining = deadline - HTTPSMonotonicNow();
+        if (remaining <= 0) {
+            return 0;
+        }
+
+        pfd.fd = fd;
+        pfd.events = events;
+        pfd.revents = 0;
+        result = poll(&pfd, 1, (int)(remaining * 1000.0) + 1);
+        if (result > 0) {
+            return 1;
+        }
+        if (result < 0 && errno != EINTR) {
+            return -1;
         }
-        totalSent += sent;
     }
-    
-    // Read response
-    responseData = [NSMutableData data];
-    char buffer[4096];
-    int bytes;
-    
-    while ((bytes = SSL_read(ssl, buffer, sizeof(buffer))) > 0) {
-        [responseData appendBytes:buffer length:bytes];
+}
+
+// Connects to the first of the resolved addresses that answers. Attempts are
+// staggered by the attempt delay, and a failed attempt starts the next one
+// straight away, so an unreachable address costs a quarter of a second
+// rather than a full TCP timeout. Returns the connected non-blocking socket,
+// or -1 with either *timedOut set or *lastErrno holding the last failure.
+static int HTTPSConnectRace(NSArray *addresses, double deadline, BOOL *timedOut, int *lastErrno) {
+    struct pollfd attempts[HTTPS_CONNECT_MAX_IN_FLIGHT];
+    int inFlight = 0;
+    unsigned int next = 0;
+    double nextStart = 0;
+    double now;
+    double waitUntil;
+    int winner = -1;
+    int result;
+    int i;
+
+    *timedOut = NO;
+    *lastErrno = 0;
+
+    while (winner < 0) {
+        now = HTTPSMonotonicNow();
+        if (now >= deadline) {
+            *timedOut = YES;
+            break;
+        }
+
+        // Start the next attempt when it is due, or at once if none are running
+        if (next < [addresses count] && inFlight < HTTPS_CONNECT_MAX_IN_FLIGHT &&
+            (inFlight == 0 || now >= nextStart)) {
+            NSData *address = [addresses objectAtIndex:next++];
+            const struct sockaddr *sa = (const struct sockaddr *)[address bytes];
+            int fd = socket(sa->sa_family, SOCK_STREAM, 0);
+
+            if (fd < 0) {
+                *lastErrno = errno;
+                continue;
+            }
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+            {
+                int on = 1;
+                setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+            }
+#endif
+
+            if (connect(fd, sa, (socklen_t)[address length]) == 0) {
+                winner = fd;
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                *lastErrno = errno;
+                close(fd);
+                continue;
+            }
+
+            attempts[inFlight].fd = fd;
+            attempts[inFlight].events = POLLOUT;
+            inFlight++;
+            nextStart = now + HTTPS_CONNECT_ATTEMPT_DELAY;
+            continue;
+        }
+
+        if (inFlight == 0) {
+            // Every address has been tried and refused
+            break;
+        }
+
+        // Sleep until an attempt finishes, the next one is due, or time is up
+        waitUntil = deadline;
+        if (next < [addresses count] && inFlight < HTTPS_CONNECT_MAX_IN_FLIGHT && nextStart < waitUntil) {
+            waitUntil = nextStart;
+        }
+        for (i = 0; i < inFlight; i++) {
+            attempts[i].revents = 0;
+        }
+        result = poll(attempts, inFlight, (int)((waitUntil - now) * 1000.0) + 1);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            *lastErrno = errno;
+            break;
+        }
+
+        for (i = inFlight - 1; i >= 0; i--) {
+            int socketError = 0;
+            socklen_t errorLength = sizeof(socketError);
+
+            if (attempts[i].revents == 0) {
+                continue;
+            }
+            if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &socketError, &errorLength) < 0) {
+                socketError = errno;
+            }
+
+            if (socketError == 0 && winner < 0) {
+                winner = attempts[i].fd;
+            } else {
+                if (socketError != 0) {
+                    *lastErrno = socketError;
+                    nextStart = now;
+                }
+                close(attempts[i].fd);
+            }
+            attempts[i] = attempts[--inFlight];
+        }
+    }
+
+    // Abandon the attempts that lost the race
+    for (i = 0; i < inFlight; i++) {
+        close(attempts[i].fd);
+    }
+
+    return winner;
+}
+
+// Handles a non-blocking OpenSSL call that did not complete: waits for the
+// direction OpenSSL asked for. Returns 1 to retry the call, 0 if the
+// deadline passed and -1 if the call failed outright.
+static int HTTPSWaitForSSL(SSL *ssl, int fd, int result, double deadline) {
+    switch (SSL_get_error(ssl, result)) {
+        case SSL_ERROR_WANT_READ:
+            return HTTPSWaitForSocket(fd, POLLIN, deadline) > 0 ? 1 : 0;
+        case SSL_ERROR_WANT_WRITE:
+            return HTTPSWaitForSocket(fd, POLLOUT, deadline) > 0 ? 1 : 0;
+        default:
+            return -1;
+    }
+}
+
+// Writes a buffer through a non-blocking SSL connection. A write that makes
+// no progress for the idle interval means the peer has stopped reading.
+// Returns 1 when everything was written, 0 on timeout and -1 on error.
+static int HTTPSWriteAll(SSL *ssl, int fd, const char *bytes, unsigned long length, NSTimeInterval idleTimeout) {
+    double deadline = HTTPSMonotonicNow() + idleTimeout;
+    int sent;
+    int wait;
+
+    while (length > 0) {
+        // Retries after WANT_WRITE must repeat the same buffer and length,
+        // which this loop does until the call succeeds
+        sent = SSL_write(ssl, bytes, (int)(length > 0x40000000UL ? 0x40000000UL : length));
+        if (sent > 0) {
+            bytes += sent;
+            length -= sent;
+            deadline = HTTPSMonotonicNow() + idleTimeout;
+            continue;
+        }
+
+        wait = HTTPSWaitForSSL(ssl, fd, sent, deadline);
+        if (wait <= 0) {
+            return wait;
+        }
+    }
+
+    return 1;
+}
+
+// Appends the UTF-8 bytes of a string to the request header
+static void HTTPSAppendString(NSMutableData *data, NSString *string) {
+    const char *utf8 = [string UTF8String];
+
+    [data appendBytes:utf8 length:strlen(utf8)];
+}
+
+// Content-Encoding of the response body
+enum {
+    HTTPSEncodingIdentity = 0,
+    HTTPSEncodingGzip,
+    HTTPSEncodingDeflate
+};
+
+// Where the response parser delivers what it finds for one exchange. The
+// body is collected in a malloc'd buffer that becomes the returned NSData.
+// Compressed bodies pass through the inflater on the way. A body delegate
+// is only told about a body that fits the buffer sized for it up front.
+typedef struct {
+    HTTPSClient *client;
+    id streamDelegate;
+    id bodyDelegate;
+    BOOL bodyWatched;
+    unsigned long bodyReported;
+    int *statusCode;
+    NSMutableDictionary *headers;
+    HTTPResponseParser *parser;
+    char *body;
+    unsigned long bodyLength;
+    unsigned long bodyCapacity;
+    int encoding;
+    z_stream inflater;
+    BOOL inflaterReady;
+    BOOL inflaterFinished;
+    BOOL inflaterRaw;
+    unsigned char firstBytes[2];
+    unsigned long long wireLength;
+    unsigned long long decodedLength;
+} HTTPSResponseContext;
+
+// Makes room for at least the given number of body bytes, plus the padding
+// that follows the body when it is handed over
+static BOOL HTTPSReserveBody(HTTPSResponseContext *response, unsigned long capacity) {
+    char *grown;
+
+    if (capacity <= response->bodyCapacity) {
+        return YES;
+    }
+    grown = realloc(response->body, capacity + HTTPS_BODY_PADDING);
+    if (!grown) {
+        return NO;
+    }
+    response->body = grown;
+    response->bodyCapacity = capacity;
+    return YES;
+}
+
+// Header names are case-insensitive, so the map is keyed by lowercase name.
+// Repeated fields are joined with ", " as RFC 7230 allows.
+static int HTTPSParserHeader(void *context, const char *name, size_t nameLength,
+                             const char *value, size_t valueLength) {
+    HTTPSResponseContext *response = (HTTPSResponseContext *)context;
+    NSString *key;
+    NSString *string;
+    NSString *existing;
+
+    key = [[[NSString alloc] initWithBytes:name
+                                    length:nameLength
+                                  encoding:NSISOLatin1StringEncoding] autorelease];
+    key = [key lowercaseString];
+    string = [[[NSString alloc] initWithBytes:value
+                                       length:valueLength
+                                     encoding:NSISOLatin1StringEncoding] autorelease];
+
+    existing = [response->headers objectForKey:key];
+    if (existing) {
+        string = [NSString stringWithFormat:@"%@, %@", existing, string];
+    }
+    [response->headers setObject:string forKey:key];
+    return 0;
+}
+
+// The status has to be known before the first body byte is delivered, since
+// stream delegates look at it to tell an event stream from an error body
+static int HTTPSParserHeadersComplete(void *context, int status) {
+    HTTPSResponseContext *response = (HTTPSResponseContext *)context;
+    long long contentLength = HTTPResponseParserContentLength(response->parser);
+    NSString *encoding = [[response->headers objectForKey:@"content-encoding"] lowercaseString];
+
+    *response->statusCode = status;
+
+    if ([encoding isEqualToString:@"gzip"] || [encoding isEqualToString:@"x-gzip"]) {
+        response->encoding = HTTPSEncodingGzip;
+    } else if ([encoding isEqualToString:@"deflate"]) {
+        response->encoding = HTTPSEncodingDeflate;
+    }
+
+    // Size the body buffer once instead of growing it read by read. The
+    // length of a compressed body says little about its decoded size.
+    if (!response->streamDelegate && response->encoding == HTTPSEncodingIdentity &&
+        contentLength > 0 && (unsigned long long)contentLength <= HTTPS_BODY_PRESIZE_LIMIT) {
+        if (HTTPSReserveBody(response, (unsigned long)contentLength) && response->bodyDelegate) {
+            response->bodyWatched = YES;
+            [response->bodyDelegate httpsClient:response->client
+                                willReceiveBody:response->body
+                                         length:(unsigned long)contentLength];
+        }
+    }
+    return 0;
+}
+
+// Passes decoded body bytes to the stream delegate or the body buffer
+static int HTTPSDeliverBody(HTTPSResponseContext *response, const char *bytes, size_t length) {
+    unsigned long needed;
+
+    response->decodedLength += length;
+
+    if (response->streamDelegate) {
+        [response->streamDelegate httpsClient:response->client
+                              didReceiveBytes:bytes
+                                       length:length];
+        return 0;
+    }
+
+    needed = response->bodyLength + length;
+    if (needed > response->bodyCapacity) {
+        unsigned long capacity = response->bodyCapacity ? response->bodyCapacity * 2 : HTTPS_TLS_RECORD_SIZE;
+        if (capacity < needed) {
+            capacity = needed;
+        }
+        if (!HTTPSReserveBody(response, capacity)) {
+            return -1;
+        }
+    }
+    memcpy(response->body + response->bodyLength, bytes, length);
+    response->bodyLength = needed;
+    return 0;
+}
+
+// Inflates the next piece of a gzip or deflate body. Z_SYNC_FLUSH hands out
+// everything decodable so far, so streamed events are not held back.
+static int HTTPSInflateBody(HTTPSResponseContext *response, const char *bytes, size_t length) {
+    z_stream *z = &response->inflater;
+    char decoded[HTTPS_TLS_RECORD_SIZE];
+    unsigned long produced;
+    int status;
+
+    if (response->inflaterFinished) {
+        // Anything after the end of the compressed stream is ignored
+        return 0;
+    }
+
+    if (!response->inflaterReady) {
+        memset(z, 0, sizeof(*z));
+        // 15 + 32: full window, and accept either a zlib or a gzip header
+        if (inflateInit2(z, 15 + 32) != Z_OK) {
+            return -1;
+        }
+        response->inflaterReady = YES;
+    }
+
+    z->next_in = (Bytef *)bytes;
+    z->avail_in = (uInt)length;
+
+    for (;;) {
+        z->next_out = (Bytef *)decoded;
+        z->avail_out = sizeof(decoded);
+        status = inflate(z, Z_SYNC_FLUSH);
+
+        // "deflate" is supposed to be zlib-wrapped, but some servers send the
+        // raw stream. zlib rejects a bad header by its second byte, so if
+        // that happens, start over as raw deflate, replaying the (at most
+        // one) byte that arrived in an earlier piece.
+        if (status == Z_DATA_ERROR && response->encoding == HTTPSEncodingDeflate &&
+            !response->inflaterRaw && z->total_out == 0 &&
+            response->wireLength - length < sizeof(response->firstBytes)) {
+            unsigned long replay = (unsigned long)(response->wireLength - length);
+
+            inflateEnd(z);
+            memset(z, 0, sizeof(*z));
+            if (inflateInit2(z, -15) != Z_OK) {
+                response->inflaterReady = NO;
+                return -1;
+            }
+            response->inflaterRaw = YES;
+            if (replay > 0) {
+                z->next_in = response->firstBytes;
+                z->avail_in = (uInt)replay;
+                z->next_out = (Bytef *)decoded;
+                z->avail_out = sizeof(decoded);
+                if (inflate(z, Z_SYNC_FLUSH) == Z_DATA_ERROR) {
+                    return -1;
+                }
+                produced = sizeof(decoded) - z->avail_out;
+                if (produced > 0 && HTTPSDeliverBody(response, decoded, produced) != 0) {
+                    return -1;
+                }
+            }
+            z->next_in = (Bytef *)bytes;
+            z->avail_in = (uInt)length;
+            continue;
+        }
+        if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+            return -1;
+        }
+
+        produced = sizeof(decoded) - z->avail_out;
+        if (produced > 0 && HTTPSDeliverBody(response, decoded, produced) != 0) {
+            return -1;
+        }
+
+        if (status == Z_STREAM_END) {
+            response->inflaterFinished = YES;
+            return 0;
+        }
+        // Stop once the input is used up and nothing more is pending
+        if (status == Z_BUF_ERROR || (z->avail_in == 0 && z->avail_out != 0)) {
+            return 0;
+        }
+    }
+}
+
+static int HTTPSParserBody(void *context, const char *bytes, size_t length) {
+    HTTPSResponseContext *response = (HTTPSResponseContext *)context;
+    unsigned long long offset = response->wireLength;
+
+    // Keep the opening bytes for the raw deflate fallback
+    while (offset < sizeof(response->firstBytes) && offset - response->wireLength < length) {
+        response->firstBytes[offset] = (unsigned char)bytes[offset - response->wireLength];
+        offset++;
     }
-    
-    // Clean up
-    SSL_free(ssl);
-    close(sockfd);
-    SSL_CTX_free(ctx);
-    
-    return responseData;
+
+    response->wireLength += length;
+    if (response->encoding != HTTPSEncodingIdentity) {
+        return HTTPSInflateBody(response, bytes, length);
+    }
+    return HTTPSDeliverBody(response, bytes, length);
+}
+
+static const HTTPResponseParserCallbacks HTTPSParserCallbacks = {
+    HTTPSParserHeader,
+    HTTPSParserHeadersComplete,
+    HTTPSParserBody
+};
+
+@implementation HTTPSClient
+
++ (void)initialize {
+    if (self == [HTTPSClient class] && !connectionPool) {
+        // Initialize OpenSSL (not needed for OpenSSL 1.1.0+)
+        #if OPENSSL_VERSION_NUMBER < 0x10100000L
+        int i;
+
+        SSL_load_error_strings();
+        SSL_library_init();
+        OpenSSL_add_all_algorithms();
+
+        opensslLocks = malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
+        for (i = 0; i < CRYPTO_num_locks(); i++) {
+            pthread_mutex_init(&opensslLocks[i], NULL);
+        }
+        CRYPTO_set_id_callback(HTTPSThreadIdCallback);
+        CRYPTO_set_locking_callback(HTTPSLockingCallback);
+        #endif
+
+        connectionPool = [[NSMutableDictionary alloc] init];
+        connectionPoolLock = [[NSLock alloc] init];
+        sessionCache = [[NSMutableDictionary alloc] init];
+        sessionCacheLock = [[NSLock alloc] init];
+        sharedContext = HTTPSCreateSharedContext();
+    }
+}
+
++ (unsigned long)fullHandshakeCount {
+    unsigned long count;
+
+    [sessionCacheLock lock];
+    count = fullHandshakeCount;
+    [sessionCacheLock unlock];
+    return count;
+}
+
++ (unsigned long)resumedHandshakeCount {
+    unsigned long count;
+
+    [sessionCacheLock lock];
+    count = resumedHandshakeCount;
+    [sessionCacheLock unlock];
+    return count;
+}
+
++ (BOOL)trustCertificatesInFile:(NSString *)path {
+    if (!sharedContext ||
+        SSL_CTX_load_verify_locations(sharedContext, [path fileSystemRepresentation], NULL) != 1) {
+        NSLog(@"Could not load certificates from %@", path);
+        return NO;
+    }
+
+    // Verification may have been off for want of a bundle; it is on now
+    sharedContextVerifiesPeer = YES;
+    SSL_CTX_set_verify(sharedContext, SSL_VERIFY_PEER, NULL);
+    return YES;
+}
+
++ (void)setLogsRequests:(BOOL)flag {
+    logsRequests = flag;
 }
 
-- (NSData *)sendRequest:(NSString *)request {
-    SSL_CTX *ctx = NULL;
++ (void)closeIdleConnections {
+    NSEnumerator *hostEnum;
+    NSArray *idle;
+
+    [connectionPoolLock lock];
+    hostEnum = [connectionPool objectEnumerator];
+    while ((idle = [hostEnum nextObject])) {
+        [idle makeObjectsPerformSelector:@selector(close)];
+    }
+    [connectionPool removeAllObjects];
+    [connectionPoolLock unlock];
+}
+
++ (void)closeExpiredConnections {
+    NSEnumerator *hostEnum;
+    NSMutableArray *idle;
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    int i;
+
+    [connectionPoolLock lock];
+    hostEnum = [connectionPool objectEnumerator];
+    while ((idle = [hostEnum nextObject])) {
+        for (i = [idle count] - 1; i >= 0; i--) {
+            HTTPSConnection *old = [idle objectAtIndex:i];
+            if (now - [old lastUsed] > HTTPS_POOL_IDLE_TIMEOUT) {
+                [old close];
+                [idle removeObjectAtIndex:i];
+            }
+        }
+    }
+    [connectionPoolLock unlock];
+}
+
++ (NSTimeInterval)idleConnectionLifetime {
+    return HTTPS_POOL_IDLE_TIMEOUT;
+}
+
+- (id)initWithHost:(NSString *)host port:(int)portNum {
+    self = [super init];
+    if (self) {
+        hostname = [host retain];
+        port = portNum;
+        responseHeaders = [[NSMutableDictionary alloc] init];
+        connectTimeout = HTTPS_DEFAULT_CONNECT_TIMEOUT;
+        handshakeTimeout = HTTPS_DEFAULT_HANDSHAKE_TIMEOUT;
+        firstByteTimeout = HTTPS_DEFAULT_FIRST_BYTE_TIMEOUT;
+        idleTimeout = HTTPS_DEFAULT_IDLE_TIMEOUT;
+        cancelLock = [[NSLock alloc] init];
+        activeSocket = -1;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [hostname release];
+    [responseHeaders release];
+    [lastError release];
+    [cancelLock release];
+    [super dealloc];
+}
+
+- (void)setConnectTimeout:(NSTimeInterval)seconds {
+    connectTimeout = seconds;
+}
+
+- (void)setHandshakeTimeout:(NSTimeInterval)seconds {
+    handshakeTimeout = seconds;
+}
+
+- (void)setFirstByteTimeout:(NSTimeInterval)seconds {
+    firstByteTimeout = seconds;
+}
+
+- (void)setIdleTimeout:(NSTimeInterval)seconds {
+    idleTimeout = seconds;
+}
+
+- (void)setBodyDelegate:(id)delegate {
+    bodyReceiver = delegate;
+}
+
+- (NSError *)lastError {
+    return lastError;
+}
+
+// Shutting the socket down (rather than closing it) wakes the request
+// thread from poll() without freeing the descriptor under it; the request
+// thread closes it when it unwinds. The lock keeps us from touching a
+// descriptor the request thread has already given up.
+- (void)cancel {
+    [cancelLock lock];
+    cancelled = YES;
+    if (activeSocket >= 0) {
+        shutdown(activeSocket, SHUT_RDWR);
+    }
+    [cancelLock unlock];
+}
+
+- (BOOL)isCancelled {
+    return cancelled;
+}
+
+// Publishes the socket the request thread is about to block on, so -cancel
+// can reach it. Returns NO if the request was cancelled already.
+- (BOOL)attachSocket:(int)fd {
+    BOOL attached;
+
+    [cancelLock lock];
+    attached = !cancelled;
+    activeSocket = attached ? fd : -1;
+    [cancelLock unlock];
+    return attached;
+}
+
+- (void)detachSocket {
+    [cancelLock lock];
+    activeSocket = -1;
+    [cancelLock unlock];
+}
+
+// Records why the current request failed. The first failure wins, since
+// later ones are usually just fallout from it. Once cancelled, whatever
+// broke did so because we shut the socket down, so say that instead.
+- (void)failWithCode:(int)code description:(NSString *)description {
+    if (cancelled) {
+        code = HTTPSClientErrorCancelled;
+        description = @"Request was cancelled";
+    }
+    NSLog(@"HTTPSClient %@: %@", hostname, description);
+    if (!lastError) {
+        lastError = [[NSError alloc] initWithDomain:HTTPSClientErrorDomain
+                                               code:code
+                                           userInfo:[NSDictionary dictionaryWithObject:description
+                                                                                forKey:NSLocalizedDescriptionKey]];
+    }
+}
+
+- (NSString *)poolKey {
+    return [NSString stringWithFormat:@"%@:%d", hostname, port];
+}
+
+// Takes the most recently used live connection for this host out of the pool,
+// discarding any that have expired or been closed by the server meanwhile.
+- (HTTPSConnection *)checkoutPooledConnection {
+    HTTPSConnection *found = nil;
+    NSMutableArray *idle;
+
+    [connectionPoolLock lock];
+    idle = [connectionPool objectForKey:[self poolKey]];
+    while (idle && [idle count] > 0) {
+        HTTPSConnection *candidate = [[[idle lastObject] retain] autorelease];
+        [idle removeLastObject];
+        if ([candidate isReusable]) {
+            found = candidate;
+            break;
+        }
+        [candidate close];
+    }
+    [connectionPoolLock unlock];
+
+    return found;
+}
+
+- (void)returnConnectionToPool:(HTTPSConnection *)connection {
+    NSMutableArray *idle;
+    NSString *key = [self poolKey];
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    int i;
+
+    [connection touch];
+
+    [connectionPoolLock lock];
+    idle = [connectionPool objectForKey:key];
+    if (!idle) {
+        idle = [NSMutableArray array];
+        [connectionPool setObject:idle forKey:key];
+    }
+
+    // Expire idle connections while we hold the lock
+    for (i = [idle count] - 1; i >= 0; i--) {
+        HTTPSConnection *old = [idle objectAtIndex:i];
+        if (now - [old lastUsed] > HTTPS_POOL_IDLE_TIMEOUT) {
+            [old close];
+            [idle removeObjectAtIndex:i];
+        }
+    }
+
+    if ([idle count] < HTTPS_POOL_MAX_PER_HOST) {
+        [idle addObject:connection];
+    } else {
+        [connection close];
+    }
+    [connectionPoolLock unlock];
+}
+
+- (HTTPSConnection *)openConnection {
     SSL *ssl = NULL;
     int sockfd = -1;
-    NSMutableData *responseData = nil;
-    
-    // Create SSL context (use TLS_client_method if available, fall back to SSLv23)
-    #if OPENSSL_VERSION_NUMBER >= 0x10100000L
-        const SSL_METHOD *method = TLS_client_method();
-    #else
-        const SSL_METHOD *method = SSLv23_client_method();
-    #endif
-    ctx = SSL_CTX_new(method);
-    if (!ctx) {
-        NSLog(@"Failed to create SSL context");
+    char *sessionHost;
+    NSValue *cachedSession;
+    BOOL offeredSession = NO;
+    NSArray *addresses;
+    NSString *resolveError = nil;
+    BOOL timedOut;
+    int connectErrno;
+    double deadline;
+    double phaseStart;
+    int result;
+    int wait;
+
+    if (!sharedContext) {
+        [self failWithCode:HTTPSClientErrorHandshakeFailed description:@"No SSL context available"];
         return nil;
     }
-    
-    // Set options for compatibility
-    SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
-    
-    // Create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        NSLog(@"Failed to create socket");
-        SSL_CTX_free(ctx);
+
+    // Resolve hostname (cached for a short while across requests)
+    phaseStart = HTTPSMonotonicNow();
+    addresses = [[HostResolver sharedResolver] addressesForHost:hostname port:port errorMessage:&resolveError];
+    metrics.dnsTime = HTTPSMonotonicNow() - phaseStart;
+    if (!addresses) {
+        [self failWithCode:HTTPSClientErrorResolveFailed description:resolveError];
         return nil;
     }
-    
-    // Resolve hostname
-    struct hostent *host_entry = gethostbyname([hostname UTF8String]);
-    if (!host_entry) {
-        NSLog(@"Failed to resolve hostname: %@", hostname);
-        close(sockfd);
-        SSL_CTX_free(ctx);
+
+    // Race the addresses; each socket is non-blocking, so every wait below
+    // is bounded by poll()
+    phaseStart = HTTPSMonotonicNow();
+    sockfd = HTTPSConnectRace(addresses, phaseStart + connectTimeout, &timedOut, &connectErrno);
+    metrics.connectTime = HTTPSMonotonicNow() - phaseStart;
+    if (sockfd < 0) {
+        // The cached addresses may be what went stale
+        [[HostResolver sharedResolver] forgetHost:hostname port:port];
+        if (timedOut) {
+            [self failWithCode:HTTPSClientErrorConnectTimeout
+                   description:[NSString stringWithFormat:@"Timed out connecting after %.0f seconds", connectTimeout]];
+        } else {
+            [self failWithCode:HTTPSClientErrorConnectFailed
+                   description:[NSString stringWithFormat:@"Failed to connect to server: %s", strerror(connectErrno)]];
+        }
         return nil;
     }
-    
-    // Setup server address
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    memcpy(&server_addr.sin_addr.s_addr, host_entry->h_addr_list[0], host_entry->h_length);
-    
-    // Connect to server
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        NSLog(@"Failed to connect to server");
+
+    // Requests are already coalesced into full TLS records, so Nagle's
+    // algorithm would only hold back the last partial one
+    {
+        int on = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    if (![self attachSocket:sockfd]) {
+        [self failWithCode:HTTPSClientErrorCancelled description:@"Request was cancelled"];
         close(sockfd);
-        SSL_CTX_free(ctx);
         return nil;
     }
-    
-    // Create SSL connection
-    ssl = SSL_new(ctx);
+
+    // Create SSL connection. The host string is owned by the connection so
+    // the session callback can find it for as long as the SSL object lives.
+    ssl = SSL_new(sharedContext);
     SSL_set_fd(ssl, sockfd);
-    
+    sessionHost = strdup([hostname UTF8String]);
+    SSL_set_app_data(ssl, sessionHost);
+
     // Set SNI hostname (only if available)
     #ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
-    SSL_ctrl(ssl, SSL_CTRL_SET_TLSEXT_HOSTNAME, TLSEXT_NAMETYPE_host_name, (char *)[hostname UTF8String]);
+    SSL_ctrl(ssl, SSL_CTRL_SET_TLSEXT_HOSTNAME, TLSEXT_NAMETYPE_host_name, sessionHost);
+    #endif
+
+    // Check the certificate is actually for this host (OpenSSL 1.0.2+)
+    #if OPENSSL_VERSION_NUMBER >= 0x10002000L
+    if (sharedContextVerifiesPeer) {
+        X509_VERIFY_PARAM_set1_host(SSL_get0_param(ssl), sessionHost, 0);
+    }
     #endif
-    
-    // Perform SSL handshake
-    if (SSL_connect(ssl) <= 0) {
-        NSLog(@"SSL handshake failed");
-        ERR_print_errors_fp(stderr);
+
+    // Offer the last session we got from this host for an abbreviated handshake
+    [sessionCacheLock lock];
+    cachedSession = [sessionCache objectForKey:hostname];
+    if (cachedSession) {
+        offeredSession = (SSL_set_session(ssl, (SSL_SESSION *)[cachedSession pointerValue]) == 1);
+    }
+    [sessionCacheLock unlock];
+
+    // Perform SSL handshake, waiting in whichever direction OpenSSL needs.
+    // SSL_get_error() is only meaningful with an empty error queue.
+    ERR_clear_error();
+    phaseStart = HTTPSMonotonicNow();
+    deadline = phaseStart + handshakeTimeout;
+    while ((result = SSL_connect(ssl)) <= 0) {
+        wait = HTTPSWaitForSSL(ssl, sockfd, result, deadline);
+        if (wait > 0) {
+            continue;
+        }
+
+        if (wait == 0) {
+            [self failWithCode:HTTPSClientErrorHandshakeTimeout
+                   description:[NSString stringWithFormat:@"Timed out in TLS handshake after %.0f seconds", handshakeTimeout]];
+        } else {
+            [self failWithCode:HTTPSClientErrorHandshakeFailed description:@"SSL handshake failed"];
+            ERR_print_errors_fp(stderr);
+        }
+        if (offeredSession && !cancelled) {
+            HTTPSForgetSession(hostname);
+        }
+        [self detachSocket];
         SSL_free(ssl);
         close(sockfd);
-        SSL_CTX_free(ctx);
+        free(sessionHost);
         return nil;
     }
-    
-    // Send request
-    const char *requestStr = [request UTF8String];
-    int totalSent = 0;
-    int requestLen = strlen(requestStr);
-    
-    while (totalSent < requestLen) {
-        int sent = SSL_write(ssl, requestStr + totalSent, requestLen - totalSent);
-        if (sent <= 0) {
-            NSLog(@"Failed to send request");
-            SSL_free(ssl);
-            close(sockfd);
-            SSL_CTX_free(ctx);
-            return nil;
+
+    metrics.handshakeTime = HTTPSMonotonicNow() - phaseStart;
+    metrics.resumedSession = (SSL_session_reused(ssl) != 0);
+
+    [sessionCacheLock lock];
+    if (SSL_session_reused(ssl)) {
+        resumedHandshakeCount++;
+    } else {
+        fullHandshakeCount++;
+    }
+    if (logsRequests) {
+        NSLog(@"TLS handshake with %@ %@ (full: %lu, resumed: %lu)", hostname,
+              SSL_session_reused(ssl) ? @"resumed" : @"full",
+              fullHandshakeCount, resumedHandshakeCount);
+    }
+    [sessionCacheLock unlock];
+
+    [self detachSocket];
+    return [[[HTTPSConnection alloc] initWithSSL:ssl socket:sockfd sessionHost:sessionHost] autorelease];
+}
+
+// Whether a live connection for this host is already waiting in the pool.
+// Leaves it there untouched, so its expiry clock keeps running.
+- (BOOL)hasPooledConnection {
+    NSMutableArray *idle;
+    BOOL found = NO;
+    int i;
+
+    [connectionPoolLock lock];
+    idle = [connectionPool objectForKey:[self poolKey]];
+    for (i = [idle count] - 1; i >= 0 && !found; i--) {
+        HTTPSConnection *candidate = [idle objectAtIndex:i];
+        if ([candidate isReusable]) {
+            found = YES;
+        } else {
+            [candidate close];
+            [idle removeObjectAtIndex:i];
         }
-        totalSent += sent;
     }
-    
-    // Read response
-    responseData = [NSMutableData data];
-    char buffer[4096];
+    [connectionPoolLock unlock];
+
+    return found;
+}
+
+- (BOOL)prewarmConnection {
+    HTTPSConnection *connection;
+    HTTPSSigpipeGuard guard;
+    BOOL ready;
+
+    // Checking the pool and reading tickets both go through OpenSSL, which
+    // may write to the socket
+    HTTPSBlockSigpipe(&guard);
+    if ([self hasPooledConnection]) {
+        HTTPSRestoreSigpipe(&guard);
+        return YES;
+    }
+
+    // Resolve, connect and handshake exactly as a request would, then park
+    // the connection for the next request to this host
+    memset(&metrics, 0, sizeof(metrics));
+    connection = [self openConnection];
+    ready = (connection && !cancelled && [connection readSessionTicketsWaiting:HTTPS_PREWARM_TICKET_WAIT]);
+    HTTPSRestoreSigpipe(&guard);
+    if (!ready) {
+        [connection close];
+        return NO;
+    }
+    [self returnConnectionToPool:connection];
+    if (logsRequests) {
+        NSLog(@"Pre-warmed connection to %@ (dns=%.1fms connect=%.1fms tls=%.1fms)",
+              hostname, metrics.dnsTime * 1000.0, metrics.connectTime * 1000.0,
+              metrics.handshakeTime * 1000.0);
+    }
+    return YES;
+}
+
+// Sends the header and body pieces as a run of full TLS records. Pieces are
+// never joined into one request buffer: a body piece that starts on a record
+// boundary is written straight from the caller's memory, and only the header
+// and the odd bytes at either end of a piece are staged to top up a record.
+// The header therefore shares its record (and TCP segment) with the start of
+// the body instead of going out alone.
+- (BOOL)writeRequestHeader:(NSData *)header
+                 bodyParts:(NSArray *)bodyParts
+              onConnection:(HTTPSConnection *)connection {
+    SSL *ssl = [connection ssl];
+    int fd = [connection socket];
+    char staging[HTTPS_TLS_RECORD_SIZE];
+    unsigned long staged = 0;
+    unsigned long partCount = [bodyParts count];
+    unsigned long partIndex;
+    int written = 1;
+
+    for (partIndex = 0; partIndex <= partCount && written > 0; partIndex++) {
+        NSData *part = (partIndex == 0) ? header : [bodyParts objectAtIndex:partIndex - 1];
+        const char *bytes = [part bytes];
+        unsigned long length = [part length];
+        unsigned long take;
+
+        metrics.bytesSent += length;
+        while (length > 0 && written > 0) {
+            if (staged == 0 && length >= HTTPS_TLS_RECORD_SIZE) {
+                // Whole records straight from the caller's buffer
+                take = length - (length % HTTPS_TLS_RECORD_SIZE);
+                written = HTTPSWriteAll(ssl, fd, bytes, take, idleTimeout);
+            } else {
+                take = HTTPS_TLS_RECORD_SIZE - staged;
+                if (take > length) {
+                    take = length;
+                }
+                memcpy(staging + staged, bytes, take);
+                staged += take;
+                if (staged == HTTPS_TLS_RECORD_SIZE) {
+                    written = HTTPSWriteAll(ssl, fd, staging, staged, idleTimeout);
+                    staged = 0;
+                }
+            }
+            bytes += take;
+            length -= take;
+        }
+    }
+
+    if (written > 0 && staged > 0) {
+        written = HTTPSWriteAll(ssl, fd, staging, staged, idleTimeout);
+    }
+
+    if (written == 0) {
+        [self failWithCode:HTTPSClientErrorIdleTimeout description:@"Timed out sending request"];
+    } else if (written < 0) {
+        [self failWithCode:HTTPSClientErrorSendFailed description:@"Failed to send request"];
+    }
+    return (written > 0);
+}
+
+// Writes one request and reads one complete response. The parser frames the
+// body by Content-Length or chunked encoding when the server uses either, so
+// the connection can be kept; otherwise we read to EOF and the connection is
+// spent.
+//
+// Without a stream delegate the result is the decoded body. With one, body
+// bytes are handed over as they are decoded and the result is empty. The
+// status code and header map are available as soon as the headers arrive.
+- (NSData *)exchangeRequestHeader:(NSData *)header
+                        bodyParts:(NSArray *)bodyParts
+                     onConnection:(HTTPSConnection *)connection
+                   streamDelegate:(id)streamDelegate
+                        keepAlive:(BOOL *)keepAlive {
+    SSL *ssl = [connection ssl];
+    int fd = [connection socket];
+    HTTPResponseParser parser;
+    HTTPSResponseContext context;
+    BOOL complete = NO;
+    BOOL failed = NO;
+    BOOL receivedAny = NO;
+    BOOL direct;
+    double deadline;
+    double now;
+    double firstByteAt = 0;
+    char buffer[HTTPS_TLS_RECORD_SIZE];
+    int readSize = HTTPS_INITIAL_READ_SIZE;
     int bytes;
-    
-    while ((bytes = SSL_read(ssl, buffer, sizeof(buffer))) > 0) {
-        [responseData appendBytes:buffer length:bytes];
+    int wait;
+
+    *keepAlive = NO;
+    statusCode = 0;
+    bodyWireLength = 0;
+    bodyDecodedLength = 0;
+    [responseHeaders removeAllObjects];
+    ERR_clear_error();
+
+    if (![self writeRequestHeader:header bodyParts:bodyParts onConnection:connection]) {
+        return nil;
+    }
+
+    // Read response
+    HTTPResponseParserInit(&parser, 0);
+    memset(&context, 0, sizeof(context));
+    context.client = self;
+    context.streamDelegate = streamDelegate;
+    context.bodyDelegate = streamDelegate ? nil : bodyReceiver;
+    context.statusCode = &statusCode;
+    context.headers = responseHeaders;
+    context.parser = &parser;
+
+    // The first byte may take as long as the model needs to start replying;
+    // after that, every read has to arrive within the idle interval
+    now = HTTPSMonotonicNow();
+    deadline = now + firstByteTimeout;
+    while (!complete && !failed) {
+        unsigned long long remaining = HTTPResponseParserBodyRemaining(&parser);
+
+        // Bytes already decrypted would still be readable after a cancel;
+        // the caller wants none of them
+        if (cancelled) {
+            [self failWithCode:HTTPSClientErrorCancelled description:@"Request was cancelled"];
+            failed = YES;
+            break;
+        }
+
+        // Once a sized body's buffer is allocated, read straight into it and
+        // skip the trip through the read buffer and parser callback
+        direct = (remaining > 0 && !streamDelegate && context.encoding == HTTPSEncodingIdentity &&
+                  context.bodyCapacity - context.bodyLength >= remaining);
+        if (direct) {
+            bytes = SSL_read(ssl, context.body + context.bodyLength,
+                             (int)(remaining > 0x40000000ULL ? 0x40000000ULL : remaining));
+        } else {
+            bytes = SSL_read(ssl, buffer, readSize);
+        }
+
+        if (bytes <= 0) {
+            wait = HTTPSWaitForSSL(ssl, fd, bytes, deadline);
+            if (wait > 0) {
+                continue;
+            }
+            if (wait == 0) {
+                if (receivedAny) {
+                    [self failWithCode:HTTPSClientErrorIdleTimeout
+                           description:[NSString stringWithFormat:@"No data received for %.0f seconds", idleTimeout]];
+                } else {
+                    [self failWithCode:HTTPSClientErrorFirstByteTimeout
+                           description:[NSString stringWithFormat:@"No response after %.0f seconds", firstByteTimeout]];
+                }
+                failed = YES;
+            }
+            // Otherwise it was a clean shutdown, reset or EOF: the parser
+            // decides below if that is an acceptable end of the response
+            break;
+        }
+
+        if (!receivedAny) {
+            firstByteAt = HTTPSMonotonicNow();
+            metrics.firstByteTime = firstByteAt - now;
+        }
+        receivedAny = YES;
+        metrics.bytesReceived += bytes;
+        deadline = HTTPSMonotonicNow() + idleTimeout;
+
+        if (direct) {
+            HTTPResponseParserSkipBody(&parser, bytes);
+            context.bodyLength += bytes;
+            context.wireLength += bytes;
+            context.decodedLength += bytes;
+        } else {
+            if (HTTPResponseParserExecute(&parser, &HTTPSParserCallbacks, &context, buffer, bytes) < 0) {
+                [self failWithCode:HTTPSClientErrorMalformedResponse description:@"Malformed HTTP response"];
+                failed = YES;
+                break;
+            }
+
+            // A read that filled the buffer means more is queued; ask for
+            // up to a whole TLS record next time
+            if (bytes == readSize && readSize < (int)sizeof(buffer)) {
+                readSize *= 2;
+            }
+        }
+
+        // The body delegate runs here, between reads, so it works on the body
+        // in step with its arrival rather than after the last byte
+        if (context.bodyWatched && context.bodyLength > context.bodyReported) {
+            context.bodyReported = context.bodyLength;
+            [context.bodyDelegate httpsClient:self didReceiveBodyLength:context.bodyLength];
+        }
+        complete = HTTPResponseParserIsComplete(&parser);
+    }
+
+    if (receivedAny) {
+        metrics.transferTime = HTTPSMonotonicNow() - firstByteAt;
+    }
+
+    if (!failed && !complete && !HTTPResponseParserFinish(&parser)) {
+        // Nothing at all, or a framed body that stopped short: either way the
+        // connection died before the response was complete
+        [self failWithCode:HTTPSClientErrorConnectionClosed
+               description:receivedAny ? @"Connection closed before the response was complete"
+                                       : @"Connection closed before a response was received"];
+        failed = YES;
+    }
+
+    if (!failed && context.inflaterReady && !context.inflaterFinished) {
+        [self failWithCode:HTTPSClientErrorMalformedResponse description:@"Compressed response body was truncated"];
+        failed = YES;
+    }
+    if (context.inflaterReady) {
+        inflateEnd(&context.inflater);
+    }
+
+    bodyWireLength = context.wireLength;
+    bodyDecodedLength = context.decodedLength;
+
+    if (failed) {
+        free(context.body);
+        return nil;
+    }
+
+    *keepAlive = HTTPResponseParserShouldKeepAlive(&parser);
+
+    // Hand the buffer over as it is, padded for in-place parsing; the
+    // NSData frees it when released
+    if (!context.body && !HTTPSReserveBody(&context, 1)) {
+        return [NSData data];
     }
-    
-    // Clean up
-    SSL_free(ssl);
-    close(sockfd);
-    SSL_CTX_free(ctx);
-    
-    return responseData;
+    memset(context.body + context.bodyLength, 0, HTTPS_BODY_PADDING);
+    return [NSData dataWithBytesNoCopy:context.body length:context.bodyLength freeWhenDone:YES];
 }
 
-- (NSData *)sendPOSTRequest:(NSString *)path
-                    headers:(NSDictionary *)headers
-                       body:(NSData *)bodyData {
-    
-    // Build HTTP request
-    NSMutableString *request = [NSMutableString string];
-    [request appendFormat:@"POST %@ HTTP/1.1\r\n", path];
-    [request appendFormat:@"Host: %@\r\n", hostname];
-    [request appendFormat:@"Content-Length: %lu\r\n", (unsigned long)[bodyData length]];
-    
-    // Add custom headers
-    NSEnumerator *keyEnum = [headers keyEnumerator];
-    NSString *key;
-    while ((key = [keyEnum nextObject])) {
-        NSString *value = [headers objectForKey:key];
-        [request appendFormat:@"%@: %@\r\n", key, value];
-    }
-    
-    // Add connection close header
-    [request appendString:@"Connection: close\r\n"];
-    [request appendString:@"\r\n"];
-    
-    // Combine headers and body
-    NSMutableData *fullRequest = [NSMutableData data];
-    [fullRequest appendData:[request dataUsingEncoding:NSUTF8StringEncoding]];
-    [fullRequest appendData:bodyData];
-    
-    // Send request directly as data
-    NSData *response = [self sendRequestData:fullRequest];
-    
-    if (!response) {
+// Runs one request and accounts for it: the phase timings go to the log and
+// to the per-host histograms whether or not the request succeeded.
+- (NSData *)sendRequestHeader:(NSData *)header
+                     bodyParts:(NSArray *)bodyParts
+                streamDelegate:(id)streamDelegate {
+    double started = HTTPSMonotonicNow();
+    NSData *response;
+    HTTPSSigpipeGuard guard;
+
+    memset(&metrics, 0, sizeof(metrics));
+    HTTPSBlockSigpipe(&guard);
+    response = [self performRequestHeader:header bodyParts:bodyParts streamDelegate:streamDelegate];
+    HTTPSRestoreSigpipe(&guard);
+    metrics.totalTime = HTTPSMonotonicNow() - started;
+
+    if (logsRequests) {
+        NSLog(@"%@", [NetworkMetrics logLineForMetrics:metrics host:hostname status:statusCode]);
+    }
+    [[NetworkMetrics sharedMetrics] recordMetrics:metrics forHost:hostname];
+    return response;
+}
+
+- (NSData *)performRequestHeader:(NSData *)header
+                        bodyParts:(NSArray *)bodyParts
+                   streamDelegate:(id)streamDelegate {
+    HTTPSConnection *connection;
+    NSData *response;
+    BOOL reused;
+    BOOL keepAlive;
+    int attempt;
+
+    [lastError release];
+    lastError = nil;
+    if (cancelled) {
+        [self failWithCode:HTTPSClientErrorCancelled description:@"Request was cancelled"];
         return nil;
     }
-    
-    // Parse response to extract body
-    NSString *responseStr = [[[NSString alloc] initWithData:response encoding:NSUTF8StringEncoding] autorelease];
-    NSRange headerEnd = [responseStr rangeOfString:@"\r\n\r\n"];
-    
-    if (headerEnd.location != NSNotFound) {
-        unsigned int bodyStart = headerEnd.location + 4;
-        if (bodyStart < [response length]) {
-            return [response subdataWithRange:NSMakeRange(bodyStart, [response length] - bodyStart)];
+
+    // A pooled connection can still die between the liveness probe and our
+    // write. If that happens before any response byte arrives, retry once on
+    // a freshly opened connection. Timeouts are not retried; waiting out the
+    // same deadline twice would defeat the point of having one.
+    for (attempt = 0; attempt < 2; attempt++) {
+        // Only the last attempt's phases are kept; total covers them all
+        memset(&metrics, 0, sizeof(metrics));
+        connection = [self checkoutPooledConnection];
+        reused = (connection != nil);
+        metrics.reusedConnection = reused;
+        if (!connection) {
+            connection = [self openConnection];
         }
+        if (!connection) {
+            return nil;
+        }
+        if (![self attachSocket:[connection socket]]) {
+            [connection close];
+            [self failWithCode:HTTPSClientErrorCancelled description:@"Request was cancelled"];
+            return nil;
+        }
+
+        response = [self exchangeRequestHeader:header
+                                     bodyParts:bodyParts
+                                  onConnection:connection
+                                streamDelegate:streamDelegate
+                                     keepAlive:&keepAlive];
+        [self detachSocket];
+        if (response) {
+            if (keepAlive && !cancelled) {
+                [self returnConnectionToPool:connection];
+            } else {
+                [connection close];
+            }
+            return response;
+        }
+
+        [connection close];
+        if (!reused || statusCode != 0 ||
+            ([lastError code] != HTTPSClientErrorConnectionClosed && [lastError code] != HTTPSClientErrorSendFailed)) {
+            break;
+        }
+        NSLog(@"Pooled connection to %@ was stale, reconnecting", hostname);
+        [lastError release];
+        lastError = nil;
     }
-    
+
     return nil;
 }
 
-- (NSData *)sendGETRequest:(NSString *)path
-                   headers:(NSDictionary *)headers {
-    
-    // Build HTTP request
-    NSMutableString *request = [NSMutableString string];
-    [request appendFormat:@"GET %@ HTTP/1.1\r\n", path];
-    [request appendFormat:@"Host: %@\r\n", hostname];
-    
-    // Add custom headers
-    NSEnumerator *keyEnum = [headers keyEnumerator];
+// Builds the request line and header block. The body is not included; it
+// is written separately from the caller's buffers.
+- (NSData *)requestHeaderWithMethod:(NSString *)method
+                               path:(NSString *)path
+                            headers:(NSDictionary *)headers
+                      contentLength:(long long)contentLength {
+    NSMutableData *header = [NSMutableData dataWithCapacity:512];
+    NSEnumerator *keyEnum;
     NSString *key;
+
+    HTTPSAppendString(header, [NSString stringWithFormat:@"%@ %@ HTTP/1.1\r\nHost: %@\r\n", method, path, hostname]);
+    if (contentLength >= 0) {
+        HTTPSAppendString(header, [NSString stringWithFormat:@"Content-Length: %lld\r\n", contentLength]);
+    }
+
+    // Add custom headers
+    keyEnum = [headers keyEnumerator];
     while ((key = [keyEnum nextObject])) {
-        NSString *value = [headers objectForKey:key];
-        [request appendFormat:@"%@: %@\r\n", key, value];
-    }
-    
-    // Add connection close header
-    [request appendString:@"Connection: close\r\n"];
-    [request appendString:@"\r\n"];
-    
-    // Send request and get response
-    NSData *response = [self sendRequest:request];
-    
-    if (!response) {
-        return nil;
+        HTTPSAppendString(header, [NSString stringWithFormat:@"%@: %@\r\n", key, [headers objectForKey:key]]);
     }
-    
-    // Parse response to extract body
-    NSString *responseStr = [[[NSString alloc] initWithData:response encoding:NSUTF8StringEncoding] autorelease];
-    NSRange headerEnd = [responseStr rangeOfString:@"\r\n\r\n"];
-    
-    if (headerEnd.location != NSNotFound) {
-        unsigned int bodyStart = headerEnd.location + 4;
-        if (bodyStart < [response length]) {
-            return [response subdataWithRange:NSMakeRange(bodyStart, [response length] - bodyStart)];
-        }
+
+    // Replies are mostly JSON and compress well; inflating them costs far
+    // less than the transfer time saved on a slow link
+    if (![headers objectForKey:@"Accept-Encoding"] && ![headers objectForKey:@"accept-encoding"]) {
+        HTTPSAppendString(header, @"Accept-Encoding: gzip, deflate\r\n");
     }
-    
-    return nil;
+
+    // Keep the connection open for the next request
+    HTTPSAppendString(header, @"Connection: keep-alive\r\n\r\n");
+
+    return header;
+}
+
+// Total size of a body supplied in pieces, or -1 for no body at all
+static long long HTTPSBodyLength(NSArray *bodyParts) {
+    NSEnumerator *partEnum;
+    NSData *part;
+    long long length = 0;
+
+    if (!bodyParts) {
+        return -1;
+    }
+    partEnum = [bodyParts objectEnumerator];
+    while ((part = [partEnum nextObject])) {
+        length += [part length];
+    }
+    return length;
+}
+
+- (int)lastStatusCode {
+    return statusCode;
+}
+
+- (NSDictionary *)lastResponseHeaders {
+    return responseHeaders;
+}
+
+- (unsigned long long)lastBodyWireLength {
+    return bodyWireLength;
+}
+
+- (unsigned long long)lastBodyDecodedLength {
+    return bodyDecodedLength;
+}
+
+- (HTTPSRequestMetrics)lastMetrics {
+    return metrics;
+}
+
+- (NSData *)sendPOSTRequest:(NSString *)path
+                    headers:(NSDictionary *)headers
+                       body:(NSData *)bodyData {
+    return [self sendPOSTRequest:path
+                         headers:headers
+                       bodyParts:(bodyData ? [NSArray arrayWithObject:bodyData] : nil)];
+}
+
+- (NSData *)sendPOSTRequest:(NSString *)path
+                    headers:(NSDictionary *)headers
+                  bodyParts:(NSArray *)bodyParts {
+    NSData *header = [self requestHeaderWithMethod:@"POST"
+                                              path:path
+                                           headers:headers
+                                     contentLength:HTTPSBodyLength(bodyParts)];
+
+    return [self sendRequestHeader:header bodyParts:bodyParts streamDelegate:nil];
+}
+
+- (BOOL)sendStreamingRequest:(NSString *)method
+                        path:(NSString *)path
+                     headers:(NSDictionary *)headers
+                        body:(NSData *)bodyData
+                    delegate:(id)streamDelegate {
+    return [self sendStreamingRequest:method
+                                 path:path
+                              headers:headers
+                            bodyParts:(bodyData ? [NSArray arrayWithObject:bodyData] : nil)
+                             delegate:streamDelegate];
+}
+
+- (BOOL)sendStreamingRequest:(NSString *)method
+                        path:(NSString *)path
+                     headers:(NSDictionary *)headers
+                   bodyParts:(NSArray *)bodyParts
+                    delegate:(id)streamDelegate {
+    NSData *header = [self requestHeaderWithMethod:method
+                                              path:path
+                                           headers:headers
+                                     contentLength:HTTPSBodyLength(bodyParts)];
+
+    return ([self sendRequestHeader:header bodyParts:bodyParts streamDelegate:streamDelegate] != nil);
+}
+
+- (NSData *)sendGETRequest:(NSString *)path
+                   headers:(NSDictionary *)headers {
+    NSData *header = [self requestHeaderWithMethod:@"GET" path:path headers:headers contentLength:-1];
+
+    // Send request and get response
+    return [self sendRequestHeader:header bodyParts:nil streamDelegate:nil];
 }
 
-@end
\ No newline at end of file
+@end
@@ -0,0 +1,83 @@
+////////////////////////////////////////////////////////////////////////////////
+// HostResolver.h
+// ClaudeChat
+//
+// Thread-safe name resolution built on getaddrinfo(), with a small in-process
+// cache so back-to-back requests to the same host skip the lookup entirely.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import <Foundation/Foundation.h>
+
+
+/**
+ * How long resolved addresses are reused, in seconds. getaddrinfo() does not
+ * report the record TTL, so this is a conservative fixed value.
+ */
+#define HOST_RESOLVER_DEFAULT_TTL 60.0
+
+
+////////////////////////////////////////////////////////////////////////////////
+/**
+ * @class HostResolver
+ * @brief Caching IPv4/IPv6 resolver
+ *
+ * Addresses come back as NSData objects wrapping a struct sockaddr (either
+ * sockaddr_in or sockaddr_in6) with the port already filled in, ready to hand
+ * to connect(). They are ordered for connection racing: the system's
+ * preferred family first, then alternating between families, so a client
+ * trying them in turn reaches both IPv6 and IPv4 early.
+ *
+ * All methods may be called from any thread. This is a singleton class -
+ * use [HostResolver sharedResolver].
+ */
+@interface HostResolver : NSObject
+{
+  NSMutableDictionary *_cache;
+  NSLock *_cacheLock;
+  NSTimeInterval _timeToLive;
+}
+
+
+/**
+ * Returns the shared HostResolver instance.
+ *
+ * @return The singleton HostResolver instance
+ */
++ (HostResolver *)sharedResolver;
+
+
+/**
+ * Resolves a host name, answering from the cache while the entry is fresh.
+ *
+ * @param host Host name or numeric address
+ * @param port Port to store in each address
+ * @param errorMessage On failure, set to a description of the problem
+ *                     (may be NULL)
+ * @return Array of NSData sockaddrs, or nil if the name did not resolve
+ */
+- (NSArray *)addressesForHost:(NSString *)host
+                         port:(int)port
+                 errorMessage:(NSString **)errorMessage;
+
+
+/**
+ * Drops any cached addresses for a host, so the next lookup goes back to
+ * the system resolver. Call this when none of the addresses answered.
+ *
+ * @param host Host name
+ * @param port Port the addresses were resolved for
+ */
+- (void)forgetHost:(NSString *)host port:(int)port;
+
+
+/**
+ * Sets how long resolved addresses are kept. Zero disables caching.
+ *
+ * @param seconds Cache lifetime
+ */
+- (void)setTimeToLive:(NSTimeInterval)seconds;
+
+@end
@@ -0,0 +1,275 @@
+////////////////////////////////////////////////////////////////////////////////
+// HostResolver.m
+// ClaudeChat
+//
+// getaddrinfo()-based resolver with a time-limited address cache.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import "HostResolver.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+
+// Cache entry keys
+static NSString * const HostResolverAddressesKey = @"addresses";
+static NSString * const HostResolverExpiresKey = @"expires";
+
+static HostResolver *sharedInstance = nil;
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Private Interface
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+@interface HostResolver (Private)
+
+- (NSString *)cacheKeyForHost:(NSString *)host port:(int)port;
+- (NSArray *)lookupHost:(NSString *)host
+                   port:(int)port
+           errorMessage:(NSString **)errorMessage;
+
+@end
+
+
+@implementation HostResolver
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Singleton
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+// +initialize runs once, before any other message, and the runtime
+// serializes it, so request threads racing to the first lookup are safe
++ (void)initialize
+{
+  if (self == [HostResolver class] && sharedInstance == nil)
+  {
+    sharedInstance = [[HostResolver alloc] init];
+  }
+}
+
+
++ (HostResolver *)sharedResolver
+{
+  return sharedInstance;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Lifecycle
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (id)init
+{
+  self = [super init];
+
+  if (self)
+  {
+    _cache = [[NSMutableDictionary alloc] init];
+    _cacheLock = [[NSLock alloc] init];
+    _timeToLive = HOST_RESOLVER_DEFAULT_TTL;
+  }
+
+  return self;
+}
+
+
+- (void)dealloc
+{
+  [_cache release];
+  [_cacheLock release];
+
+  [super dealloc];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Resolution
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (NSArray *)addressesForHost:(NSString *)host
+                         port:(int)port
+                 errorMessage:(NSString **)errorMessage
+{
+  NSString *key = [self cacheKeyForHost:host port:port];
+  NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+  NSDictionary *entry;
+  NSArray *addresses = nil;
+
+  [_cacheLock lock];
+  entry = [_cache objectForKey:key];
+  if (entry && [[entry objectForKey:HostResolverExpiresKey] doubleValue] > now)
+  {
+    addresses = [[[entry objectForKey:HostResolverAddressesKey] retain] autorelease];
+  }
+  [_cacheLock unlock];
+
+  if (addresses)
+  {
+    return addresses;
+  }
+
+  // Look up outside the lock; a slow resolver must not stall other hosts.
+  // Two threads missing at once both resolve, which is harmless.
+  addresses = [self lookupHost:host port:port errorMessage:errorMessage];
+
+  if (addresses && _timeToLive > 0)
+  {
+    entry = [NSDictionary dictionaryWithObjectsAndKeys:
+             addresses, HostResolverAddressesKey,
+             [NSNumber numberWithDouble:now + _timeToLive], HostResolverExpiresKey,
+             nil];
+
+    [_cacheLock lock];
+    [_cache setObject:entry forKey:key];
+    [_cacheLock unlock];
+  }
+
+  return addresses;
+}
+
+
+- (void)forgetHost:(NSString *)host port:(int)port
+{
+  [_cacheLock lock];
+  [_cache removeObjectForKey:[self cacheKeyForHost:host port:port]];
+  [_cacheLock unlock];
+}
+
+
+- (void)setTimeToLive:(NSTimeInterval)seconds
+{
+  [_cacheLock lock];
+  _timeToLive = seconds;
+  if (seconds <= 0)
+  {
+    [_cache removeAllObjects];
+  }
+  [_cacheLock unlock];
+}
+
+@end
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Private Implementation
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+@implementation HostResolver (Private)
+
+- (NSString *)cacheKeyForHost:(NSString *)host port:(int)port
+{
+  return [NSString stringWithFormat:@"%@:%d", [host lowercaseString], port];
+}
+
+
+/**
+ * Calls getaddrinfo() and orders the results for connection racing: the
+ * first family the system returned leads (it has already applied its
+ * address selection policy), then the two families alternate.
+ */
+- (NSArray *)lookupHost:(NSString *)host
+                   port:(int)port
+           errorMessage:(NSString **)errorMessage
+{
+  struct addrinfo hints;
+  struct addrinfo *results = NULL;
+  struct addrinfo *info;
+  char service[16];
+  int status;
+  int preferredFamily = AF_UNSPEC;
+  NSMutableArray *preferred = [NSMutableArray array];
+  NSMutableArray *others = [NSMutableArray array];
+  NSMutableArray *ordered;
+  unsigned int i;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+#ifdef AI_ADDRCONFIG
+  // Skip IPv6 answers on machines with no IPv6 address, and vice versa
+  hints.ai_flags = AI_ADDRCONFIG;
+#endif
+  snprintf(service, sizeof(service), "%d", port);
+
+  status = getaddrinfo([host UTF8String], service, &hints, &results);
+  if (status != 0 || !results)
+  {
+    if (errorMessage)
+    {
+      *errorMessage = [NSString stringWithFormat:@"Failed to resolve hostname %@: %s",
+                       host, gai_strerror(status)];
+    }
+    return nil;
+  }
+
+  for (info = results; info; info = info->ai_next)
+  {
+    NSData *address;
+
+    if (info->ai_family != AF_INET && info->ai_family != AF_INET6)
+    {
+      continue;
+    }
+
+    address = [NSData dataWithBytes:info->ai_addr length:info->ai_addrlen];
+    if (preferredFamily == AF_UNSPEC)
+    {
+      preferredFamily = info->ai_family;
+    }
+
+    // Resolvers often repeat an address once per protocol or socket type
+    if ([preferred containsObject:address] || [others containsObject:address])
+    {
+      continue;
+    }
+
+    if (info->ai_family == preferredFamily)
+    {
+      [preferred addObject:address];
+    }
+    else
+    {
+      [others addObject:address];
+    }
+  }
+
+  freeaddrinfo(results);
+
+  ordered = [NSMutableArray arrayWithCapacity:[preferred count] + [others count]];
+  for (i = 0; i < [preferred count] || i < [others count]; i++)
+  {
+    if (i < [preferred count])
+    {
+      [ordered addObject:[preferred objectAtIndex:i]];
+    }
+    if (i < [others count])
+    {
+      [ordered addObject:[others objectAtIndex:i]];
+    }
+  }
+
+  if ([ordered count] == 0)
+  {
+    if (errorMessage)
+    {
+      *errorMessage = [NSString stringWithFormat:@"No usable addresses for %@", host];
+    }
+    return nil;
+  }
+
+  return ordered;
+}
+
+@end
@@ -0,0 +1,118 @@
+////////////////////////////////////////////////////////////////////////////////
+// JSONArena.h
+// ClaudeChat
+//
+// A per-thread bump allocator for yyjson, so parsing and serialising on a
+// busy thread reuses one block of memory instead of calling malloc and
+// free for every document.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import <Foundation/Foundation.h>
+#include "yyjson.h"
+
+
+/** Block each thread's arena starts with; enough for typical replies. */
+#define JSON_ARENA_INITIAL_SIZE (256 * 1024)
+
+/** Most a thread's arena keeps between documents, however large one was. */
+#define JSON_ARENA_RETAIN_LIMIT (16 * 1024 * 1024)
+
+
+/**
+ * Allocation state behind an arena's yyjson_alc. A plain struct, so the
+ * allocator callbacks can reach it without a message send.
+ */
+typedef struct JSONArenaState
+{
+  char *block;
+  size_t capacity;
+  size_t used;
+  char *last;
+  struct JSONArenaOverflow *overflow;
+  size_t inUse;
+  size_t highWaterMark;
+  unsigned long live;
+} JSONArenaState;
+
+
+////////////////////////////////////////////////////////////////////////////////
+/**
+ * @class JSONArena
+ * @brief Reusable memory for yyjson documents on one thread
+ *
+ * Allocations are carved from one block in order, and freeing does
+ * nothing until everything carved out has been freed. At that point the
+ * arena starts again from the beginning of the block. yyjson frees all of
+ * a document's memory when the document is freed. So between documents,
+ * and so between requests, the arena is empty and ready for reuse without
+ * returning anything to the system.
+ *
+ * Whatever does not fit gets its own malloc. When the arena next empties,
+ * those blocks are freed, and the main block grows to the most that was
+ * in use at once (the high-water mark), up to JSON_ARENA_RETAIN_LIMIT. A
+ * thread settles on a block that fits its documents after its first few.
+ *
+ * Each thread has its own arena, created on first use and released when
+ * the thread exits. Use it only on that thread, and free every document
+ * before the thread's work item ends.
+ */
+@interface JSONArena : NSObject
+{
+  JSONArenaState _state;
+  yyjson_alc _allocator;
+}
+
+
+/**
+ * The calling thread's arena, created if needed.
+ *
+ * @return Arena owned by the current thread
+ */
++ (JSONArena *)currentArena;
+
+
+/**
+ * Shorthand for [[JSONArena currentArena] allocator].
+ *
+ * @return The current thread's yyjson allocator
+ */
++ (const yyjson_alc *)currentAllocator;
+
+
+/**
+ * The allocator to pass to yyjson_read_opts, yyjson_mut_doc_new and
+ * similar functions.
+ *
+ * @return Allocator backed by this arena, valid for the arena's lifetime
+ */
+- (const yyjson_alc *)allocator;
+
+
+/**
+ * Starts again from the beginning of the block. This happens by itself
+ * when the last allocation is freed. Call it only when nothing allocated
+ * from the arena is still in use.
+ */
+- (void)reset;
+
+
+/**
+ * The most memory that has been in use at once since the arena was
+ * created, in bytes. Compare it with JSON_ARENA_INITIAL_SIZE when sizing.
+ *
+ * @return High-water mark in bytes
+ */
+- (size_t)highWaterMark;
+
+
+/**
+ * Size of the arena's main block.
+ *
+ * @return Capacity in bytes
+ */
+- (size_t)capacity;
+
+@end
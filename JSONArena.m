@@ -0,0 +1,282 @@
+////////////////////////////////////////////////////////////////////////////////
+// JSONArena.m
+// ClaudeChat
+//
+// Per-thread bump allocator behind yyjson's yyjson_alc interface.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import "JSONArena.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Every allocation starts on a boundary suitable for any value yyjson stores
+#define JSON_ARENA_ALIGNMENT 16
+#define JSON_ARENA_ALIGN(size) (((size) + JSON_ARENA_ALIGNMENT - 1) & ~(size_t)(JSON_ARENA_ALIGNMENT - 1))
+
+
+/** An allocation too big for the rest of the block, freed when the arena empties. */
+typedef struct JSONArenaOverflow
+{
+  struct JSONArenaOverflow *next;
+  double alignment;
+} JSONArenaOverflow;
+
+#define JSON_ARENA_OVERFLOW_HEADER JSON_ARENA_ALIGN(sizeof(JSONArenaOverflow))
+
+
+static pthread_key_t JSONArenaKey;
+static pthread_once_t JSONArenaKeyOnce = PTHREAD_ONCE_INIT;
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Allocator
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Empties the arena: frees the overflow allocations and grows the block to
+ * the high-water mark, so next time everything fits in it.
+ */
+static void JSONArenaEmpty(JSONArenaState *arena)
+{
+  size_t wanted = arena->highWaterMark;
+  char *grown;
+
+  while (arena->overflow)
+  {
+    JSONArenaOverflow *next = arena->overflow->next;
+
+    free(arena->overflow);
+    arena->overflow = next;
+  }
+
+  if (wanted > JSON_ARENA_RETAIN_LIMIT)
+  {
+    wanted = JSON_ARENA_RETAIN_LIMIT;
+  }
+  if (wanted > arena->capacity)
+  {
+    // The old contents are garbage, so there is nothing to copy
+    grown = malloc(wanted);
+    if (grown)
+    {
+      free(arena->block);
+      arena->block = grown;
+      arena->capacity = wanted;
+    }
+  }
+
+  arena->used = 0;
+  arena->inUse = 0;
+  arena->last = NULL;
+  arena->live = 0;
+}
+
+
+static void *JSONArenaMalloc(void *ctx, size_t size)
+{
+  JSONArenaState *arena = (JSONArenaState *)ctx;
+  size_t aligned = JSON_ARENA_ALIGN(size ? size : 1);
+  char *bytes;
+
+  if (aligned <= arena->capacity - arena->used)
+  {
+    bytes = arena->block + arena->used;
+    arena->used += aligned;
+    arena->last = bytes;
+  }
+  else
+  {
+    JSONArenaOverflow *node = malloc(JSON_ARENA_OVERFLOW_HEADER + aligned);
+
+    if (!node)
+    {
+      return NULL;
+    }
+    node->next = arena->overflow;
+    arena->overflow = node;
+    bytes = (char *)node + JSON_ARENA_OVERFLOW_HEADER;
+  }
+
+  arena->live++;
+  arena->inUse += aligned;
+  if (arena->inUse > arena->highWaterMark)
+  {
+    arena->highWaterMark = arena->inUse;
+  }
+
+  return bytes;
+}
+
+
+/**
+ * yyjson grows its value and output buffers with realloc. The newest
+ * allocation in the block can grow where it is; anything else moves.
+ */
+static void *JSONArenaRealloc(void *ctx, void *ptr, size_t oldSize, size_t size)
+{
+  JSONArenaState *arena = (JSONArenaState *)ctx;
+  size_t aligned = JSON_ARENA_ALIGN(size ? size : 1);
+  size_t oldAligned;
+  size_t offset;
+  void *bytes;
+
+  if (!ptr)
+  {
+    return JSONArenaMalloc(ctx, size);
+  }
+
+  if ((char *)ptr == arena->last)
+  {
+    offset = (char *)ptr - arena->block;
+    if (offset + aligned <= arena->capacity)
+    {
+      arena->inUse = arena->inUse - (arena->used - offset) + aligned;
+      arena->used = offset + aligned;
+      if (arena->inUse > arena->highWaterMark)
+      {
+        arena->highWaterMark = arena->inUse;
+      }
+      return ptr;
+    }
+  }
+
+  // The old allocation will never be freed by name; stop counting it. Its
+  // bytes are no longer in use once copied, and leaving them in inUse
+  // would raise the high-water mark by every block yyjson outgrows.
+  oldAligned = JSON_ARENA_ALIGN(oldSize ? oldSize : 1);
+  arena->inUse -= oldAligned;
+
+  bytes = JSONArenaMalloc(ctx, size);
+  if (!bytes)
+  {
+    arena->inUse += oldAligned;
+    return NULL;
+  }
+  memcpy(bytes, ptr, oldSize < size ? oldSize : size);
+  arena->live--;
+
+  return bytes;
+}
+
+
+static void JSONArenaFree(void *ctx, void *ptr)
+{
+  JSONArenaState *arena = (JSONArenaState *)ctx;
+
+  if (ptr && arena->live > 0 && --arena->live == 0)
+  {
+    JSONArenaEmpty(arena);
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Thread Ownership
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+static void JSONArenaThreadExit(void *arena)
+{
+  [(JSONArena *)arena release];
+}
+
+
+static void JSONArenaCreateKey(void)
+{
+  pthread_key_create(&JSONArenaKey, JSONArenaThreadExit);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Implementation
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+@implementation JSONArena
+
++ (JSONArena *)currentArena
+{
+  JSONArena *arena;
+
+  pthread_once(&JSONArenaKeyOnce, JSONArenaCreateKey);
+  arena = (JSONArena *)pthread_getspecific(JSONArenaKey);
+  if (!arena)
+  {
+    // Owned by the thread, and released by the key's destructor
+    arena = [[JSONArena alloc] init];
+    pthread_setspecific(JSONArenaKey, arena);
+  }
+
+  return arena;
+}
+
+
++ (const yyjson_alc *)currentAllocator
+{
+  return [[JSONArena currentArena] allocator];
+}
+
+
+- (id)init
+{
+  self = [super init];
+
+  if (self)
+  {
+    memset(&_state, 0, sizeof(_state));
+    _state.block = malloc(JSON_ARENA_INITIAL_SIZE);
+    _state.capacity = _state.block ? JSON_ARENA_INITIAL_SIZE : 0;
+
+    _allocator.malloc = JSONArenaMalloc;
+    _allocator.realloc = JSONArenaRealloc;
+    _allocator.free = JSONArenaFree;
+    _allocator.ctx = &_state;
+  }
+
+  return self;
+}
+
+
+- (void)dealloc
+{
+  JSONArenaEmpty(&_state);
+  free(_state.block);
+
+  [super dealloc];
+}
+
+
+- (const yyjson_alc *)allocator
+{
+  return &_allocator;
+}
+
+
+- (void)reset
+{
+  if (_state.live > 0)
+  {
+    NSLog(@"JSONArena: reset with %lu allocations still in use", _state.live);
+  }
+  JSONArenaEmpty(&_state);
+}
+
+
+- (size_t)highWaterMark
+{
+  return _state.highWaterMark;
+}
+
+
+- (size_t)capacity
+{
+  return _state.capacity;
+}
+
+@end
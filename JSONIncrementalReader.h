@@ -0,0 +1,78 @@
+////////////////////////////////////////////////////////////////////////////////
+// JSONIncrementalReader.h
+// ClaudeChat
+//
+// Parses a response body with yyjson while it is still arriving, so the
+// document is ready when the connection finishes.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import <Foundation/Foundation.h>
+#import "HTTPSClient.h"
+#include "yyjson.h"
+
+
+/** Bodies shorter than this are left to be parsed whole; too little to overlap. */
+#define JSON_INCREMENTAL_MIN_LENGTH (32 * 1024)
+
+/** New bytes gathered before parsing resumes; yyjson prefers kilobytes at a time. */
+#define JSON_INCREMENTAL_STEP (16 * 1024)
+
+
+////////////////////////////////////////////////////////////////////////////////
+/**
+ * @class JSONIncrementalReader
+ * @brief An HTTPSClient body delegate that parses as the body fills
+ *
+ * Set as an HTTPSClient's body delegate for a non-streamed request. When
+ * the client says a body of known size is on the way, the reader starts a
+ * yyjson_incr_read over its buffer, in place (YYJSON_READ_INSITU). Each
+ * time another JSON_INCREMENTAL_STEP bytes arrive, it parses as far as
+ * they go. This happens on the reading thread, between reads, so parsing
+ * keeps pace with the body instead of starting after the last byte. Once
+ * the last byte is in, at most the last step is left to parse.
+ *
+ * Bodies of unknown size, compressed bodies and small bodies are not
+ * parsed. HTTPSClient does not report them, or the reader ignores them,
+ * and -takeDocumentForData:error: says so, so the caller parses them
+ * whole as before.
+ *
+ * The reader parses the body in place, so the document's strings point
+ * into the NSData the client returns. Keep the data until the document is
+ * freed. Memory comes from the reading thread's JSONArena. A reader serves
+ * one request at a time, and starts over when the client begins another
+ * body, as it does on a retry.
+ */
+@interface JSONIncrementalReader : NSObject <HTTPSClientBodyDelegate>
+{
+  yyjson_incr_state *_state;
+  yyjson_doc *_document;
+  yyjson_read_err _error;
+  char *_buffer;
+  unsigned long _length;
+  unsigned long _parsedLength;
+}
+
+
+/**
+ * Hands over the document parsed from a body, if the body was parsed as
+ * it arrived.
+ *
+ * @param data Body returned by the client the reader was attached to
+ * @param err Set to the parse error if the body was read and is not valid
+ *        JSON, or to YYJSON_READ_SUCCESS otherwise
+ * @return The document, which the caller frees with yyjson_doc_free, or
+ *         NULL if the body was not parsed as it arrived (check err) and
+ *         has to be parsed whole
+ */
+- (yyjson_doc *)takeDocumentForData:(NSData *)data error:(yyjson_read_err *)err;
+
+
+/**
+ * Drops whatever the reader holds, parsed or half parsed.
+ */
+- (void)reset;
+
+@end
@@ -0,0 +1,115 @@
+////////////////////////////////////////////////////////////////////////////////
+// JSONIncrementalReader.m
+// ClaudeChat
+//
+// yyjson_incr_read driven by HTTPSClient's body delegate calls.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import "JSONIncrementalReader.h"
+#import "JSONArena.h"
+#include <string.h>
+
+
+@implementation JSONIncrementalReader
+
+- (void)dealloc
+{
+  [self reset];
+
+  [super dealloc];
+}
+
+
+- (void)reset
+{
+  if (_state)
+  {
+    yyjson_incr_free(_state);
+    _state = NULL;
+  }
+  if (_document)
+  {
+    yyjson_doc_free(_document);
+    _document = NULL;
+  }
+  memset(&_error, 0, sizeof(_error));
+  _buffer = NULL;
+  _length = 0;
+  _parsedLength = 0;
+}
+
+
+- (yyjson_doc *)takeDocumentForData:(NSData *)data error:(yyjson_read_err *)err
+{
+  yyjson_doc *document = NULL;
+  BOOL ours = (_buffer && (const char *)[data bytes] == _buffer && [data length] == _length);
+
+  memset(err, 0, sizeof(*err));
+  if (ours && _document)
+  {
+    document = _document;
+    _document = NULL;
+  }
+  else if (ours && _error.code != YYJSON_READ_SUCCESS)
+  {
+    // The body has been partly rewritten in place; parsing it again from
+    // the start could not do better
+    *err = _error;
+  }
+  [self reset];
+
+  return document;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - HTTPSClientBodyDelegate
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (void)httpsClient:(HTTPSClient *)client willReceiveBody:(char *)buffer length:(unsigned long)length
+{
+  [self reset];
+
+  if (length < JSON_INCREMENTAL_MIN_LENGTH)
+  {
+    return;
+  }
+
+  // The buffer holds exactly the body, so yyjson knows where it must end
+  _state = yyjson_incr_new(buffer, length, YYJSON_READ_INSITU, [JSONArena currentAllocator]);
+  if (_state)
+  {
+    _buffer = buffer;
+    _length = length;
+  }
+}
+
+
+- (void)httpsClient:(HTTPSClient *)client didReceiveBodyLength:(unsigned long)length
+{
+  yyjson_read_err err;
+
+  if (!_state || (length < _length && length - _parsedLength < JSON_INCREMENTAL_STEP))
+  {
+    return;
+  }
+
+  _parsedLength = length;
+  _document = yyjson_incr_read(_state, length, &err);
+  if (_document || err.code != YYJSON_READ_ERROR_MORE)
+  {
+    // Finished one way or the other; the state has nothing more to give
+    yyjson_incr_free(_state);
+    _state = NULL;
+    if (!_document)
+    {
+      _error = err;
+    }
+  }
+}
+
+@end
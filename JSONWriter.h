@@ -0,0 +1,165 @@
+////////////////////////////////////////////////////////////////////////////////
+// JSONWriter.h
+// ClaudeChat
+//
+// Serialises Foundation property lists (dictionaries, arrays, strings,
+// numbers) to JSON with yyjson, into a buffer reused from one request to
+// the next.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import <Foundation/Foundation.h>
+#include "yyjson.h"
+
+
+/** Output buffer size a new writer starts with; it grows as needed. */
+#define JSON_WRITER_INITIAL_CAPACITY 4096
+
+
+/**
+ * Memory the writer hands to yyjson as its output allocation. Kept as a
+ * plain struct so the allocator callbacks can reach it.
+ */
+typedef struct
+{
+  char *bytes;
+  size_t capacity;
+} JSONWriterBuffer;
+
+
+////////////////////////////////////////////////////////////////////////////////
+/**
+ * @class JSONWriter
+ * @brief Property lists to JSON through a yyjson mutable document
+ *
+ * Each object is mirrored into a yyjson_mut_doc and written in one pass,
+ * with yyjson's escaping, so backslashes, control characters and
+ * non-ASCII text always come out as valid JSON. Strings are referenced,
+ * not copied, while the document is built.
+ *
+ * The output goes into a buffer owned by the writer. It grows to fit the
+ * largest body written and is then reused, so a conversation sent again
+ * and again costs no new allocation for its serialised form. The bytes
+ * are valid until the next write or until the writer is released.
+ *
+ * NSNumbers holding BOOLs become true or false, other NSNumbers integers
+ * or reals by their type, and NSNull null. Dictionary keys must be
+ * strings. Any other object is written as null.
+ *
+ * A writer is not thread-safe; give each thread that writes its own, or
+ * use the class methods, which copy their result.
+ */
+@interface JSONWriter : NSObject
+{
+  JSONWriterBuffer _output;
+  size_t _length;
+}
+
+
+/**
+ * Serialises an object into a new NSData.
+ *
+ * @param object Dictionary, array, string, number or NSNull
+ * @return UTF-8 JSON, or nil if it could not be written
+ */
++ (NSData *)dataWithJSONObject:(id)object;
+
+
+/**
+ * Serialises an object into a new NSString.
+ *
+ * @param object Dictionary, array, string, number or NSNull
+ * @return JSON text, or nil if it could not be written
+ */
++ (NSString *)stringWithJSONObject:(id)object;
+
+
+/**
+ * Mirrors an object into a yyjson mutable document, for callers that
+ * want to add to the tree before writing it. String values point at the
+ * objects' UTF-8 representations, so write the document before the
+ * current autorelease pool is released.
+ *
+ * @param object Dictionary, array, string, number or NSNull
+ * @param doc Document to allocate the values from
+ * @return The value, or NULL if out of memory
+ */
++ (yyjson_mut_val *)valueForObject:(id)object inDocument:(yyjson_mut_doc *)doc;
+
+
+/**
+ * Whether a number holds a boolean, as made by numberWithBool:. The
+ * objCType cannot tell: BOOL numbers report "c" like any char, while
+ * @encode(BOOL) is "B" on arm64. Apple's boolean numbers are two shared
+ * instances of a class of their own, and GNUstep's have a class of their
+ * own, so the test is by identity and class.
+ *
+ * @param number Any number
+ * @return YES for a boolean
+ */
++ (BOOL)isBooleanNumber:(NSNumber *)number;
+
+
+/**
+ * Creates a writer with an empty output buffer.
+ *
+ * @return Initialised writer
+ */
+- (id)init;
+
+
+/**
+ * Serialises an object, replacing what the writer held before.
+ *
+ * @param object Dictionary, array, string, number or NSNull
+ * @return YES on success; on failure the writer holds nothing
+ */
+- (BOOL)writeObject:(id)object;
+
+
+/**
+ * Writes an already built document, replacing what the writer held.
+ *
+ * @param doc Document with a root value
+ * @return YES on success; on failure the writer holds nothing
+ */
+- (BOOL)writeDocument:(yyjson_mut_doc *)doc;
+
+
+/**
+ * The JSON last written, NUL-terminated.
+ *
+ * @return Pointer into the writer's buffer, or NULL if nothing was written
+ */
+- (const char *)bytes;
+
+
+/**
+ * Length of the JSON last written, excluding the terminator.
+ *
+ * @return Length in bytes
+ */
+- (size_t)length;
+
+
+/**
+ * The JSON last written, without copying it. The data is only valid
+ * until the next write or until the writer is released; copy it to keep
+ * it longer.
+ *
+ * @return Data wrapping the writer's buffer
+ */
+- (NSData *)data;
+
+
+/**
+ * Size of the output buffer, which is the most memory kept between
+ * writes.
+ *
+ * @return Capacity in bytes
+ */
+- (size_t)capacity;
+
+@end
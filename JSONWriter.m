@@ -0,0 +1,348 @@
+////////////////////////////////////////////////////////////////////////////////
+// JSONWriter.m
+// ClaudeChat
+//
+// yyjson-backed JSON serialisation into a reusable buffer.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import "JSONWriter.h"
+#import "JSONArena.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Output Allocator
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+// yyjson asks for one block for its output, grows it as it writes and
+// frees it on failure. Handing it the writer's buffer every time means the
+// output is written in place and the memory outlives the call.
+
+static void *JSONWriterMalloc(void *ctx, size_t size)
+{
+  JSONWriterBuffer *output = (JSONWriterBuffer *)ctx;
+  char *bytes;
+
+  if (size > output->capacity)
+  {
+    // Nothing in the old buffer is needed, so there is nothing to copy
+    bytes = malloc(size);
+    if (!bytes)
+    {
+      return NULL;
+    }
+    free(output->bytes);
+    output->bytes = bytes;
+    output->capacity = size;
+  }
+
+  return output->bytes;
+}
+
+
+static void *JSONWriterRealloc(void *ctx, void *ptr, size_t oldSize, size_t size)
+{
+  JSONWriterBuffer *output = (JSONWriterBuffer *)ctx;
+  char *bytes;
+
+  if (size > output->capacity)
+  {
+    bytes = realloc(output->bytes, size);
+    if (!bytes)
+    {
+      return NULL;
+    }
+    output->bytes = bytes;
+    output->capacity = size;
+  }
+
+  return output->bytes;
+}
+
+
+static void JSONWriterFree(void *ctx, void *ptr)
+{
+  // The buffer belongs to the writer and is kept for the next write
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Values
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+/** A string value referencing the string's UTF-8 form, which is not copied. */
+static yyjson_mut_val *JSONWriterString(yyjson_mut_doc *doc, NSString *string)
+{
+  const char *utf8 = [string UTF8String];
+
+  if (!utf8)
+  {
+    // Unpaired surrogates have no UTF-8 form; keep what can be converted
+    NSData *lossy = [string dataUsingEncoding:NSUTF8StringEncoding allowLossyConversion:YES];
+
+    return yyjson_mut_strncpy(doc, (const char *)[lossy bytes], [lossy length]);
+  }
+
+  return yyjson_mut_strn(doc, utf8, strlen(utf8));
+}
+
+
+static yyjson_mut_val *JSONWriterNumber(yyjson_mut_doc *doc, NSNumber *number)
+{
+  const char *type = [number objCType];
+
+  if ([JSONWriter isBooleanNumber:number])
+  {
+    return yyjson_mut_bool(doc, [number boolValue]);
+  }
+
+  switch (type[0])
+  {
+    case 'f':
+      return yyjson_mut_float(doc, [number floatValue]);
+
+    case 'd':
+      return yyjson_mut_real(doc, [number doubleValue]);
+
+    case 'C':
+    case 'S':
+    case 'I':
+    case 'L':
+    case 'Q':
+      return yyjson_mut_uint(doc, [number unsignedLongLongValue]);
+
+    default:
+      return yyjson_mut_sint(doc, [number longLongValue]);
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Implementation
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+// The numbers numberWithBool: returns, and their class if it is theirs alone
+static NSNumber *JSONWriterTrue = nil;
+static NSNumber *JSONWriterFalse = nil;
+static Class JSONWriterBooleanClass = Nil;
+
+
+@implementation JSONWriter
+
++ (void)initialize
+{
+  if (self == [JSONWriter class])
+  {
+    JSONWriterTrue = [[NSNumber numberWithBool:YES] retain];
+    JSONWriterFalse = [[NSNumber numberWithBool:NO] retain];
+    JSONWriterBooleanClass = [JSONWriterFalse class];
+    if (JSONWriterBooleanClass == [[NSNumber numberWithChar:0] class])
+    {
+      // Booleans share their class with other numbers; rely on identity
+      JSONWriterBooleanClass = Nil;
+    }
+  }
+}
+
+
++ (BOOL)isBooleanNumber:(NSNumber *)number
+{
+  return (number == JSONWriterTrue || number == JSONWriterFalse ||
+          (JSONWriterBooleanClass && [number isKindOfClass:JSONWriterBooleanClass]));
+}
+
+
++ (NSData *)dataWithJSONObject:(id)object
+{
+  JSONWriter *writer = [[JSONWriter alloc] init];
+  NSData *data = nil;
+
+  if ([writer writeObject:object])
+  {
+    data = [NSData dataWithBytes:[writer bytes] length:[writer length]];
+  }
+  [writer release];
+
+  return data;
+}
+
+
++ (NSString *)stringWithJSONObject:(id)object
+{
+  JSONWriter *writer = [[JSONWriter alloc] init];
+  NSString *string = nil;
+
+  if ([writer writeObject:object])
+  {
+    string = [[[NSString alloc] initWithBytes:[writer bytes]
+                                       length:[writer length]
+                                     encoding:NSUTF8StringEncoding] autorelease];
+  }
+  [writer release];
+
+  return string;
+}
+
+
++ (yyjson_mut_val *)valueForObject:(id)object inDocument:(yyjson_mut_doc *)doc
+{
+  yyjson_mut_val *value;
+
+  if ([object isKindOfClass:[NSString class]])
+  {
+    return JSONWriterString(doc, object);
+  }
+
+  if ([object isKindOfClass:[NSNumber class]])
+  {
+    return JSONWriterNumber(doc, object);
+  }
+
+  if ([object isKindOfClass:[NSDictionary class]])
+  {
+    NSEnumerator *keyEnum = [object keyEnumerator];
+    NSString *key;
+
+    value = yyjson_mut_obj(doc);
+    while (value && (key = [keyEnum nextObject]))
+    {
+      yyjson_mut_val *member = [self valueForObject:[object objectForKey:key] inDocument:doc];
+
+      if (!member || !yyjson_mut_obj_add(value, JSONWriterString(doc, [key description]), member))
+      {
+        return NULL;
+      }
+    }
+    return value;
+  }
+
+  if ([object isKindOfClass:[NSArray class]])
+  {
+    NSEnumerator *elementEnum = [object objectEnumerator];
+    id element;
+
+    value = yyjson_mut_arr(doc);
+    while (value && (element = [elementEnum nextObject]))
+    {
+      if (!yyjson_mut_arr_append(value, [self valueForObject:element inDocument:doc]))
+      {
+        return NULL;
+      }
+    }
+    return value;
+  }
+
+  return yyjson_mut_null(doc);
+}
+
+
+- (id)init
+{
+  self = [super init];
+
+  if (self)
+  {
+    _output.bytes = malloc(JSON_WRITER_INITIAL_CAPACITY);
+    _output.capacity = _output.bytes ? JSON_WRITER_INITIAL_CAPACITY : 0;
+    _length = 0;
+  }
+
+  return self;
+}
+
+
+- (void)dealloc
+{
+  free(_output.bytes);
+
+  [super dealloc];
+}
+
+
+- (BOOL)writeObject:(id)object
+{
+  yyjson_mut_doc *doc = yyjson_mut_doc_new([JSONArena currentAllocator]);
+  yyjson_mut_val *root;
+  BOOL written = NO;
+
+  if (!doc)
+  {
+    _length = 0;
+    return NO;
+  }
+
+  root = [JSONWriter valueForObject:object inDocument:doc];
+  if (root)
+  {
+    yyjson_mut_doc_set_root(doc, root);
+    written = [self writeDocument:doc];
+  }
+  else
+  {
+    _length = 0;
+  }
+  yyjson_mut_doc_free(doc);
+
+  return written;
+}
+
+
+- (BOOL)writeDocument:(yyjson_mut_doc *)doc
+{
+  yyjson_alc alc;
+  yyjson_write_err err;
+  size_t length = 0;
+
+  alc.malloc = JSONWriterMalloc;
+  alc.realloc = JSONWriterRealloc;
+  alc.free = JSONWriterFree;
+  alc.ctx = &_output;
+
+  if (!yyjson_mut_write_opts(doc, YYJSON_WRITE_NOFLAG, &alc, &length, &err))
+  {
+    NSLog(@"JSONWriter: %s", err.msg ? err.msg : "write failed");
+    _length = 0;
+    return NO;
+  }
+  _length = length;
+
+  return YES;
+}
+
+
+- (const char *)bytes
+{
+  return _length > 0 ? _output.bytes : NULL;
+}
+
+
+- (size_t)length
+{
+  return _length;
+}
+
+
+- (NSData *)data
+{
+  if (_length == 0)
+  {
+    return [NSData data];
+  }
+
+  return [NSData dataWithBytesNoCopy:_output.bytes length:_length freeWhenDone:NO];
+}
+
+
+- (size_t)capacity
+{
+  return _output.capacity;
+}
+
+@end
@@ -0,0 +1,64 @@
+////////////////////////////////////////////////////////////////////////////////
+// ModelComparisonWindowController.h
+// ClaudeChat
+//
+// A window with one pane per model, each streaming that model's reply to
+// the same message, with its time to first token, output speed and total
+// latency underneath.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import <Cocoa/Cocoa.h>
+#import "ModelFanOut.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+/**
+ * @class ModelComparisonWindowController
+ * @brief Side-by-side replies from several models
+ *
+ * Panes are laid out in a grid, up to three across, in the order the
+ * models were given. Replies stream in as plain text. Nothing shown here
+ * becomes part of the chat; send the message normally to keep a reply.
+ * Closing the window cancels any replies still arriving.
+ */
+@interface ModelComparisonWindowController : NSWindowController <ModelFanOutDelegate>
+{
+  ModelFanOut *_fanOut;
+  NSArray *_models;
+  NSMutableArray *_titleFields;
+  NSMutableArray *_scrollViews;
+  NSMutableArray *_textViews;
+  NSMutableArray *_statsFields;
+}
+
+
+/**
+ * Creates the window, with a pane for each model.
+ *
+ * @param models Model dictionaries as in AppDelegate's model map (id,
+ *               name, max-tokens, context-window)
+ * @return Initialised controller; the window is not yet shown
+ */
+- (id)initWithModels:(NSArray *)models;
+
+
+/**
+ * Shows the window and sends the message to every model, replacing
+ * whatever the panes showed before.
+ *
+ * @param message The new user turn
+ * @param history Earlier turns of the conversation, oldest first
+ * @param apiKey API key
+ */
+- (void)compareMessage:(NSString *)message history:(NSArray *)history apiKey:(NSString *)apiKey;
+
+
+/**
+ * Re-applies the app's theme and fonts to the panes.
+ */
+- (void)updateTheme;
+
+@end
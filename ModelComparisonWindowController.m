@@ -0,0 +1,393 @@
+////////////////////////////////////////////////////////////////////////////////
+// ModelComparisonWindowController.m
+// ClaudeChat
+//
+// Grid of streaming reply panes driven by a ModelFanOut.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import "ModelComparisonWindowController.h"
+#import "AppDelegate.h"
+#import "ThemeColors.h"
+
+
+// Most panes side by side before starting another row
+#define COMPARISON_MAX_COLUMNS 3
+
+// Pane spacing and the heights of the label above and below each reply
+#define COMPARISON_MARGIN 12.0
+#define COMPARISON_TITLE_HEIGHT 18.0
+#define COMPARISON_STATS_HEIGHT 16.0
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Private Interface
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+@interface ModelComparisonWindowController (Private)
+
+- (NSTextField *)labelWithFont:(NSFont *)font;
+- (void)createPanes;
+- (void)layoutPanes;
+- (int)paneForModel:(NSString *)model;
+- (NSDictionary *)replyAttributes;
+- (void)setStats:(NSString *)stats forPane:(int)pane failed:(BOOL)failed;
+
+@end
+
+
+@implementation ModelComparisonWindowController
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Lifecycle
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (id)initWithModels:(NSArray *)models
+{
+  NSWindow *window = [[[NSWindow alloc] initWithContentRect:NSMakeRect(140, 120, 960, 620)
+                                                  styleMask:NSTitledWindowMask | NSClosableWindowMask |
+                                                            NSMiniaturizableWindowMask | NSResizableWindowMask
+                                                    backing:NSBackingStoreBuffered
+                                                      defer:NO] autorelease];
+
+  self = [super initWithWindow:window];
+
+  if (self)
+  {
+    _models = [models copy];
+    _titleFields = [[NSMutableArray alloc] init];
+    _scrollViews = [[NSMutableArray alloc] init];
+    _textViews = [[NSMutableArray alloc] init];
+    _statsFields = [[NSMutableArray alloc] init];
+    _fanOut = [[ModelFanOut alloc] initWithModels:_models];
+    [_fanOut setDelegate:self];
+
+    [window setTitle:@"Model Comparison"];
+    [window setMinSize:NSMakeSize(480, 320)];
+    [window setReleasedWhenClosed:NO];
+    [window setDelegate:self];
+
+    [self createPanes];
+    [self updateTheme];
+  }
+
+  return self;
+}
+
+
+- (void)dealloc
+{
+  [_fanOut setDelegate:nil];
+  [_fanOut cancel];
+  [_fanOut release];
+  [_models release];
+  [_titleFields release];
+  [_scrollViews release];
+  [_textViews release];
+  [_statsFields release];
+
+  [super dealloc];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Comparing
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (void)compareMessage:(NSString *)message history:(NSArray *)history apiKey:(NSString *)apiKey
+{
+  NSString *excerpt = [[message componentsSeparatedByString:@"\n"] objectAtIndex:0];
+  unsigned int pane;
+
+  if ([excerpt length] > 60)
+  {
+    excerpt = [[excerpt substringToIndex:60] stringByAppendingString:@"..."];
+  }
+  [[self window] setTitle:[NSString stringWithFormat:@"Comparing: %@", excerpt]];
+
+  for (pane = 0; pane < [_textViews count]; pane++)
+  {
+    [[_textViews objectAtIndex:pane] setString:@""];
+    [self setStats:@"Waiting for first token..." forPane:pane failed:NO];
+  }
+
+  [self showWindow:self];
+  [_fanOut sendMessage:message history:history withAPIKey:apiKey];
+}
+
+
+- (void)windowWillClose:(NSNotification *)notification
+{
+  [_fanOut cancel];
+}
+
+
+- (void)windowDidResize:(NSNotification *)notification
+{
+  [self layoutPanes];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Appearance
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (void)updateTheme
+{
+  AppDelegate *appDelegate = (AppDelegate *)[[NSApplication sharedApplication] delegate];
+  BOOL isDark = [appDelegate isDarkMode];
+  NSDictionary *attributes = [self replyAttributes];
+  unsigned int pane;
+
+  [[self window] setBackgroundColor:[ThemeColors windowBackgroundColorForDarkMode:isDark]];
+  for (pane = 0; pane < [_textViews count]; pane++)
+  {
+    NSTextView *textView = [_textViews objectAtIndex:pane];
+    NSTextStorage *storage = [textView textStorage];
+
+    [textView setBackgroundColor:[ThemeColors textBackgroundColorForDarkMode:isDark]];
+    [textView setTypingAttributes:attributes];
+    [storage setAttributes:attributes range:NSMakeRange(0, [storage length])];
+    [[_titleFields objectAtIndex:pane] setTextColor:[ThemeColors systemPurpleForDarkMode:isDark]];
+    [[_statsFields objectAtIndex:pane] setTextColor:[ThemeColors secondaryLabelColorForDarkMode:isDark]];
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - ModelFanOutDelegate
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (void)fanOut:(ModelFanOut *)fanOut model:(NSString *)model didReceiveDelta:(NSString *)delta
+{
+  int pane = [self paneForModel:model];
+  NSTextView *textView;
+
+  if (pane < 0)
+  {
+    return;
+  }
+  textView = [_textViews objectAtIndex:pane];
+  [[textView textStorage] appendAttributedString:
+    [[[NSAttributedString alloc] initWithString:delta attributes:[self replyAttributes]] autorelease]];
+  [textView scrollRangeToVisible:NSMakeRange([[textView string] length], 0)];
+  if ([[[_statsFields objectAtIndex:pane] stringValue] hasPrefix:@"Waiting"])
+  {
+    [self setStats:@"Generating..." forPane:pane failed:NO];
+  }
+}
+
+
+- (void)fanOut:(ModelFanOut *)fanOut model:(NSString *)model didReceiveTimings:(NSDictionary *)timings
+{
+  int pane = [self paneForModel:model];
+
+  if (pane < 0)
+  {
+    return;
+  }
+  [self setStats:[NSString stringWithFormat:@"First token %.2f s, %.1f tokens/s, %.2f s total",
+                  [[timings objectForKey:@"time_to_first_token"] doubleValue],
+                  [[timings objectForKey:@"tokens_per_second"] doubleValue],
+                  [[timings objectForKey:@"latency"] doubleValue]]
+         forPane:pane
+          failed:NO];
+}
+
+
+- (void)fanOut:(ModelFanOut *)fanOut model:(NSString *)model didReceiveResponse:(NSString *)response
+{
+  int pane = [self paneForModel:model];
+  NSTextStorage *storage;
+
+  if (pane < 0)
+  {
+    return;
+  }
+
+  // The whole reply, in case any delta was coalesced away
+  storage = [[_textViews objectAtIndex:pane] textStorage];
+  [storage replaceCharactersInRange:NSMakeRange(0, [storage length])
+               withAttributedString:[[[NSAttributedString alloc] initWithString:response
+                                                                     attributes:[self replyAttributes]] autorelease]];
+}
+
+
+- (void)fanOut:(ModelFanOut *)fanOut model:(NSString *)model didFailWithError:(NSError *)error
+{
+  int pane = [self paneForModel:model];
+
+  if (pane >= 0)
+  {
+    [self setStats:[NSString stringWithFormat:@"Failed: %@", [error localizedDescription]]
+           forPane:pane
+            failed:YES];
+  }
+}
+
+
+- (void)fanOutDidFinish:(ModelFanOut *)fanOut
+{
+  [[self window] setTitle:@"Model Comparison"];
+}
+
+@end
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Private Implementation
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+@implementation ModelComparisonWindowController (Private)
+
+- (NSTextField *)labelWithFont:(NSFont *)font
+{
+  NSTextField *label = [[[NSTextField alloc] initWithFrame:NSZeroRect] autorelease];
+
+  [label setEditable:NO];
+  [label setSelectable:NO];
+  [label setBezeled:NO];
+  [label setDrawsBackground:NO];
+  [label setFont:font];
+  [[label cell] setLineBreakMode:NSLineBreakByTruncatingTail];
+
+  return label;
+}
+
+
+- (void)createPanes
+{
+  NSView *contentView = [[self window] contentView];
+  NSEnumerator *modelEnum = [_models objectEnumerator];
+  NSDictionary *model;
+
+  while ((model = [modelEnum nextObject]))
+  {
+    NSTextField *title = [self labelWithFont:[NSFont boldSystemFontOfSize:[NSFont systemFontSize]]];
+    NSTextField *stats = [self labelWithFont:[NSFont systemFontOfSize:[NSFont smallSystemFontSize]]];
+    NSScrollView *scrollView = [[[NSScrollView alloc] initWithFrame:NSMakeRect(0, 0, 300, 200)] autorelease];
+    NSTextView *textView;
+    NSSize contentSize;
+
+    [title setStringValue:[model objectForKey:@"name"] ? [model objectForKey:@"name"] : [model objectForKey:@"id"]];
+
+    [scrollView setHasVerticalScroller:YES];
+    [scrollView setBorderType:NSBezelBorder];
+    contentSize = [scrollView contentSize];
+    textView = [[[NSTextView alloc] initWithFrame:NSMakeRect(0, 0, contentSize.width, contentSize.height)] autorelease];
+    [textView setEditable:NO];
+    [textView setSelectable:YES];
+    [textView setRichText:NO];
+    [textView setVerticallyResizable:YES];
+    [textView setHorizontallyResizable:NO];
+    [textView setAutoresizingMask:NSViewWidthSizable];
+    [textView setMaxSize:NSMakeSize(1e7, 1e7)];
+    [textView setTextContainerInset:NSMakeSize(4.0, 4.0)];
+    [[textView textContainer] setWidthTracksTextView:YES];
+    [scrollView setDocumentView:textView];
+
+    [contentView addSubview:title];
+    [contentView addSubview:scrollView];
+    [contentView addSubview:stats];
+    [_titleFields addObject:title];
+    [_scrollViews addObject:scrollView];
+    [_textViews addObject:textView];
+    [_statsFields addObject:stats];
+  }
+
+  [self layoutPanes];
+}
+
+
+/** Divides the window into equal cells, filling rows left to right. */
+- (void)layoutPanes
+{
+  NSRect bounds = [[[self window] contentView] bounds];
+  unsigned int count = [_scrollViews count];
+  unsigned int columns = count < COMPARISON_MAX_COLUMNS ? count : COMPARISON_MAX_COLUMNS;
+  unsigned int rows;
+  float cellWidth;
+  float cellHeight;
+  unsigned int pane;
+
+  if (count == 0)
+  {
+    return;
+  }
+  rows = (count + columns - 1) / columns;
+  cellWidth = (bounds.size.width - COMPARISON_MARGIN) / columns;
+  cellHeight = (bounds.size.height - COMPARISON_MARGIN) / rows;
+
+  for (pane = 0; pane < count; pane++)
+  {
+    float x = COMPARISON_MARGIN + (pane % columns) * cellWidth;
+    float top = bounds.size.height - COMPARISON_MARGIN - (pane / columns) * cellHeight;
+    float width = cellWidth - COMPARISON_MARGIN;
+    float replyHeight = cellHeight - COMPARISON_MARGIN - COMPARISON_TITLE_HEIGHT - COMPARISON_STATS_HEIGHT - 4.0;
+
+    [[_titleFields objectAtIndex:pane] setFrame:NSMakeRect(x, top - COMPARISON_TITLE_HEIGHT,
+                                                           width, COMPARISON_TITLE_HEIGHT)];
+    [[_scrollViews objectAtIndex:pane] setFrame:NSMakeRect(x, top - COMPARISON_TITLE_HEIGHT - 2.0 - replyHeight,
+                                                           width, replyHeight)];
+    [[_statsFields objectAtIndex:pane] setFrame:NSMakeRect(x, top - cellHeight + COMPARISON_MARGIN,
+                                                           width, COMPARISON_STATS_HEIGHT)];
+  }
+  [[[self window] contentView] setNeedsDisplay:YES];
+}
+
+
+- (int)paneForModel:(NSString *)model
+{
+  unsigned int pane;
+
+  for (pane = 0; pane < [_models count]; pane++)
+  {
+    if ([[[_models objectAtIndex:pane] objectForKey:@"id"] isEqualToString:model])
+    {
+      return (int)pane;
+    }
+  }
+
+  return -1;
+}
+
+
+/** Plain reply text in the chat window's proportional font and colours. */
+- (NSDictionary *)replyAttributes
+{
+  AppDelegate *appDelegate = (AppDelegate *)[[NSApplication sharedApplication] delegate];
+  NSFont *font = [NSFont fontWithName:[appDelegate proportionalFontName]
+                                 size:[appDelegate proportionalFontSize]];
+
+  if (!font)
+  {
+    font = [NSFont systemFontOfSize:[appDelegate proportionalFontSize]];
+  }
+
+  return [NSDictionary dictionaryWithObjectsAndKeys:
+          font, NSFontAttributeName,
+          [ThemeColors labelColorForDarkMode:[appDelegate isDarkMode]], NSForegroundColorAttributeName,
+          nil];
+}
+
+
+- (void)setStats:(NSString *)stats forPane:(int)pane failed:(BOOL)failed
+{
+  AppDelegate *appDelegate = (AppDelegate *)[[NSApplication sharedApplication] delegate];
+  NSTextField *field = [_statsFields objectAtIndex:pane];
+
+  [field setStringValue:stats];
+  [field setToolTip:stats];
+  [field setTextColor:failed ? [ThemeColors systemRedForDarkMode:[appDelegate isDarkMode]]
+                             : [ThemeColors secondaryLabelColorForDarkMode:[appDelegate isDarkMode]]];
+}
+
+@end
@@ -0,0 +1,155 @@
+////////////////////////////////////////////////////////////////////////////////
+// ModelFanOut.h
+// ClaudeChat
+//
+// Sends one conversation to several models at once, each over its own
+// connection, so their replies and speed can be compared side by side.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import <Foundation/Foundation.h>
+#import "ClaudeAPIManager.h"
+
+@class ModelFanOut;
+@class WorkerPool;
+
+
+/**
+ * Messages sent to a ModelFanOut's delegate, on the main thread. Each
+ * model's messages arrive in the same order as ClaudeAPIManagerDelegate's:
+ * deltas, then timings, then the response or an error.
+ */
+@protocol ModelFanOutDelegate
+
+/**
+ * Streamed text from one model, as it is generated.
+ *
+ * @param fanOut The sender
+ * @param model Model ID the text came from
+ * @param delta Text since the last delta
+ */
+- (void)fanOut:(ModelFanOut *)fanOut model:(NSString *)model didReceiveDelta:(NSString *)delta;
+
+
+/**
+ * Speed of one model's completed reply, as passed to the manager's
+ * apiManager:didReceiveTimings: (time_to_first_token, tokens_per_second
+ * and latency).
+ *
+ * @param fanOut The sender
+ * @param model Model ID
+ * @param timings Timings dictionary
+ */
+- (void)fanOut:(ModelFanOut *)fanOut model:(NSString *)model didReceiveTimings:(NSDictionary *)timings;
+
+
+/**
+ * One model's complete reply.
+ *
+ * @param fanOut The sender
+ * @param model Model ID
+ * @param response Full reply text
+ */
+- (void)fanOut:(ModelFanOut *)fanOut model:(NSString *)model didReceiveResponse:(NSString *)response;
+
+
+/**
+ * One model's request failed.
+ *
+ * @param fanOut The sender
+ * @param model Model ID
+ * @param error What went wrong
+ */
+- (void)fanOut:(ModelFanOut *)fanOut model:(NSString *)model didFailWithError:(NSError *)error;
+
+
+/**
+ * Every model has answered, failed or been cancelled.
+ *
+ * @param fanOut The sender
+ */
+- (void)fanOutDidFinish:(ModelFanOut *)fanOut;
+
+@end
+
+
+////////////////////////////////////////////////////////////////////////////////
+/**
+ * @class ModelFanOut
+ * @brief Runs the same message against several models in parallel
+ *
+ * Each model gets a ClaudeAPIManager of its own, seeded with a copy of the
+ * conversation, and streams its reply. The managers run on a worker pool
+ * with a thread per model, so every request is in flight at once rather
+ * than queued behind the shared pool's limit, and each opens its own
+ * connection. Replies are not added to any conversation; the caller
+ * decides what, if anything, to keep.
+ *
+ * Use from the main thread. The pool's threads last for the life of the
+ * process, as with any WorkerPool, so keep one fan-out and send it again
+ * rather than creating one per comparison.
+ */
+@interface ModelFanOut : NSObject
+{
+  NSArray *_models;
+  NSMutableArray *_managers;
+  WorkerPool *_pool;
+  id _delegate;
+  unsigned int _pending;
+}
+
+
+/**
+ * Creates a fan-out over the given models.
+ *
+ * @param models Model dictionaries as in AppDelegate's model map: id,
+ *               max-tokens and context-window
+ * @return Initialised fan-out
+ */
+- (id)initWithModels:(NSArray *)models;
+
+
+/**
+ * Sets the delegate. Not retained.
+ *
+ * @param delegate Object implementing ModelFanOutDelegate
+ */
+- (void)setDelegate:(id)delegate;
+
+
+/**
+ * Model IDs in the order they were given.
+ *
+ * @return Array of NSString
+ */
+- (NSArray *)modelIdentifiers;
+
+
+/**
+ * Sends a message to every model, following the given conversation.
+ * Cancels anything still running from the previous send.
+ *
+ * @param message The new user turn
+ * @param history Earlier turns, as returned by -[ClaudeAPIManager history]
+ * @param apiKey API key for all requests
+ */
+- (void)sendMessage:(NSString *)message history:(NSArray *)history withAPIKey:(NSString *)apiKey;
+
+
+/**
+ * Stops every request still running. The delegate hears nothing more
+ * about them, not even fanOutDidFinish:.
+ */
+- (void)cancel;
+
+
+/**
+ * Whether any model has yet to finish.
+ *
+ * @return YES while requests are running
+ */
+- (BOOL)isRunning;
+
+@end
@@ -0,0 +1,229 @@
+////////////////////////////////////////////////////////////////////////////////
+// ModelFanOut.m
+// ClaudeChat
+//
+// One ClaudeAPIManager per model, all streaming at once.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import "ModelFanOut.h"
+#import "WorkerPool.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Private Interface
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+@interface ModelFanOut (Private)
+
+- (void)managerDidFinish:(ClaudeAPIManager *)manager;
+
+@end
+
+
+@implementation ModelFanOut
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Lifecycle
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (id)initWithModels:(NSArray *)models
+{
+  self = [super init];
+
+  if (self)
+  {
+    _models = [models copy];
+    _managers = [[NSMutableArray alloc] init];
+
+    // A thread per model, plus the one the pool keeps back from
+    // interactive work, so no model waits for another
+    _pool = [[WorkerPool alloc] initWithThreadLimit:[_models count] + 1
+                                         queueLimit:[_models count]];
+  }
+
+  return self;
+}
+
+
+- (void)dealloc
+{
+  [self cancel];
+  [_managers release];
+  [_models release];
+  [_pool release];
+
+  [super dealloc];
+}
+
+
+- (void)setDelegate:(id)delegate
+{
+  _delegate = delegate;
+}
+
+
+- (NSArray *)modelIdentifiers
+{
+  NSMutableArray *identifiers = [NSMutableArray arrayWithCapacity:[_models count]];
+  NSEnumerator *modelEnum = [_models objectEnumerator];
+  NSDictionary *model;
+
+  while ((model = [modelEnum nextObject]))
+  {
+    [identifiers addObject:[model objectForKey:@"id"]];
+  }
+
+  return identifiers;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Sending
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (void)sendMessage:(NSString *)message history:(NSArray *)history withAPIKey:(NSString *)apiKey
+{
+  NSEnumerator *modelEnum;
+  NSEnumerator *turnEnum;
+  NSEnumerator *managerEnum;
+  NSDictionary *model;
+  NSDictionary *turn;
+  ClaudeAPIManager *manager;
+
+  [self cancel];
+
+  modelEnum = [_models objectEnumerator];
+  while ((model = [modelEnum nextObject]))
+  {
+    manager = [[ClaudeAPIManager alloc] init];
+    [manager setDelegate:self];
+    [manager setStreamsResponses:YES];
+    [manager setWorkerPool:_pool];
+    [manager setModel:[model objectForKey:@"id"]];
+    [manager setMaxTokens:[[model objectForKey:@"max-tokens"] intValue]];
+    [manager setContextWindow:[[model objectForKey:@"context-window"] intValue]];
+
+    turnEnum = [history objectEnumerator];
+    while ((turn = [turnEnum nextObject]))
+    {
+      if ([[turn objectForKey:@"content"] isKindOfClass:[NSString class]])
+      {
+        [manager addToHistory:[turn objectForKey:@"content"]
+                       isUser:[[turn objectForKey:@"role"] isEqualToString:@"user"]];
+      }
+    }
+
+    [_managers addObject:manager];
+    [manager release];
+  }
+
+  // Start them together, once every manager is set up
+  _pending = [_managers count];
+  managerEnum = [_managers objectEnumerator];
+  while ((manager = [managerEnum nextObject]))
+  {
+    [manager sendMessage:message withAPIKey:apiKey];
+  }
+}
+
+
+- (void)cancel
+{
+  NSEnumerator *managerEnum = [_managers objectEnumerator];
+  ClaudeAPIManager *manager;
+
+  while ((manager = [managerEnum nextObject]))
+  {
+    [manager setDelegate:nil];
+    [manager cancelRequest];
+  }
+  [_managers removeAllObjects];
+  _pending = 0;
+}
+
+
+- (BOOL)isRunning
+{
+  return _pending > 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - ClaudeAPIManagerDelegate
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (void)apiManager:(ClaudeAPIManager *)manager didReceiveDelta:(NSString *)delta
+{
+  if (_delegate && [_delegate respondsToSelector:@selector(fanOut:model:didReceiveDelta:)])
+  {
+    [_delegate fanOut:self model:[manager model] didReceiveDelta:delta];
+  }
+}
+
+
+- (void)apiManager:(ClaudeAPIManager *)manager didReceiveTimings:(NSDictionary *)timings
+{
+  if (_delegate && [_delegate respondsToSelector:@selector(fanOut:model:didReceiveTimings:)])
+  {
+    [_delegate fanOut:self model:[manager model] didReceiveTimings:timings];
+  }
+}
+
+
+- (void)apiManager:(ClaudeAPIManager *)manager didReceiveResponse:(NSString *)response
+{
+  if (_delegate && [_delegate respondsToSelector:@selector(fanOut:model:didReceiveResponse:)])
+  {
+    [_delegate fanOut:self model:[manager model] didReceiveResponse:response];
+  }
+  [self managerDidFinish:manager];
+}
+
+
+- (void)apiManager:(ClaudeAPIManager *)manager didFailWithError:(NSError *)error
+{
+  if (_delegate && [_delegate respondsToSelector:@selector(fanOut:model:didFailWithError:)])
+  {
+    [_delegate fanOut:self model:[manager model] didFailWithError:error];
+  }
+  [self managerDidFinish:manager];
+}
+
+
+- (void)apiManagerDidCancelRequest:(ClaudeAPIManager *)manager
+{
+  [self managerDidFinish:manager];
+}
+
+@end
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Private Implementation
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+@implementation ModelFanOut (Private)
+
+- (void)managerDidFinish:(ClaudeAPIManager *)manager
+{
+  if (_pending == 0 || [_managers indexOfObjectIdenticalTo:manager] == NSNotFound)
+  {
+    return;
+  }
+
+  _pending--;
+  if (_pending == 0 && _delegate && [_delegate respondsToSelector:@selector(fanOutDidFinish:)])
+  {
+    [_delegate fanOutDidFinish:self];
+  }
+}
+
+@end
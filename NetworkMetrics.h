@@ -0,0 +1,148 @@
+////////////////////////////////////////////////////////////////////////////////
+// NetworkMetrics.h
+// ClaudeChat
+//
+// Rolling per-host latency histograms built from HTTPSClient request
+// metrics, for tuning connection pooling and timeouts.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import <Foundation/Foundation.h>
+#import "HTTPSClient.h"
+
+
+/**
+ * Number of histogram buckets. Bucket i holds durations up to
+ * 0.1 ms * 2^i, so the last one reaches about 14 minutes.
+ */
+#define NETWORK_METRICS_BUCKETS 24
+
+/**
+ * Length of one histogram window, in seconds. Queries cover the current
+ * window and the one before it, i.e. the last five to ten minutes.
+ */
+#define NETWORK_METRICS_WINDOW 300.0
+
+
+/** Request phases with a histogram each. */
+typedef enum
+{
+  NetworkMetricsPhaseDNS = 0,
+  NetworkMetricsPhaseConnect,
+  NetworkMetricsPhaseHandshake,
+  NetworkMetricsPhaseFirstByte,
+  NetworkMetricsPhaseTransfer,
+  NetworkMetricsPhaseTotal,
+  NetworkMetricsPhaseCount
+} NetworkMetricsPhase;
+
+
+////////////////////////////////////////////////////////////////////////////////
+/**
+ * @class NetworkMetrics
+ * @brief Log-scale histograms of request phase timings, per host
+ *
+ * Recording a request costs one lock and a handful of counter increments,
+ * so HTTPSClient does it for every call. The connection phases (DNS,
+ * connect, handshake) are only recorded for requests that opened a new
+ * connection; otherwise the reused connections' zeros would drown out
+ * the real setup cost.
+ *
+ * All methods may be called from any thread. This is a singleton class -
+ * use [NetworkMetrics sharedMetrics].
+ */
+@interface NetworkMetrics : NSObject
+{
+  NSMutableDictionary *_hosts;
+  NSLock *_lock;
+}
+
+
+/**
+ * Returns the shared NetworkMetrics instance.
+ *
+ * @return The singleton NetworkMetrics instance
+ */
++ (NetworkMetrics *)sharedMetrics;
+
+
+/**
+ * Returns a short name for a phase, as used in log lines.
+ *
+ * @param phase Phase to name
+ * @return Name such as @"dns" or @"ttfb"
+ */
++ (NSString *)nameOfPhase:(NetworkMetricsPhase)phase;
+
+
+/**
+ * Formats one request's metrics as a single key=value log line.
+ *
+ * @param metrics Timings and byte counts from -[HTTPSClient lastMetrics]
+ * @param host Host the request went to
+ * @param status HTTP status, or 0 if no response arrived
+ * @return Line such as "metrics host=... status=200 dns=0.4ms ..."
+ */
++ (NSString *)logLineForMetrics:(HTTPSRequestMetrics)metrics
+                           host:(NSString *)host
+                         status:(int)status;
+
+
+/**
+ * Adds one request's timings to the host's histograms.
+ *
+ * @param metrics Timings and byte counts from -[HTTPSClient lastMetrics]
+ * @param host Host the request went to
+ */
+- (void)recordMetrics:(HTTPSRequestMetrics)metrics forHost:(NSString *)host;
+
+
+/**
+ * Hosts that have recorded at least one request.
+ *
+ * @return Array of host names
+ */
+- (NSArray *)hosts;
+
+
+/**
+ * Number of requests to a host in the current and previous windows.
+ *
+ * @param host Host name
+ * @return Request count
+ */
+- (unsigned long)requestCountForHost:(NSString *)host;
+
+
+/**
+ * Estimates a percentile of one phase for a host. The answer is the upper
+ * edge of the bucket the percentile falls in, so it errs high by at most
+ * a factor of two.
+ *
+ * @param percentile Between 0 and 100
+ * @param phase Phase to query
+ * @param host Host name
+ * @return Duration in seconds, or 0 if nothing has been recorded
+ */
+- (double)percentile:(double)percentile
+             ofPhase:(NetworkMetricsPhase)phase
+             forHost:(NSString *)host;
+
+
+/**
+ * Describes a host's p50/p90/p99 for every phase on one line.
+ *
+ * @param host Host name
+ * @return Summary suitable for logging
+ */
+- (NSString *)summaryForHost:(NSString *)host;
+
+
+/**
+ * Forgets everything recorded so far.
+ */
+- (void)reset;
+
+@end
@@ -0,0 +1,358 @@
+////////////////////////////////////////////////////////////////////////////////
+// NetworkMetrics.m
+// ClaudeChat
+//
+// Rolling per-host latency histograms.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import "NetworkMetrics.h"
+
+
+// Upper edge of the first bucket, in seconds
+#define NETWORK_METRICS_FIRST_BUCKET 0.0001
+
+/**
+ * One host's histograms, stored in an NSMutableData. Two windows are kept;
+ * when the current one is older than NETWORK_METRICS_WINDOW the other is
+ * cleared and becomes current.
+ */
+typedef struct
+{
+  unsigned long counts[2][NetworkMetricsPhaseCount][NETWORK_METRICS_BUCKETS];
+  unsigned long requests[2];
+  NSTimeInterval windowStart;
+  int current;
+} NetworkMetricsHost;
+
+static NetworkMetrics *sharedInstance = nil;
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Helpers
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+/** Returns the bucket a duration falls in. */
+static int NetworkMetricsBucket(double seconds)
+{
+  double edge = NETWORK_METRICS_FIRST_BUCKET;
+  int bucket = 0;
+
+  while (seconds > edge && bucket < NETWORK_METRICS_BUCKETS - 1)
+  {
+    edge *= 2.0;
+    bucket++;
+  }
+
+  return bucket;
+}
+
+
+/** Starts a new window if the current one has run its course. */
+static void NetworkMetricsRotate(NetworkMetricsHost *host, NSTimeInterval now)
+{
+  if (now - host->windowStart < NETWORK_METRICS_WINDOW)
+  {
+    return;
+  }
+
+  // Idle for more than two windows: everything is stale
+  if (now - host->windowStart >= 2 * NETWORK_METRICS_WINDOW)
+  {
+    memset(host->counts, 0, sizeof(host->counts));
+    memset(host->requests, 0, sizeof(host->requests));
+  }
+  else
+  {
+    host->current ^= 1;
+    memset(host->counts[host->current], 0, sizeof(host->counts[host->current]));
+    host->requests[host->current] = 0;
+  }
+  host->windowStart = now;
+}
+
+
+/** Formats a duration for log lines, in milliseconds. */
+static NSString *NetworkMetricsFormat(double seconds)
+{
+  return [NSString stringWithFormat:@"%.1fms", seconds * 1000.0];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Private Interface
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+@interface NetworkMetrics (Private)
+
+- (NetworkMetricsHost *)histogramsForHost:(NSString *)host create:(BOOL)create;
+
+@end
+
+
+@implementation NetworkMetrics
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Singleton
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
++ (void)initialize
+{
+  if (self == [NetworkMetrics class] && sharedInstance == nil)
+  {
+    sharedInstance = [[NetworkMetrics alloc] init];
+  }
+}
+
+
++ (NetworkMetrics *)sharedMetrics
+{
+  return sharedInstance;
+}
+
+
++ (NSString *)nameOfPhase:(NetworkMetricsPhase)phase
+{
+  switch (phase)
+  {
+    case NetworkMetricsPhaseDNS:
+      return @"dns";
+    case NetworkMetricsPhaseConnect:
+      return @"connect";
+    case NetworkMetricsPhaseHandshake:
+      return @"tls";
+    case NetworkMetricsPhaseFirstByte:
+      return @"ttfb";
+    case NetworkMetricsPhaseTransfer:
+      return @"transfer";
+    case NetworkMetricsPhaseTotal:
+      return @"total";
+    default:
+      return @"unknown";
+  }
+}
+
+
++ (NSString *)logLineForMetrics:(HTTPSRequestMetrics)metrics
+                           host:(NSString *)host
+                         status:(int)status
+{
+  return [NSString stringWithFormat:
+          @"metrics host=%@ status=%d dns=%@ connect=%@ tls=%@ ttfb=%@ transfer=%@ "
+          @"total=%@ sent=%llu received=%llu reused=%d resumed=%d",
+          host, status,
+          NetworkMetricsFormat(metrics.dnsTime),
+          NetworkMetricsFormat(metrics.connectTime),
+          NetworkMetricsFormat(metrics.handshakeTime),
+          NetworkMetricsFormat(metrics.firstByteTime),
+          NetworkMetricsFormat(metrics.transferTime),
+          NetworkMetricsFormat(metrics.totalTime),
+          metrics.bytesSent, metrics.bytesReceived,
+          metrics.reusedConnection ? 1 : 0, metrics.resumedSession ? 1 : 0];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Lifecycle
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (id)init
+{
+  self = [super init];
+
+  if (self)
+  {
+    _hosts = [[NSMutableDictionary alloc] init];
+    _lock = [[NSLock alloc] init];
+  }
+
+  return self;
+}
+
+
+- (void)dealloc
+{
+  [_hosts release];
+  [_lock release];
+
+  [super dealloc];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Recording
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (void)recordMetrics:(HTTPSRequestMetrics)metrics forHost:(NSString *)host
+{
+  NetworkMetricsHost *histograms;
+  unsigned long (*counts)[NETWORK_METRICS_BUCKETS];
+  BOOL opened = !metrics.reusedConnection && metrics.handshakeTime > 0;
+
+  [_lock lock];
+  histograms = [self histogramsForHost:host create:YES];
+  NetworkMetricsRotate(histograms, [NSDate timeIntervalSinceReferenceDate]);
+  histograms->requests[histograms->current]++;
+
+  counts = histograms->counts[histograms->current];
+  if (opened)
+  {
+    counts[NetworkMetricsPhaseDNS][NetworkMetricsBucket(metrics.dnsTime)]++;
+    counts[NetworkMetricsPhaseConnect][NetworkMetricsBucket(metrics.connectTime)]++;
+    counts[NetworkMetricsPhaseHandshake][NetworkMetricsBucket(metrics.handshakeTime)]++;
+  }
+  if (metrics.firstByteTime > 0)
+  {
+    counts[NetworkMetricsPhaseFirstByte][NetworkMetricsBucket(metrics.firstByteTime)]++;
+    counts[NetworkMetricsPhaseTransfer][NetworkMetricsBucket(metrics.transferTime)]++;
+  }
+  counts[NetworkMetricsPhaseTotal][NetworkMetricsBucket(metrics.totalTime)]++;
+  [_lock unlock];
+}
+
+
+- (void)reset
+{
+  [_lock lock];
+  [_hosts removeAllObjects];
+  [_lock unlock];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Queries
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (NSArray *)hosts
+{
+  NSArray *hosts;
+
+  [_lock lock];
+  hosts = [_hosts allKeys];
+  [_lock unlock];
+
+  return hosts;
+}
+
+
+- (unsigned long)requestCountForHost:(NSString *)host
+{
+  NetworkMetricsHost *histograms;
+  unsigned long count = 0;
+
+  [_lock lock];
+  histograms = [self histogramsForHost:host create:NO];
+  if (histograms)
+  {
+    NetworkMetricsRotate(histograms, [NSDate timeIntervalSinceReferenceDate]);
+    count = histograms->requests[0] + histograms->requests[1];
+  }
+  [_lock unlock];
+
+  return count;
+}
+
+
+- (double)percentile:(double)percentile
+             ofPhase:(NetworkMetricsPhase)phase
+             forHost:(NSString *)host
+{
+  NetworkMetricsHost *histograms;
+  unsigned long merged[NETWORK_METRICS_BUCKETS];
+  unsigned long total = 0;
+  unsigned long seen = 0;
+  double target;
+  double edge = NETWORK_METRICS_FIRST_BUCKET;
+  int i;
+
+  if (phase < 0 || phase >= NetworkMetricsPhaseCount)
+  {
+    return 0;
+  }
+
+  [_lock lock];
+  histograms = [self histogramsForHost:host create:NO];
+  if (histograms)
+  {
+    NetworkMetricsRotate(histograms, [NSDate timeIntervalSinceReferenceDate]);
+    for (i = 0; i < NETWORK_METRICS_BUCKETS; i++)
+    {
+      merged[i] = histograms->counts[0][phase][i] + histograms->counts[1][phase][i];
+      total += merged[i];
+    }
+  }
+  [_lock unlock];
+
+  if (total == 0)
+  {
+    return 0;
+  }
+
+  target = total * percentile / 100.0;
+  for (i = 0; i < NETWORK_METRICS_BUCKETS - 1; i++)
+  {
+    seen += merged[i];
+    if (seen >= target && seen > 0)
+    {
+      break;
+    }
+    edge *= 2.0;
+  }
+
+  return edge;
+}
+
+
+- (NSString *)summaryForHost:(NSString *)host
+{
+  NSMutableString *summary;
+  int phase;
+
+  summary = [NSMutableString stringWithFormat:@"host=%@ requests=%lu",
+             host, [self requestCountForHost:host]];
+  for (phase = 0; phase < NetworkMetricsPhaseCount; phase++)
+  {
+    [summary appendFormat:@" %@=%@/%@/%@",
+     [NetworkMetrics nameOfPhase:phase],
+     NetworkMetricsFormat([self percentile:50 ofPhase:phase forHost:host]),
+     NetworkMetricsFormat([self percentile:90 ofPhase:phase forHost:host]),
+     NetworkMetricsFormat([self percentile:99 ofPhase:phase forHost:host])];
+  }
+
+  return summary;
+}
+
+@end
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Private Implementation
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+@implementation NetworkMetrics (Private)
+
+/** Returns the host's histograms, optionally creating them. Call with _lock held. */
+- (NetworkMetricsHost *)histogramsForHost:(NSString *)host create:(BOOL)create
+{
+  NSMutableData *histograms = [_hosts objectForKey:host ? host : @""];
+
+  if (!histograms && create)
+  {
+    histograms = [NSMutableData dataWithLength:sizeof(NetworkMetricsHost)];
+    ((NetworkMetricsHost *)[histograms mutableBytes])->windowStart = [NSDate timeIntervalSinceReferenceDate];
+    [_hosts setObject:histograms forKey:host ? host : @""];
+  }
+
+  return histograms ? (NetworkMetricsHost *)[histograms mutableBytes] : NULL;
+}
+
+@end
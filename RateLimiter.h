@@ -0,0 +1,119 @@
+////////////////////////////////////////////////////////////////////////////////
+// RateLimiter.h
+// ClaudeChat
+//
+// Client-side pacing for API requests, driven by the anthropic-ratelimit-*
+// and retry-after headers the server sends back with every response.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import <Foundation/Foundation.h>
+
+
+/** How many times a 429 or 529 reply is retried before it is reported. */
+#define RATE_LIMITER_MAX_RETRIES 4
+
+/** First retry delay in seconds when the server gives no retry-after. */
+#define RATE_LIMITER_BASE_BACKOFF 1.0
+
+/** Upper bound on any single retry delay, in seconds. */
+#define RATE_LIMITER_MAX_BACKOFF 60.0
+
+
+////////////////////////////////////////////////////////////////////////////////
+/**
+ * @class RateLimiter
+ * @brief Token buckets for request, input token and output token budgets
+ *
+ * Each API key gets a bucket per limit the server reports: requests,
+ * input tokens, output tokens and (on older accounts) combined tokens.
+ * A bucket learns its size and refill rate from the limit, remaining and
+ * reset headers of each response, and drains locally as requests go out,
+ * so a burst of sends is paced before the server has to refuse any.
+ * Until the first response arrives nothing is known and nothing waits.
+ *
+ * Callers run on background request threads and block in
+ * -waitForKey:inputTokens: until the budget allows the send. All methods
+ * may be called from any thread. This is a singleton class - use
+ * [RateLimiter sharedLimiter].
+ */
+@interface RateLimiter : NSObject
+{
+  NSMutableDictionary *_accounts;
+  NSLock *_lock;
+}
+
+
+/**
+ * Returns the shared RateLimiter instance.
+ *
+ * @return The singleton RateLimiter instance
+ */
++ (RateLimiter *)sharedLimiter;
+
+
+/**
+ * Whether a response status means "try again later": 429 (rate limited)
+ * or 529 (overloaded).
+ *
+ * @param status HTTP status code
+ * @return YES if the request should be retried after a delay
+ */
++ (BOOL)isRetryableStatus:(int)status;
+
+
+/**
+ * Blocks the calling thread until the key's buckets can cover one more
+ * request of the given size, then takes that much from them. Must not be
+ * called on the main thread.
+ *
+ * @param key API key the request is made with
+ * @param inputTokens Estimated input tokens for the request
+ * @return Seconds spent waiting
+ */
+- (NSTimeInterval)waitForKey:(NSString *)key inputTokens:(unsigned long)inputTokens;
+
+
+/**
+ * Like -waitForKey:inputTokens:, but gives up as soon as the flag is set,
+ * without taking anything from the buckets. The flag is checked at least
+ * four times a second while waiting.
+ *
+ * @param key API key the request is made with
+ * @param inputTokens Estimated input tokens for the request
+ * @param cancelled Flag another thread sets to abandon the request, or NULL
+ * @return YES once the request may be sent, NO if it was cancelled first
+ */
+- (BOOL)waitForKey:(NSString *)key
+       inputTokens:(unsigned long)inputTokens
+        cancelFlag:(volatile BOOL *)cancelled;
+
+
+/**
+ * Refreshes the key's buckets from a response's headers. Headers that are
+ * missing leave the matching bucket as it was.
+ *
+ * @param key API key the request was made with
+ * @param headers Response headers keyed by lowercase field name
+ */
+- (void)updateKey:(NSString *)key withResponseHeaders:(NSDictionary *)headers;
+
+
+/**
+ * Holds back every request on the key after a 429 or 529. The pause is
+ * the server's retry-after when it sent one, otherwise an exponential
+ * backoff with random jitter so that clients sharing a key spread out.
+ * The next -waitForKey:inputTokens: sleeps through it.
+ *
+ * @param key API key the request was made with
+ * @param attempt Zero-based number of the attempt that just failed
+ * @param headers Response headers keyed by lowercase field name
+ * @return The delay chosen, in seconds
+ */
+- (NSTimeInterval)backOffKey:(NSString *)key
+                     attempt:(unsigned int)attempt
+             responseHeaders:(NSDictionary *)headers;
+
+@end
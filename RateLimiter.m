@@ -0,0 +1,410 @@
+////////////////////////////////////////////////////////////////////////////////
+// RateLimiter.m
+// ClaudeChat
+//
+// Per-key token buckets fed by the anthropic-ratelimit-* response headers.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import "RateLimiter.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+
+// Longest single sleep while waiting, so fresh headers from another thread
+// are noticed reasonably soon
+#define RATE_LIMITER_MAX_SLEEP 5.0
+
+// Longest single sleep when the wait can be cancelled, so a cancel is
+// acted on promptly
+#define RATE_LIMITER_CANCEL_SLEEP 0.25
+
+/**
+ * One limit the server enforces. capacity is zero until a response has
+ * reported the limit; an unknown bucket never makes a request wait.
+ */
+typedef struct
+{
+  double capacity;
+  double available;
+  double refillPerSecond;
+  NSTimeInterval updated;
+} RateLimitBucket;
+
+enum
+{
+  RateLimitBucketRequests = 0,
+  RateLimitBucketInputTokens,
+  RateLimitBucketOutputTokens,
+  RateLimitBucketTokens,
+  RateLimitBucketCount
+};
+
+/** Everything known about one API key, stored in an NSMutableData. */
+typedef struct
+{
+  RateLimitBucket buckets[RateLimitBucketCount];
+  NSTimeInterval blockedUntil;
+} RateLimitAccount;
+
+// Header name prefixes, indexed like the bucket enum. Each is followed by
+// -limit, -remaining and -reset.
+static const char *RateLimitHeaderPrefixes[RateLimitBucketCount] =
+{
+  "anthropic-ratelimit-requests",
+  "anthropic-ratelimit-input-tokens",
+  "anthropic-ratelimit-output-tokens",
+  "anthropic-ratelimit-tokens"
+};
+
+static RateLimiter *sharedInstance = nil;
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Helpers
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Parses an RFC 3339 UTC timestamp such as 2024-06-01T12:00:30Z into
+ * seconds since the reference date. Fractional seconds are ignored.
+ * Returns 0 if the string is not in that form.
+ */
+static NSTimeInterval RateLimitParseTime(NSString *value)
+{
+  struct tm parts;
+  time_t seconds;
+
+  if (!value)
+  {
+    return 0;
+  }
+
+  memset(&parts, 0, sizeof(parts));
+  if (sscanf([value UTF8String], "%4d-%2d-%2dT%2d:%2d:%2d",
+             &parts.tm_year, &parts.tm_mon, &parts.tm_mday,
+             &parts.tm_hour, &parts.tm_min, &parts.tm_sec) != 6)
+  {
+    return 0;
+  }
+  parts.tm_year -= 1900;
+  parts.tm_mon -= 1;
+
+  seconds = timegm(&parts);
+  if (seconds == (time_t)-1)
+  {
+    return 0;
+  }
+
+  return (NSTimeInterval)seconds - NSTimeIntervalSince1970;
+}
+
+
+/** Tops a bucket up for the time that has passed since it was last seen. */
+static void RateLimitRefill(RateLimitBucket *bucket, NSTimeInterval now)
+{
+  if (bucket->capacity <= 0 || now <= bucket->updated)
+  {
+    return;
+  }
+
+  bucket->available += (now - bucket->updated) * bucket->refillPerSecond;
+  if (bucket->available > bucket->capacity)
+  {
+    bucket->available = bucket->capacity;
+  }
+  bucket->updated = now;
+}
+
+
+/**
+ * Seconds until a bucket holds `needed`, or zero if it already does. A
+ * request bigger than the whole bucket only waits for a full one; waiting
+ * for more would never end.
+ */
+static NSTimeInterval RateLimitDelay(RateLimitBucket *bucket, double needed)
+{
+  if (bucket->capacity <= 0)
+  {
+    return 0;
+  }
+  if (needed > bucket->capacity)
+  {
+    needed = bucket->capacity;
+  }
+  if (bucket->available >= needed)
+  {
+    return 0;
+  }
+  if (bucket->refillPerSecond <= 0)
+  {
+    return 1.0;
+  }
+
+  return (needed - bucket->available) / bucket->refillPerSecond;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Private Interface
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+@interface RateLimiter (Private)
+
+- (RateLimitAccount *)accountForKey:(NSString *)key;
+
+@end
+
+
+@implementation RateLimiter
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Singleton
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
++ (void)initialize
+{
+  if (self == [RateLimiter class] && sharedInstance == nil)
+  {
+    sharedInstance = [[RateLimiter alloc] init];
+  }
+}
+
+
++ (RateLimiter *)sharedLimiter
+{
+  return sharedInstance;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Lifecycle
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (id)init
+{
+  self = [super init];
+
+  if (self)
+  {
+    _accounts = [[NSMutableDictionary alloc] init];
+    _lock = [[NSLock alloc] init];
+  }
+
+  return self;
+}
+
+
+- (void)dealloc
+{
+  [_accounts release];
+  [_lock release];
+
+  [super dealloc];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Classification
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
++ (BOOL)isRetryableStatus:(int)status
+{
+  return status == 429 || status == 529;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Pacing
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (NSTimeInterval)waitForKey:(NSString *)key inputTokens:(unsigned long)inputTokens
+{
+  NSTimeInterval started = [NSDate timeIntervalSinceReferenceDate];
+
+  [self waitForKey:key inputTokens:inputTokens cancelFlag:NULL];
+
+  return [NSDate timeIntervalSinceReferenceDate] - started;
+}
+
+
+- (BOOL)waitForKey:(NSString *)key
+       inputTokens:(unsigned long)inputTokens
+        cancelFlag:(volatile BOOL *)cancelled
+{
+  NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+  NSTimeInterval longestSleep = cancelled ? RATE_LIMITER_CANCEL_SLEEP : RATE_LIMITER_MAX_SLEEP;
+  BOOL logged = NO;
+
+  for (;;)
+  {
+    RateLimitAccount *account;
+    NSTimeInterval delay;
+    NSTimeInterval bucketDelay;
+    unsigned int i;
+
+    if (cancelled && *cancelled)
+    {
+      return NO;
+    }
+
+    [_lock lock];
+    account = [self accountForKey:key];
+    for (i = 0; i < RateLimitBucketCount; i++)
+    {
+      RateLimitRefill(&account->buckets[i], now);
+    }
+
+    // Output tokens are counted as they are generated, so a send only
+    // needs the output bucket to not be empty
+    delay = account->blockedUntil - now;
+    bucketDelay = RateLimitDelay(&account->buckets[RateLimitBucketRequests], 1);
+    delay = bucketDelay > delay ? bucketDelay : delay;
+    bucketDelay = RateLimitDelay(&account->buckets[RateLimitBucketInputTokens], inputTokens);
+    delay = bucketDelay > delay ? bucketDelay : delay;
+    bucketDelay = RateLimitDelay(&account->buckets[RateLimitBucketOutputTokens], 1);
+    delay = bucketDelay > delay ? bucketDelay : delay;
+    bucketDelay = RateLimitDelay(&account->buckets[RateLimitBucketTokens], inputTokens);
+    delay = bucketDelay > delay ? bucketDelay : delay;
+
+    if (delay <= 0)
+    {
+      account->buckets[RateLimitBucketRequests].available -= 1;
+      account->buckets[RateLimitBucketInputTokens].available -= inputTokens;
+      account->buckets[RateLimitBucketTokens].available -= inputTokens;
+      [_lock unlock];
+      break;
+    }
+    [_lock unlock];
+
+    if (!logged)
+    {
+      NSLog(@"Rate limit: holding request for %.1f seconds", delay);
+      logged = YES;
+    }
+    if (delay > longestSleep)
+    {
+      delay = longestSleep;
+    }
+    [NSThread sleepUntilDate:[NSDate dateWithTimeIntervalSinceNow:delay]];
+    now = [NSDate timeIntervalSinceReferenceDate];
+  }
+
+  return YES;
+}
+
+
+- (void)updateKey:(NSString *)key withResponseHeaders:(NSDictionary *)headers
+{
+  NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+  RateLimitAccount *account;
+  unsigned int i;
+
+  if ([headers count] == 0)
+  {
+    return;
+  }
+
+  [_lock lock];
+  account = [self accountForKey:key];
+  for (i = 0; i < RateLimitBucketCount; i++)
+  {
+    RateLimitBucket *bucket = &account->buckets[i];
+    NSString *prefix = [NSString stringWithUTF8String:RateLimitHeaderPrefixes[i]];
+    NSString *limit = [headers objectForKey:[prefix stringByAppendingString:@"-limit"]];
+    NSString *remaining = [headers objectForKey:[prefix stringByAppendingString:@"-remaining"]];
+    NSTimeInterval reset;
+
+    if (!limit || !remaining || [limit doubleValue] <= 0)
+    {
+      continue;
+    }
+
+    // The bucket refills continuously and is full again at the reset time.
+    // Without a usable reset, assume the limit is per minute.
+    bucket->capacity = [limit doubleValue];
+    bucket->available = [remaining doubleValue];
+    reset = RateLimitParseTime([headers objectForKey:[prefix stringByAppendingString:@"-reset"]]);
+    if (reset > now && bucket->available < bucket->capacity)
+    {
+      bucket->refillPerSecond = (bucket->capacity - bucket->available) / (reset - now);
+    }
+    else
+    {
+      bucket->refillPerSecond = bucket->capacity / 60.0;
+    }
+    bucket->updated = now;
+  }
+  [_lock unlock];
+}
+
+
+- (NSTimeInterval)backOffKey:(NSString *)key
+                     attempt:(unsigned int)attempt
+             responseHeaders:(NSDictionary *)headers
+{
+  NSString *retryAfter = [headers objectForKey:@"retry-after"];
+  NSTimeInterval delay;
+  RateLimitAccount *account;
+
+  if (retryAfter && [retryAfter doubleValue] > 0)
+  {
+    delay = [retryAfter doubleValue];
+  }
+  else
+  {
+    // Half fixed, half random: never retries at once, and clients that
+    // failed together do not all come back together
+    delay = RATE_LIMITER_BASE_BACKOFF * (double)(1UL << (attempt < 16 ? attempt : 16));
+    if (delay > RATE_LIMITER_MAX_BACKOFF)
+    {
+      delay = RATE_LIMITER_MAX_BACKOFF;
+    }
+    delay = delay / 2.0 + (delay / 2.0) * ((double)arc4random() / 4294967295.0);
+  }
+
+  [_lock lock];
+  account = [self accountForKey:key];
+  if (account->blockedUntil < [NSDate timeIntervalSinceReferenceDate] + delay)
+  {
+    account->blockedUntil = [NSDate timeIntervalSinceReferenceDate] + delay;
+  }
+  [_lock unlock];
+
+  return delay;
+}
+
+@end
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Private Implementation
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+@implementation RateLimiter (Private)
+
+/** Returns the key's state, creating it empty. Call with _lock held. */
+- (RateLimitAccount *)accountForKey:(NSString *)key
+{
+  NSMutableData *account = [_accounts objectForKey:key ? key : @""];
+
+  if (!account)
+  {
+    // NSMutableData zero-fills, which is the "nothing known" state
+    account = [NSMutableData dataWithLength:sizeof(RateLimitAccount)];
+    [_accounts setObject:account forKey:key ? key : @""];
+  }
+
+  return (RateLimitAccount *)[account mutableBytes];
+}
+
+@end
@@ -0,0 +1,81 @@
+////////////////////////////////////////////////////////////////////////////////
+// SSEParser.h
+// ClaudeChat
+//
+// Incremental parser for text/event-stream (server-sent events) bodies.
+// Bytes can be fed in arbitrary pieces as they come off the socket; each
+// complete event is handed to the delegate as soon as its blank line arrives.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import <Foundation/Foundation.h>
+
+
+@class SSEParser;
+
+
+/**
+ * Informal delegate protocol for SSEParser.
+ */
+@interface NSObject (SSEParserDelegate)
+
+/**
+ * Called once per dispatched event.
+ *
+ * @param parser The parser that produced the event
+ * @param event The value of the "event:" field, or @"message" if none was sent
+ * @param data The joined "data:" lines as raw UTF-8 bytes, without the
+ *             trailing newline. Only valid for the duration of the call.
+ */
+- (void)parser:(SSEParser *)parser didReceiveEvent:(NSString *)event data:(NSData *)data;
+
+@end
+
+
+////////////////////////////////////////////////////////////////////////////////
+/**
+ * @class SSEParser
+ * @brief Streaming server-sent events decoder
+ *
+ * Implements the line protocol from the HTML event-stream specification:
+ * "event:" and "data:" fields, ":" comments, and CR, LF or CRLF line endings.
+ * Lines that arrive whole are parsed straight out of the caller's buffer;
+ * only a partial trailing line is copied until the rest of it arrives.
+ */
+@interface SSEParser : NSObject
+{
+  id _delegate;
+  NSMutableData *_partialLine;
+  NSMutableData *_eventData;
+  NSString *_eventName;
+  BOOL _skipLeadingLF;
+}
+
+
+/**
+ * Initializes a parser that reports events to the given delegate.
+ *
+ * @param aDelegate Receiver of -parser:didReceiveEvent:data: (not retained)
+ * @return An initialized SSEParser instance
+ */
+- (id)initWithDelegate:(id)aDelegate;
+
+
+/**
+ * Feeds the next piece of the response body to the parser.
+ *
+ * @param bytes Body bytes, exactly as received
+ * @param length Number of bytes
+ */
+- (void)appendBytes:(const char *)bytes length:(unsigned long)length;
+
+
+/**
+ * Resets the parser once the connection has finished. As the specification
+ * requires, an event whose terminating blank line never arrived is dropped.
+ */
+- (void)finish;
+
+@end
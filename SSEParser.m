@@ -0,0 +1,219 @@
+////////////////////////////////////////////////////////////////////////////////
+// SSEParser.m
+// ClaudeChat
+//
+// Implementation of the incremental server-sent events parser.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import "SSEParser.h"
+#include <string.h>
+
+
+@interface SSEParser (Private)
+- (void)processLine:(const char *)line length:(unsigned long)length;
+- (void)dispatchEvent;
+@end
+
+
+@implementation SSEParser
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Lifecycle
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (id)initWithDelegate:(id)aDelegate
+{
+  self = [super init];
+
+  if (self)
+  {
+    _delegate = aDelegate;
+    _partialLine = [[NSMutableData alloc] init];
+    _eventData = [[NSMutableData alloc] init];
+    _eventName = nil;
+    _skipLeadingLF = NO;
+  }
+
+  return self;
+}
+
+
+- (void)dealloc
+{
+  [_partialLine release];
+  [_eventData release];
+  [_eventName release];
+
+  [super dealloc];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Parsing
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (void)appendBytes:(const char *)bytes length:(unsigned long)length
+{
+  const char *cursor = bytes;
+  const char *end = bytes + length;
+  const char *eol;
+
+  // A CR ended the previous piece; swallow the LF of a split CRLF
+  if (_skipLeadingLF && cursor < end)
+  {
+    if (*cursor == '\n')
+    {
+      cursor++;
+    }
+    _skipLeadingLF = NO;
+  }
+
+  while (cursor < end)
+  {
+    eol = cursor;
+    while (eol < end && *eol != '\n' && *eol != '\r')
+    {
+      eol++;
+    }
+
+    // No line ending yet: keep the fragment until the next piece arrives
+    if (eol == end)
+    {
+      [_partialLine appendBytes:cursor length:end - cursor];
+      break;
+    }
+
+    if ([_partialLine length] > 0)
+    {
+      [_partialLine appendBytes:cursor length:eol - cursor];
+      [self processLine:[_partialLine bytes] length:[_partialLine length]];
+      [_partialLine setLength:0];
+    }
+    else
+    {
+      [self processLine:cursor length:eol - cursor];
+    }
+
+    if (*eol == '\r')
+    {
+      if (eol + 1 < end)
+      {
+        if (eol[1] == '\n')
+        {
+          eol++;
+        }
+      }
+      else
+      {
+        _skipLeadingLF = YES;
+      }
+    }
+
+    cursor = eol + 1;
+  }
+}
+
+
+- (void)finish
+{
+  [_partialLine setLength:0];
+  [_eventData setLength:0];
+  [_eventName release];
+  _eventName = nil;
+  _skipLeadingLF = NO;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Private Methods
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (void)processLine:(const char *)line length:(unsigned long)length
+{
+  const char *colon;
+  const char *value;
+  unsigned long fieldLength;
+  unsigned long valueLength;
+
+  // Blank line ends the event
+  if (length == 0)
+  {
+    [self dispatchEvent];
+    return;
+  }
+
+  // Comment lines (used by some servers as keep-alives)
+  if (line[0] == ':')
+  {
+    return;
+  }
+
+  colon = memchr(line, ':', length);
+  if (colon)
+  {
+    fieldLength = colon - line;
+    value = colon + 1;
+    valueLength = length - fieldLength - 1;
+
+    if (valueLength > 0 && value[0] == ' ')
+    {
+      value++;
+      valueLength--;
+    }
+  }
+  else
+  {
+    fieldLength = length;
+    value = line + length;
+    valueLength = 0;
+  }
+
+  if (fieldLength == 5 && memcmp(line, "event", 5) == 0)
+  {
+    [_eventName release];
+    _eventName = [[NSString alloc] initWithBytes:value
+                                          length:valueLength
+                                        encoding:NSUTF8StringEncoding];
+  }
+  else if (fieldLength == 4 && memcmp(line, "data", 4) == 0)
+  {
+    [_eventData appendBytes:value length:valueLength];
+    [_eventData appendBytes:"\n" length:1];
+  }
+
+  // "id" and "retry" only matter for EventSource reconnection; ignored
+}
+
+
+- (void)dispatchEvent
+{
+  NSString *name;
+
+  if ([_eventData length] == 0)
+  {
+    [_eventName release];
+    _eventName = nil;
+    return;
+  }
+
+  // Drop the newline appended after the last data line
+  [_eventData setLength:[_eventData length] - 1];
+
+  name = _eventName ? _eventName : @"message";
+  if (_delegate && [_delegate respondsToSelector:@selector(parser:didReceiveEvent:data:)])
+  {
+    [_delegate parser:self didReceiveEvent:name data:_eventData];
+  }
+
+  [_eventData setLength:0];
+  [_eventName release];
+  _eventName = nil;
+}
+
+@end
@@ -0,0 +1,94 @@
+////////////////////////////////////////////////////////////////////////////////
+// TokenEstimator.h
+// ClaudeChat
+//
+// Fast local estimate of how many input tokens a conversation will be
+// billed for, so requests can be sized to the model's context window
+// before they are sent.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import <Foundation/Foundation.h>
+
+
+/** Tokens per UTF-8 byte in the uncalibrated estimate. */
+#define TOKEN_ESTIMATOR_BYTE_WEIGHT 0.20
+
+/** Tokens per whitespace-separated word in the uncalibrated estimate. */
+#define TOKEN_ESTIMATOR_WORD_WEIGHT 0.35
+
+/** Fixed cost of each message's role and framing, in tokens. */
+#define TOKEN_ESTIMATOR_MESSAGE_OVERHEAD 4
+
+/** How far each calibration moves the scale towards the observed ratio. */
+#define TOKEN_ESTIMATOR_SMOOTHING 0.25
+
+
+////////////////////////////////////////////////////////////////////////////////
+/**
+ * @class TokenEstimator
+ * @brief Byte- and word-based token counts, calibrated against the API
+ *
+ * The estimate is a weighted sum of UTF-8 bytes and words, which tracks
+ * the tokenizer well for prose and code alike and takes one pass over the
+ * text. A scale factor corrects it: after each reply, the input tokens the
+ * API reported are compared with what was estimated for that request and
+ * the scale is nudged towards the ratio. Requests below a few hundred
+ * tokens are not used for calibration, as the fixed overheads dominate.
+ *
+ * All methods may be called from any thread. This is a singleton class -
+ * use [TokenEstimator sharedEstimator].
+ */
+@interface TokenEstimator : NSObject
+{
+  double _scale;
+  NSLock *_lock;
+}
+
+
+/**
+ * Returns the shared TokenEstimator instance.
+ *
+ * @return The singleton TokenEstimator instance
+ */
++ (TokenEstimator *)sharedEstimator;
+
+
+/**
+ * Estimates the tokens in a piece of text.
+ *
+ * @param text Text to measure
+ * @return Calibrated token estimate
+ */
+- (unsigned long)estimatedTokensForString:(NSString *)text;
+
+
+/**
+ * Estimates the input tokens of a Messages API message array. Content may
+ * be a string or an array of text blocks; other block types are ignored.
+ *
+ * @param messages Array of message dictionaries with role and content
+ * @return Calibrated token estimate including per-message overhead
+ */
+- (unsigned long)estimatedTokensForMessages:(NSArray *)messages;
+
+
+/**
+ * Corrects the scale with the input tokens the API reported for a request.
+ *
+ * @param actual Input tokens billed, cached and uncached together
+ * @param estimated What this estimator predicted for the same request
+ */
+- (void)recordActualTokens:(unsigned long)actual forEstimatedTokens:(unsigned long)estimated;
+
+
+/**
+ * Current correction applied to the raw byte/word estimate.
+ *
+ * @return Scale factor, 1.0 before any calibration
+ */
+- (double)scale;
+
+@end
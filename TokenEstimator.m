@@ -0,0 +1,204 @@
+////////////////////////////////////////////////////////////////////////////////
+// TokenEstimator.m
+// ClaudeChat
+//
+// Byte- and word-based token estimates with online calibration.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import "TokenEstimator.h"
+
+
+// Requests smaller than this are too dominated by overhead to calibrate with
+#define TOKEN_ESTIMATOR_MIN_CALIBRATION 256
+
+// Bounds on the scale, so one odd reply cannot wreck the estimate
+#define TOKEN_ESTIMATOR_MIN_SCALE 0.5
+#define TOKEN_ESTIMATOR_MAX_SCALE 4.0
+
+static TokenEstimator *sharedInstance = nil;
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Helpers
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+/** Uncalibrated estimate for UTF-8 text: weighted bytes plus words. */
+static double TokenEstimatorRaw(const char *bytes)
+{
+  unsigned long length = 0;
+  unsigned long words = 0;
+  BOOL inWord = NO;
+  const unsigned char *cursor;
+
+  if (!bytes)
+  {
+    return 0;
+  }
+
+  for (cursor = (const unsigned char *)bytes; *cursor; cursor++)
+  {
+    BOOL space = (*cursor == ' ' || *cursor == '\n' || *cursor == '\t' || *cursor == '\r');
+
+    if (!space && !inWord)
+    {
+      words++;
+    }
+    inWord = !space;
+    length++;
+  }
+
+  return length * TOKEN_ESTIMATOR_BYTE_WEIGHT + words * TOKEN_ESTIMATOR_WORD_WEIGHT;
+}
+
+
+/** Uncalibrated estimate for a message's content: a string or text blocks. */
+static double TokenEstimatorRawContent(id content)
+{
+  NSEnumerator *blockEnum;
+  NSDictionary *block;
+  double raw = 0;
+
+  if ([content isKindOfClass:[NSString class]])
+  {
+    return TokenEstimatorRaw([content UTF8String]);
+  }
+  if (![content isKindOfClass:[NSArray class]])
+  {
+    return 0;
+  }
+
+  blockEnum = [content objectEnumerator];
+  while ((block = [blockEnum nextObject]))
+  {
+    if ([block isKindOfClass:[NSDictionary class]])
+    {
+      raw += TokenEstimatorRaw([[block objectForKey:@"text"] UTF8String]);
+    }
+  }
+
+  return raw;
+}
+
+
+@implementation TokenEstimator
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Singleton
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
++ (void)initialize
+{
+  if (self == [TokenEstimator class] && sharedInstance == nil)
+  {
+    sharedInstance = [[TokenEstimator alloc] init];
+  }
+}
+
+
++ (TokenEstimator *)sharedEstimator
+{
+  return sharedInstance;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Lifecycle
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (id)init
+{
+  self = [super init];
+
+  if (self)
+  {
+    _scale = 1.0;
+    _lock = [[NSLock alloc] init];
+  }
+
+  return self;
+}
+
+
+- (void)dealloc
+{
+  [_lock release];
+
+  [super dealloc];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Estimates
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (unsigned long)estimatedTokensForString:(NSString *)text
+{
+  return (unsigned long)(TokenEstimatorRaw([text UTF8String]) * [self scale] + 0.5);
+}
+
+
+- (unsigned long)estimatedTokensForMessages:(NSArray *)messages
+{
+  NSEnumerator *messageEnum = [messages objectEnumerator];
+  NSDictionary *message;
+  double raw = 0;
+
+  while ((message = [messageEnum nextObject]))
+  {
+    raw += TokenEstimatorRawContent([message objectForKey:@"content"]);
+    raw += TOKEN_ESTIMATOR_MESSAGE_OVERHEAD;
+  }
+
+  return (unsigned long)(raw * [self scale] + 0.5);
+}
+
+
+- (double)scale
+{
+  double scale;
+
+  [_lock lock];
+  scale = _scale;
+  [_lock unlock];
+
+  return scale;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Calibration
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (void)recordActualTokens:(unsigned long)actual forEstimatedTokens:(unsigned long)estimated
+{
+  double observed;
+
+  if (estimated < TOKEN_ESTIMATOR_MIN_CALIBRATION || actual == 0)
+  {
+    return;
+  }
+
+  [_lock lock];
+  // The estimate already carried the current scale; this is what it should have been
+  observed = _scale * (double)actual / (double)estimated;
+  _scale += (observed - _scale) * TOKEN_ESTIMATOR_SMOOTHING;
+  if (_scale < TOKEN_ESTIMATOR_MIN_SCALE)
+  {
+    _scale = TOKEN_ESTIMATOR_MIN_SCALE;
+  }
+  else if (_scale > TOKEN_ESTIMATOR_MAX_SCALE)
+  {
+    _scale = TOKEN_ESTIMATOR_MAX_SCALE;
+  }
+  [_lock unlock];
+}
+
+@end
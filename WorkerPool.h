@@ -0,0 +1,137 @@
+////////////////////////////////////////////////////////////////////////////////
+// WorkerPool.h
+// ClaudeChat
+//
+// A small set of long-lived background threads fed from bounded, prioritised
+// queues, used instead of starting a new thread for every piece of
+// background work.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import <Foundation/Foundation.h>
+
+
+/** Threads in the shared pool. Enough for a few windows sending at once. */
+#define WORKER_POOL_DEFAULT_THREADS 4
+
+/** Tasks each priority level of the shared pool will hold before refusing more. */
+#define WORKER_POOL_DEFAULT_QUEUE_LIMIT 32
+
+
+/**
+ * Task priorities, most urgent first. A free thread always takes the
+ * oldest task of the most urgent non-empty level.
+ */
+typedef enum
+{
+  /** Work the user is waiting on, such as sending a message */
+  WorkerPoolPriorityInteractive = 0,
+
+  /** Ordinary background work */
+  WorkerPoolPriorityDefault,
+
+  /** Housekeeping that can wait, such as saving conversations */
+  WorkerPoolPriorityBackground,
+
+  WorkerPoolPriorityCount
+} WorkerPoolPriority;
+
+
+////////////////////////////////////////////////////////////////////////////////
+/**
+ * @class WorkerPool
+ * @brief Bounded thread pool with priorities, built on NSThread
+ *
+ * Threads are started on demand, up to the pool's limit, and then kept
+ * for reuse; starting a thread is slow on older machines and a burst of
+ * sends should not become a burst of threads. Each task runs inside its
+ * own autorelease pool.
+ *
+ * Interactive tasks (API requests) may block for minutes while a reply
+ * streams in, so they are never given the last thread: with a limit of
+ * N threads at most N-1 run interactive work, and saves keep moving even
+ * while every window is waiting on the network.
+ *
+ * Each priority level has its own bounded queue. When a level is full,
+ * -performSelector:onTarget:withObject:priority: refuses the task and
+ * returns NO; the caller decides whether to do the work itself, report
+ * an error or drop it. The pool never blocks the calling thread.
+ *
+ * All methods may be called from any thread. Pools live for the life of
+ * the process; their threads are never stopped. Most callers should use
+ * [WorkerPool sharedPool].
+ */
+@interface WorkerPool : NSObject
+{
+  NSConditionLock *_lock;
+  NSMutableArray *_queues[WorkerPoolPriorityCount];
+  unsigned int _running[WorkerPoolPriorityCount];
+  unsigned int _threadLimit;
+  unsigned int _queueLimit;
+  unsigned int _threadCount;
+  unsigned int _idleThreads;
+}
+
+
+/**
+ * Returns the pool shared by the application's background work.
+ *
+ * @return The shared WorkerPool instance
+ */
++ (WorkerPool *)sharedPool;
+
+
+/**
+ * Creates a pool. No threads are started until work arrives.
+ *
+ * @param threadLimit Most threads the pool will start (at least 1)
+ * @param queueLimit Most tasks waiting per priority level (at least 1)
+ * @return Initialised pool
+ */
+- (id)initWithThreadLimit:(unsigned int)threadLimit
+               queueLimit:(unsigned int)queueLimit;
+
+
+/**
+ * Queues [target performSelector:selector withObject:object] to run on
+ * a pool thread. Target and object are retained until the task has run.
+ *
+ * @param selector Method taking one object argument
+ * @param target Receiver
+ * @param object Argument, may be nil
+ * @param priority Queue to place the task in
+ * @return YES if queued, NO if that priority's queue is full
+ */
+- (BOOL)performSelector:(SEL)selector
+               onTarget:(id)target
+             withObject:(id)object
+               priority:(WorkerPoolPriority)priority;
+
+
+/**
+ * Tasks queued at a priority and not yet started.
+ *
+ * @param priority Priority level
+ * @return Number of waiting tasks
+ */
+- (unsigned int)pendingCountForPriority:(WorkerPoolPriority)priority;
+
+
+/**
+ * Tasks currently running on pool threads, across all priorities.
+ *
+ * @return Number of running tasks
+ */
+- (unsigned int)runningCount;
+
+
+/**
+ * Threads started so far.
+ *
+ * @return Thread count, never more than the pool's limit
+ */
+- (unsigned int)threadCount;
+
+@end
@@ -0,0 +1,337 @@
+////////////////////////////////////////////////////////////////////////////////
+// WorkerPool.m
+// ClaudeChat
+//
+// Bounded, prioritised thread pool on NSThread and NSConditionLock.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import "WorkerPool.h"
+
+
+// NSConditionLock conditions: whether some queued task may start now
+#define WORKER_POOL_NOTHING_RUNNABLE 0
+#define WORKER_POOL_RUNNABLE 1
+
+static WorkerPool *sharedInstance = nil;
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Task
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+/** One queued call. */
+@interface WorkerPoolTask : NSObject
+{
+  id _target;
+  SEL _selector;
+  id _object;
+}
+
+- (id)initWithTarget:(id)target selector:(SEL)selector object:(id)object;
+- (void)run;
+
+@end
+
+
+@implementation WorkerPoolTask
+
+- (id)initWithTarget:(id)target selector:(SEL)selector object:(id)object
+{
+  self = [super init];
+
+  if (self)
+  {
+    _target = [target retain];
+    _selector = selector;
+    _object = [object retain];
+  }
+
+  return self;
+}
+
+
+- (void)dealloc
+{
+  [_target release];
+  [_object release];
+
+  [super dealloc];
+}
+
+
+- (void)run
+{
+  [_target performSelector:_selector withObject:_object];
+}
+
+@end
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Private Interface
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+@interface WorkerPool (Private)
+
+- (int)nextRunnablePriority;
+- (int)runnableCondition;
+- (void)workerMain:(id)unused;
+
+@end
+
+
+@implementation WorkerPool
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Singleton
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
++ (void)initialize
+{
+  if (self == [WorkerPool class] && sharedInstance == nil)
+  {
+    sharedInstance = [[WorkerPool alloc]
+                      initWithThreadLimit:WORKER_POOL_DEFAULT_THREADS
+                               queueLimit:WORKER_POOL_DEFAULT_QUEUE_LIMIT];
+  }
+}
+
+
++ (WorkerPool *)sharedPool
+{
+  return sharedInstance;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Lifecycle
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (id)init
+{
+  return [self initWithThreadLimit:WORKER_POOL_DEFAULT_THREADS
+                        queueLimit:WORKER_POOL_DEFAULT_QUEUE_LIMIT];
+}
+
+
+- (id)initWithThreadLimit:(unsigned int)threadLimit
+               queueLimit:(unsigned int)queueLimit
+{
+  int priority;
+
+  self = [super init];
+
+  if (self)
+  {
+    _lock = [[NSConditionLock alloc] initWithCondition:WORKER_POOL_NOTHING_RUNNABLE];
+    for (priority = 0; priority < WorkerPoolPriorityCount; priority++)
+    {
+      _queues[priority] = [[NSMutableArray alloc] init];
+    }
+    _threadLimit = threadLimit > 0 ? threadLimit : 1;
+    _queueLimit = queueLimit > 0 ? queueLimit : 1;
+  }
+
+  return self;
+}
+
+
+- (void)dealloc
+{
+  int priority;
+
+  for (priority = 0; priority < WorkerPoolPriorityCount; priority++)
+  {
+    [_queues[priority] release];
+  }
+  [_lock release];
+
+  [super dealloc];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Queueing
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (BOOL)performSelector:(SEL)selector
+               onTarget:(id)target
+             withObject:(id)object
+               priority:(WorkerPoolPriority)priority
+{
+  WorkerPoolTask *task;
+  unsigned int pending = 0;
+  BOOL startThread = NO;
+  int level;
+
+  if (priority < 0 || priority >= WorkerPoolPriorityCount)
+  {
+    priority = WorkerPoolPriorityDefault;
+  }
+
+  task = [[WorkerPoolTask alloc] initWithTarget:target selector:selector object:object];
+
+  [_lock lock];
+  if ([_queues[priority] count] >= _queueLimit)
+  {
+    [_lock unlockWithCondition:[self runnableCondition]];
+    [task release];
+    return NO;
+  }
+  [_queues[priority] addObject:task];
+
+  // Start another thread only if the idle ones cannot cover the backlog
+  for (level = 0; level < WorkerPoolPriorityCount; level++)
+  {
+    pending += [_queues[level] count];
+  }
+  if (pending > _idleThreads && _threadCount < _threadLimit)
+  {
+    _threadCount++;
+    _idleThreads++;
+    startThread = YES;
+  }
+  [_lock unlockWithCondition:[self runnableCondition]];
+  [task release];
+
+  if (startThread)
+  {
+    [NSThread detachNewThreadSelector:@selector(workerMain:) toTarget:self withObject:nil];
+  }
+
+  return YES;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Status
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+- (unsigned int)pendingCountForPriority:(WorkerPoolPriority)priority
+{
+  unsigned int count = 0;
+
+  if (priority >= 0 && priority < WorkerPoolPriorityCount)
+  {
+    [_lock lock];
+    count = [_queues[priority] count];
+    [_lock unlockWithCondition:[self runnableCondition]];
+  }
+
+  return count;
+}
+
+
+- (unsigned int)runningCount
+{
+  unsigned int count = 0;
+  int priority;
+
+  [_lock lock];
+  for (priority = 0; priority < WorkerPoolPriorityCount; priority++)
+  {
+    count += _running[priority];
+  }
+  [_lock unlockWithCondition:[self runnableCondition]];
+
+  return count;
+}
+
+
+- (unsigned int)threadCount
+{
+  unsigned int count;
+
+  [_lock lock];
+  count = _threadCount;
+  [_lock unlockWithCondition:[self runnableCondition]];
+
+  return count;
+}
+
+@end
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Private Implementation
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+@implementation WorkerPool (Private)
+
+/**
+ * The priority a free thread should take from next, or
+ * WorkerPoolPriorityCount if nothing may start. Interactive work is
+ * held back once it occupies all threads but one. Call with _lock held.
+ */
+- (int)nextRunnablePriority
+{
+  unsigned int interactiveLimit = _threadLimit > 1 ? _threadLimit - 1 : 1;
+  int priority;
+
+  for (priority = 0; priority < WorkerPoolPriorityCount; priority++)
+  {
+    if ([_queues[priority] count] == 0)
+    {
+      continue;
+    }
+    if (priority == WorkerPoolPriorityInteractive &&
+        _running[priority] >= interactiveLimit)
+    {
+      continue;
+    }
+    return priority;
+  }
+
+  return WorkerPoolPriorityCount;
+}
+
+
+/** Condition to leave _lock with. Call with _lock held. */
+- (int)runnableCondition
+{
+  return [self nextRunnablePriority] < WorkerPoolPriorityCount
+    ? WORKER_POOL_RUNNABLE
+    : WORKER_POOL_NOTHING_RUNNABLE;
+}
+
+
+/** Body of every pool thread: take the most urgent runnable task, run it, repeat. */
+- (void)workerMain:(id)unused
+{
+  NSAutoreleasePool *pool;
+  WorkerPoolTask *task;
+  int priority;
+
+  for (;;)
+  {
+    [_lock lockWhenCondition:WORKER_POOL_RUNNABLE];
+    priority = [self nextRunnablePriority];
+    task = [[_queues[priority] objectAtIndex:0] retain];
+    [_queues[priority] removeObjectAtIndex:0];
+    _running[priority]++;
+    _idleThreads--;
+    [_lock unlockWithCondition:[self runnableCondition]];
+
+    pool = [[NSAutoreleasePool alloc] init];
+    [task run];
+    [task release];
+    [pool release];
+
+    [_lock lock];
+    _running[priority]--;
+    _idleThreads++;
+    [_lock unlockWithCondition:[self runnableCondition]];
+  }
+}
+
+@end
@@ -0,0 +1,419 @@
+////////////////////////////////////////////////////////////////////////////////
+// HTTPSBenchmark.m
+// ClaudeChat Benchmarks
+//
+// Drives HTTPSClient against the loopback mock server through a fixed set
+// of scenarios and reports throughput, latency percentiles and client CPU
+// time per request. The server runs in a forked process, so the CPU figures
+// are the client's alone.
+//
+// Usage: httpsbench [-n requests] [-b body-bytes] [-s name-filter] [-v]
+//
+// Compatibility: Mac OS X 10.4 Tiger and later, Linux (GNUstep)
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import <Foundation/Foundation.h>
+#import "HTTPSClient.h"
+#import "NetworkMetrics.h"
+
+#include "MockTLSServer.h"
+
+#include <sys/time.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/** Requests per scenario unless -n says otherwise. */
+#define BENCH_DEFAULT_REQUESTS 100
+
+/** Request body size unless -b says otherwise; about a short conversation. */
+#define BENCH_DEFAULT_BODY_BYTES 2048
+
+
+/**
+ * One benchmark case. The query string is passed to the mock server, which
+ * shapes its reply from it (see MockTLSServer.h). Big bodies run fewer
+ * requests, by `divisor`, so every scenario takes a similar time. With
+ * `prewarm`, each request is preceded by a fresh pre-warmed connection,
+ * and counts as failed unless it went out on that connection and the
+ * pre-warm handshake resumed a cached session.
+ */
+typedef struct
+{
+  const char *name;
+  const char *query;
+  BOOL streaming;
+  int expectedStatus;
+  int divisor;
+  BOOL prewarm;
+} BenchScenario;
+
+
+static const BenchScenario BenchScenarios[] =
+{
+  // Small replies on a pooled connection: per-request overhead
+  { "json-1k",          "size=1024",                                     NO,  200, 1, NO },
+
+  // A new connection each time: connect plus (resumed) TLS handshake
+  { "json-1k-close",    "size=1024&close=1",                             NO,  200, 1, NO },
+
+  // Connection opened ahead of the send: session tickets must be read and
+  // the parked connection reused
+  { "json-1k-prewarm",  "size=1024",                                     NO,  200, 1, YES },
+
+  // Server checks the request carries cache breakpoints and reports cache usage
+  { "json-1k-cache",    "size=1024&cache=1",                             NO,  200, 1, NO },
+
+  // Time to first byte dominated by the server
+  { "json-1k-ttfb20",   "size=1024&delay=20",                            NO,  200, 4, NO },
+
+  // Large bodies: pre-sizing and in-place reads
+  { "json-1m",          "size=1048576",                                  NO,  200, 4, NO },
+  { "json-10m",         "size=10485760",                                 NO,  200, 20, NO },
+  { "json-1m-chunked",  "size=1048576&chunked=1&write=8192",             NO,  200, 4, NO },
+
+  // Compression: wire vs. decoded bytes, and the cost of inflating
+  { "json-1m-gzip",     "size=1048576&gzip=1",                           NO,  200, 4, NO },
+
+  // Streamed replies in small writes, as the API sends them
+  { "sse-16k",          "size=16384&stream=1&chunked=1&write=256",       YES, 200, 1, NO },
+  { "sse-16k-gzip",     "size=16384&stream=1&chunked=1&write=256&gzip=1", YES, 200, 1, NO },
+
+  // Error replies with rate-limit headers
+  { "status-429",       "status=429&ratelimit=1",                        NO,  429, 1, NO },
+  { "status-529",       "status=529",                                    NO,  529, 1, NO }
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Stream Sink
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Stream delegate that only counts what it is given, so streaming
+ * scenarios measure the transport rather than a consumer.
+ */
+@interface BenchStreamSink : NSObject
+{
+  unsigned long long _received;
+}
+
+- (unsigned long long)received;
+- (void)reset;
+
+@end
+
+
+@implementation BenchStreamSink
+
+- (unsigned long long)received
+{
+  return _received;
+}
+
+
+- (void)reset
+{
+  _received = 0;
+}
+
+
+- (void)httpsClient:(HTTPSClient *)client didReceiveBytes:(const char *)bytes length:(unsigned long)length
+{
+  _received += length;
+}
+
+@end
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Helpers
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+static double BenchNow(void)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (double)now.tv_sec + (double)now.tv_usec / 1e6;
+}
+
+
+/** User plus system CPU time of this process, in seconds. */
+static double BenchCPUTime(void)
+{
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  return (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6 +
+         (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+}
+
+
+static int BenchCompareDoubles(const void *a, const void *b)
+{
+  double left = *(const double *)a;
+  double right = *(const double *)b;
+
+  return (left > right) - (left < right);
+}
+
+
+/** Nearest-rank percentile of sorted samples. */
+static double BenchPercentile(const double *sorted, int count, double percentile)
+{
+  int rank = (int)(percentile / 100.0 * count + 0.999999);
+
+  if (rank < 1)
+  {
+    rank = 1;
+  }
+  if (rank > count)
+  {
+    rank = count;
+  }
+  return sorted[rank - 1];
+}
+
+
+/**
+ * A Messages API request body of roughly the given size, shaped like the
+ * app's: the user turn is a text block with a prompt cache breakpoint.
+ */
+static NSData *BenchRequestBody(unsigned long size)
+{
+  NSMutableString *text = [NSMutableString string];
+  NSString *json;
+
+  while ([text length] < size)
+  {
+    [text appendString:@"Please summarise the benchmark results so far. "];
+  }
+  json = [NSString stringWithFormat:
+          @"{\"model\":\"mock\",\"max_tokens\":1024,\"stream\":false,"
+          @"\"messages\":[{\"role\":\"user\",\"content\":[{\"type\":\"text\",\"text\":\"%@\","
+          @"\"cache_control\":{\"type\":\"ephemeral\"}}]}]}", text];
+
+  return [json dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Scenarios
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Runs one scenario and prints its row. Returns the number of requests
+ * that did not end with the expected status.
+ */
+static int BenchRunScenario(const BenchScenario *scenario, int port, int requests, NSData *body)
+{
+  NSDictionary *headers;
+  NSString *path;
+  BenchStreamSink *sink;
+  double *latencies;
+  double wallStart;
+  double wallTime;
+  double cpuStart;
+  double cpuTime;
+  unsigned long long wireBytes = 0;
+  unsigned long long decodedBytes = 0;
+  int failures = 0;
+  int i;
+
+  if (requests < 1)
+  {
+    requests = 1;
+  }
+
+  headers = [NSDictionary dictionaryWithObjectsAndKeys:
+             @"mock-key", @"x-api-key",
+             @"2023-06-01", @"anthropic-version",
+             @"application/json", @"content-type",
+             nil];
+  path = [NSString stringWithFormat:@"/v1/messages?%s", scenario->query];
+  sink = [[BenchStreamSink alloc] init];
+  latencies = malloc(sizeof(double) * requests);
+
+  // One warm-up request so the first sample does not carry the handshake
+  {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    HTTPSClient *client = [[[HTTPSClient alloc] initWithHost:@"127.0.0.1" port:port] autorelease];
+
+    [client sendPOSTRequest:path headers:headers body:body];
+    [pool release];
+  }
+
+  cpuStart = BenchCPUTime();
+  wallStart = BenchNow();
+  for (i = 0; i < requests; i++)
+  {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    HTTPSClient *client = [[[HTTPSClient alloc] initWithHost:@"127.0.0.1" port:port] autorelease];
+    unsigned long resumedBefore = [HTTPSClient resumedHandshakeCount];
+    BOOL warmed = NO;
+    double started;
+    BOOL answered;
+
+    if (scenario->prewarm)
+    {
+      // Only the connection opened here may be in the pool
+      [HTTPSClient closeIdleConnections];
+      warmed = [client prewarmConnection];
+    }
+
+    started = BenchNow();
+
+    if (scenario->streaming)
+    {
+      answered = [client sendStreamingRequest:@"POST"
+                                         path:path
+                                      headers:headers
+                                         body:body
+                                     delegate:sink];
+    }
+    else
+    {
+      answered = ([client sendPOSTRequest:path headers:headers body:body] != nil);
+    }
+    latencies[i] = BenchNow() - started;
+
+    if (!answered || [client lastStatusCode] != scenario->expectedStatus)
+    {
+      failures++;
+    }
+    else if (scenario->prewarm &&
+             (!warmed || ![client lastMetrics].reusedConnection ||
+              [HTTPSClient resumedHandshakeCount] == resumedBefore))
+    {
+      failures++;
+    }
+    wireBytes += [client lastBodyWireLength];
+    decodedBytes += [client lastBodyDecodedLength];
+    [pool release];
+  }
+  wallTime = BenchNow() - wallStart;
+  cpuTime = BenchCPUTime() - cpuStart;
+
+  qsort(latencies, requests, sizeof(double), BenchCompareDoubles);
+  printf("%-17s %6d %9.1f %9.2f %9.2f %9.1f %11.1f %11.1f %5d\n",
+         scenario->name,
+         requests,
+         requests / wallTime,
+         BenchPercentile(latencies, requests, 50) * 1000.0,
+         BenchPercentile(latencies, requests, 99) * 1000.0,
+         cpuTime / requests * 1e6,
+         (double)wireBytes / requests / 1024.0,
+         (double)decodedBytes / requests / 1024.0,
+         failures);
+  fflush(stdout);
+
+  free(latencies);
+  [sink release];
+  return failures;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Main
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+static void BenchUsage(const char *program)
+{
+  fprintf(stderr,
+          "usage: %s [-n requests] [-b body-bytes] [-s name-filter] [-v]\n"
+          "  -n  requests per scenario (default %d; large bodies run fewer)\n"
+          "  -b  request body size in bytes (default %d)\n"
+          "  -s  only run scenarios whose name contains this text\n"
+          "  -v  keep HTTPSClient's per-request log lines\n",
+          program, BENCH_DEFAULT_REQUESTS, BENCH_DEFAULT_BODY_BYTES);
+}
+
+
+int main(int argc, char *argv[])
+{
+  MockTLSServer server;
+  NSAutoreleasePool *pool;
+  NSData *body;
+  const char *filter = NULL;
+  int requests = BENCH_DEFAULT_REQUESTS;
+  unsigned long bodyBytes = BENCH_DEFAULT_BODY_BYTES;
+  BOOL verbose = NO;
+  int failures = 0;
+  unsigned int i;
+  int option;
+
+  // A server closing a pooled connection must fail the write, not end the run
+  signal(SIGPIPE, SIG_IGN);
+
+  while ((option = getopt(argc, argv, "n:b:s:vh")) != -1)
+  {
+    switch (option)
+    {
+      case 'n':
+        requests = atoi(optarg);
+        break;
+      case 'b':
+        bodyBytes = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        filter = optarg;
+        break;
+      case 'v':
+        verbose = YES;
+        break;
+      default:
+        BenchUsage(argv[0]);
+        return 2;
+    }
+  }
+
+  // Fork the server before Foundation starts any threads of its own
+  if (MockTLSServerPrepare(&server) != 0 || MockTLSServerFork(&server) != 0)
+  {
+    return 1;
+  }
+
+  pool = [[NSAutoreleasePool alloc] init];
+  if (![HTTPSClient trustCertificatesInFile:[NSString stringWithUTF8String:server.certificatePath]])
+  {
+    fprintf(stderr, "Could not trust the mock server certificate\n");
+    MockTLSServerStop(&server);
+    return 1;
+  }
+  [HTTPSClient setLogsRequests:verbose];
+  body = BenchRequestBody(bodyBytes);
+
+  printf("Mock server on 127.0.0.1:%d, request body %lu bytes\n\n", server.port, (unsigned long)[body length]);
+  printf("%-17s %6s %9s %9s %9s %9s %11s %11s %5s\n",
+         "scenario", "reqs", "req/s", "p50 ms", "p99 ms", "cpu us", "wire KB", "decoded KB", "fail");
+
+  for (i = 0; i < sizeof(BenchScenarios) / sizeof(BenchScenarios[0]); i++)
+  {
+    if (filter && !strstr(BenchScenarios[i].name, filter))
+    {
+      continue;
+    }
+    failures += BenchRunScenario(&BenchScenarios[i], server.port,
+                                 requests / BenchScenarios[i].divisor, body);
+  }
+
+  printf("\nTLS handshakes: %lu full, %lu resumed\n",
+         [HTTPSClient fullHandshakeCount], [HTTPSClient resumedHandshakeCount]);
+  printf("%s\n", [[[NetworkMetrics sharedMetrics] summaryForHost:@"127.0.0.1"] UTF8String]);
+
+  [HTTPSClient closeIdleConnections];
+  MockTLSServerStop(&server);
+  [pool release];
+
+  return failures > 0 ? 1 : 0;
+}
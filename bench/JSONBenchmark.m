@@ -0,0 +1,340 @@
+////////////////////////////////////////////////////////////////////////////////
+// JSONBenchmark.m
+// ClaudeChat Benchmarks
+//
+// Times request body serialisation for conversations of 1 to 1000 turns:
+// the string-building serialiser ClaudeAPIManager used to have against
+// JSONWriter, and checks that each one's output parses.
+//
+// Usage: jsonbench [-n runs] [-t max-turns]
+//
+// Compatibility: Mac OS X 10.4 Tiger and later, Linux (GNUstep)
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import <Foundation/Foundation.h>
+#import "JSONArena.h"
+#import "JSONWriter.h"
+
+#include "yyjson.h"
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/** Serialisations per conversation size, scaled down for long ones. */
+#define BENCH_DEFAULT_RUNS 2000
+
+/** Longest conversation unless -t says otherwise. */
+#define BENCH_DEFAULT_MAX_TURNS 1000
+
+
+/** Conversation lengths measured, in turns. */
+static const int BenchTurnCounts[] = { 1, 3, 10, 30, 100, 300, 1000 };
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Legacy Serialiser
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+// The serialiser ClaudeAPIManager had before JSONWriter, as functions:
+// appendFormat: and four replacements per string, escaping only quotes,
+// newlines, returns and tabs. Its test for BOOLs (added for "stream")
+// compared objCType with @encode(BOOL), which misses them on arm64; it uses
+// JSONWriter's test here so both serialisers write the same values.
+
+static NSString *LegacyArrayToJSON(NSArray *array);
+
+static NSString *LegacyDictionaryToJSON(NSDictionary *dict)
+{
+  NSMutableString *json = [NSMutableString stringWithString:@"{"];
+  NSArray *keys = [dict allKeys];
+  int i;
+
+  for (i = 0; i < [keys count]; i++)
+  {
+    NSString *key = [keys objectAtIndex:i];
+    id value = [dict objectForKey:key];
+
+    if (i > 0) [json appendString:@","];
+    [json appendFormat:@"\"%@\":", key];
+
+    if ([value isKindOfClass:[NSString class]])
+    {
+      NSString *escaped = [(NSString *)value stringByReplacingOccurrencesOfString:@"\""
+                                                                       withString:@"\\\""];
+      escaped = [escaped stringByReplacingOccurrencesOfString:@"\n" withString:@"\\n"];
+      escaped = [escaped stringByReplacingOccurrencesOfString:@"\r" withString:@"\\r"];
+      escaped = [escaped stringByReplacingOccurrencesOfString:@"\t" withString:@"\\t"];
+      [json appendFormat:@"\"%@\"", escaped];
+    }
+    else if ([value isKindOfClass:[NSNumber class]])
+    {
+      if ([JSONWriter isBooleanNumber:value])
+      {
+        [json appendString:[value boolValue] ? @"true" : @"false"];
+      }
+      else
+      {
+        [json appendFormat:@"%@", value];
+      }
+    }
+    else if ([value isKindOfClass:[NSArray class]])
+    {
+      [json appendString:LegacyArrayToJSON(value)];
+    }
+    else if ([value isKindOfClass:[NSDictionary class]])
+    {
+      [json appendString:LegacyDictionaryToJSON(value)];
+    }
+  }
+  [json appendString:@"}"];
+  return json;
+}
+
+
+static NSString *LegacyArrayToJSON(NSArray *array)
+{
+  NSMutableString *json = [NSMutableString stringWithString:@"["];
+  int i;
+
+  for (i = 0; i < [array count]; i++)
+  {
+    id value = [array objectAtIndex:i];
+
+    if (i > 0) [json appendString:@","];
+
+    if ([value isKindOfClass:[NSString class]])
+    {
+      NSString *escaped = [(NSString *)value stringByReplacingOccurrencesOfString:@"\""
+                                                                       withString:@"\\\""];
+      escaped = [escaped stringByReplacingOccurrencesOfString:@"\n" withString:@"\\n"];
+      escaped = [escaped stringByReplacingOccurrencesOfString:@"\r" withString:@"\\r"];
+      escaped = [escaped stringByReplacingOccurrencesOfString:@"\t" withString:@"\\t"];
+      [json appendFormat:@"\"%@\"", escaped];
+    }
+    else if ([value isKindOfClass:[NSNumber class]])
+    {
+      if ([JSONWriter isBooleanNumber:value])
+      {
+        [json appendString:[value boolValue] ? @"true" : @"false"];
+      }
+      else
+      {
+        [json appendFormat:@"%@", value];
+      }
+    }
+    else if ([value isKindOfClass:[NSDictionary class]])
+    {
+      [json appendString:LegacyDictionaryToJSON(value)];
+    }
+  }
+  [json appendString:@"]"];
+  return json;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Helpers
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+/** User plus system CPU time of this process, in seconds. */
+static double BenchCPUTime(void)
+{
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  return (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6 +
+         (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+}
+
+
+/** Whether yyjson accepts the bytes as a JSON document. */
+static BOOL BenchIsValidJSON(const char *bytes, size_t length)
+{
+  yyjson_doc *doc = yyjson_read(bytes, length, 0);
+
+  if (!doc)
+  {
+    return NO;
+  }
+  yyjson_doc_free(doc);
+  return YES;
+}
+
+
+/**
+ * A request body shaped like the app's: alternating turns of a few
+ * hundred bytes with code, quotes, a Windows path and non-ASCII text, the
+ * last user turn as a text block carrying a cache breakpoint. The text
+ * comes from C strings, as Tiger's compiler only takes ASCII in @"".
+ */
+static NSDictionary *BenchRequestBody(int turns)
+{
+  NSMutableArray *messages = [NSMutableArray arrayWithCapacity:turns];
+  NSString *userText = [NSString stringWithUTF8String:
+                        "Why does this print \"nil\"?\n\n\tNSString *path = @\"C:\\\\Users\\\\me\";\n"
+                        "It worked on 10.4 but not on 10.5 \xe2\x80\x94 any idea? Thanks!"];
+  NSString *replyText = [NSString stringWithUTF8String:
+                         "The string is released before it is used. In `-loadPath` you return "
+                         "`[path autorelease]` but the caller never retains it:\n\n```objc\n"
+                         "NSString *p = [self loadPath];\n[p retain]; // keep it past the pool\n```\n\n"
+                         "On 10.5 the pool drains sooner, which is why it shows up there first. \xe2\x9c\x93"];
+  int turn;
+
+  for (turn = 0; turn < turns; turn++)
+  {
+    BOOL isUser = (turn % 2 == 0);
+    id content = isUser ? userText : replyText;
+
+    if (turn == turns - 1)
+    {
+      content = [NSArray arrayWithObject:
+                 [NSDictionary dictionaryWithObjectsAndKeys:
+                  @"text", @"type",
+                  content, @"text",
+                  [NSDictionary dictionaryWithObject:@"ephemeral" forKey:@"type"], @"cache_control",
+                  nil]];
+    }
+    [messages addObject:[NSDictionary dictionaryWithObjectsAndKeys:
+                         isUser ? @"user" : @"assistant", @"role",
+                         content, @"content",
+                         nil]];
+  }
+
+  return [NSDictionary dictionaryWithObjectsAndKeys:
+          @"claude-sonnet-4-5-20250929", @"model",
+          messages, @"messages",
+          [NSNumber numberWithInt:64000], @"max_tokens",
+          [NSNumber numberWithBool:YES], @"stream",
+          nil];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Main
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+static void BenchUsage(const char *program)
+{
+  fprintf(stderr,
+          "usage: %s [-n runs] [-t max-turns]\n"
+          "  -n  serialisations of a one-turn conversation (default %d; longer ones run fewer)\n"
+          "  -t  longest conversation to measure, in turns (default %d)\n",
+          program, BENCH_DEFAULT_RUNS, BENCH_DEFAULT_MAX_TURNS);
+}
+
+
+int main(int argc, char *argv[])
+{
+  NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+  JSONWriter *writer = [[JSONWriter alloc] init];
+  int runs = BENCH_DEFAULT_RUNS;
+  int maxTurns = BENCH_DEFAULT_MAX_TURNS;
+  int invalid = 0;
+  unsigned int i;
+  int option;
+
+  while ((option = getopt(argc, argv, "n:t:h")) != -1)
+  {
+    switch (option)
+    {
+      case 'n':
+        runs = atoi(optarg);
+        break;
+      case 't':
+        maxTurns = atoi(optarg);
+        break;
+      default:
+        BenchUsage(argv[0]);
+        return 2;
+    }
+  }
+
+  printf("%6s %6s %10s %10s %10s %8s %6s %6s\n",
+         "turns", "runs", "body KB", "legacy us", "yyjson us", "speedup", "legacy", "yyjson");
+
+  for (i = 0; i < sizeof(BenchTurnCounts) / sizeof(BenchTurnCounts[0]); i++)
+  {
+    NSAutoreleasePool *sizePool = [[NSAutoreleasePool alloc] init];
+    int turns = BenchTurnCounts[i];
+    NSDictionary *body;
+    NSData *legacyData;
+    int sizeRuns;
+    double started;
+    double legacyTime;
+    double writerTime;
+    BOOL legacyValid;
+    BOOL writerValid;
+    int run;
+
+    if (turns > maxTurns)
+    {
+      [sizePool release];
+      break;
+    }
+    body = BenchRequestBody(turns);
+    sizeRuns = runs / turns;
+    if (sizeRuns < 3)
+    {
+      sizeRuns = 3;
+    }
+
+    // What the app sent: the string, then its UTF-8 bytes
+    started = BenchCPUTime();
+    for (run = 0; run < sizeRuns; run++)
+    {
+      NSAutoreleasePool *runPool = [[NSAutoreleasePool alloc] init];
+
+      [LegacyDictionaryToJSON(body) dataUsingEncoding:NSUTF8StringEncoding];
+      [runPool release];
+    }
+    legacyTime = (BenchCPUTime() - started) / sizeRuns;
+
+    started = BenchCPUTime();
+    for (run = 0; run < sizeRuns; run++)
+    {
+      NSAutoreleasePool *runPool = [[NSAutoreleasePool alloc] init];
+
+      [writer writeObject:body];
+      [runPool release];
+    }
+    writerTime = (BenchCPUTime() - started) / sizeRuns;
+
+    legacyData = [LegacyDictionaryToJSON(body) dataUsingEncoding:NSUTF8StringEncoding];
+    legacyValid = BenchIsValidJSON([legacyData bytes], [legacyData length]);
+    writerValid = [writer writeObject:body] && BenchIsValidJSON([writer bytes], [writer length]);
+    if (!writerValid)
+    {
+      invalid++;
+    }
+
+    printf("%6d %6d %10.1f %10.1f %10.1f %7.1fx %6s %6s\n",
+           turns,
+           sizeRuns,
+           [writer length] / 1024.0,
+           legacyTime * 1e6,
+           writerTime * 1e6,
+           writerTime > 0 ? legacyTime / writerTime : 0.0,
+           legacyValid ? "ok" : "BAD",
+           writerValid ? "ok" : "BAD");
+    fflush(stdout);
+    [sizePool release];
+  }
+
+  printf("\nWriter buffer after the run: %.1f KB\n", [writer capacity] / 1024.0);
+  printf("Arena high-water mark: %.1f KB, block kept: %.1f KB\n",
+         [[JSONArena currentArena] highWaterMark] / 1024.0, [[JSONArena currentArena] capacity] / 1024.0);
+
+  [writer release];
+  [pool release];
+
+  return invalid > 0 ? 1 : 0;
+}
@@ -0,0 +1,1219 @@
+////////////////////////////////////////////////////////////////////////////////
+// MockTLSServer.c
+// ClaudeChat Benchmarks
+//
+// Forked, thread-per-connection TLS server with a generated self-signed
+// certificate and canned Messages API responses.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later, Linux
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#include "MockTLSServer.h"
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include <openssl/ec.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+
+// Longest request header block accepted
+#define MOCK_MAX_REQUEST_HEAD 65536
+
+// Reply text is this sentence repeated; it compresses about as well as
+// real prose and needs no JSON escaping
+static const char MockFillerText[] =
+  "The quick brown fox jumps over the lazy dog while the benchmark counts "
+  "every byte that crosses the loopback interface. ";
+
+// Message batches remembered by the server
+#define MOCK_MAX_BATCHES 64
+
+// Status polls a batch answers "in_progress" to before it has ended
+#define MOCK_BATCH_POLLS 2
+
+static SSL_CTX *mockContext = NULL;
+static pthread_mutex_t mockCounterLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long mockRequestCount = 0;
+static int mockPort = 0;
+
+
+/** A growable byte buffer. */
+typedef struct
+{
+  char *bytes;
+  size_t length;
+  size_t capacity;
+} MockBuffer;
+
+
+/** A submitted message batch: its custom_ids, one per line. */
+typedef struct
+{
+  char *customIds;
+  unsigned long count;
+  unsigned long polls;
+} MockBatch;
+
+static pthread_mutex_t mockBatchLock = PTHREAD_MUTEX_INITIALIZER;
+static MockBatch mockBatches[MOCK_MAX_BATCHES];
+static int mockBatchCount = 0;
+
+
+/** What one request asked for, from its query string. */
+typedef struct
+{
+  unsigned long size;
+  unsigned long delta;
+  unsigned long writeSize;
+  unsigned long delay;
+  unsigned long interval;
+  int stream;
+  int chunked;
+  int gzip;
+  int status;
+  int close;
+  int rateLimit;
+  int cache;
+  unsigned long breakpoints;
+  unsigned long bodyLength;
+} MockOptions;
+
+
+// MARK: - Buffers
+
+static int MockAppend(MockBuffer *buffer, const char *bytes, size_t length)
+{
+  if (buffer->length + length > buffer->capacity)
+  {
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    char *grown;
+
+    while (capacity < buffer->length + length)
+    {
+      capacity *= 2;
+    }
+    grown = realloc(buffer->bytes, capacity);
+    if (!grown)
+    {
+      return -1;
+    }
+    buffer->bytes = grown;
+    buffer->capacity = capacity;
+  }
+
+  memcpy(buffer->bytes + buffer->length, bytes, length);
+  buffer->length += length;
+  return 0;
+}
+
+
+static int MockAppendString(MockBuffer *buffer, const char *string)
+{
+  return MockAppend(buffer, string, strlen(string));
+}
+
+
+/** Appends `length` bytes of filler text. */
+static int MockAppendFiller(MockBuffer *buffer, unsigned long length)
+{
+  size_t sentence = sizeof(MockFillerText) - 1;
+
+  while (length > 0)
+  {
+    size_t take = length < sentence ? length : sentence;
+
+    if (MockAppend(buffer, MockFillerText, take) != 0)
+    {
+      return -1;
+    }
+    length -= take;
+  }
+
+  return 0;
+}
+
+
+// MARK: - Certificate
+
+/**
+ * Makes a P-256 key and a self-signed certificate for localhost and
+ * 127.0.0.1, good for a day.
+ */
+static int MockGenerateCertificate(MockTLSServer *server)
+{
+  EVP_PKEY *key = NULL;
+  X509 *certificate = NULL;
+  X509_NAME *name;
+  X509_EXTENSION *extension;
+  X509V3_CTX extensionContext;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  key = EVP_EC_gen("P-256");
+#else
+  {
+    EC_KEY *ecKey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+
+    if (ecKey && EC_KEY_generate_key(ecKey) == 1)
+    {
+      EC_KEY_set_asn1_flag(ecKey, OPENSSL_EC_NAMED_CURVE);
+      key = EVP_PKEY_new();
+      if (key)
+      {
+        EVP_PKEY_assign_EC_KEY(key, ecKey);
+        ecKey = NULL;
+      }
+    }
+    EC_KEY_free(ecKey);
+  }
+#endif
+  if (!key)
+  {
+    return -1;
+  }
+
+  certificate = X509_new();
+  if (!certificate)
+  {
+    EVP_PKEY_free(key);
+    return -1;
+  }
+
+  X509_set_version(certificate, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(certificate), (long)time(NULL));
+  X509_gmtime_adj(X509_get_notBefore(certificate), -60);
+  X509_gmtime_adj(X509_get_notAfter(certificate), 24 * 60 * 60);
+  X509_set_pubkey(certificate, key);
+
+  name = X509_get_subject_name(certificate);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(certificate, name);
+
+  X509V3_set_ctx(&extensionContext, certificate, certificate, NULL, NULL, 0);
+  extension = X509V3_EXT_conf_nid(NULL, &extensionContext, NID_subject_alt_name,
+                                  "DNS:localhost,DNS:127.0.0.1,IP:127.0.0.1");
+  if (extension)
+  {
+    X509_add_ext(certificate, extension, -1);
+    X509_EXTENSION_free(extension);
+  }
+  extension = X509V3_EXT_conf_nid(NULL, &extensionContext, NID_basic_constraints, "critical,CA:TRUE");
+  if (extension)
+  {
+    X509_add_ext(certificate, extension, -1);
+    X509_EXTENSION_free(extension);
+  }
+
+  if (X509_sign(certificate, key, EVP_sha256()) == 0)
+  {
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    return -1;
+  }
+
+  server->key = key;
+  server->certificate = certificate;
+  return 0;
+}
+
+
+static int MockWriteCertificate(MockTLSServer *server)
+{
+  FILE *file;
+  int fd;
+
+  snprintf(server->certificatePath, sizeof(server->certificatePath), "/tmp/mocktls-XXXXXX");
+  fd = mkstemp(server->certificatePath);
+  if (fd < 0)
+  {
+    return -1;
+  }
+
+  file = fdopen(fd, "w");
+  if (!file)
+  {
+    close(fd);
+    return -1;
+  }
+  PEM_write_X509(file, (X509 *)server->certificate);
+  fclose(file);
+
+  return 0;
+}
+
+
+// MARK: - Requests
+
+/** Reads a numeric query option, or returns the default. */
+static unsigned long MockOption(const char *query, const char *name, unsigned long fallback)
+{
+  size_t nameLength = strlen(name);
+  const char *cursor = query;
+
+  while (cursor && *cursor)
+  {
+    if (strncmp(cursor, name, nameLength) == 0 && cursor[nameLength] == '=')
+    {
+      return strtoul(cursor + nameLength + 1, NULL, 10);
+    }
+    cursor = strchr(cursor, '&');
+    if (cursor)
+    {
+      cursor++;
+    }
+  }
+
+  return fallback;
+}
+
+
+static void MockParseOptions(const char *query, MockOptions *options)
+{
+  options->size = MockOption(query, "size", 1024);
+  options->delta = MockOption(query, "delta", 32);
+  options->writeSize = MockOption(query, "write", 16384);
+  options->delay = MockOption(query, "delay", 0);
+  options->interval = MockOption(query, "interval", 0);
+  options->stream = (int)MockOption(query, "stream", 0);
+  options->chunked = (int)MockOption(query, "chunked", 0);
+  options->gzip = (int)MockOption(query, "gzip", 0);
+  options->status = (int)MockOption(query, "status", 200);
+  options->close = (int)MockOption(query, "close", 0);
+  options->rateLimit = (int)MockOption(query, "ratelimit", 0);
+  options->cache = (int)MockOption(query, "cache", 0);
+  options->breakpoints = 0;
+  options->bodyLength = 0;
+
+  if (options->delta == 0)
+  {
+    options->delta = 32;
+  }
+  if (options->writeSize == 0)
+  {
+    options->writeSize = 16384;
+  }
+}
+
+
+// MARK: - Responses
+
+static const char *MockReason(int status)
+{
+  switch (status)
+  {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 404: return "Not Found";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 529: return "Overloaded";
+    default: return "Status";
+  }
+}
+
+
+/**
+ * Usage fields for a reply. With cache=1 the request's estimated input
+ * tokens (bytes / 4) are split into a small cache write and a large cache
+ * read, as on the later turns of a conversation.
+ */
+static void MockFormatUsage(const MockOptions *options, unsigned long outputTokens, char *usage, size_t size)
+{
+  unsigned long input = options->bodyLength / 4;
+  unsigned long written = options->breakpoints > 0 ? input / (options->breakpoints * 4) : 0;
+
+  if (options->cache)
+  {
+    snprintf(usage, size,
+             "{\"input_tokens\":10,\"output_tokens\":%lu,"
+             "\"cache_creation_input_tokens\":%lu,\"cache_read_input_tokens\":%lu}",
+             outputTokens, written, input - written);
+  }
+  else
+  {
+    snprintf(usage, size, "{\"input_tokens\":10,\"output_tokens\":%lu}", outputTokens);
+  }
+}
+
+
+static int MockBuildBody(const MockOptions *options, MockBuffer *body)
+{
+  char line[768];
+  char usage[256];
+  unsigned long sent;
+
+  if (options->cache && (options->breakpoints == 0 || options->breakpoints > 4))
+  {
+    // The API's own limit; zero means the client forgot to mark the prefix
+    snprintf(line, sizeof(line),
+             "{\"type\":\"error\",\"error\":{\"type\":\"invalid_request_error\","
+             "\"message\":\"Mock expected 1 to 4 cache_control breakpoints, got %lu\"}}",
+             options->breakpoints);
+    return MockAppendString(body, line);
+  }
+
+  if (options->status >= 400)
+  {
+    const char *type = "api_error";
+
+    if (options->status == 429)
+    {
+      type = "rate_limit_error";
+    }
+    else if (options->status == 529)
+    {
+      type = "overloaded_error";
+    }
+    snprintf(line, sizeof(line),
+             "{\"type\":\"error\",\"error\":{\"type\":\"%s\",\"message\":\"Mock status %d\"}}",
+             type, options->status);
+    return MockAppendString(body, line);
+  }
+
+  if (!options->stream)
+  {
+    if (MockAppendString(body, "{\"id\":\"msg_mock\",\"type\":\"message\",\"role\":\"assistant\","
+                               "\"model\":\"mock\",\"content\":[{\"type\":\"text\",\"text\":\"") != 0 ||
+        MockAppendFiller(body, options->size) != 0)
+    {
+      return -1;
+    }
+    MockFormatUsage(options, options->size / 4, usage, sizeof(usage));
+    snprintf(line, sizeof(line),
+             "\"}],\"stop_reason\":\"end_turn\",\"stop_sequence\":null,\"usage\":%s}",
+             usage);
+    return MockAppendString(body, line);
+  }
+
+  MockFormatUsage(options, 1, usage, sizeof(usage));
+  snprintf(line, sizeof(line),
+           "event: message_start\n"
+           "data: {\"type\":\"message_start\",\"message\":{\"id\":\"msg_mock\",\"type\":\"message\","
+           "\"role\":\"assistant\",\"model\":\"mock\",\"content\":[],\"stop_reason\":null,"
+           "\"usage\":%s}}\n\n",
+           usage);
+  if (MockAppendString(body, line) != 0 ||
+      MockAppendString(body,
+        "event: content_block_start\n"
+        "data: {\"type\":\"content_block_start\",\"index\":0,"
+        "\"content_block\":{\"type\":\"text\",\"text\":\"\"}}\n\n") != 0)
+  {
+    return -1;
+  }
+
+  for (sent = 0; sent < options->size; sent += options->delta)
+  {
+    unsigned long take = options->size - sent < options->delta ? options->size - sent : options->delta;
+
+    if (MockAppendString(body, "event: content_block_delta\n"
+                               "data: {\"type\":\"content_block_delta\",\"index\":0,"
+                               "\"delta\":{\"type\":\"text_delta\",\"text\":\"") != 0 ||
+        MockAppendFiller(body, take) != 0 ||
+        MockAppendString(body, "\"}}\n\n") != 0)
+    {
+      return -1;
+    }
+  }
+
+  snprintf(line, sizeof(line),
+           "event: content_block_stop\n"
+           "data: {\"type\":\"content_block_stop\",\"index\":0}\n\n"
+           "event: message_delta\n"
+           "data: {\"type\":\"message_delta\",\"delta\":{\"stop_reason\":\"end_turn\","
+           "\"stop_sequence\":null},\"usage\":{\"output_tokens\":%lu}}\n\n"
+           "event: message_stop\n"
+           "data: {\"type\":\"message_stop\"}\n\n",
+           options->size / 4);
+  return MockAppendString(body, line);
+}
+
+
+static int MockGzip(const MockBuffer *input, MockBuffer *output)
+{
+  z_stream z;
+  int status;
+
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    return -1;
+  }
+
+  output->capacity = deflateBound(&z, (uLong)input->length) + 32;
+  output->bytes = malloc(output->capacity);
+  if (!output->bytes)
+  {
+    deflateEnd(&z);
+    return -1;
+  }
+
+  z.next_in = (Bytef *)input->bytes;
+  z.avail_in = (uInt)input->length;
+  z.next_out = (Bytef *)output->bytes;
+  z.avail_out = (uInt)output->capacity;
+  status = deflate(&z, Z_FINISH);
+  output->length = output->capacity - z.avail_out;
+  deflateEnd(&z);
+
+  return status == Z_STREAM_END ? 0 : -1;
+}
+
+
+static void MockAppendRateLimitHeaders(MockBuffer *head, const MockOptions *options, unsigned long count)
+{
+  char line[512];
+  char reset[32];
+  time_t resetTime = time(NULL) + 60;
+  struct tm parts;
+
+  gmtime_r(&resetTime, &parts);
+  strftime(reset, sizeof(reset), "%Y-%m-%dT%H:%M:%SZ", &parts);
+
+  snprintf(line, sizeof(line),
+           "anthropic-ratelimit-requests-limit: 1000\r\n"
+           "anthropic-ratelimit-requests-remaining: %lu\r\n"
+           "anthropic-ratelimit-requests-reset: %s\r\n",
+           count < 1000 ? 1000 - count : 0, reset);
+  MockAppendString(head, line);
+  snprintf(line, sizeof(line),
+           "anthropic-ratelimit-input-tokens-limit: 400000\r\n"
+           "anthropic-ratelimit-input-tokens-remaining: 399000\r\n"
+           "anthropic-ratelimit-input-tokens-reset: %s\r\n"
+           "anthropic-ratelimit-output-tokens-limit: 80000\r\n"
+           "anthropic-ratelimit-output-tokens-remaining: 79000\r\n"
+           "anthropic-ratelimit-output-tokens-reset: %s\r\n",
+           reset, reset);
+  MockAppendString(head, line);
+  if (options->status == 429 || options->status == 529)
+  {
+    MockAppendString(head, "retry-after: 1\r\n");
+  }
+}
+
+
+static int MockWrite(SSL *ssl, const char *bytes, size_t length)
+{
+  while (length > 0)
+  {
+    int written = SSL_write(ssl, bytes, (int)length);
+
+    if (written <= 0)
+    {
+      return -1;
+    }
+    bytes += written;
+    length -= (size_t)written;
+  }
+
+  return 0;
+}
+
+
+/** Sends one response. Returns -1 if the connection should be dropped. */
+/**
+ * Sends a response shaped by the options. The body is built from them
+ * unless `reply` supplies one (with its content type), as the batch
+ * endpoints do.
+ */
+static int MockRespond(SSL *ssl, const MockOptions *options, int acceptsGzip,
+                       const MockBuffer *reply, const char *replyType)
+{
+  MockBuffer head = { NULL, 0, 0 };
+  MockBuffer body = { NULL, 0, 0 };
+  MockBuffer compressed = { NULL, 0, 0 };
+  MockBuffer *payload = &body;
+  MockBuffer frame = { NULL, 0, 0 };
+  char line[256];
+  unsigned long count;
+  size_t offset;
+  int result = 0;
+
+  pthread_mutex_lock(&mockCounterLock);
+  count = ++mockRequestCount;
+  pthread_mutex_unlock(&mockCounterLock);
+
+  if (reply)
+  {
+    if (MockAppend(&body, reply->bytes, reply->length) != 0)
+    {
+      free(body.bytes);
+      return -1;
+    }
+  }
+  else if (MockBuildBody(options, &body) != 0)
+  {
+    free(body.bytes);
+    return -1;
+  }
+  if (options->gzip && acceptsGzip && MockGzip(&body, &compressed) == 0)
+  {
+    payload = &compressed;
+  }
+
+  if (!replyType)
+  {
+    replyType = (options->stream && options->status < 400) ? "text/event-stream" : "application/json";
+  }
+  snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\n",
+           options->status, MockReason(options->status), replyType);
+  MockAppendString(&head, line);
+  if (payload == &compressed)
+  {
+    MockAppendString(&head, "Content-Encoding: gzip\r\n");
+  }
+  if (options->chunked)
+  {
+    MockAppendString(&head, "Transfer-Encoding: chunked\r\n");
+  }
+  else
+  {
+    snprintf(line, sizeof(line), "Content-Length: %lu\r\n", (unsigned long)payload->length);
+    MockAppendString(&head, line);
+  }
+  if (options->rateLimit)
+  {
+    MockAppendRateLimitHeaders(&head, options, count);
+  }
+  MockAppendString(&head, options->close ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n");
+
+  if (options->delay > 0)
+  {
+    usleep((useconds_t)(options->delay * 1000));
+  }
+  if (MockWrite(ssl, head.bytes, head.length) != 0)
+  {
+    result = -1;
+  }
+
+  for (offset = 0; result == 0 && offset < payload->length; offset += options->writeSize)
+  {
+    size_t take = payload->length - offset;
+
+    if (take > options->writeSize)
+    {
+      take = options->writeSize;
+    }
+    if (offset > 0 && options->interval > 0)
+    {
+      usleep((useconds_t)(options->interval * 1000));
+    }
+
+    if (options->chunked)
+    {
+      // Size line, data and CRLF in one record, as a real server would
+      frame.length = 0;
+      snprintf(line, sizeof(line), "%lx\r\n", (unsigned long)take);
+      if (MockAppendString(&frame, line) != 0 ||
+          MockAppend(&frame, payload->bytes + offset, take) != 0 ||
+          MockAppendString(&frame, "\r\n") != 0 ||
+          MockWrite(ssl, frame.bytes, frame.length) != 0)
+      {
+        result = -1;
+      }
+    }
+    else if (MockWrite(ssl, payload->bytes + offset, take) != 0)
+    {
+      result = -1;
+    }
+  }
+
+  if (result == 0 && options->chunked && MockWrite(ssl, "0\r\n\r\n", 5) != 0)
+  {
+    result = -1;
+  }
+
+  free(head.bytes);
+  free(body.bytes);
+  free(compressed.bytes);
+  free(frame.bytes);
+
+  return (result == 0 && !options->close) ? 0 : -1;
+}
+
+
+// MARK: - Message Batches
+
+/** Whether a custom_id asks for an errored result. */
+static int MockWantsError(const char *customId, size_t length)
+{
+  size_t i;
+
+  for (i = 0; i + 5 <= length; i++)
+  {
+    if (memcmp(customId + i, "error", 5) == 0)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+/** Collects the custom_id of every request in a batch submission. */
+static int MockCreateBatch(const MockBuffer *body, MockBuffer *reply)
+{
+  static const char marker[] = "\"custom_id\":\"";
+  MockBuffer ids = { NULL, 0, 0 };
+  unsigned long count = 0;
+  char line[512];
+  size_t i = 0;
+  int index;
+
+  while (body->length >= sizeof(marker) - 1 && i <= body->length - (sizeof(marker) - 1))
+  {
+    if (memcmp(body->bytes + i, marker, sizeof(marker) - 1) == 0)
+    {
+      size_t start = i + sizeof(marker) - 1;
+      size_t end = start;
+
+      while (end < body->length && body->bytes[end] != '"')
+      {
+        end++;
+      }
+      MockAppend(&ids, body->bytes + start, end - start);
+      MockAppend(&ids, "\n", 1);
+      count++;
+      i = end;
+    }
+    i++;
+  }
+
+  pthread_mutex_lock(&mockBatchLock);
+  if (mockBatchCount == MOCK_MAX_BATCHES || count == 0)
+  {
+    pthread_mutex_unlock(&mockBatchLock);
+    free(ids.bytes);
+    return -1;
+  }
+  index = mockBatchCount++;
+  mockBatches[index].customIds = ids.bytes;
+  mockBatches[index].count = count;
+  mockBatches[index].polls = 0;
+  pthread_mutex_unlock(&mockBatchLock);
+
+  snprintf(line, sizeof(line),
+           "{\"id\":\"msgbatch_mock_%d\",\"type\":\"message_batch\",\"processing_status\":\"in_progress\","
+           "\"request_counts\":{\"processing\":%lu,\"succeeded\":0,\"errored\":0,\"canceled\":0,\"expired\":0},"
+           "\"results_url\":null}",
+           index, count);
+  return MockAppendString(reply, line);
+}
+
+
+/** Looks up "msgbatch_mock_N"; returns its index or -1. Call with mockBatchLock held. */
+static int MockFindBatch(const char *batchId)
+{
+  int index;
+
+  if (sscanf(batchId, "msgbatch_mock_%d", &index) != 1 || index < 0 || index >= mockBatchCount)
+  {
+    return -1;
+  }
+
+  return index;
+}
+
+
+/**
+ * Reports a batch's status. Requests whose custom_id contains "error"
+ * are counted as errored, the rest as succeeded, once it has ended.
+ */
+static int MockBatchStatus(const char *batchId, MockBuffer *reply)
+{
+  char line[768];
+  unsigned long errored = 0;
+  unsigned long count;
+  const char *cursor;
+  const char *end;
+  int ended;
+  int index;
+
+  pthread_mutex_lock(&mockBatchLock);
+  index = MockFindBatch(batchId);
+  if (index < 0)
+  {
+    pthread_mutex_unlock(&mockBatchLock);
+    return -1;
+  }
+  ended = (++mockBatches[index].polls > MOCK_BATCH_POLLS);
+  count = mockBatches[index].count;
+  for (cursor = mockBatches[index].customIds; (end = strchr(cursor, '\n')); cursor = end + 1)
+  {
+    errored += MockWantsError(cursor, (size_t)(end - cursor));
+  }
+  pthread_mutex_unlock(&mockBatchLock);
+
+  if (ended)
+  {
+    snprintf(line, sizeof(line),
+             "{\"id\":\"msgbatch_mock_%d\",\"type\":\"message_batch\",\"processing_status\":\"ended\","
+             "\"request_counts\":{\"processing\":0,\"succeeded\":%lu,\"errored\":%lu,\"canceled\":0,\"expired\":0},"
+             "\"results_url\":\"https://localhost:%d/v1/messages/batches/msgbatch_mock_%d/results\"}",
+             index, count - errored, errored, mockPort, index);
+  }
+  else
+  {
+    snprintf(line, sizeof(line),
+             "{\"id\":\"msgbatch_mock_%d\",\"type\":\"message_batch\",\"processing_status\":\"in_progress\","
+             "\"request_counts\":{\"processing\":%lu,\"succeeded\":0,\"errored\":0,\"canceled\":0,\"expired\":0},"
+             "\"results_url\":null}",
+             index, count);
+  }
+
+  return MockAppendString(reply, line);
+}
+
+
+/** One JSONL result line per request of an ended batch. */
+static int MockBatchResults(const char *batchId, MockBuffer *reply)
+{
+  char line[1024];
+  const char *cursor;
+  const char *end;
+  int index;
+  int result = 0;
+
+  pthread_mutex_lock(&mockBatchLock);
+  index = MockFindBatch(batchId);
+  if (index < 0 || mockBatches[index].polls <= MOCK_BATCH_POLLS)
+  {
+    pthread_mutex_unlock(&mockBatchLock);
+    return -1;
+  }
+
+  for (cursor = mockBatches[index].customIds; result == 0 && (end = strchr(cursor, '\n')); cursor = end + 1)
+  {
+    int length = (int)(end - cursor);
+
+    if (MockWantsError(cursor, (size_t)length))
+    {
+      snprintf(line, sizeof(line),
+               "{\"custom_id\":\"%.*s\",\"result\":{\"type\":\"errored\",\"error\":{\"type\":\"error\","
+               "\"error\":{\"type\":\"invalid_request_error\",\"message\":\"Mock error for %.*s\"}}}}\n",
+               length, cursor, length, cursor);
+    }
+    else
+    {
+      snprintf(line, sizeof(line),
+               "{\"custom_id\":\"%.*s\",\"result\":{\"type\":\"succeeded\",\"message\":{\"id\":\"msg_mock\","
+               "\"type\":\"message\",\"role\":\"assistant\",\"model\":\"mock\","
+               "\"content\":[{\"type\":\"text\",\"text\":\"Mock reply to %.*s\"}],\"stop_reason\":\"end_turn\","
+               "\"stop_sequence\":null,\"usage\":{\"input_tokens\":10,\"output_tokens\":5}}}}\n",
+               length, cursor, length, cursor);
+    }
+    result = MockAppendString(reply, line);
+  }
+  pthread_mutex_unlock(&mockBatchLock);
+
+  return result;
+}
+
+
+// MARK: - Connections
+
+/** Finds a header value in a request head; the result is not terminated. */
+static const char *MockHeader(const char *head, const char *name, size_t *length)
+{
+  size_t nameLength = strlen(name);
+  const char *line = strstr(head, "\r\n");
+
+  while (line && line[2] != '\r')
+  {
+    line += 2;
+    if (strncasecmp(line, name, nameLength) == 0 && line[nameLength] == ':')
+    {
+      const char *value = line + nameLength + 1;
+      const char *end = strstr(value, "\r\n");
+
+      while (*value == ' ')
+      {
+        value++;
+      }
+      *length = end ? (size_t)(end - value) : strlen(value);
+      return value;
+    }
+    line = strstr(line, "\r\n");
+  }
+
+  return NULL;
+}
+
+
+/** Counts the occurrences of a marker, such as "cache_control", in a request body. */
+static unsigned long MockCountMarker(const MockBuffer *body, const char *marker)
+{
+  size_t markerLength = strlen(marker);
+  unsigned long count = 0;
+  size_t i;
+
+  for (i = 0; i + markerLength <= body->length; i++)
+  {
+    if (memcmp(body->bytes + i, marker, markerLength) == 0)
+    {
+      count++;
+      i += markerLength - 1;
+    }
+  }
+
+  return count;
+}
+
+
+static void *MockServeConnection(void *argument)
+{
+  int fd = (int)(long)argument;
+  SSL *ssl = SSL_new(mockContext);
+  char *buffer = malloc(MOCK_MAX_REQUEST_HEAD + 1);
+  MockBuffer requestBody = { NULL, 0, 0 };
+  size_t buffered = 0;
+  int on = 1;
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  SSL_set_fd(ssl, fd);
+  if (!buffer || SSL_accept(ssl) != 1)
+  {
+    goto done;
+  }
+
+  for (;;)
+  {
+    MockOptions options;
+    MockBuffer reply = { NULL, 0, 0 };
+    const char *replyType = NULL;
+    char method[8];
+    char path[256];
+    char *batchId = NULL;
+    int batchCreate;
+    int messagesCreate;
+    int keepBody;
+    char *end = NULL;
+    char *query;
+    const char *value;
+    size_t valueLength;
+    unsigned long contentLength = 0;
+    size_t headLength;
+    int acceptsGzip = 0;
+    int got;
+
+    // Read until the blank line that ends the request head
+    for (;;)
+    {
+      buffer[buffered] = '\0';
+      end = strstr(buffer, "\r\n\r\n");
+      if (end || buffered == MOCK_MAX_REQUEST_HEAD)
+      {
+        break;
+      }
+      got = SSL_read(ssl, buffer + buffered, (int)(MOCK_MAX_REQUEST_HEAD - buffered));
+      if (got <= 0)
+      {
+        goto done;
+      }
+      buffered += (size_t)got;
+    }
+    if (!end)
+    {
+      goto done;
+    }
+    headLength = (size_t)(end - buffer) + 4;
+    end[2] = '\0';
+
+    if (sscanf(buffer, "%7s %255[^? \r\n]", method, path) != 2)
+    {
+      goto done;
+    }
+    batchCreate = (strcmp(method, "POST") == 0 && strcmp(path, "/v1/messages/batches") == 0);
+    messagesCreate = (strcmp(method, "POST") == 0 && strcmp(path, "/v1/messages") == 0);
+    if (strncmp(path, "/v1/messages/batches/", 21) == 0)
+    {
+      batchId = path + 21;
+    }
+
+    value = MockHeader(buffer, "Content-Length", &valueLength);
+    if (value)
+    {
+      contentLength = strtoul(value, NULL, 10);
+    }
+    value = MockHeader(buffer, "Accept-Encoding", &valueLength);
+    if (value)
+    {
+      char encodings[256];
+
+      snprintf(encodings, sizeof(encodings), "%.*s", (int)valueLength, value);
+      acceptsGzip = (strstr(encodings, "gzip") != NULL);
+    }
+
+    query = strchr(buffer, '?');
+    if (query && query < strchr(buffer, '\n'))
+    {
+      char *space = strchr(query, ' ');
+
+      if (space)
+      {
+        *space = '\0';
+      }
+      query++;
+    }
+    else
+    {
+      query = "";
+    }
+    MockParseOptions(query, &options);
+
+    // Consume the request body, keeping anything that follows it. It is
+    // only kept when it has to be looked at: a batch submission, or a
+    // message that may ask for a stream or (with cache=1) have its
+    // breakpoints checked.
+    if (batchCreate)
+    {
+      options.cache = 0;
+    }
+    keepBody = (batchCreate || messagesCreate || options.cache);
+    if (buffered - headLength >= contentLength)
+    {
+      if (keepBody)
+      {
+        MockAppend(&requestBody, buffer + headLength, contentLength);
+      }
+      memmove(buffer, buffer + headLength + contentLength, buffered - headLength - contentLength);
+      buffered -= headLength + contentLength;
+    }
+    else
+    {
+      unsigned long remaining = contentLength - (buffered - headLength);
+
+      if (keepBody)
+      {
+        MockAppend(&requestBody, buffer + headLength, buffered - headLength);
+      }
+      buffered = 0;
+      while (remaining > 0)
+      {
+        got = SSL_read(ssl, buffer, (int)(remaining < MOCK_MAX_REQUEST_HEAD ? remaining : MOCK_MAX_REQUEST_HEAD));
+        if (got <= 0)
+        {
+          goto done;
+        }
+        if (keepBody)
+        {
+          MockAppend(&requestBody, buffer, (size_t)got);
+        }
+        remaining -= (unsigned long)got;
+      }
+    }
+
+    // A client that cannot add stream=1 to the path asks in the body
+    if (messagesCreate && MockCountMarker(&requestBody, "\"stream\":true") > 0)
+    {
+      options.stream = 1;
+    }
+    if (options.cache)
+    {
+      options.bodyLength = contentLength;
+      options.breakpoints = MockCountMarker(&requestBody, "\"cache_control\"");
+      if (options.breakpoints == 0 || options.breakpoints > 4)
+      {
+        options.status = 400;
+      }
+    }
+    if (!batchCreate)
+    {
+      requestBody.length = 0;
+    }
+
+    if (batchCreate || batchId)
+    {
+      char *results = batchId ? strstr(batchId, "/results") : NULL;
+      int found;
+
+      if (batchCreate)
+      {
+        found = MockCreateBatch(&requestBody, &reply);
+        requestBody.length = 0;
+      }
+      else if (results)
+      {
+        // Results come as JSON Lines in many small chunks, like a download
+        *results = '\0';
+        found = MockBatchResults(batchId, &reply);
+        replyType = "application/binary";
+        options.chunked = 1;
+        options.writeSize = 4096;
+      }
+      else
+      {
+        found = MockBatchStatus(batchId, &reply);
+      }
+
+      if (found != 0)
+      {
+        reply.length = 0;
+        replyType = NULL;
+        options.status = 404;
+        MockAppendString(&reply, "{\"type\":\"error\",\"error\":{\"type\":\"not_found_error\","
+                                 "\"message\":\"No such batch, or its results are not ready\"}}");
+      }
+    }
+
+    if (MockRespond(ssl, &options, acceptsGzip, reply.length ? &reply : NULL, replyType) != 0)
+    {
+      free(reply.bytes);
+      SSL_shutdown(ssl);
+      break;
+    }
+    free(reply.bytes);
+  }
+
+done:
+  SSL_free(ssl);
+  close(fd);
+  free(buffer);
+  free(requestBody.bytes);
+  return NULL;
+}
+
+
+static void MockServe(MockTLSServer *server)
+{
+  signal(SIGPIPE, SIG_IGN);
+  mockPort = server->port;
+
+  mockContext = SSL_CTX_new(SSLv23_server_method());
+  if (!mockContext ||
+      SSL_CTX_use_certificate(mockContext, (X509 *)server->certificate) != 1 ||
+      SSL_CTX_use_PrivateKey(mockContext, (EVP_PKEY *)server->key) != 1)
+  {
+    ERR_print_errors_fp(stderr);
+    _exit(1);
+  }
+  SSL_CTX_set_options(mockContext, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+  SSL_CTX_set_session_cache_mode(mockContext, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_set_session_id_context(mockContext, (const unsigned char *)"mock", 4);
+
+  for (;;)
+  {
+    int fd = accept(server->listenSocket, NULL, NULL);
+    pthread_t thread;
+
+    if (fd < 0)
+    {
+      continue;
+    }
+    if (pthread_create(&thread, NULL, MockServeConnection, (void *)(long)fd) != 0)
+    {
+      close(fd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+
+// MARK: - Public API
+
+int MockTLSServerPrepare(MockTLSServer *server)
+{
+  struct sockaddr_in address;
+  socklen_t addressLength = sizeof(address);
+  int on = 1;
+
+  memset(server, 0, sizeof(*server));
+  server->listenSocket = -1;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  SSL_load_error_strings();
+  SSL_library_init();
+  OpenSSL_add_all_algorithms();
+#endif
+
+  if (MockGenerateCertificate(server) != 0 || MockWriteCertificate(server) != 0)
+  {
+    fprintf(stderr, "mock server: could not create a certificate\n");
+    ERR_print_errors_fp(stderr);
+    return -1;
+  }
+
+  server->listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+  if (server->listenSocket < 0)
+  {
+    perror("mock server: socket");
+    return -1;
+  }
+  setsockopt(server->listenSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+  if (bind(server->listenSocket, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(server->listenSocket, 128) != 0 ||
+      getsockname(server->listenSocket, (struct sockaddr *)&address, &addressLength) != 0)
+  {
+    perror("mock server: listen");
+    close(server->listenSocket);
+    server->listenSocket = -1;
+    return -1;
+  }
+  server->port = ntohs(address.sin_port);
+
+  return 0;
+}
+
+
+int MockTLSServerFork(MockTLSServer *server)
+{
+  server->pid = fork();
+  if (server->pid < 0)
+  {
+    perror("mock server: fork");
+    return -1;
+  }
+  if (server->pid == 0)
+  {
+    MockServe(server);
+    _exit(0);
+  }
+
+  // The child owns the listening socket now
+  close(server->listenSocket);
+  server->listenSocket = -1;
+  return 0;
+}
+
+
+void MockTLSServerStop(MockTLSServer *server)
+{
+  if (server->pid > 0)
+  {
+    kill(server->pid, SIGTERM);
+    waitpid(server->pid, NULL, 0);
+    server->pid = 0;
+  }
+  if (server->certificatePath[0])
+  {
+    unlink(server->certificatePath);
+    server->certificatePath[0] = '\0';
+  }
+  X509_free((X509 *)server->certificate);
+  EVP_PKEY_free((EVP_PKEY *)server->key);
+  server->certificate = NULL;
+  server->key = NULL;
+}
@@ -0,0 +1,91 @@
+////////////////////////////////////////////////////////////////////////////////
+// MockTLSServer.h
+// ClaudeChat Benchmarks
+//
+// Loopback HTTPS server that replays canned Messages API responses, so the
+// OpenSSL transport can be measured without a network or an API key.
+//
+// Each request picks its response through the query string, e.g.
+//
+//   POST /v1/messages?size=1048576&chunked=1&gzip=1
+//
+// size=N        Bytes of reply text (default 1024)
+// stream=1      Answer with an SSE event stream instead of a JSON message
+//               ("stream":true in the request body does the same)
+// delta=N       Text bytes per SSE content_block_delta (default 32)
+// chunked=1     Use chunked transfer encoding instead of Content-Length
+// write=N       Bytes per socket write (default 16384)
+// delay=MS      Wait before sending the status line (time to first byte)
+// interval=MS   Wait between writes
+// gzip=1        Compress the body, if the request accepts gzip
+// status=N      Reply with this status; >= 400 sends an API error object
+// close=1       Send Connection: close and drop the connection afterwards
+// ratelimit=1   Add anthropic-ratelimit-* headers (and retry-after on 429/529)
+// cache=1       Require 1-4 cache_control breakpoints in the request body
+//               (400 otherwise) and report prompt cache usage
+//
+// The Message Batches endpoints are served too, for any query:
+//
+//   POST /v1/messages/batches                Remembers the requests' custom_ids
+//   GET  /v1/messages/batches/<id>           "in_progress" for two polls, then "ended"
+//   GET  /v1/messages/batches/<id>/results   One JSONL result per request, chunked;
+//                                            custom_ids containing "error" fail
+//
+// Plain C and OpenSSL, so the server side costs the client nothing it
+// would not pay against the real API.
+//
+// Compatibility: Mac OS X 10.4 Tiger and later, Linux
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef MOCK_TLS_SERVER_H
+#define MOCK_TLS_SERVER_H
+
+#include <sys/types.h>
+
+
+/**
+ * A prepared server: a listening loopback socket and a freshly generated
+ * self-signed certificate (valid for localhost and 127.0.0.1).
+ */
+typedef struct
+{
+  int listenSocket;
+  int port;
+  pid_t pid;
+  void *key;
+  void *certificate;
+  char certificatePath[256];
+} MockTLSServer;
+
+
+/**
+ * Generates the key and certificate, writes the certificate as PEM to a
+ * temporary file (for the client to trust) and starts listening on an
+ * ephemeral 127.0.0.1 port. Nothing is served until MockTLSServerFork().
+ *
+ * @param server Server to set up
+ * @return 0 on success, -1 on failure (with a message on stderr)
+ */
+int MockTLSServerPrepare(MockTLSServer *server);
+
+
+/**
+ * Forks the serving process. Call before the parent starts any threads.
+ * The child accepts connections until it is killed, handling each one on
+ * its own thread; the parent gets back immediately.
+ *
+ * @param server Prepared server
+ * @return 0 in the parent on success, -1 on failure (never returns in the child)
+ */
+int MockTLSServerFork(MockTLSServer *server);
+
+
+/**
+ * Kills the serving process and removes the certificate file.
+ *
+ * @param server Running server
+ */
+void MockTLSServerStop(MockTLSServer *server);
+
+#endif
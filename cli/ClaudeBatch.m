@@ -0,0 +1,872 @@
+////////////////////////////////////////////////////////////////////////////////
+// ClaudeBatch.m
+// ClaudeChat Command Line
+//
+// Runs a JSON Lines file of prompts through ClaudeAPIManager, several at a
+// time, and appends each response with its timings to an output JSON Lines
+// file. A run that is interrupted picks up where it left off: prompts that
+// already have a successful result in the output file are skipped.
+//
+// Usage: claudebatch [-c concurrency] [-m model] [-t max-tokens] [-s]
+//                    [-H host[:port]] [-C ca-file] [-k api-key] [-M]
+//                    input.jsonl output.jsonl
+//
+// Compatibility: Mac OS X 10.4 Tiger and later, Linux (GNUstep)
+// Copyright (c) 2024 Nyteshade. All rights reserved.
+////////////////////////////////////////////////////////////////////////////////
+
+#import <Foundation/Foundation.h>
+#import "ClaudeAPIManager.h"
+#import "HTTPSClient.h"
+#import "JSONArena.h"
+#import "NetworkMetrics.h"
+#import "WorkerPool.h"
+
+#include "MockTLSServer.h"
+#include "yyjson.h"
+
+#include <sys/time.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/** Requests in flight at once unless -c says otherwise. */
+#define BATCH_DEFAULT_CONCURRENCY 4
+
+/** Output tokens per reply unless -t or the prompt's max_tokens says otherwise. */
+#define BATCH_DEFAULT_MAX_TOKENS 1024
+
+/** Seconds between progress lines on stderr. */
+#define BATCH_PROGRESS_INTERVAL 5.0
+
+/**
+ * Latency histogram size. Bucket i holds latencies up to 1 ms * 2^(i/8),
+ * so a percentile read from it is at most 9% high, and the last bucket
+ * reaches about 17 minutes.
+ */
+#define BATCH_LATENCY_BUCKETS 160
+#define BATCH_LATENCY_FIRST_EDGE 0.001
+#define BATCH_LATENCY_GROWTH 1.0905077326652577
+
+@class BatchRunner;
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Helpers
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+static double BatchNow(void)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (double)now.tv_sec + (double)now.tv_usec / 1e6;
+}
+
+
+/** Returns the latency histogram bucket a duration falls in. */
+static int BatchLatencyBucket(double seconds)
+{
+  double edge = BATCH_LATENCY_FIRST_EDGE;
+  int bucket = 0;
+
+  while (seconds > edge && bucket < BATCH_LATENCY_BUCKETS - 1)
+  {
+    edge *= BATCH_LATENCY_GROWTH;
+    bucket++;
+  }
+  return bucket;
+}
+
+
+/**
+ * Nearest-rank percentile from the latency histogram: the upper edge of
+ * the bucket it falls in, but never more than the slowest latency seen.
+ */
+static double BatchPercentile(const unsigned long *counts, unsigned long count,
+                              double slowest, double percentile)
+{
+  unsigned long rank = (unsigned long)(percentile / 100.0 * count + 0.999999);
+  unsigned long seen = 0;
+  double edge = BATCH_LATENCY_FIRST_EDGE;
+  int bucket;
+
+  if (rank < 1)
+  {
+    rank = 1;
+  }
+  for (bucket = 0; bucket < BATCH_LATENCY_BUCKETS; bucket++)
+  {
+    seen += counts[bucket];
+    if (seen >= rank)
+    {
+      break;
+    }
+    edge *= BATCH_LATENCY_GROWTH;
+  }
+  return edge < slowest ? edge : slowest;
+}
+
+
+/**
+ * Reads one line, without its newline, into `line`. Lines of any length
+ * are read in pieces, so nothing beyond the current line is held.
+ *
+ * @return NO at end of file with nothing read
+ */
+static BOOL BatchReadLine(FILE *file, NSMutableData *line)
+{
+  char piece[4096];
+  size_t length;
+
+  [line setLength:0];
+  while (fgets(piece, sizeof(piece), file))
+  {
+    length = strlen(piece);
+    if (length > 0 && piece[length - 1] == '\n')
+    {
+      [line appendBytes:piece length:length - 1];
+      return YES;
+    }
+    [line appendBytes:piece length:length];
+  }
+
+  return [line length] > 0;
+}
+
+
+/** An NSString from a yyjson string value, or nil. */
+static NSString *BatchString(yyjson_val *value)
+{
+  const char *string = yyjson_get_str(value);
+
+  return string ? [NSString stringWithUTF8String:string] : nil;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Job
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * One prompt in flight. Owns a ClaudeAPIManager of its own, so every prompt
+ * starts from an empty history, and acts as its delegate.
+ */
+@interface BatchJob : NSObject
+{
+  BatchRunner *_runner;
+  ClaudeAPIManager *_manager;
+  NSString *_identifier;
+  NSString *_response;
+  NSString *_error;
+  NSDictionary *_usage;
+  double _started;
+  double _firstDelta;
+  double _finished;
+}
+
+- (id)initWithRunner:(BatchRunner *)runner identifier:(NSString *)identifier manager:(ClaudeAPIManager *)manager;
+- (void)sendPrompt:(NSString *)prompt apiKey:(NSString *)apiKey;
+- (void)failWithMessage:(NSString *)message;
+- (NSString *)identifier;
+- (NSString *)error;
+- (double)latency;
+- (void)writeRecordToFile:(FILE *)file;
+
+@end
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Runner
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Reads prompts as slots free up, so the input file can be any size, and
+ * writes each result as soon as it arrives. What it keeps does not grow
+ * with the input: latencies go into a fixed histogram, and the only IDs
+ * held are those an earlier run finished, each dropped once its line has
+ * been skipped.
+ */
+@interface BatchRunner : NSObject
+{
+  FILE *_input;
+  FILE *_output;
+  NSMutableData *_line;
+  NSMutableSet *_skipIdentifiers;
+  WorkerPool *_pool;
+  NSString *_apiKey;
+  NSString *_model;
+  NSString *_host;
+  int _port;
+  int _maxTokens;
+  BOOL _streams;
+  unsigned int _concurrency;
+  unsigned int _active;
+  BOOL _filling;
+  BOOL _inputDone;
+  unsigned long _lineNumber;
+  unsigned long _succeeded;
+  unsigned long _failed;
+  unsigned long _skipped;
+  unsigned long _latencyCounts[BATCH_LATENCY_BUCKETS];
+  double _slowestLatency;
+  double _startTime;
+}
+
+- (id)initWithInput:(FILE *)input output:(FILE *)output concurrency:(unsigned int)concurrency;
+- (void)setAPIKey:(NSString *)apiKey model:(NSString *)model maxTokens:(int)maxTokens streams:(BOOL)streams;
+- (void)setHost:(NSString *)host port:(int)port;
+- (unsigned long)skipFinishedInFile:(const char *)path;
+- (void)fillSlots;
+- (void)jobDidFinish:(BatchJob *)job;
+- (BOOL)isDone;
+- (void)reportProgress:(NSTimer *)timer;
+- (unsigned long)failedCount;
+- (void)printSummary;
+
+@end
+
+
+@implementation BatchJob
+
+- (id)initWithRunner:(BatchRunner *)runner identifier:(NSString *)identifier manager:(ClaudeAPIManager *)manager
+{
+  self = [super init];
+
+  if (self)
+  {
+    _runner = runner;
+    _identifier = [identifier copy];
+    _manager = [manager retain];
+    [_manager setDelegate:self];
+  }
+
+  return self;
+}
+
+
+- (void)dealloc
+{
+  [_manager setDelegate:nil];
+  [_manager release];
+  [_identifier release];
+  [_response release];
+  [_error release];
+  [_usage release];
+
+  [super dealloc];
+}
+
+
+- (void)sendPrompt:(NSString *)prompt apiKey:(NSString *)apiKey
+{
+  _started = BatchNow();
+  [_manager sendMessage:prompt withAPIKey:apiKey];
+}
+
+
+/** Ends the job without sending anything, e.g. for an unreadable line. */
+- (void)failWithMessage:(NSString *)message
+{
+  _started = _finished = BatchNow();
+  _error = [message copy];
+  [_runner jobDidFinish:self];
+}
+
+
+- (NSString *)identifier
+{
+  return _identifier;
+}
+
+
+- (NSString *)error
+{
+  return _error;
+}
+
+
+- (double)latency
+{
+  return _finished - _started;
+}
+
+
+/** Appends this job's result as one JSON line and flushes it to disk. */
+- (void)writeRecordToFile:(FILE *)file
+{
+  const yyjson_alc *alc = [JSONArena currentAllocator];
+  yyjson_mut_doc *doc = yyjson_mut_doc_new(alc);
+  yyjson_mut_val *root = yyjson_mut_obj(doc);
+  yyjson_mut_val *usage;
+  NSEnumerator *keyEnum;
+  NSString *key;
+  char *json;
+  size_t length;
+
+  yyjson_mut_doc_set_root(doc, root);
+  yyjson_mut_obj_add_strcpy(doc, root, "id", [_identifier UTF8String]);
+  yyjson_mut_obj_add_str(doc, root, "status", _error ? "error" : "ok");
+  yyjson_mut_obj_add_strcpy(doc, root, "model", [[_manager model] UTF8String]);
+  if (_error)
+  {
+    yyjson_mut_obj_add_strcpy(doc, root, "error", [_error UTF8String]);
+  }
+  else
+  {
+    yyjson_mut_obj_add_strcpy(doc, root, "text", [_response UTF8String]);
+  }
+  yyjson_mut_obj_add_real(doc, root, "started", _started);
+  if (_firstDelta > 0)
+  {
+    yyjson_mut_obj_add_real(doc, root, "ttft_ms", (_firstDelta - _started) * 1000.0);
+  }
+  yyjson_mut_obj_add_real(doc, root, "latency_ms", [self latency] * 1000.0);
+
+  if (_usage)
+  {
+    usage = yyjson_mut_obj_add_obj(doc, root, "usage");
+    keyEnum = [[_usage allKeys] objectEnumerator];
+    while ((key = [keyEnum nextObject]))
+    {
+      yyjson_mut_obj_add(usage, yyjson_mut_strcpy(doc, [key UTF8String]),
+                         yyjson_mut_uint(doc, [[_usage objectForKey:key] unsignedLongLongValue]));
+    }
+  }
+
+  json = yyjson_mut_write_opts(doc, 0, alc, &length, NULL);
+  if (json)
+  {
+    fwrite(json, 1, length, file);
+    fputc('\n', file);
+    fflush(file);
+    alc->free(alc->ctx, json);
+  }
+  yyjson_mut_doc_free(doc);
+}
+
+
+- (void)apiManager:(ClaudeAPIManager *)manager didReceiveDelta:(NSString *)delta
+{
+  if (_firstDelta == 0)
+  {
+    _firstDelta = BatchNow();
+  }
+}
+
+
+- (void)apiManager:(ClaudeAPIManager *)manager didReceiveUsage:(NSDictionary *)usage
+{
+  [_usage release];
+  _usage = [usage copy];
+}
+
+
+- (void)apiManager:(ClaudeAPIManager *)manager didReceiveResponse:(NSString *)response
+{
+  _finished = BatchNow();
+
+  // The manager reports API error objects as text rather than as failures
+  if ([response hasPrefix:@"API Error: "])
+  {
+    _error = [[response substringFromIndex:11] copy];
+  }
+  else
+  {
+    _response = [response copy];
+  }
+  [_runner jobDidFinish:self];
+}
+
+
+- (void)apiManager:(ClaudeAPIManager *)manager didFailWithError:(NSError *)error
+{
+  _finished = BatchNow();
+  _error = [[error localizedDescription] copy];
+  [_runner jobDidFinish:self];
+}
+
+
+- (void)apiManagerDidCancelRequest:(ClaudeAPIManager *)manager
+{
+  _finished = BatchNow();
+  _error = [@"Cancelled" copy];
+  [_runner jobDidFinish:self];
+}
+
+@end
+
+
+@implementation BatchRunner
+
+- (id)initWithInput:(FILE *)input output:(FILE *)output concurrency:(unsigned int)concurrency
+{
+  self = [super init];
+
+  if (self)
+  {
+    _input = input;
+    _output = output;
+    _concurrency = concurrency > 0 ? concurrency : 1;
+    _line = [[NSMutableData alloc] init];
+    _skipIdentifiers = [[NSMutableSet alloc] init];
+
+    // One thread more than requests in flight: the pool never gives
+    // interactive work its last thread
+    _pool = [[WorkerPool alloc] initWithThreadLimit:_concurrency + 1 queueLimit:_concurrency];
+    _startTime = BatchNow();
+  }
+
+  return self;
+}
+
+
+- (void)dealloc
+{
+  [_line release];
+  [_skipIdentifiers release];
+  [_pool release];
+  [_apiKey release];
+  [_model release];
+  [_host release];
+
+  [super dealloc];
+}
+
+
+- (void)setAPIKey:(NSString *)apiKey model:(NSString *)model maxTokens:(int)maxTokens streams:(BOOL)streams
+{
+  [_apiKey release];
+  _apiKey = [apiKey copy];
+  [_model release];
+  _model = [model copy];
+  _maxTokens = maxTokens;
+  _streams = streams;
+}
+
+
+- (void)setHost:(NSString *)host port:(int)port
+{
+  [_host release];
+  _host = [host copy];
+  _port = port;
+}
+
+
+/**
+ * Collects the IDs that already succeeded in an earlier run's output so
+ * they are not sent again. Failed ones are retried; a later line for the
+ * same ID supersedes an earlier one. Returns how many were found.
+ */
+- (unsigned long)skipFinishedInFile:(const char *)path
+{
+  FILE *file = fopen(path, "r");
+  NSMutableData *line = [NSMutableData data];
+
+  if (!file)
+  {
+    return 0;
+  }
+
+  while (BatchReadLine(file, line))
+  {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    yyjson_doc *doc = yyjson_read_opts((char *)[line bytes], [line length], 0,
+                                       [JSONArena currentAllocator], NULL);
+    yyjson_val *root = yyjson_doc_get_root(doc);
+    NSString *identifier = BatchString(yyjson_obj_get(root, "id"));
+
+    // A line cut short by an interruption does not parse, and is ignored
+    if (identifier)
+    {
+      if (yyjson_equals_str(yyjson_obj_get(root, "status"), "ok"))
+      {
+        [_skipIdentifiers addObject:identifier];
+      }
+      else
+      {
+        [_skipIdentifiers removeObject:identifier];
+      }
+    }
+    yyjson_doc_free(doc);
+    [pool release];
+  }
+
+  // Start the next record on a fresh line if the last one was cut short
+  if (ftell(file) > 0 && fseek(file, -1, SEEK_END) == 0 && fgetc(file) != '\n')
+  {
+    fputc('\n', _output);
+  }
+  fclose(file);
+
+  return [_skipIdentifiers count];
+}
+
+
+/**
+ * Starts prompts until every slot is busy or the input runs out. Each
+ * line is an object with a "prompt" and optionally an "id" (or
+ * "custom_id"), "model" and "max_tokens"; lines without an ID are known
+ * by their line number.
+ */
+- (void)fillSlots
+{
+  // A line that fails at once finishes inside this loop; the loop itself
+  // then refills its slot
+  if (_filling)
+  {
+    return;
+  }
+  _filling = YES;
+
+  while (!_inputDone && _active < _concurrency)
+  {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    ClaudeAPIManager *manager;
+    BatchJob *job;
+    yyjson_doc *doc;
+    yyjson_val *root;
+    NSString *identifier;
+    NSString *prompt;
+    NSString *model;
+    int maxTokens;
+
+    if (!BatchReadLine(_input, _line))
+    {
+      _inputDone = YES;
+      [pool release];
+      break;
+    }
+    _lineNumber++;
+
+    doc = yyjson_read_opts((char *)[_line bytes], [_line length], 0, [JSONArena currentAllocator], NULL);
+    root = yyjson_doc_get_root(doc);
+    if (!doc && [[[[[NSString alloc] initWithData:_line encoding:NSUTF8StringEncoding] autorelease]
+                   stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]] length] == 0)
+    {
+      [pool release];
+      continue;
+    }
+
+    identifier = BatchString(yyjson_obj_get(root, "id"));
+    if (!identifier)
+    {
+      identifier = BatchString(yyjson_obj_get(root, "custom_id"));
+    }
+    if (!identifier)
+    {
+      identifier = [NSString stringWithFormat:@"line-%lu", _lineNumber];
+    }
+    prompt = BatchString(yyjson_obj_get(root, "prompt"));
+    model = BatchString(yyjson_obj_get(root, "model"));
+    maxTokens = yyjson_is_int(yyjson_obj_get(root, "max_tokens"))
+      ? yyjson_get_int(yyjson_obj_get(root, "max_tokens"))
+      : _maxTokens;
+    yyjson_doc_free(doc);
+
+    // Done in an earlier run. Only that run's IDs are held, and each only
+    // until its line comes round; an ID repeated within the input is not
+    // detected, and is sent again
+    if ([_skipIdentifiers containsObject:identifier])
+    {
+      [_skipIdentifiers removeObject:identifier];
+      _skipped++;
+      [pool release];
+      continue;
+    }
+
+    manager = [[[ClaudeAPIManager alloc] init] autorelease];
+    [manager setWorkerPool:_pool];
+    [manager setStreamsResponses:_streams];
+    [manager setModel:model ? model : _model];
+    [manager setMaxTokens:maxTokens];
+    if (_host)
+    {
+      [manager setHost:_host port:_port];
+    }
+
+    job = [[BatchJob alloc] initWithRunner:self identifier:identifier manager:manager];
+    _active++;
+    if (prompt)
+    {
+      [job sendPrompt:prompt apiKey:_apiKey];
+    }
+    else
+    {
+      [job failWithMessage:[NSString stringWithFormat:@"Line %lu is not an object with a prompt", _lineNumber]];
+    }
+    [pool release];
+  }
+
+  _filling = NO;
+}
+
+
+/** Records the result, releases the job and refills its slot. */
+- (void)jobDidFinish:(BatchJob *)job
+{
+  [job writeRecordToFile:_output];
+
+  _latencyCounts[BatchLatencyBucket([job latency])]++;
+  if ([job latency] > _slowestLatency)
+  {
+    _slowestLatency = [job latency];
+  }
+
+  if ([job error])
+  {
+    _failed++;
+    fprintf(stderr, "%s: %s\n", [[job identifier] UTF8String], [[job error] UTF8String]);
+  }
+  else
+  {
+    _succeeded++;
+  }
+
+  _active--;
+  [job release];
+  [self fillSlots];
+}
+
+
+- (BOOL)isDone
+{
+  return _inputDone && _active == 0;
+}
+
+
+- (void)reportProgress:(NSTimer *)timer
+{
+  fprintf(stderr, "%lu done, %lu failed, %lu skipped, %u running\n",
+          _succeeded, _failed, _skipped, _active);
+}
+
+
+- (unsigned long)failedCount
+{
+  return _failed;
+}
+
+
+- (void)printSummary
+{
+  unsigned long count = _succeeded + _failed;
+  double wallTime = BatchNow() - _startTime;
+
+  printf("%lu succeeded, %lu failed, %lu skipped in %.1f s", _succeeded, _failed, _skipped, wallTime);
+  if (count > 0)
+  {
+    printf(" (%.2f req/s, latency p50 %.0f ms, p99 %.0f ms)",
+           count / wallTime,
+           BatchPercentile(_latencyCounts, count, _slowestLatency, 50) * 1000.0,
+           BatchPercentile(_latencyCounts, count, _slowestLatency, 99) * 1000.0);
+  }
+  printf("\n");
+  if (_host)
+  {
+    printf("%s\n", [[[NetworkMetrics sharedMetrics] summaryForHost:_host] UTF8String]);
+  }
+}
+
+@end
+
+
+////////////////////////////////////////////////////////////////////////////////
+#pragma mark - Main
+// MARK: -
+////////////////////////////////////////////////////////////////////////////////
+
+static void BatchUsage(const char *program)
+{
+  fprintf(stderr,
+          "usage: %s [options] input.jsonl output.jsonl\n"
+          "  -c  requests in flight at once (default %d)\n"
+          "  -m  model (default claude-3-haiku-20240307)\n"
+          "  -t  max output tokens per reply (default %d)\n"
+          "  -s  stream replies, which also records time to first token\n"
+          "  -H  send to host[:port] instead of the API\n"
+          "  -C  trust the CA certificates in this PEM file\n"
+          "  -k  API key (default $ANTHROPIC_API_KEY)\n"
+          "  -M  run against a built-in loopback mock server\n"
+          "  -v  keep HTTPSClient's per-request log lines\n"
+          "Each input line is {\"id\": ..., \"prompt\": ...}; \"model\" and\n"
+          "\"max_tokens\" may override the defaults per line. Results are\n"
+          "appended to the output file; prompts that already succeeded in it\n"
+          "are skipped, so an interrupted run resumes when started again.\n"
+          "IDs should be unique: a repeat within the input is sent again.\n",
+          program, BATCH_DEFAULT_CONCURRENCY, BATCH_DEFAULT_MAX_TOKENS);
+}
+
+
+int main(int argc, char *argv[])
+{
+  MockTLSServer server;
+  NSAutoreleasePool *pool;
+  BatchRunner *runner;
+  FILE *input;
+  FILE *output;
+  const char *model = "claude-3-haiku-20240307";
+  const char *host = NULL;
+  const char *caFile = NULL;
+  const char *apiKey = getenv("ANTHROPIC_API_KEY");
+  char hostName[256];
+  int port = 443;
+  int concurrency = BATCH_DEFAULT_CONCURRENCY;
+  int maxTokens = BATCH_DEFAULT_MAX_TOKENS;
+  BOOL streams = NO;
+  BOOL mock = NO;
+  BOOL verbose = NO;
+  int status;
+  int option;
+
+  // A server closing a pooled connection must fail the write, not end the run
+  signal(SIGPIPE, SIG_IGN);
+
+  while ((option = getopt(argc, argv, "c:m:t:sH:C:k:Mvh")) != -1)
+  {
+    switch (option)
+    {
+      case 'c':
+        concurrency = atoi(optarg);
+        break;
+      case 'm':
+        model = optarg;
+        break;
+      case 't':
+        maxTokens = atoi(optarg);
+        break;
+      case 's':
+        streams = YES;
+        break;
+      case 'H':
+        host = optarg;
+        break;
+      case 'C':
+        caFile = optarg;
+        break;
+      case 'k':
+        apiKey = optarg;
+        break;
+      case 'M':
+        mock = YES;
+        break;
+      case 'v':
+        verbose = YES;
+        break;
+      default:
+        BatchUsage(argv[0]);
+        return 2;
+    }
+  }
+  if (argc - optind != 2 || concurrency < 1)
+  {
+    BatchUsage(argv[0]);
+    return 2;
+  }
+
+  // Fork the server before Foundation starts any threads of its own
+  if (mock)
+  {
+    if (MockTLSServerPrepare(&server) != 0 || MockTLSServerFork(&server) != 0)
+    {
+      return 1;
+    }
+    snprintf(hostName, sizeof(hostName), "127.0.0.1");
+    port = server.port;
+    caFile = server.certificatePath;
+    if (!apiKey)
+    {
+      apiKey = "mock-key";
+    }
+  }
+  else if (host)
+  {
+    const char *colon = strrchr(host, ':');
+
+    snprintf(hostName, sizeof(hostName), "%.*s",
+             (int)(colon ? colon - host : (long)strlen(host)), host);
+    if (colon)
+    {
+      port = atoi(colon + 1);
+    }
+  }
+  if (!apiKey || !*apiKey)
+  {
+    fprintf(stderr, "No API key: set ANTHROPIC_API_KEY or pass -k\n");
+    return 2;
+  }
+
+  input = fopen(argv[optind], "r");
+  if (!input)
+  {
+    perror(argv[optind]);
+    return 1;
+  }
+  output = fopen(argv[optind + 1], "a");
+  if (!output)
+  {
+    perror(argv[optind + 1]);
+    fclose(input);
+    return 1;
+  }
+
+  pool = [[NSAutoreleasePool alloc] init];
+  [HTTPSClient setLogsRequests:verbose];
+  if (caFile && ![HTTPSClient trustCertificatesInFile:[NSString stringWithUTF8String:caFile]])
+  {
+    fprintf(stderr, "Could not trust the certificates in %s\n", caFile);
+    return 1;
+  }
+
+  runner = [[BatchRunner alloc] initWithInput:input output:output concurrency:(unsigned int)concurrency];
+  [runner setAPIKey:[NSString stringWithUTF8String:apiKey]
+              model:[NSString stringWithUTF8String:model]
+          maxTokens:maxTokens
+            streams:streams];
+  if (mock || host)
+  {
+    [runner setHost:[NSString stringWithUTF8String:hostName] port:port];
+  }
+  if ([runner skipFinishedInFile:argv[optind + 1]] > 0)
+  {
+    fprintf(stderr, "Resuming: skipping prompts already answered in %s\n", argv[optind + 1]);
+  }
+
+  // Results come back through the main run loop; the timer keeps it alive
+  // between them as well as reporting progress
+  [NSTimer scheduledTimerWithTimeInterval:BATCH_PROGRESS_INTERVAL
+                                   target:runner
+                                 selector:@selector(reportProgress:)
+                                 userInfo:nil
+                                  repeats:YES];
+  [runner fillSlots];
+  while (![runner isDone])
+  {
+    NSAutoreleasePool *loopPool = [[NSAutoreleasePool alloc] init];
+
+    [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode
+                             beforeDate:[NSDate dateWithTimeIntervalSinceNow:BATCH_PROGRESS_INTERVAL]];
+    [loopPool release];
+  }
+
+  [runner printSummary];
+  status = [runner failedCount] > 0 ? 1 : 0;
+  [runner release];
+
+  fclose(input);
+  fclose(output);
+  [HTTPSClient closeIdleConnections];
+  if (mock)
+  {
+    MockTLSServerStop(&server);
+  }
+  [pool release];
+
+  return status;
+}
@@ -71,10 +71,10 @@ mkdir -p "$XCODEPROJ_DIR"
 
 echo "Discovering source files..."
 
-# Find all source files
-M_FILES=$(find . -name "*.m" ! -path "./build/*" ! -path "./xcode/*" ! -path "./.git/*" -type f | sed 's|^\./||')
-C_FILES=$(find . -name "*.c" ! -path "./build/*" ! -path "./xcode/*" ! -path "./.git/*" -type f | sed 's|^\./||')
-H_FILES=$(find . -name "*.h" ! -path "./build/*" ! -path "./xcode/*" ! -path "./.git/*" -type f | sed 's|^\./||')
+# Find all source files (bench/ and cli/ are separate executables)
+M_FILES=$(find . -name "*.m" ! -path "./build/*" ! -path "./xcode/*" ! -path "./.git/*" ! -path "./bench/*" ! -path "./cli/*" -type f | sed 's|^\./||')
+C_FILES=$(find . -name "*.c" ! -path "./build/*" ! -path "./xcode/*" ! -path "./.git/*" ! -path "./bench/*" ! -path "./cli/*" -type f | sed 's|^\./||')
+H_FILES=$(find . -name "*.h" ! -path "./build/*" ! -path "./xcode/*" ! -path "./.git/*" ! -path "./bench/*" ! -path "./cli/*" -type f | sed 's|^\./||')
 
 # Platform-specific filtering
 case $PLATFORM in
@@ -237,7 +237,7 @@ esac
 if [ "$NEEDS_OPENSSL" = "yes" ]; then
   HEADER_SEARCH_PATHS="HEADER_SEARCH_PATHS = /opt/local/include;"
   LIBRARY_SEARCH_PATHS="LIBRARY_SEARCH_PATHS = /opt/local/lib;"
-  OTHER_LDFLAGS='OTHER_LDFLAGS = "-lssl -lcrypto";'
+  OTHER_LDFLAGS='OTHER_LDFLAGS = "-lssl -lcrypto -lz";'
 else
   HEADER_SEARCH_PATHS=""
   LIBRARY_SEARCH_PATHS=""